@@ -0,0 +1,173 @@
+#pragma once
+
+#ifdef SYNTH_HAVE_ALSA
+
+#include <cstring>
+#include <cstdlib>
+#include <type_traits>
+#include <alsa/asoundlib.h>
+
+#include "AudioBackend.hpp"
+
+// ALSA playback through snd_pcm_writei. The hardware buffer holds every block the queue
+// may grow to, but the audio thread only keeps the target number of blocks in it, so
+// the latency is the queue depth rather than the buffer size.
+template <typename T>
+class AlsaBackend : public BlockingBackend<T>
+{
+private:
+	snd_pcm_t* a_pcm;
+	snd_pcm_uframes_t a_buffer_frames;
+
+public:
+	AlsaBackend()
+		: a_pcm(nullptr), a_buffer_frames(0)
+	{
+	}
+
+	~AlsaBackend()
+	{
+		this->close();
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"ALSA";
+	}
+
+	virtual std::vector<std::wstring> enumerate() override
+	{
+		std::vector<std::wstring> devices = { L"default" };
+		void** hints = nullptr;
+		if (snd_device_name_hint(-1, "pcm", &hints) < 0)
+			return devices;
+
+		for (void** hint = hints; *hint != nullptr; hint++)
+		{
+			char* name = snd_device_name_get_hint(*hint, "NAME");
+			char* direction = snd_device_name_get_hint(*hint, "IOID");
+
+			// No direction means the device does both
+			if (name != nullptr && std::strcmp(name, "default") != 0 && (direction == nullptr || std::strcmp(direction, "Output") == 0))
+				devices.push_back(widenDeviceName(name));
+			std::free(name);
+			std::free(direction);
+		}
+		snd_device_name_free_hint(hints);
+		return devices;
+	}
+
+protected:
+	virtual bool openDevice(const std::wstring& device) override
+	{
+		uint32_t sample_rate = this->a_sample_rate;
+		uint32_t block_frames = this->a_block_frames;
+
+		std::string name = device.empty() ? "default" : narrowDeviceName(device);
+		if (snd_pcm_open(&a_pcm, name.c_str(), SND_PCM_STREAM_PLAYBACK, 0) < 0)
+		{
+			a_pcm = nullptr;
+			return false;
+		}
+
+		snd_pcm_hw_params_t* hw_params = nullptr;
+		snd_pcm_hw_params_alloca(&hw_params);
+		unsigned int rate = sample_rate;
+		snd_pcm_uframes_t period_frames = block_frames;
+		a_buffer_frames = static_cast<snd_pcm_uframes_t>(block_frames) * this->a_block_count;
+
+		bool configured = snd_pcm_hw_params_any(a_pcm, hw_params) >= 0
+			&& snd_pcm_hw_params_set_access(a_pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED) >= 0
+			&& snd_pcm_hw_params_set_format(a_pcm, hw_params, pcmFormat()) >= 0
+			&& snd_pcm_hw_params_set_channels(a_pcm, hw_params, this->a_channels) >= 0
+			&& snd_pcm_hw_params_set_rate_near(a_pcm, hw_params, &rate, nullptr) >= 0 && rate == sample_rate
+			&& snd_pcm_hw_params_set_period_size_near(a_pcm, hw_params, &period_frames, nullptr) >= 0
+			&& snd_pcm_hw_params_set_buffer_size_near(a_pcm, hw_params, &a_buffer_frames) >= 0
+			&& snd_pcm_hw_params(a_pcm, hw_params) >= 0;
+
+		// Start playing as soon as the first block is in
+		snd_pcm_sw_params_t* sw_params = nullptr;
+		snd_pcm_sw_params_alloca(&sw_params);
+		configured = configured
+			&& snd_pcm_sw_params_current(a_pcm, sw_params) >= 0
+			&& snd_pcm_sw_params_set_avail_min(a_pcm, sw_params, period_frames) >= 0
+			&& snd_pcm_sw_params_set_start_threshold(a_pcm, sw_params, block_frames) >= 0
+			&& snd_pcm_sw_params(a_pcm, sw_params) >= 0
+			&& snd_pcm_prepare(a_pcm) >= 0;
+
+		if (!configured)
+			closeDevice();
+		return configured;
+	}
+
+	virtual void closeDevice() override
+	{
+		if (a_pcm != nullptr)
+		{
+			snd_pcm_drop(a_pcm);
+			snd_pcm_close(a_pcm);
+			a_pcm = nullptr;
+		}
+	}
+
+	virtual uint32_t queuedBlocks() const override
+	{
+		return static_cast<uint32_t>(queuedFrames() / this->a_block_frames);
+	}
+
+	// The device only wakes us once a period is free, which is far more room than a short
+	// queue target needs, so sleep for the time it takes to play down to the target instead
+	virtual bool waitForSpace(uint32_t target_blocks) override
+	{
+		snd_pcm_uframes_t target_frames = static_cast<snd_pcm_uframes_t>(target_blocks) * this->a_block_frames;
+		snd_pcm_uframes_t queued = queuedFrames();
+		while (this->isRunning() && queued >= target_frames)
+		{
+			snd_pcm_uframes_t excess = queued - target_frames + 1;
+			std::this_thread::sleep_for(std::chrono::microseconds(1000000 * excess / this->a_sample_rate));
+			queued = queuedFrames();
+		}
+		return this->isRunning();
+	}
+
+	virtual bool write(const T* samples) override
+	{
+		snd_pcm_uframes_t remaining = this->a_block_frames;
+		while (remaining > 0)
+		{
+			snd_pcm_sframes_t written = snd_pcm_writei(a_pcm, samples, remaining);
+			if (written < 0)
+			{
+				// Underruns (-EPIPE) and suspends (-ESTRPIPE) restart the stream, anything else is fatal
+				if (snd_pcm_recover(a_pcm, static_cast<int>(written), 1) < 0)
+					return false;
+				continue;
+			}
+			samples += written * this->a_channels;
+			remaining -= written;
+		}
+		return true;
+	}
+
+private:
+	static snd_pcm_format_t pcmFormat()
+	{
+		if constexpr (std::is_same_v<T, float>)
+			return SND_PCM_FORMAT_FLOAT;
+		else if constexpr (std::is_same_v<T, int32_t>)
+			return SND_PCM_FORMAT_S32;
+		else
+			return SND_PCM_FORMAT_S16;
+	}
+
+	// Frames written and not yet played. After an underrun nothing is queued.
+	snd_pcm_uframes_t queuedFrames() const
+	{
+		snd_pcm_sframes_t available = snd_pcm_avail_update(a_pcm);
+		if (available < 0)
+			return 0;
+		return a_buffer_frames - std::min(static_cast<snd_pcm_uframes_t>(available), a_buffer_frames);
+	}
+};
+
+#endif
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <numbers>
+#include <algorithm>
+
+#include "AudioBus.hpp"
+#include "RingBuffer.hpp"
+#include "FFT.hpp"
+
+#define ANALYZER_FFT_SIZE 4096			// About 11 Hz per bin at 44.1 kHz
+#define ANALYZER_BUFFER_SECONDS 1.0		// Audio the ring holds between two updates
+#define ANALYZER_READ_FRAMES 1024		// Frames taken from the ring at once
+#define ANALYZER_REFRESH_SECONDS 0.25	// How often the console redraws the analysis
+#define ANALYZER_FLOOR_DB -120.0f		// Level reported for silence
+
+// Level and spectrum analysis of the master bus, for the console. The audio thread only
+// counts samples over full scale, which the conversion to the device format saturates, and
+// copies each block into a ring. Everything else, the meters and a Hann-windowed FFT of the
+// latest audio, runs in update() on the control thread at the console's refresh rate. If the
+// control thread falls a whole ring behind, the blocks that don't fit are left out of the
+// meters; the clip count stays exact.
+class Analyzer
+{
+private:
+	SpscRingBuffer<float> a_ring;			// Interleaved stereo
+	std::vector<float> a_interleaved;		// One block, on the audio thread
+	std::atomic<uint64_t> a_clipped_samples;
+
+	// Control thread
+	std::vector<float> a_chunk;
+	std::vector<float> a_history;			// Latest ANALYZER_FFT_SIZE mono samples, oldest at a_history_pos
+	size_t a_history_pos;
+	std::vector<float> a_window;
+	std::vector<float> a_windowed;
+	RealFFT a_fft;
+	std::vector<std::complex<float>> a_bins;
+	std::vector<float> a_spectrum;			// Level of each bin in dBFS
+	std::array<float, 2> a_peak;
+	std::array<float, 2> a_rms;
+	double a_sample_rate;
+
+public:
+	Analyzer()
+		: a_clipped_samples(0), a_history_pos(0), a_peak{ ANALYZER_FLOOR_DB, ANALYZER_FLOOR_DB }, a_rms{ ANALYZER_FLOOR_DB, ANALYZER_FLOOR_DB },
+		a_sample_rate(0.0)
+	{
+	}
+
+	// Not for the audio thread. Blocks of up to max_frames are taken without allocating.
+	void prepare(double sample_rate, uint32_t max_frames)
+	{
+		a_sample_rate = sample_rate;
+		a_ring.resize(static_cast<size_t>(ANALYZER_BUFFER_SECONDS * sample_rate) * 2);
+		a_interleaved.assign(static_cast<size_t>(max_frames) * 2, 0.0f);
+		a_chunk.assign(static_cast<size_t>(ANALYZER_READ_FRAMES) * 2, 0.0f);
+		a_clipped_samples = 0;
+
+		a_fft.setSize(ANALYZER_FFT_SIZE);
+		a_history.assign(ANALYZER_FFT_SIZE, 0.0f);
+		a_history_pos = 0;
+		a_windowed.assign(ANALYZER_FFT_SIZE, 0.0f);
+		a_bins.assign(ANALYZER_FFT_SIZE / 2 + 1, 0.0f);
+		a_spectrum.assign(ANALYZER_FFT_SIZE / 2 + 1, ANALYZER_FLOOR_DB);
+
+		// Scaled so a full-scale sine on a bin reads 0 dB
+		a_window.resize(ANALYZER_FFT_SIZE);
+		double sum = 0.0;
+		for (size_t i = 0; i < a_window.size(); i++)
+		{
+			a_window[i] = static_cast<float>(0.5 - 0.5 * std::cos(2.0 * std::numbers::pi * i / a_window.size()));
+			sum += a_window[i];
+		}
+		for (float& w : a_window)
+			w = static_cast<float>(w * 2.0 / sum);
+	}
+
+	// Audio thread. Takes the bus as it goes to the device.
+	void process(const AudioBus& bus)
+	{
+		if (a_interleaved.empty())
+			return;
+
+		uint32_t frames = std::min<uint32_t>(bus.getFrames(), static_cast<uint32_t>(a_interleaved.size() / 2));
+		uint32_t channels = bus.getChannels();
+		uint64_t clipped = 0;
+		for (uint32_t c = 0; c < channels; c++)
+		{
+			const float* source = bus.channel(c);
+			for (uint32_t n = 0; n < frames; n++)
+				clipped += std::fabs(source[n]) > 1.0f;
+		}
+		if (clipped > 0)
+			a_clipped_samples.fetch_add(clipped, std::memory_order_relaxed);
+
+		if (a_ring.availableWrite() < static_cast<size_t>(frames) * 2)
+			return;
+		for (uint32_t c = 0; c < 2; c++)
+		{
+			const float* source = bus.channel(std::min(c, channels - 1));
+			for (uint32_t n = 0; n < frames; n++)
+				a_interleaved[static_cast<size_t>(n) * 2 + c] = source[n];
+		}
+		a_ring.write(a_interleaved.data(), static_cast<size_t>(frames) * 2);
+	}
+
+	// Control thread. Meters cover the audio since the last update, the spectrum the latest
+	// ANALYZER_FFT_SIZE frames. Returns false, keeping the last results, if nothing new came in.
+	bool update()
+	{
+		std::array<float, 2> peak = {};
+		std::array<double, 2> energy = {};
+		size_t total = 0;
+		size_t frames;
+		while ((frames = a_ring.read(a_chunk.data(), a_chunk.size()) / 2) > 0)
+		{
+			for (size_t n = 0; n < frames; n++)
+			{
+				float left = a_chunk[2 * n];
+				float right = a_chunk[2 * n + 1];
+				peak[0] = std::max(peak[0], std::fabs(left));
+				peak[1] = std::max(peak[1], std::fabs(right));
+				energy[0] += static_cast<double>(left) * left;
+				energy[1] += static_cast<double>(right) * right;
+
+				a_history[a_history_pos] = 0.5f * (left + right);
+				a_history_pos = (a_history_pos + 1) % a_history.size();
+			}
+			total += frames;
+		}
+		if (total == 0)
+			return false;
+
+		for (int c = 0; c < 2; c++)
+		{
+			a_peak[c] = toDecibels(peak[c]);
+			a_rms[c] = toDecibels(static_cast<float>(std::sqrt(energy[c] / total)));
+		}
+
+		for (size_t i = 0; i < a_history.size(); i++)
+			a_windowed[i] = a_window[i] * a_history[(a_history_pos + i) % a_history.size()];
+		a_fft.forward(a_windowed.data(), a_bins.data());
+		for (size_t k = 0; k < a_bins.size(); k++)
+			a_spectrum[k] = toDecibels(std::abs(a_bins[k]));
+		return true;
+	}
+
+	// Any thread. Samples over full scale since prepare().
+	uint64_t getClippedSamples() const
+	{
+		return a_clipped_samples.load(std::memory_order_relaxed);
+	}
+
+	// Control thread, from the last update. Channel 0 is left, 1 is right.
+	float getPeakDb(int channel) const
+	{
+		return a_peak[channel];
+	}
+
+	float getRmsDb(int channel) const
+	{
+		return a_rms[channel];
+	}
+
+	const std::vector<float>& getSpectrum() const
+	{
+		return a_spectrum;
+	}
+
+	double getBinHz() const
+	{
+		return a_sample_rate / ANALYZER_FFT_SIZE;
+	}
+
+	// Loudest bin between two frequencies, in dBFS
+	float getBandLevel(double low_hz, double high_hz) const
+	{
+		size_t first = std::min(static_cast<size_t>(std::max(low_hz / getBinHz(), 0.0)), a_spectrum.size() - 1);
+		size_t last = std::min(static_cast<size_t>(std::ceil(high_hz / getBinHz())), a_spectrum.size() - 1);
+		float level = ANALYZER_FLOOR_DB;
+		for (size_t k = first; k <= last; k++)
+			level = std::max(level, a_spectrum[k]);
+		return level;
+	}
+
+	// The spectrum as one line of characters, bands spaced evenly in pitch from low_hz to
+	// high_hz, each from ' ' at floor_db or below up to '@' at 0 dB
+	std::wstring spectrumText(int bands, double low_hz, double high_hz, float floor_db = -90.0f) const
+	{
+		static const wchar_t ramp[] = L" .:-=+*#%@";
+		const int steps = static_cast<int>(std::size(ramp)) - 2;
+
+		std::wstring text;
+		double ratio = std::pow(high_hz / low_hz, 1.0 / bands);
+		for (int b = 0; b < bands; b++)
+		{
+			double low = low_hz * std::pow(ratio, b);
+			float level = getBandLevel(low, low * ratio);
+			int step = static_cast<int>(std::lround((1.0f - std::min(level, 0.0f) / floor_db) * steps));
+			text += ramp[std::clamp(step, 0, steps)];
+		}
+		return text;
+	}
+
+private:
+	static float toDecibels(float amplitude)
+	{
+		return amplitude > 0.0f ? std::max(20.0f * std::log10(amplitude), ANALYZER_FLOOR_DB) : ANALYZER_FLOOR_DB;
+	}
+};
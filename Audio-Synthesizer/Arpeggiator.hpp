@@ -1,22 +1,24 @@
 #include "Note.hpp"
+#include "Synth.hpp"
 
 class Arpeggiator {
 private:
+    Engine& a_engine; // Where the notes are played
     std::vector<int> a_chord; // The current chord
     double a_note_duration; // The duration of each note in seconds
     double a_arpeggio_start_time; // The time when the arpeggio started
 
 public:
-    Arpeggiator(double note_duration)
-        : a_note_duration(note_duration), a_arpeggio_start_time(0.0) {}
+    Arpeggiator(Engine& engine, double note_duration)
+        : a_engine(engine), a_note_duration(note_duration), a_arpeggio_start_time(0.0) {}
 
     void setChord(const std::vector<int>& new_chord, double start_time) {
         a_chord = new_chord;
         a_arpeggio_start_time = start_time;
     }
 
-    // Call this function every frame to update the arpeggio
-    void update(double time, const SoundGenerator<int16_t>& sound_generator, std::vector<Note>& notes, std::mutex& mutex_notes) {
+    // Call this function every frame to update the arpeggio. Notes go to the engine as events.
+    void update(double time) {
         if (a_chord.empty()) {
             return; // No chord set, so do nothing
         }
@@ -27,30 +29,16 @@ public:
         // Calculate which note of the arpeggio should be playing
         int note_index = static_cast<int>(elapsed_time / a_note_duration) % a_chord.size();
 
-        // Play the note
-        {
-            std::unique_lock<std::mutex> lock(mutex_notes);
-            notes.emplace_back(a_chord[note_index], time, 0.0, true);
-        }
-
-        // Stop the previous note
+        // Stop the previous note, or the last one if we're at the start of the chord
         if (note_index > 0) {
-            std::unique_lock<std::mutex> lock(mutex_notes);
-            auto note_found = find_if(notes.begin(), notes.end(), [this, note_index](Note const& item) { return item.a_id == a_chord[static_cast<size_t>(note_index) - 1u]; });
-            if (note_found != notes.end()) {
-                note_found->a_off = time;
-                note_found->a_active = false;
-            }
+            a_engine.postNoteOff(a_chord[static_cast<size_t>(note_index) - 1u], time);
         }
-        // If we're at the start of the chord, stop the last note
         else if (a_chord.size() > 1) {
-            std::unique_lock<std::mutex> lock(mutex_notes);
-            auto note_found = find_if(notes.begin(), notes.end(), [this](Note const& item) { return item.a_id == a_chord.back(); });
-            if (note_found != notes.end()) {
-                note_found->a_off = time;
-                note_found->a_active = false;
-            }
+            a_engine.postNoteOff(a_chord.back(), time);
         }
+
+        // Play the note
+        a_engine.postNoteOn(a_chord[note_index], time);
     }
 
     double getNoteDuration() const {
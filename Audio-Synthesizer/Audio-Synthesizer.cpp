@@ -6,89 +6,151 @@
 #include <condition_variable>
 #include <numbers>
 #include <array>
+#include <iomanip>
 
 #include "SoundCard.hpp"
-#include "Instrument.hpp"
+#include "Keyboard.hpp"
+#include "MidiInput.hpp"
+#include "Synth.hpp"
 #include "Arpeggiator.hpp"
-#include "SoundEffect.hpp"
+#include "Recorder.hpp"
+#include "Analyzer.hpp"
 
-#define NUM_INSTRUMENTS 5
-#define NUM_SOUND_EFFECTS 4
+// The one engine the keyboard and MIDI input play
+Engine engine;
+Arpeggiator arp(engine, 0.5);
 
-extern int octave;
+// Captures the master output with --record
+Recorder recorder;
 
-std::vector<Note> notes;
-std::mutex mutex_notes;
+// Meters and spectrum of the master output for the status line
+Analyzer analyzer;
 
-Arpeggiator arp(0.5);
-int instrument_index = 0;
-std::array<std::unique_ptr<BaseInstrument>, NUM_INSTRUMENTS> instruments = { std::make_unique<Piano>(), std::make_unique<Accordion>(), std::make_unique<Trumpet>(), std::make_unique<Saxophone>(), std::make_unique<Drum>() };
-int sound_effect_index = 0;
-std::array<std::unique_ptr<BaseSoundEffect<double>>, NUM_SOUND_EFFECTS> sound_effects = { std::make_unique<BaseSoundEffect<double>>(), std::make_unique<Flanger<double>>(5.0, 0.5, 0.25), std::make_unique<Delay<double>>(static_cast<int>(SAMPLE_RATE), 0.7), std::make_unique<MultitapReverb<double>>(std::vector<ReverbTap<double>>{
-	{SAMPLE_RATE / 2, 0.5}, // 0.5 seconds delay and 0.5 feedback
-	{SAMPLE_RATE / 4, 0.3}, // 0.25 seconds delay and 0.3 feedback
-	{SAMPLE_RATE / 8, 0.2}, // 0.125 seconds delay and 0.2 feedback
-	{SAMPLE_RATE / 16, 0.1}, // 0.0625 seconds delay and 0.1 feedback
-	{SAMPLE_RATE / 32, 0.05}, // 0.03125 seconds delay and 0.05 feedback
-	{SAMPLE_RATE / 64, 0.025}, // 0.015625 seconds delay and 0.025 feedback
-	{SAMPLE_RATE / 128, 0.01}, // 0.0078125 seconds delay and 0.01 feedback
-}) };
-
-
-template<typename T>
-void safeRemove(T& v, bool(*func)(Note const& item))
+void generateSound(AudioBus& bus, double time, double time_step)
 {
-	auto n = v.begin();
-	while (n != v.end()) {
-		if (!func(*n)) {
-			n = v.erase(n);
-		}
-		else {
-			++n;
-		}
-	}
+	engine.generateSound(bus, time, time_step);
+	recorder.record(bus);
+	analyzer.process(bus);
 }
 
-double generateSound(int channel, double time)
+int main(int argc, char* argv[])
 {
-	std::unique_lock<std::mutex> lock(mutex_notes);
-	double mixed_output = 0.0;
-
-	std::for_each(notes.begin(), notes.end(), [&mixed_output, &time](Note& n) {
-		bool is_note_finished = false;
-		double sound = 0.0;
-
-		sound = instruments[instrument_index]->sound(time, n, is_note_finished);
-		mixed_output += sound;
+	std::locale::global(std::locale(""));
 
-		if (is_note_finished && n.a_off > n.a_on) {
-			n.a_active = false;
+	// Optional audio backend and device, output and render rates, MIDI input, a recording of the output, fixed quality, a scrolling spectrum, Scala scale (.scl), keyboard mapping (.kbm), sample library (.sfz) and granular source (.wav) on the command line
+	AUDIO_BACKEND backend_type = AUDIO_BACKEND::DEFAULT;
+	std::wstring device_name;
+	std::wstring midi_device_name;
+	uint32_t sample_rate = DEFAULT_SAMPLE_RATE;
+	uint32_t render_rate = 0;
+	std::string record_path;
+	bool is_quality_fixed = false;
+	bool is_spectrum_shown = false;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		if ((argument == "--rate" || argument == "--render-rate") && i + 1 < argc)
+		{
+			uint32_t rate = static_cast<uint32_t>(std::max(std::atoi(argv[++i]), 0));
+			(argument == "--rate" ? sample_rate : render_rate) = rate;
+			continue;
+		}
+		if (argument == "--record" && i + 1 < argc)
+		{
+			record_path = argv[++i];
+			continue;
+		}
+		if (argument == "--fixed-quality")
+		{
+			is_quality_fixed = true;
+			continue;
+		}
+		if (argument == "--spectrum")
+		{
+			is_spectrum_shown = true;
+			continue;
+		}
+		if (argument == "--backend" && i + 1 < argc)
+		{
+			backend_type = parseAudioBackend(argv[++i]);
+			continue;
+		}
+		if (argument == "--device" && i + 1 < argc)
+		{
+			device_name = widenDeviceName(argv[++i]);
+			continue;
+		}
+		if (argument == "--midi" && i + 1 < argc)
+		{
+			midi_device_name = widenDeviceName(argv[++i]);
+			continue;
+		}
+		if (argument.ends_with(".sfz"))
+		{
+			for (auto& instrument : engine.a_instruments)
+			{
+				if (auto sampler = dynamic_cast<Sampler*>(instrument.get()))
+					std::cout << (sampler->load(argument) ? "Loaded sample library: " : "Could not load sample library: ") << argument << std::endl;
+			}
+			continue;
+		}
+		if (argument.ends_with(".wav"))
+		{
+			for (auto& instrument : engine.a_instruments)
+			{
+				if (auto granular = dynamic_cast<Granular*>(instrument.get()))
+					std::cout << (granular->loadSource(argument) ? "Loaded granular source: " : "Could not load granular source: ") << argument << std::endl;
+			}
+			continue;
 		}
-		});
 
-	safeRemove<std::vector<Note>>(notes, [](Note const& item) { return item.a_active; });
+		bool is_scale = argument.ends_with(".scl");
+		bool is_mapping = argument.ends_with(".kbm");
+		if (!is_scale && !is_mapping)
+			continue;
 
-	return sound_effects[sound_effect_index]->process(mixed_output) * 0.5;
-}
+		bool loaded = is_scale ? engine.a_tuning.loadScala(argument) : engine.a_tuning.loadKeyboardMapping(argument);
+		std::cout << (loaded ? "Loaded tuning: " : "Could not load tuning: ") << argument << std::endl;
+	}
 
-int main()
-{
-	std::locale::global(std::locale(""));
+	// Every coefficient and buffer follows the rates, so they are set before anything plays
+	if (sample_rate < 8000 || render_rate > sample_rate)
+	{
+		std::cout << "The output rate has to be at least 8000 Hz and the render rate no higher than it" << std::endl;
+		return 1;
+	}
+	engine.setSampleRate(sample_rate, render_rate);
+
+	// Live play has a deadline: under load the engine gives up quality before the output glitches
+	engine.a_governor.setEnabled(!is_quality_fixed);
 
-	// Get all sound hardware
-	std::vector<std::wstring> devices = SoundGenerator<int16_t>::enumerate();
+	// Get all sound hardware the backend can see
+	std::unique_ptr<AudioBackend<int16_t>> backend = createAudioBackend<int16_t>(backend_type);
+	if (backend == nullptr)
+	{
+		std::cout << "This audio backend was not built in" << std::endl;
+		return 1;
+	}
+	std::vector<std::wstring> devices = backend->enumerate();
+	if (device_name.empty() && !devices.empty())
+		device_name = devices[0];
 
-	// Display findings
+	// Display findings. Everything from here on is wide, glibc drops narrow output on a wide stream.
+	std::wcout << "Audio Backend: " << backend->getName() << std::endl;
 	for (const std::wstring& d : devices) std::wcout << "Audio Device: " << d << std::endl;
-	std::wcout << "Using: " << devices[0] << std::endl << std::endl;
+	std::wcout << "Using: " << device_name << std::endl;
+	std::wcout << "Sample Rate: " << engine.getSampleRate() << " Hz";
+	if (engine.isResampling())
+		std::wcout << ", rendered at " << engine.getRenderRate() << " Hz";
+	std::wcout << std::endl << std::endl;
 
-	std::cout << "============================================================" << std::endl;
-	std::cout << "| Press Esc to exit                                        |" << std::endl;
-	std::cout << "| Press Tab to change instrument                           |" << std::endl;
-	std::cout << "| Press Up/Down to change octave                           |" << std::endl;
-	std::cout << "| Press Ctrl to turn on/off arpeggiator                    |" << std::endl;
-	std::cout << "| Press '`' to turn change sound effect                    |" << std::endl;
-	std::cout << "============================================================" << std::endl;
+	std::wcout << "============================================================" << std::endl;
+	std::wcout << "| Press Esc to exit                                        |" << std::endl;
+	std::wcout << "| Press Tab to change instrument                           |" << std::endl;
+	std::wcout << "| Press Up/Down to change octave                           |" << std::endl;
+	std::wcout << "| Press " << std::left << std::setw(5) << KEY_ARPEGGIATOR_NAME << " to turn on/off arpeggiator                   |" << std::endl;
+	std::wcout << "| Press '`' to turn change sound effect                    |" << std::endl;
+	std::wcout << "============================================================" << std::endl;
 
 
 	// Display a keyboard
@@ -106,17 +168,46 @@ int main()
 		"    |               |               |               |               " << std::endl <<
 		"    C5              C6              C7              C8              " << std::endl << std::endl;
 
+	// Independent branches of the audio graph run on spare cores, leaving one for the control thread
+	engine.a_graph->startWorkers(std::min(std::max(std::thread::hardware_concurrency(), 2u) - 2, static_cast<uint32_t>(GRAPH_MAX_WORKERS)));
+
+	// The analyzer's ring has to exist before the first block reaches it
+	analyzer.prepare(sample_rate, MAX_BLOCK_FRAMES);
+
+	// Create sound machine!! Blocks of 64 stereo frames, queue depth adapts between 2 and 32 blocks
+	SoundGenerator<int16_t> sound_generator(std::move(backend), std::move(device_name), 2, 32, 128, LATENCY_MODE::ADAPTIVE, sample_rate);
+	if (!sound_generator.isRunning())
+	{
+		std::wcout << "Could not open the audio device" << std::endl;
+		return 1;
+	}
 
-	// Create sound machine!!
-	SoundGenerator<int16_t> sound_generator(std::move(devices[0]), 2, 8, 512);
+	// Recording starts before the first block, so the take has the whole session
+	if (!record_path.empty())
+	{
+		bool recording = recorder.start(record_path, 2, sample_rate, MAX_BLOCK_FRAMES);
+		std::wcout << (recording ? "Recording to: " : "Could not record to: ") << std::wstring(record_path.begin(), record_path.end()) << std::endl;
+	}
 
 	// Link noise function with sound machine
 	sound_generator.setUserFunction(generateSound);
 
-	char keyboard[129];
-	std::memset(keyboard, ' ', 127);
-	keyboard[128] = '\0';
+	// Give the audio thread a moment to start before reporting its priority
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	std::wcout << (sound_generator.isRealtime() ? "Audio thread runs at real-time priority" : "Audio thread could not get real-time priority") << std::endl;
+
+	// MIDI is played alongside the computer keyboard, stamped on the sound generator's clock
+	MidiInput midi_input(engine.a_midi_events);
+	for (const std::wstring& d : midi_input.enumerate()) std::wcout << "MIDI Device: " << d << std::endl;
+	if (midi_input.open(sound_generator.getClock(), midi_device_name))
+		std::wcout << "MIDI Input: " << midi_input.getPortName() << std::endl;
+	else
+		std::wcout << "No MIDI input (" << midi_input.getName() << ")" << std::endl;
+
+	// Static so the terminal is restored when Esc exits the program
+	static Keyboard keyboard;
 
+	auto next_analysis_time = std::chrono::steady_clock::now();
 	auto clock_old_time = std::chrono::high_resolution_clock::now();
 	auto clock_real_time = std::chrono::high_resolution_clock::now();
 	double elapsed_time = 0.0;
@@ -129,9 +220,10 @@ int main()
 	bool is_esc_pressed = false;
 
 	// Note keys
-	std::array<int, 33> keys = { 'Z', 'X', 'C', 'V', 'B', 'N', 'M', VK_OEM_COMMA, VK_OEM_PERIOD, VK_OEM_2,
-								 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', VK_OEM_1, VK_OEM_7,
-								 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', VK_OEM_4, VK_OEM_6 };
+	std::array<int, 33> keys = { 'Z', 'X', 'C', 'V', 'B', 'N', 'M', KEY_COMMA, KEY_PERIOD, KEY_SLASH,
+								 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', KEY_SEMICOLON, KEY_QUOTE,
+								 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', KEY_LEFT_BRACKET, KEY_RIGHT_BRACKET };
+	std::array<bool, 33> was_key_down = {};
 
 	// Set the initial chord to play
 	static bool was_ctrl_down = false;
@@ -150,84 +242,58 @@ int main()
 	static bool was_backtick_down = false;
 	bool is_backtick_pressed = false;
 
+	// Switch between FM algorithms
+	static bool was_right_down = false;
+
 	while (1)
 	{
 		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		keyboard.update();
 
 		for (int k = 0; k < keys.size(); k++)
 		{
-			int16_t note_key_state = GetAsyncKeyState(keys[k]);
-			double curr_time = sound_generator.getTime();
+			bool is_key_down = keyboard.isKeyDown(keys[k]);
+			if (is_key_down == was_key_down[k])
+				continue;
 
-			// Check if note already exists in currently playing notes
-			std::unique_lock<std::mutex> lock(mutex_notes);
-			auto note_found = find_if(notes.begin(), notes.end(), [&k](Note const& item) { return item.a_id == k; });
-			if (note_found == notes.end())
-			{
-				// Note not found in vector
-
-				if (note_key_state & 0x8000)
-				{
-					// Add note to vector
-					notes.emplace_back(k, curr_time, 0.0, true);
-				}
-
-			}
-			else
-			{
-				// Note exists in vector
-				if (note_key_state & 0x8000)
-				{
-					// Key is still held, so do nothing
-					if (note_found->a_off > note_found->a_on)
-					{
-						// Key has been pressed again during release phase
-						note_found->a_on = curr_time;
-						note_found->a_active = true;
-					}
-				}
-				else
-				{
-					// Key has been released, so switch off
-					if (note_found->a_off < note_found->a_on)
-					{
-						note_found->a_off = curr_time;
-					}
-				}
-			}
+			// Pressed keys start or retrigger their note, released keys switch it off. A full
+			// queue drops the change, so it is tried again on the next pass.
+			double curr_time = sound_generator.getTime();
+			if (is_key_down ? engine.postNoteOn(k, curr_time) : engine.postNoteOff(k, curr_time))
+				was_key_down[k] = is_key_down;
 		}
 
 		if (is_ctrl_pressed) {
 			double curr_time = sound_generator.getTime();
 			if (curr_time >= next_update_time) {
-				arp.update(curr_time, sound_generator, notes, mutex_notes);
+				arp.update(curr_time);
 				next_update_time = curr_time + arp.getNoteDuration();
 			}
 		}
 
-		if (GetAsyncKeyState(VK_CONTROL) & 0x8000) {
-			if (!was_ctrl_down) {  // The Ctrl key was just pressed
+		if (keyboard.isKeyDown(KEY_ARPEGGIATOR)) {
+			if (!was_ctrl_down) {  // The arpeggiator key was just pressed
 				is_ctrl_pressed = !is_ctrl_pressed;  // Toggle is_ctrl_pressed
 				was_ctrl_down = true;
 			}
 		}
 		else {
-			was_ctrl_down = false;  // The Ctrl key is not being pressed
+			was_ctrl_down = false;  // The arpeggiator key is not being pressed
 		}
 
 		// Control the octave parameter
-		if (GetAsyncKeyState(VK_DOWN) & 0x8000) {
+		if (keyboard.isKeyDown(KEY_DOWN)) {
 			if (!is_down_pressed) {
-				octave--;
+				engine.setOctave(engine.getOctave() - 1);
 				is_down_pressed = true;
 			}
 		}
 		else {
 			is_down_pressed = false;
 		}
-		if (GetAsyncKeyState(VK_UP) & 0x8000) {
+		if (keyboard.isKeyDown(KEY_UP)) {
 			if (!is_up_pressed) {
-				octave++;
+				engine.setOctave(engine.getOctave() + 1);
 				is_up_pressed = true;
 			}
 		}
@@ -236,9 +302,9 @@ int main()
 		}
 
 		// Switch between instruments
-		if (GetAsyncKeyState(VK_TAB) & 0x8000) {
+		if (keyboard.isKeyDown(KEY_TAB)) {
 			if (!was_tab_down) {
-				instrument_index = (instrument_index + 1) % NUM_INSTRUMENTS;
+				engine.postEvent({ SYNTH_EVENT::INSTRUMENT, (engine.a_instrument_index + 1) % NUM_INSTRUMENTS, sound_generator.getTime(), 0.0 });
 				was_tab_down = true;
 			}
 		}
@@ -246,10 +312,21 @@ int main()
 			was_tab_down = false;
 		}
 
+		// Switch between FM algorithms while the FM instrument is selected
+		if (keyboard.isKeyDown(KEY_RIGHT)) {
+			if (!was_right_down) {
+				engine.postEvent({ SYNTH_EVENT::NEXT_FM_ALGORITHM, 0, sound_generator.getTime(), 0.0 });
+				was_right_down = true;
+			}
+		}
+		else {
+			was_right_down = false;
+		}
+
 		// Switch between sound effects
-		if (GetAsyncKeyState(VK_OEM_3) & 0x8000) {
+		if (keyboard.isKeyDown(KEY_BACKTICK)) {
 			if (!was_backtick_down) {
-				sound_effect_index = (sound_effect_index + 1) % NUM_SOUND_EFFECTS;
+				engine.postEvent({ SYNTH_EVENT::SOUND_EFFECT, (engine.a_sound_effect_index + 1) % NUM_SOUND_EFFECTS, sound_generator.getTime(), 0.0 });
 				was_backtick_down = true;
 			}
 		}
@@ -258,9 +335,15 @@ int main()
 		}
 
 		// Exit program
-		if (GetAsyncKeyState(VK_ESCAPE) & 0x8000) {
+		if (keyboard.isKeyDown(KEY_ESCAPE)) {
 			if (!is_esc_pressed) {
 				std::wcout << "\nExiting program...";
+				if (recorder.isRecording())
+				{
+					recorder.stop();
+					std::wcout << "\nRecorded " << static_cast<double>(recorder.getRecordedFrames()) / sample_rate << " s to " << recorder.getFileCount() << " file(s), "
+						<< recorder.getDroppedFrames() << " frames dropped" << (recorder.hasWriteFailed() ? ", a disk write failed" : "") << std::endl;
+				}
 				exit(0); // Terminate the program
 			}
 		}
@@ -268,7 +351,34 @@ int main()
 			is_esc_pressed = false;
 		}
 
-		std::wcout << "\rnote: " << notes.size() << "; octave: " << octave << "; instrument: " << instruments[instrument_index]->getName() << "; sound effect: " << sound_effects[sound_effect_index]->getName() << "            ";
+		// Log every quality change, so the governor's thresholds can be tuned against real sessions
+		QualityChange change;
+		while (engine.a_governor.readChanges(&change, 1) == 1)
+		{
+			std::wcout << "\rQuality: " << qualityStageName(change.a_stage) << " at " << std::fixed << std::setprecision(2) << change.a_time << "s, load " << static_cast<int>(change.a_load * 100.0)
+				<< "%, " << change.a_voices << " voices";
+			if (change.a_stage == QUALITY_STAGE::VOICE_LIMIT)
+				std::wcout << ", limit " << change.a_voice_limit;
+			std::wcout << std::defaultfloat << std::setprecision(6) << "                                        " << std::endl;
+		}
+
+		// The analysis runs here rather than on the audio thread, a few times a second is plenty to read
+		if (std::chrono::steady_clock::now() >= next_analysis_time)
+		{
+			next_analysis_time += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(ANALYZER_REFRESH_SECONDS));
+			if (analyzer.update() && is_spectrum_shown)
+				std::wcout << "\r50 Hz |" << analyzer.spectrumText(48, 50.0, std::min(16000.0, sample_rate / 2.0)) << "| " << static_cast<int>(std::min(16000.0, sample_rate / 2.0) / 1000.0) << " kHz" << "                                        " << std::endl;
+		}
+
+		std::wcout << "\rnote: " << engine.a_note_count << "; octave: " << engine.getOctave() << "; instrument: " << engine.getInstrument().getName() << "; sound effect: " << engine.getSoundEffect(0).getName() << "; latency: " << static_cast<int>((sound_generator.getLatency() + static_cast<double>(MasterDynamics::getLatency()) / engine.getSampleRate()) * 1000.0) << "ms";
+		std::wcout << "; peak: " << static_cast<int>(std::lround(analyzer.getPeakDb(0))) << "/" << static_cast<int>(std::lround(analyzer.getPeakDb(1))) << " dB"
+			<< "; rms: " << static_cast<int>(std::lround(analyzer.getRmsDb(0))) << "/" << static_cast<int>(std::lround(analyzer.getRmsDb(1))) << " dB"
+			<< "; clipped: " << analyzer.getClippedSamples();
+		if (engine.a_governor.isEnabled())
+			std::wcout << "; load: " << static_cast<int>(engine.a_governor.getLoad() * 100.0) << "%";
+		if (recorder.isRecording())
+			std::wcout << "; recorded: " << recorder.getRecordedFrames() / sample_rate << "s, dropped: " << recorder.getDroppedFrames();
+		std::wcout << "            ";
 	}
 
 	return 0;
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#include "AudioBus.hpp"
+#include "Realtime.hpp"
+
+enum class LATENCY_MODE {
+	FIXED,		// Always keep every block queued at the device
+	ADAPTIVE	// Start with a shallow queue and grow/shrink it from observed underruns and render headroom
+};
+
+// Device names on the POSIX backends are plain ASCII
+inline std::string narrowDeviceName(const std::wstring& name)
+{
+	std::string narrow;
+	for (wchar_t c : name)
+		narrow += static_cast<char>(c);
+	return narrow;
+}
+
+inline std::wstring widenDeviceName(const std::string& name)
+{
+	return std::wstring(name.begin(), name.end());
+}
+
+// Renders the next frames into a bus when the backend asks for them. Called on the audio
+// thread only, so it must not lock, allocate or do I/O.
+class BlockSource
+{
+public:
+	virtual ~BlockSource() = default;
+	virtual AudioBus& renderBlock(uint32_t frames) = 0;
+};
+
+// Maps steady_clock time to stream time, so threads other than the audio thread can stamp
+// events with the time they should sound at. Events are scheduled one block ahead: one
+// arriving while a block renders lands in the next block at the same offset, so the
+// latency stays constant instead of jittering with where in the block it arrived.
+class StreamClock
+{
+private:
+	std::atomic<double> a_offset;	// Stream time minus steady_clock seconds
+	std::atomic<double> a_lead;		// One block
+
+	static double seconds(std::chrono::steady_clock::time_point t)
+	{
+		return std::chrono::duration<double>(t.time_since_epoch()).count();
+	}
+
+public:
+	StreamClock()
+		: a_offset(0.0), a_lead(0.0)
+	{
+	}
+
+	// The audio thread calls this as it starts rendering the block at stream_time
+	void mark(double stream_time, double block_duration, std::chrono::steady_clock::time_point now)
+	{
+		a_offset = stream_time - seconds(now);
+		a_lead = block_duration;
+	}
+
+	double timeAt(std::chrono::steady_clock::time_point t) const
+	{
+		return seconds(t) + a_offset + a_lead;
+	}
+
+	double now() const
+	{
+		return timeAt(std::chrono::steady_clock::now());
+	}
+};
+
+// Connection to an audio device. Every backend pulls: once started it calls the source
+// from its audio thread whenever the device needs the next block.
+template <typename T>
+class AudioBackend
+{
+public:
+	virtual ~AudioBackend() = default;
+
+	virtual std::wstring getName() const = 0;
+	virtual std::vector<std::wstring> enumerate() = 0;
+
+	// Blocks are block_frames interleaved frames of T, at most blocks of them queued at once
+	virtual bool open(const std::wstring& device, uint32_t sample_rate, uint32_t channels, uint32_t block_frames, uint32_t blocks, LATENCY_MODE latency_mode) = 0;
+	virtual bool start(BlockSource& source) = 0;
+	virtual void close() = 0;
+
+	// Time from render to the speaker, in seconds
+	virtual double getLatency() const = 0;
+
+	virtual uint32_t getQueuedBlockTarget() const
+	{
+		return 0;
+	}
+
+	virtual uint32_t getUnderrunCount() const
+	{
+		return 0;
+	}
+
+	// Whether the audio thread got real-time scheduling
+	virtual bool isRealtime() const = 0;
+};
+
+// Base for devices that take blocks through a blocking write. An audio thread of our own
+// at real-time priority waits for room, pulls a block from the source and writes it,
+// keeping the device queue at a target depth that adapts to underruns and render load.
+template <typename T>
+class BlockingBackend : public AudioBackend<T>
+{
+protected:
+	uint32_t a_sample_rate;
+	uint32_t a_channels;
+	uint32_t a_block_frames;
+	uint32_t a_block_count;
+
+private:
+	std::unique_ptr<T[]> a_block_memory_ptr;
+	std::thread a_audio_thread;
+	std::atomic<bool> a_is_running;
+	std::atomic<bool> a_is_realtime;
+
+	// Queue depth control
+	LATENCY_MODE a_latency_mode;
+	std::atomic<uint32_t> a_block_target;		// Number of blocks we allow to be queued at the device
+	std::atomic<uint32_t> a_underrun_count;
+	uint32_t a_blocks_written;
+	uint32_t a_stable_blocks;
+
+	static constexpr uint32_t MIN_QUEUED_BLOCKS = 2;
+	static constexpr double HIGH_RENDER_LOAD = 0.75;	// Grow the queue when a block takes longer than this to render
+	static constexpr double LOW_RENDER_LOAD = 0.35;		// Only shrink the queue while rendering stays below this
+	static constexpr double SHRINK_AFTER_SECONDS = 2.0;	// How long the output has to be stable before we shrink
+
+public:
+	BlockingBackend()
+		: a_sample_rate(0), a_channels(0), a_block_frames(0), a_block_count(0), a_is_running(false), a_is_realtime(false),
+		a_latency_mode(LATENCY_MODE::FIXED), a_block_target(0), a_underrun_count(0), a_blocks_written(0), a_stable_blocks(0)
+	{
+	}
+
+	virtual bool open(const std::wstring& device, uint32_t sample_rate, uint32_t channels, uint32_t block_frames, uint32_t blocks, LATENCY_MODE latency_mode) override
+	{
+		a_sample_rate = sample_rate;
+		a_channels = channels;
+		a_block_frames = block_frames;
+		a_block_count = std::max(blocks, MIN_QUEUED_BLOCKS);
+
+		// In adaptive mode the block count is only the upper bound of the queue
+		a_latency_mode = latency_mode;
+		a_block_target = a_latency_mode == LATENCY_MODE::ADAPTIVE ? MIN_QUEUED_BLOCKS : a_block_count;
+		a_underrun_count = 0;
+		a_blocks_written = 0;
+		a_stable_blocks = 0;
+		a_block_memory_ptr = std::make_unique<T[]>(static_cast<size_t>(a_block_frames) * a_channels);
+
+		return openDevice(device);
+	}
+
+	virtual bool start(BlockSource& source) override
+	{
+		a_is_running = true;
+		a_audio_thread = std::thread(&BlockingBackend::audioThread, this, &source);
+		return true;
+	}
+
+	// Subclasses call this first thing in their destructor, the thread uses their device
+	virtual void close() override
+	{
+		a_is_running = false;
+		wakeUp();
+		if (a_audio_thread.joinable())
+			a_audio_thread.join();
+		closeDevice();
+	}
+
+	virtual double getLatency() const override
+	{
+		return static_cast<double>(a_block_target) * static_cast<double>(a_block_frames) / static_cast<double>(a_sample_rate);
+	}
+
+	virtual uint32_t getQueuedBlockTarget() const override
+	{
+		return a_block_target;
+	}
+
+	virtual uint32_t getUnderrunCount() const override
+	{
+		return a_underrun_count;
+	}
+
+	virtual bool isRealtime() const override
+	{
+		return a_is_realtime;
+	}
+
+protected:
+	virtual bool openDevice(const std::wstring& device) = 0;
+	virtual void closeDevice() = 0;
+
+	// Blocks written and not yet played
+	virtual uint32_t queuedBlocks() const = 0;
+
+	// Wait until fewer than target_blocks are queued. Returns false once the backend is closing.
+	virtual bool waitForSpace(uint32_t target_blocks) = 0;
+
+	// Queue one block, false on a device error
+	virtual bool write(const T* samples) = 0;
+
+	// Cut a wait short so close() doesn't have to sit out its timeout
+	virtual void wakeUp()
+	{
+	}
+
+	bool isRunning() const
+	{
+		return a_is_running;
+	}
+
+private:
+	// Grow the queue as soon as the device starves or rendering gets tight,
+	// shrink it again once the output has been stable for a while
+	void adaptQueueDepth(bool underrun, double render_load)
+	{
+		if (a_latency_mode != LATENCY_MODE::ADAPTIVE)
+			return;
+
+		if (underrun || render_load > HIGH_RENDER_LOAD)
+		{
+			if (a_block_target < a_block_count)
+				a_block_target++;
+			a_stable_blocks = 0;
+			return;
+		}
+
+		if (render_load > LOW_RENDER_LOAD)
+		{
+			a_stable_blocks = 0;
+			return;
+		}
+
+		double block_duration = static_cast<double>(a_block_frames) / static_cast<double>(a_sample_rate);
+		if (++a_stable_blocks >= static_cast<uint32_t>(SHRINK_AFTER_SECONDS / block_duration))
+		{
+			if (a_block_target > MIN_QUEUED_BLOCKS)
+				a_block_target--;
+			a_stable_blocks = 0;
+		}
+	}
+
+	void audioThread(BlockSource* source)
+	{
+		a_is_realtime = promoteToRealtimePriority();
+		double block_duration = static_cast<double>(a_block_frames) / static_cast<double>(a_sample_rate);
+
+		while (a_is_running)
+		{
+			// Wait until the device has room for another block within the target queue depth
+			if (!waitForSpace(a_block_target))
+				break;
+
+			// Every block came back before we could send a new one, so the device ran dry
+			bool underrun = a_blocks_written > 0 && queuedBlocks() == 0;
+			if (underrun)
+				a_underrun_count++;
+
+			auto render_start = std::chrono::steady_clock::now();
+
+			// Single clip/dither/interleave pass into the device format
+			AudioBus& bus = source->renderBlock(a_block_frames);
+			bus.convertToPCM(a_block_memory_ptr.get());
+
+			std::chrono::duration<double> render_time = std::chrono::steady_clock::now() - render_start;
+			adaptQueueDepth(underrun, render_time.count() / block_duration);
+
+			// Send block to sound device
+			if (!write(a_block_memory_ptr.get()))
+				break;
+			a_blocks_written++;
+		}
+	}
+};
+
+// Plays into nothing at the pace of a real device. Keeps the synthesizer running on
+// machines without a sound card, such as build servers.
+template <typename T>
+class NullBackend : public BlockingBackend<T>
+{
+private:
+	std::atomic<uint64_t> a_frames_written;
+	std::chrono::steady_clock::time_point a_start;
+
+public:
+	NullBackend()
+		: a_frames_written(0)
+	{
+	}
+
+	~NullBackend()
+	{
+		this->close();
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"Null";
+	}
+
+	virtual std::vector<std::wstring> enumerate() override
+	{
+		return { L"No output" };
+	}
+
+protected:
+	virtual bool openDevice(const std::wstring& device) override
+	{
+		a_frames_written = 0;
+		a_start = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	virtual void closeDevice() override
+	{
+	}
+
+	virtual uint32_t queuedBlocks() const override
+	{
+		uint64_t written = a_frames_written;
+		return static_cast<uint32_t>((written - std::min(playedFrames(), written)) / this->a_block_frames);
+	}
+
+	virtual bool waitForSpace(uint32_t target_blocks) override
+	{
+		while (this->isRunning() && queuedBlocks() >= target_blocks)
+			std::this_thread::sleep_for(std::chrono::microseconds(1000000 * this->a_block_frames / (2 * this->a_sample_rate)));
+		return this->isRunning();
+	}
+
+	virtual bool write(const T* samples) override
+	{
+		// Ran dry, so playback restarts from this block the way a real device would
+		if (queuedBlocks() == 0 && playedFrames() > a_frames_written)
+		{
+			a_start = std::chrono::steady_clock::now();
+			a_frames_written = 0;
+		}
+		a_frames_written += this->a_block_frames;
+		return true;
+	}
+
+private:
+	uint64_t playedFrames() const
+	{
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - a_start;
+		return static_cast<uint64_t>(elapsed.count() * this->a_sample_rate);
+	}
+};
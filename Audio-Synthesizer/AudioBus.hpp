@@ -0,0 +1,186 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numbers>
+#include <algorithm>
+#include <type_traits>
+
+#include "Noise.hpp"
+
+// Constant-power pan law scaled so that the centre position is unity gain on both sides
+inline void panGains(double pan, float& gain_left, float& gain_right)
+{
+	double angle = (std::clamp(pan, -1.0, 1.0) + 1.0) * std::numbers::pi / 4.0;
+	gain_left = static_cast<float>(std::cos(angle) * std::numbers::sqrt2);
+	gain_right = static_cast<float>(std::sin(angle) * std::numbers::sqrt2);
+}
+
+// Planar float32 bus that the engine mixes into. Every channel is one contiguous
+// run of frames, so per-channel processing and the final PCM conversion stay
+// simple loops the compiler can vectorize.
+class AudioBus
+{
+private:
+	uint32_t a_channels;
+	uint32_t a_capacity;
+	uint32_t a_frames;
+	std::vector<float> a_data;
+	std::vector<float> a_dither;
+	std::vector<float> a_dither_second;
+	NoiseGenerator a_dither_noise;
+
+public:
+	AudioBus(uint32_t channels = 1, uint32_t capacity = 0)
+		: a_channels(0), a_capacity(0), a_frames(0), a_dither_noise(DEFAULT_NOISE_SEED)
+	{
+		resize(channels, capacity);
+	}
+
+	void resize(uint32_t channels, uint32_t capacity)
+	{
+		a_channels = std::max(channels, 1u);
+		a_capacity = capacity;
+		a_frames = capacity;
+		a_data.assign(static_cast<size_t>(a_channels) * a_capacity, 0.0f);
+		a_dither.assign(static_cast<size_t>(a_channels) * a_capacity, 0.0f);
+		a_dither_second.assign(a_capacity, 0.0f);
+	}
+
+	// Restarts the dither noise, so a render can be repeated bit for bit
+	void setDitherSeed(uint64_t seed)
+	{
+		a_dither_noise.setSeed(seed);
+	}
+
+	uint32_t getChannels() const
+	{
+		return a_channels;
+	}
+
+	uint32_t getFrames() const
+	{
+		return a_frames;
+	}
+
+	// Number of frames the next render should produce, never more than the capacity
+	void setFrames(uint32_t frames)
+	{
+		a_frames = std::min(frames, a_capacity);
+	}
+
+	float* channel(uint32_t c)
+	{
+		return a_data.data() + static_cast<size_t>(c) * a_capacity;
+	}
+
+	const float* channel(uint32_t c) const
+	{
+		return a_data.data() + static_cast<size_t>(c) * a_capacity;
+	}
+
+	void clear()
+	{
+		for (uint32_t c = 0; c < a_channels; c++)
+			std::fill_n(channel(c), a_frames, 0.0f);
+	}
+
+	// Add a mono source to the bus, panned with panGains() in stereo. Any other
+	// layout gets the source on every channel.
+	void addMono(const float* source, float pan = 0.0f)
+	{
+		if (a_channels == 2)
+		{
+			float gain_left, gain_right;
+			panGains(pan, gain_left, gain_right);
+
+			float* left = channel(0);
+			float* right = channel(1);
+			for (uint32_t n = 0; n < a_frames; n++)
+			{
+				left[n] += source[n] * gain_left;
+				right[n] += source[n] * gain_right;
+			}
+			return;
+		}
+
+		for (uint32_t c = 0; c < a_channels; c++)
+		{
+			float* out = channel(c);
+			for (uint32_t n = 0; n < a_frames; n++)
+				out[n] += source[n];
+		}
+	}
+
+	// Add a stereo source. Other layouts get the average of both sides on every channel.
+	void addStereo(const float* source_left, const float* source_right)
+	{
+		if (a_channels == 2)
+		{
+			float* left = channel(0);
+			float* right = channel(1);
+			for (uint32_t n = 0; n < a_frames; n++)
+			{
+				left[n] += source_left[n];
+				right[n] += source_right[n];
+			}
+			return;
+		}
+
+		for (uint32_t c = 0; c < a_channels; c++)
+		{
+			float* out = channel(c);
+			for (uint32_t n = 0; n < a_frames; n++)
+				out[n] += 0.5f * (source_left[n] + source_right[n]);
+		}
+	}
+
+	// Clip, dither and interleave the whole bus into the device format in one pass.
+	// Integer formats get TPDF dither of +-1 LSB. Returns the number of samples that clipped.
+	template <typename T>
+	uint32_t convertToPCM(T* out)
+	{
+		float scale = 1.0f;
+		float low = -1.0f;
+		float high = 1.0f;
+		if constexpr (std::is_integral_v<T>)
+		{
+			scale = static_cast<float>(std::numeric_limits<T>::max());
+			low = static_cast<float>(std::numeric_limits<T>::min());
+			high = scale;
+			fillDither();
+		}
+
+		uint32_t clipped = 0;
+		for (uint32_t c = 0; c < a_channels; c++)
+		{
+			const float* in = channel(c);
+			const float* dither = a_dither.data() + static_cast<size_t>(c) * a_capacity;
+			for (uint32_t n = 0; n < a_frames; n++)
+			{
+				float sample = in[n] * scale;
+				if constexpr (std::is_integral_v<T>)
+					sample = std::floor(sample + dither[n] + 0.5f);
+				clipped += (sample > high) | (sample < low);
+				out[static_cast<size_t>(n) * a_channels + c] = static_cast<T>(std::clamp(sample, low, high));
+			}
+		}
+		return clipped;
+	}
+
+private:
+	// Triangular dither is the sum of two uniform values of +-0.5 LSB
+	void fillDither()
+	{
+		for (uint32_t c = 0; c < a_channels; c++)
+		{
+			float* dither = a_dither.data() + static_cast<size_t>(c) * a_capacity;
+			a_dither_noise.fillWhite(dither, a_frames);
+			a_dither_noise.fillWhite(a_dither_second.data(), a_frames);
+			for (uint32_t n = 0; n < a_frames; n++)
+				dither[n] = 0.5f * (dither[n] + a_dither_second[n]);
+		}
+	}
+};
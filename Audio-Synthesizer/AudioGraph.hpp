@@ -0,0 +1,627 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+
+#include "Filter.hpp"
+#include "SoundEffect.hpp"
+#include "Realtime.hpp"
+
+// Signal flow as a graph of stereo nodes. Edits are made on the control thread and
+// compiled into a plan: the nodes feeding the output, grouped into levels that only
+// depend on earlier levels, each with a buffer picked by liveness so buffers are reused
+// once their last reader has run. The audio thread swaps a new plan in between blocks
+// and nodes that survive an edit keep their state, so editing never glitches. Nodes of
+// one level are independent and run on worker threads alongside the audio thread.
+
+#define GRAPH_MAX_WORKERS 3
+#define GRAPH_CONVERT_FRAMES 256	// Stretch of a float buffer converted at once for a double precision effect
+
+enum class NODE_TYPE {
+	SOURCE,		// Renders into silence, has no inputs
+	FILTER,
+	EFFECT,
+	MIXER,		// Sums its inputs at a level
+	BUS			// Mixer the graph's output is taken from
+};
+
+// Left and right halves of one of the plan's buffers
+struct NodeBuffer
+{
+	float* a_left;
+	float* a_right;
+};
+
+class AudioNode
+{
+public:
+	virtual ~AudioNode() = default;
+
+	virtual NODE_TYPE getType() const = 0;
+	virtual std::wstring getName() const = 0;
+
+	// Reserve what a block of up to max_frames needs. Called on the control thread when
+	// the node is added, before it ever runs.
+	virtual void prepare([[maybe_unused]] uint32_t max_frames)
+	{
+	}
+
+	// Process a block in place. The buffer comes in holding the sum of the node's inputs,
+	// each scaled by the gain of its connection, or silence for a source.
+	virtual void process(NodeBuffer buffer, uint32_t frames, double time, double time_step) = 0;
+};
+
+class MixerNode : public AudioNode
+{
+private:
+	std::atomic<float> a_level;
+
+public:
+	MixerNode(float level = 1.0f)
+		: a_level(level)
+	{
+	}
+
+	void setLevel(float level)
+	{
+		a_level = level;
+	}
+
+	virtual NODE_TYPE getType() const override
+	{
+		return NODE_TYPE::MIXER;
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"Mixer";
+	}
+
+	virtual void process(NodeBuffer buffer, uint32_t frames, double, double) override
+	{
+		float level = a_level;
+		if (level == 1.0f)
+			return;
+
+		for (uint32_t i = 0; i < frames; i++)
+		{
+			buffer.a_left[i] *= level;
+			buffer.a_right[i] *= level;
+		}
+	}
+};
+
+class BusNode : public MixerNode
+{
+public:
+	virtual NODE_TYPE getType() const override
+	{
+		return NODE_TYPE::BUS;
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"Bus";
+	}
+};
+
+// Run a filter or effect working in T, the engine's Sample type unless given, over a float
+// buffer. In single precision it works on the buffer in place with one call for the whole block.
+template<typename T = Sample, typename Processor>
+void processBuffer(Processor& processor, float* buffer, uint32_t frames)
+{
+	if constexpr (std::is_same_v<T, float>)
+		processor.processBlock(buffer, frames);
+	else
+	{
+		T block[GRAPH_CONVERT_FRAMES];
+		for (uint32_t done = 0; done < frames; done += GRAPH_CONVERT_FRAMES)
+		{
+			uint32_t count = std::min<uint32_t>(frames - done, GRAPH_CONVERT_FRAMES);
+			std::copy_n(buffer + done, count, block);
+			processor.processBlock(block, count);
+			std::copy_n(block, count, buffer + done);
+		}
+	}
+}
+
+// A filter per side
+class FilterNode : public AudioNode
+{
+private:
+	std::unique_ptr<BaseFilter<Sample>> a_left;
+	std::unique_ptr<BaseFilter<Sample>> a_right;
+
+public:
+	FilterNode(std::unique_ptr<BaseFilter<Sample>> left, std::unique_ptr<BaseFilter<Sample>> right)
+		: a_left(std::move(left)), a_right(std::move(right))
+	{
+	}
+
+	virtual NODE_TYPE getType() const override
+	{
+		return NODE_TYPE::FILTER;
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"Filter";
+	}
+
+	virtual void process(NodeBuffer buffer, uint32_t frames, double, double) override
+	{
+		processBuffer(*a_left, buffer.a_left, frames);
+		processBuffer(*a_right, buffer.a_right, frames);
+	}
+};
+
+// An effect of its own per side, such as a send effect next to the selected one. T is the
+// precision the effect runs in, so a long feedback delay can run in double in a float build.
+template<typename T>
+class BasicEffectNode : public AudioNode
+{
+private:
+	std::unique_ptr<BaseSoundEffect<T>> a_left;
+	std::unique_ptr<BaseSoundEffect<T>> a_right;
+
+public:
+	BasicEffectNode(std::unique_ptr<BaseSoundEffect<T>> left, std::unique_ptr<BaseSoundEffect<T>> right)
+		: a_left(std::move(left)), a_right(std::move(right))
+	{
+	}
+
+	virtual NODE_TYPE getType() const override
+	{
+		return NODE_TYPE::EFFECT;
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return a_left->getName();
+	}
+
+	virtual void process(NodeBuffer buffer, uint32_t frames, double, double) override
+	{
+		processBuffer<T>(*a_left, buffer.a_left, frames);
+		processBuffer<T>(*a_right, buffer.a_right, frames);
+	}
+};
+
+using EffectNode = BasicEffectNode<Sample>;
+
+// Compiled graph. Built on the control thread, only read by the audio thread and the workers.
+struct GraphPlan
+{
+	struct Input
+	{
+		uint32_t a_buffer;
+		float a_gain;
+	};
+
+	struct Step
+	{
+		AudioNode* a_node;
+		std::vector<Input> a_inputs;
+		uint32_t a_buffer;
+	};
+
+	std::vector<std::vector<Step>> a_levels;
+	std::vector<std::shared_ptr<AudioNode>> a_nodes;	// Keeps nodes removed by a later edit alive while this plan may run
+	std::vector<std::vector<float>> a_buffers;			// Left then right, max_frames each
+	uint32_t a_output = 0;
+	uint32_t a_max_frames = 0;
+
+	NodeBuffer buffer(uint32_t index)
+	{
+		return { a_buffers[index].data(), a_buffers[index].data() + a_max_frames };
+	}
+
+	// Sum the inputs into the step's buffer and run its node
+	void run(const Step& step, uint32_t frames, double time, double time_step)
+	{
+		NodeBuffer out = buffer(step.a_buffer);
+		if (step.a_inputs.empty())
+		{
+			std::fill_n(out.a_left, frames, 0.0f);
+			std::fill_n(out.a_right, frames, 0.0f);
+		}
+		else
+		{
+			// The first input is copied rather than added to silence, so one input at unity gain passes unchanged
+			NodeBuffer in = buffer(step.a_inputs[0].a_buffer);
+			float gain = step.a_inputs[0].a_gain;
+			for (uint32_t i = 0; i < frames; i++)
+			{
+				out.a_left[i] = in.a_left[i] * gain;
+				out.a_right[i] = in.a_right[i] * gain;
+			}
+		}
+		for (size_t k = 1; k < step.a_inputs.size(); k++)
+		{
+			NodeBuffer in = buffer(step.a_inputs[k].a_buffer);
+			float gain = step.a_inputs[k].a_gain;
+			for (uint32_t i = 0; i < frames; i++)
+			{
+				out.a_left[i] += in.a_left[i] * gain;
+				out.a_right[i] += in.a_right[i] * gain;
+			}
+		}
+		step.a_node->process(out, frames, time, time_step);
+	}
+};
+
+// Threads that run the steps of a level alongside the audio thread. Dispatch and completion
+// go through atomics only, so the audio thread never locks or allocates. Steps are claimed
+// with a ticket holding the dispatch generation, the level size and the next step, so a
+// worker that wakes late can never claim a step of a level that already finished.
+class GraphWorkers
+{
+private:
+	std::vector<std::thread> a_threads;
+	std::atomic<bool> a_is_running;
+	std::atomic<uint32_t> a_generation;
+	std::atomic<uint64_t> a_ticket;
+	std::atomic<uint32_t> a_remaining;
+
+	// The level being run, valid while its ticket is current
+	GraphPlan* a_plan;
+	const std::vector<GraphPlan::Step>* a_level;
+	uint32_t a_frames;
+	double a_time;
+	double a_time_step;
+
+	static uint64_t makeTicket(uint32_t generation, uint32_t size, uint32_t next)
+	{
+		return (static_cast<uint64_t>(generation) << 40) | (static_cast<uint64_t>(size) << 20) | next;
+	}
+
+public:
+	GraphWorkers()
+		: a_is_running(false), a_generation(0), a_ticket(0), a_remaining(0), a_plan(nullptr), a_level(nullptr), a_frames(0), a_time(0.0), a_time_step(0.0)
+	{
+	}
+
+	~GraphWorkers()
+	{
+		stop();
+	}
+
+	// Control thread, while the audio thread is not running the graph
+	void start(uint32_t count)
+	{
+		stop();
+		a_is_running = true;
+		for (uint32_t t = 0; t < std::min<uint32_t>(count, GRAPH_MAX_WORKERS); t++)
+			a_threads.emplace_back(&GraphWorkers::workerThread, this);
+	}
+
+	void stop()
+	{
+		a_is_running = false;
+		a_generation.fetch_add(1, std::memory_order_release);
+		a_generation.notify_all();
+		for (std::thread& thread : a_threads)
+			thread.join();
+		a_threads.clear();
+	}
+
+	uint32_t getCount() const
+	{
+		return static_cast<uint32_t>(a_threads.size());
+	}
+
+	// Audio thread. Runs every step of the level and returns once they are all done.
+	void run(GraphPlan& plan, const std::vector<GraphPlan::Step>& level, uint32_t frames, double time, double time_step)
+	{
+		if (a_threads.empty() || level.size() < 2)
+		{
+			for (const GraphPlan::Step& step : level)
+				plan.run(step, frames, time, time_step);
+			return;
+		}
+
+		a_plan = &plan;
+		a_level = &level;
+		a_frames = frames;
+		a_time = time;
+		a_time_step = time_step;
+		a_remaining.store(static_cast<uint32_t>(level.size()), std::memory_order_relaxed);
+
+		uint32_t generation = (a_generation.load(std::memory_order_relaxed) + 1) & 0xFFFFFF;
+		a_ticket.store(makeTicket(generation, static_cast<uint32_t>(level.size()), 0), std::memory_order_release);
+		a_generation.store(generation, std::memory_order_release);
+		a_generation.notify_all();
+
+		runSteps(generation);
+
+		uint32_t remaining;
+		while ((remaining = a_remaining.load(std::memory_order_acquire)) != 0)
+			a_remaining.wait(remaining, std::memory_order_acquire);
+	}
+
+private:
+	// Claim and run steps of this generation until none are left
+	void runSteps(uint32_t generation)
+	{
+		uint64_t ticket = a_ticket.load(std::memory_order_acquire);
+		while (true)
+		{
+			uint32_t next = static_cast<uint32_t>(ticket & 0xFFFFF);
+			uint32_t size = static_cast<uint32_t>((ticket >> 20) & 0xFFFFF);
+			if ((ticket >> 40) != generation || next >= size)
+				return;
+			if (!a_ticket.compare_exchange_weak(ticket, ticket + 1, std::memory_order_acq_rel))
+				continue;
+
+			a_plan->run((*a_level)[next], a_frames, a_time, a_time_step);
+			if (a_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				a_remaining.notify_all();
+			ticket = a_ticket.load(std::memory_order_acquire);
+		}
+	}
+
+	void workerThread()
+	{
+		promoteToRealtimePriority();
+		RealtimeScope realtime;
+
+		// A stop() issued before this thread got to run has already moved the generation on,
+		// so the flag is checked before every wait, not only after it
+		uint32_t seen = a_generation.load(std::memory_order_acquire);
+		while (a_is_running)
+		{
+			a_generation.wait(seen, std::memory_order_acquire);
+			seen = a_generation.load(std::memory_order_acquire);
+			if (!a_is_running)
+				return;
+			runSteps(seen);
+		}
+	}
+};
+
+class AudioGraph
+{
+private:
+	struct Connection
+	{
+		int a_from;
+		int a_to;
+		float a_gain;
+	};
+
+	// Edited on the control thread, node ids are indices and removed nodes leave a nullptr
+	std::vector<std::shared_ptr<AudioNode>> a_nodes;
+	std::vector<Connection> a_connections;
+	int a_output;
+	uint32_t a_max_frames;
+
+	// The running plan, and the one the audio thread has in hand so it isn't freed under it
+	std::atomic<GraphPlan*> a_plan;
+	std::atomic<GraphPlan*> a_plan_in_use;
+	GraphWorkers a_workers;
+
+public:
+	AudioGraph(uint32_t max_frames)
+		: a_output(-1), a_max_frames(max_frames), a_plan(nullptr), a_plan_in_use(nullptr)
+	{
+	}
+
+	~AudioGraph()
+	{
+		a_workers.stop();
+		delete a_plan.load();
+	}
+
+	AudioGraph(const AudioGraph&) = delete;
+	AudioGraph& operator=(const AudioGraph&) = delete;
+
+	int addNode(std::shared_ptr<AudioNode> node)
+	{
+		node->prepare(a_max_frames);
+		a_nodes.push_back(std::move(node));
+		return static_cast<int>(a_nodes.size()) - 1;
+	}
+
+	void removeNode(int id)
+	{
+		a_nodes[id] = nullptr;
+		std::erase_if(a_connections, [id](const Connection& c) { return c.a_from == id || c.a_to == id; });
+		if (a_output == id)
+			a_output = -1;
+	}
+
+	std::shared_ptr<AudioNode> getNode(int id) const
+	{
+		return a_nodes[id];
+	}
+
+	void connect(int from, int to, float gain = 1.0f)
+	{
+		a_connections.push_back({ from, to, gain });
+	}
+
+	void disconnect(int from, int to)
+	{
+		std::erase_if(a_connections, [from, to](const Connection& c) { return c.a_from == from && c.a_to == to; });
+	}
+
+	void setOutput(int id)
+	{
+		a_output = id;
+	}
+
+	// Worker threads for independent branches, none runs everything on the audio thread.
+	// Only call while the audio thread is not running the graph.
+	void startWorkers(uint32_t count)
+	{
+		a_workers.start(count);
+	}
+
+	uint32_t getWorkerCount() const
+	{
+		return a_workers.getCount();
+	}
+
+	// Compile the edits and swap them in before the next block. Returns false, leaving the
+	// running plan alone, when there is no output or the connections form a cycle.
+	bool commit()
+	{
+		std::unique_ptr<GraphPlan> plan = compile();
+		if (plan == nullptr)
+			return false;
+
+		GraphPlan* retired = a_plan.exchange(plan.release());
+		while (retired != nullptr && a_plan_in_use.load() == retired)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		delete retired;
+		return true;
+	}
+
+	// Audio thread. Runs the graph for up to max_frames and writes the output to left and right.
+	void process(float* left, float* right, uint32_t frames, double time, double time_step)
+	{
+		// Publish the plan before using it, and check it is still current, so commit()
+		// either sees it in use or has already swapped it out before we took it
+		GraphPlan* plan = a_plan.load();
+		a_plan_in_use.store(plan);
+		while (plan != a_plan.load())
+		{
+			plan = a_plan.load();
+			a_plan_in_use.store(plan);
+		}
+
+		if (plan == nullptr)
+		{
+			std::fill_n(left, frames, 0.0f);
+			std::fill_n(right, frames, 0.0f);
+		}
+		else
+		{
+			for (const std::vector<GraphPlan::Step>& level : plan->a_levels)
+				a_workers.run(*plan, level, frames, time, time_step);
+
+			NodeBuffer output = plan->buffer(plan->a_output);
+			std::copy_n(output.a_left, frames, left);
+			std::copy_n(output.a_right, frames, right);
+		}
+		a_plan_in_use.store(nullptr);
+	}
+
+private:
+	std::unique_ptr<GraphPlan> compile() const
+	{
+		int count = static_cast<int>(a_nodes.size());
+		if (a_output < 0 || a_output >= count || a_nodes[a_output] == nullptr)
+			return nullptr;
+
+		// Only nodes the output can hear are scheduled
+		std::vector<bool> is_live(count, false);
+		std::vector<int> stack = { a_output };
+		is_live[a_output] = true;
+		while (!stack.empty())
+		{
+			int node = stack.back();
+			stack.pop_back();
+			for (const Connection& c : a_connections)
+			{
+				if (c.a_to == node && a_nodes[c.a_from] != nullptr && !is_live[c.a_from])
+				{
+					is_live[c.a_from] = true;
+					stack.push_back(c.a_from);
+				}
+			}
+		}
+
+		// Levels by Kahn's algorithm: a node runs one level after the latest of its inputs
+		std::vector<int> pending_inputs(count, 0);
+		for (const Connection& c : a_connections)
+		{
+			if (is_live[c.a_from] && is_live[c.a_to])
+				pending_inputs[c.a_to]++;
+		}
+
+		std::vector<int> level_of(count, 0);
+		std::vector<int> ready;
+		for (int n = 0; n < count; n++)
+		{
+			if (is_live[n] && pending_inputs[n] == 0)
+				ready.push_back(n);
+		}
+
+		std::vector<int> order;
+		while (!ready.empty())
+		{
+			int node = ready.back();
+			ready.pop_back();
+			order.push_back(node);
+			for (const Connection& c : a_connections)
+			{
+				if (c.a_from != node || !is_live[c.a_to])
+					continue;
+				level_of[c.a_to] = std::max(level_of[c.a_to], level_of[node] + 1);
+				if (--pending_inputs[c.a_to] == 0)
+					ready.push_back(c.a_to);
+			}
+		}
+		if (order.size() != static_cast<size_t>(std::count(is_live.begin(), is_live.end(), true)))
+			return nullptr;
+
+		// A buffer is free again once the last level reading it has finished
+		std::vector<int> last_read(count, -1);
+		for (const Connection& c : a_connections)
+		{
+			if (is_live[c.a_from] && is_live[c.a_to])
+				last_read[c.a_from] = std::max(last_read[c.a_from], level_of[c.a_to]);
+		}
+
+		int levels = 1 + *std::max_element(level_of.begin(), level_of.end());
+		auto plan = std::make_unique<GraphPlan>();
+		plan->a_max_frames = a_max_frames;
+		plan->a_levels.resize(levels);
+
+		std::vector<uint32_t> buffer_of(count, 0);
+		std::vector<uint32_t> free_buffers;
+		for (int level = 0; level < levels; level++)
+		{
+			// Keep the order nodes were added in within a level, so renders are repeatable
+			for (int node = 0; node < count; node++)
+			{
+				if (!is_live[node] || level_of[node] != level)
+					continue;
+
+				if (free_buffers.empty())
+				{
+					free_buffers.push_back(static_cast<uint32_t>(plan->a_buffers.size()));
+					plan->a_buffers.emplace_back(static_cast<size_t>(a_max_frames) * 2, 0.0f);
+				}
+				buffer_of[node] = free_buffers.back();
+				free_buffers.pop_back();
+
+				GraphPlan::Step step = { a_nodes[node].get(), {}, buffer_of[node] };
+				for (const Connection& c : a_connections)
+				{
+					if (c.a_to == node && is_live[c.a_from])
+						step.a_inputs.push_back({ buffer_of[c.a_from], c.a_gain });
+				}
+				plan->a_levels[level].push_back(std::move(step));
+				plan->a_nodes.push_back(a_nodes[node]);
+			}
+
+			for (int node = 0; node < count; node++)
+			{
+				if (is_live[node] && last_read[node] == level && node != a_output)
+					free_buffers.push_back(buffer_of[node]);
+			}
+		}
+
+		plan->a_output = buffer_of[a_output];
+		return plan;
+	}
+};
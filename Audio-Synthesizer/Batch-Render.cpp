@@ -0,0 +1,126 @@
+// Headless batch renderer. Reads a job list, one job per line (see RenderJob.hpp), and
+// renders the jobs in parallel, each through an engine of its own on a worker thread.
+//
+//   Batch-Render [--jobs <n>] [--memory-limit <MB>] <job list | ->
+//
+// --jobs defaults to one worker per core. --memory-limit fails any job whose heap use
+// goes over the given size, without disturbing the others.
+
+#define SYNTH_JOB_MEMORY_LIMITS
+
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include "RenderJob.hpp"
+
+int main(int argc, char* argv[])
+{
+	uint32_t worker_count = std::max(std::thread::hardware_concurrency(), 1u);
+	size_t memory_limit = 0;
+	std::string list_path;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		if (argument == "--jobs" && i + 1 < argc)
+			worker_count = static_cast<uint32_t>(std::max(std::stoi(argv[++i]), 1));
+		else if (argument == "--memory-limit" && i + 1 < argc)
+			memory_limit = static_cast<size_t>(std::stod(argv[++i]) * 1024.0 * 1024.0);
+		else if (argument.starts_with("--") || !list_path.empty())
+		{
+			std::cerr << "Usage: Batch-Render [--jobs <n>] [--memory-limit <MB>] <job list | ->" << std::endl;
+			return 2;
+		}
+		else
+			list_path = argument;
+	}
+	if (list_path.empty())
+	{
+		std::cerr << "Usage: Batch-Render [--jobs <n>] [--memory-limit <MB>] <job list | ->" << std::endl;
+		return 2;
+	}
+
+	// Scripts are read up front, so a bad line stops the batch before anything renders
+	std::ifstream list_file;
+	if (list_path != "-")
+	{
+		list_file.open(list_path);
+		if (!list_file)
+		{
+			std::cerr << "Could not open " << list_path << std::endl;
+			return 2;
+		}
+	}
+	std::istream& list = list_path == "-" ? std::cin : list_file;
+
+	std::vector<RenderJob> jobs;
+	std::string line;
+	while (std::getline(list, line))
+	{
+		RenderJob job;
+		std::string error;
+		if (!parseRenderJob(line, job, error))
+		{
+			std::cerr << error << std::endl;
+			return 2;
+		}
+		if (!job.a_input.empty())
+			jobs.push_back(std::move(job));
+	}
+
+	// Longest first, so no long job is left running alone at the end
+	std::stable_sort(jobs.begin(), jobs.end(), [](const RenderJob& a, const RenderJob& b) { return a.a_frames > b.a_frames; });
+	worker_count = std::min<uint32_t>(worker_count, static_cast<uint32_t>(std::max<size_t>(jobs.size(), 1)));
+
+	// One memory account per worker. Static, so it outlives any static a job creates
+	// and frees at exit.
+	static std::vector<JobMemory> memories(worker_count);
+	std::atomic<size_t> next_job = 0;
+	std::atomic<uint32_t> failures = 0;
+	std::mutex output_mutex;
+	double rendered_seconds = 0.0;		// Audio of the jobs that succeeded, under output_mutex
+
+	auto batch_start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (uint32_t w = 0; w < worker_count; w++)
+	{
+		workers.emplace_back([&, w]() {
+			for (size_t j = next_job++; j < jobs.size(); j = next_job++)
+			{
+				const RenderJob& job = jobs[j];
+				memories[w].begin(memory_limit);
+				JobMemory::current() = &memories[w];
+				RenderResult result = renderJob(job);
+				JobMemory::current() = nullptr;
+
+				double audio_seconds = static_cast<double>(job.a_frames) / job.a_sample_rate;
+				std::lock_guard<std::mutex> lock(output_mutex);
+				if (result.a_is_ok)
+				{
+					rendered_seconds += audio_seconds;
+					std::cout << "done     " << job.a_output << ": " << audio_seconds << " s in " << result.a_render_seconds << " s ("
+						<< audio_seconds / std::max(result.a_render_seconds, 1.0e-9) << "x real time), peak " << result.a_peak_memory / (1024.0 * 1024.0) << " MB" << std::endl;
+				}
+				else
+				{
+					std::cout << "FAILED   " << job.a_output << ": " << result.a_error << std::endl;
+					failures++;
+				}
+			}
+			});
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+
+	double batch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count();
+	std::cout << jobs.size() << " jobs, " << failures << " failed, on " << worker_count << " workers: " << rendered_seconds << " s of audio in " << batch_seconds << " s ("
+		<< rendered_seconds / std::max(batch_seconds, 1.0e-9) << "x real time, " << jobs.size() / std::max(batch_seconds, 1.0e-9) << " jobs/s)" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
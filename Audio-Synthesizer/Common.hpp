@@ -2,4 +2,15 @@
 
 #include <memory>
 
-#define SAMPLE_RATE 44100
\ No newline at end of file
+// Output rate until the engine is told otherwise. Everything rate dependent is recomputed
+// by setSampleRate(), so this is only a starting point.
+#define DEFAULT_SAMPLE_RATE 44100
+
+// Sample type of the voice, filter and effect path. Single precision halves the delay
+// buffers and fits twice the samples in a vector register; define SYNTH_DOUBLE_PRECISION
+// to run the whole path in double. Times and phases are double either way.
+#ifdef SYNTH_DOUBLE_PRECISION
+using Sample = double;
+#else
+using Sample = float;
+#endif
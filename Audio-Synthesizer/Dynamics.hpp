@@ -0,0 +1,265 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "Common.hpp"
+
+#define LIMITER_LOOKAHEAD 64			// Samples, the limiter delays the output by one less than this
+#define COMPRESSOR_CONTROL_INTERVAL 32	// Samples between gain computer updates
+
+// Maximum over the last window samples in O(1) amortized per sample. A monotonic
+// deque keeps only the values that can still become the maximum; it lives in a
+// ring of window entries so nothing is allocated while running.
+class SlidingMax
+{
+private:
+	std::vector<float> a_values;
+	std::vector<uint64_t> a_indices;
+	size_t a_head;
+	size_t a_count;
+	uint64_t a_index;
+
+public:
+	SlidingMax(size_t window = 1)
+		: a_values(std::max<size_t>(window, 1)), a_indices(std::max<size_t>(window, 1)), a_head(0), a_count(0), a_index(0)
+	{
+	}
+
+	void reset()
+	{
+		a_head = 0;
+		a_count = 0;
+		a_index = 0;
+	}
+
+	float push(float value)
+	{
+		size_t window = a_values.size();
+
+		// Drop the oldest entry once it leaves the window
+		if (a_count > 0 && a_indices[a_head] + window <= a_index)
+		{
+			a_head = (a_head + 1) % window;
+			a_count--;
+		}
+
+		// Anything smaller than the new value can never be the maximum again
+		while (a_count > 0 && a_values[(a_head + a_count - 1) % window] <= value)
+			a_count--;
+
+		size_t tail = (a_head + a_count) % window;
+		a_values[tail] = value;
+		a_indices[tail] = a_index++;
+		a_count++;
+		return a_values[a_head];
+	}
+};
+
+// Stereo-linked look-ahead peak limiter that never lets a sample past the ceiling.
+// The gain needed for every sample is the minimum over the look-ahead window, then a
+// box filter of the same length smooths it. Each value the box averages is at most
+// the gain the delayed sample needs, so the average is too. Releases follow a one-pole
+// that only ever slows increases. Latency is LIMITER_LOOKAHEAD - 1 samples.
+class LookAheadLimiter
+{
+private:
+	float a_ceiling;
+	double a_release_time;
+	float a_release_coefficient;
+	SlidingMax a_peak;
+	std::vector<float> a_gains;			// Box filter history
+	std::vector<float> a_delay_left;
+	std::vector<float> a_delay_right;
+	double a_gain_sum;
+	float a_gain;
+	size_t a_idx;
+
+public:
+	LookAheadLimiter(float ceiling = 0.9f, double release_time = 0.08)
+		: a_ceiling(ceiling), a_release_time(release_time), a_peak(LIMITER_LOOKAHEAD), a_gains(LIMITER_LOOKAHEAD, 1.0f),
+		a_delay_left(LIMITER_LOOKAHEAD, 0.0f), a_delay_right(LIMITER_LOOKAHEAD, 0.0f), a_gain_sum(LIMITER_LOOKAHEAD), a_gain(1.0f), a_idx(0)
+	{
+		setSampleRate(DEFAULT_SAMPLE_RATE);
+	}
+
+	void setSampleRate(double sample_rate)
+	{
+		a_release_coefficient = static_cast<float>(1.0 - std::exp(-1.0 / (a_release_time * sample_rate)));
+	}
+
+	static constexpr uint32_t getLatency()
+	{
+		return LIMITER_LOOKAHEAD - 1;
+	}
+
+	// Gain applied to the last sample, for metering
+	float getGain() const
+	{
+		return a_gain;
+	}
+
+	void process(float* left, float* right, uint32_t frames)
+	{
+		const float inverse_length = 1.0f / LIMITER_LOOKAHEAD;
+		for (uint32_t i = 0; i < frames; i++)
+		{
+			float peak = a_peak.push(std::max(std::abs(left[i]), std::abs(right[i])));
+			float target = peak > a_ceiling ? a_ceiling / peak : 1.0f;
+
+			a_gain_sum += target - a_gains[a_idx];
+			a_gains[a_idx] = target;
+			float smoothed = std::min(static_cast<float>(a_gain_sum) * inverse_length, 1.0f);
+
+			if (smoothed < a_gain)
+				a_gain = smoothed;
+			else
+				a_gain += a_release_coefficient * (smoothed - a_gain);
+
+			// The oldest sample in the delay line is the one the window has fully seen
+			size_t read_idx = (a_idx + 1) % LIMITER_LOOKAHEAD;
+			a_delay_left[a_idx] = left[i];
+			a_delay_right[a_idx] = right[i];
+			left[i] = a_delay_left[read_idx] * a_gain;
+			right[i] = a_delay_right[read_idx] * a_gain;
+			a_idx = read_idx;
+		}
+
+		// Rounding in the running sum drifts slowly, so rebuild it once a block
+		a_gain_sum = 0.0;
+		for (float gain : a_gains)
+			a_gain_sum += gain;
+	}
+};
+
+// Stereo-linked RMS compressor. The gain computer runs every COMPRESSOR_CONTROL_INTERVAL
+// samples and the gain is ramped in between, so the logarithms stay off the per-sample path.
+class RMSCompressor
+{
+private:
+	double a_threshold_db;
+	double a_ratio;
+	double a_makeup_db;
+	double a_attack_time;
+	double a_release_time;
+	double a_rms_time;
+	double a_rms_coefficient;
+	double a_attack_coefficient;
+	double a_release_coefficient;
+
+	double a_mean_square;
+	double a_gain_db;
+	float a_gain;
+	uint32_t a_counter;
+
+public:
+	RMSCompressor(double threshold_db = -12.0, double ratio = 2.5, double makeup_db = 6.0, double attack_time = 0.01, double release_time = 0.2, double rms_time = 0.05)
+		: a_threshold_db(threshold_db), a_ratio(ratio), a_makeup_db(makeup_db), a_attack_time(attack_time), a_release_time(release_time), a_rms_time(rms_time),
+		a_mean_square(0.0), a_gain_db(0.0), a_counter(0)
+	{
+		setSampleRate(DEFAULT_SAMPLE_RATE);
+		a_gain = static_cast<float>(std::pow(10.0, a_makeup_db / 20.0));
+	}
+
+	// The gain computer keeps running every COMPRESSOR_CONTROL_INTERVAL samples, the times stay put
+	void setSampleRate(double sample_rate)
+	{
+		a_rms_coefficient = 1.0 - std::exp(-1.0 / (a_rms_time * sample_rate));
+		a_attack_coefficient = 1.0 - std::exp(-COMPRESSOR_CONTROL_INTERVAL / (a_attack_time * sample_rate));
+		a_release_coefficient = 1.0 - std::exp(-COMPRESSOR_CONTROL_INTERVAL / (a_release_time * sample_rate));
+	}
+
+	// Gain reduction in dB, not counting the makeup gain
+	double getGainReduction() const
+	{
+		return -a_gain_db;
+	}
+
+	void process(float* left, float* right, uint32_t frames)
+	{
+		uint32_t i = 0;
+		while (i < frames)
+		{
+			uint32_t run = std::min(frames - i, COMPRESSOR_CONTROL_INTERVAL - a_counter);
+
+			// Ramp towards the gain computed at the end of the previous run
+			float target = static_cast<float>(std::pow(10.0, (a_gain_db + a_makeup_db) / 20.0));
+			float step = (target - a_gain) / run;
+			double mean_square = a_mean_square;
+			for (uint32_t n = i; n < i + run; n++)
+			{
+				double power = 0.5 * (static_cast<double>(left[n]) * left[n] + static_cast<double>(right[n]) * right[n]);
+				mean_square += a_rms_coefficient * (power - mean_square);
+
+				a_gain += step;
+				left[n] *= a_gain;
+				right[n] *= a_gain;
+			}
+			a_mean_square = mean_square;
+			a_gain = target;
+
+			i += run;
+			a_counter += run;
+			if (a_counter < COMPRESSOR_CONTROL_INTERVAL)
+				continue;
+			a_counter = 0;
+
+			double level_db = 10.0 * std::log10(a_mean_square + 1e-12);
+			double wanted_db = level_db > a_threshold_db ? (a_threshold_db - level_db) * (1.0 - 1.0 / a_ratio) : 0.0;
+			double coefficient = wanted_db < a_gain_db ? a_attack_coefficient : a_release_coefficient;
+			a_gain_db += coefficient * (wanted_db - a_gain_db);
+		}
+	}
+};
+
+// Master bus dynamics: a trim, the compressor to even out the level, then the limiter so
+// the output stays clean however many voices play. Latency is LIMITER_LOOKAHEAD - 1 samples.
+class MasterDynamics
+{
+private:
+	float a_input_gain;
+	RMSCompressor a_compressor;
+	LookAheadLimiter a_limiter;
+
+public:
+	MasterDynamics(float input_gain = 0.5f)
+		: a_input_gain(input_gain)
+	{
+	}
+
+	static constexpr uint32_t getLatency()
+	{
+		return LookAheadLimiter::getLatency();
+	}
+
+	RMSCompressor& getCompressor()
+	{
+		return a_compressor;
+	}
+
+	LookAheadLimiter& getLimiter()
+	{
+		return a_limiter;
+	}
+
+	// Only while the engine is idle
+	void setSampleRate(double sample_rate)
+	{
+		a_compressor.setSampleRate(sample_rate);
+		a_limiter.setSampleRate(sample_rate);
+	}
+
+	void process(float* left, float* right, uint32_t frames)
+	{
+		for (uint32_t i = 0; i < frames; i++)
+		{
+			left[i] *= a_input_gain;
+			right[i] *= a_input_gain;
+		}
+
+		a_compressor.process(left, right, frames);
+		a_limiter.process(left, right, frames);
+	}
+};
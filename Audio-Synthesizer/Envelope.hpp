@@ -1,11 +1,17 @@
 #pragma once
 
+// Envelopes take times in double, however long the program has run, and return their
+// amplitude in the sample type T
+template<typename T>
 struct BaseEnvelope
 {
-	virtual double amplitude(const double time, const double time_on, const double time_off) = 0;
+	virtual ~BaseEnvelope() = default;
+
+	virtual T amplitude(const double time, const double time_on, const double time_off) = 0;
 };
 
-struct ADSREnvelope : public BaseEnvelope
+template<typename T>
+struct ADSREnvelope : public BaseEnvelope<T>
 {
 	double a_attack_time;
 	double a_decay_time;
@@ -22,44 +28,48 @@ struct ADSREnvelope : public BaseEnvelope
 		a_start_amplitude = 1.0;
 	}
 
-	virtual double amplitude(const double time, const double time_on, const double time_off)
+	virtual T amplitude(const double time, const double time_on, const double time_off) override
 	{
 		double amplitude = 0.0;
-		double release_amplitude = 0.0;
 
 		if (time_on > time_off) // Note is on
-		{
-			double life_time = time - time_on;
-
-			if (life_time <= a_attack_time)
-				amplitude = (life_time / a_attack_time) * a_start_amplitude;
-
-			if (life_time > a_attack_time && life_time <= (a_attack_time + a_decay_time))
-				amplitude = ((life_time - a_attack_time) / a_decay_time) * (a_sustain_amplitude - a_start_amplitude) + a_start_amplitude;
-
-			if (life_time > (a_attack_time + a_decay_time))
-				amplitude = a_sustain_amplitude;
-		}
+			amplitude = heldAmplitude(time - time_on);
 		else // Note is off
 		{
-			double life_time = time_off - time_on;
-
-			if (life_time <= a_attack_time)
-				release_amplitude = (life_time / a_attack_time) * a_start_amplitude;
-
-			if (life_time > a_attack_time && life_time <= (a_attack_time + a_decay_time))
-				release_amplitude = ((life_time - a_attack_time) / a_decay_time) * (a_sustain_amplitude - a_start_amplitude) + a_start_amplitude;
-
-			if (life_time > (a_attack_time + a_decay_time))
-				release_amplitude = a_sustain_amplitude;
-
-			amplitude = ((time - time_off) / a_release_time) * (0.0 - release_amplitude) + release_amplitude;
+			double release_amplitude = heldAmplitude(time_off - time_on);
+			double release_time = time - time_off;
+			if (a_release_time > 0.0)
+				amplitude = (release_time / a_release_time) * (0.0 - release_amplitude) + release_amplitude;
+			else
+				amplitude = release_time < 0.0 ? release_amplitude : 0.0;
 		}
 
 		// Amplitude should not be negative
 		if (amplitude <= 0.000)
 			amplitude = 0.0;
 
-		return amplitude;
+		return static_cast<T>(amplitude);
+	}
+
+private:
+	// Attack, decay and sustain while the key is held. A stage of zero length jumps
+	// straight to the level it leads to.
+	double heldAmplitude(double life_time) const
+	{
+		if (life_time <= a_attack_time)
+		{
+			if (a_attack_time > 0.0)
+				return (life_time / a_attack_time) * a_start_amplitude;
+			return life_time < 0.0 ? 0.0 : a_start_amplitude;
+		}
+
+		if (life_time <= (a_attack_time + a_decay_time))
+		{
+			if (a_decay_time > 0.0)
+				return ((life_time - a_attack_time) / a_decay_time) * (a_sustain_amplitude - a_start_amplitude) + a_start_amplitude;
+			return a_sustain_amplitude;
+		}
+
+		return a_sustain_amplitude;
 	}
 };
\ No newline at end of file
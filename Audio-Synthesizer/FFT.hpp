@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <numbers>
+
+// Forward FFT of a real signal of a power-of-two size. The signal is packed into a complex
+// one of half the size, transformed in place by an iterative radix-2 FFT and split back
+// into the spectrum of the real signal, so it costs about half a complex FFT of the full
+// size. Twiddles and the bit-reversal order are tabulated up front, a transform doesn't
+// allocate.
+class RealFFT
+{
+private:
+	size_t a_size;
+	std::vector<std::complex<float>> a_work;		// size / 2 points
+	std::vector<std::complex<float>> a_twiddles;	// e^(-2 pi i k / size) for k up to size / 2
+	std::vector<uint32_t> a_reversed;
+
+public:
+	RealFFT(size_t size = 0)
+		: a_size(0)
+	{
+		setSize(size);
+	}
+
+	// Not for the audio thread. Sizes below 4 or not a power of two are rounded up to one.
+	void setSize(size_t size)
+	{
+		a_size = 4;
+		while (a_size < size)
+			a_size <<= 1;
+
+		size_t half = a_size / 2;
+		a_work.assign(half, 0.0f);
+		a_twiddles.resize(half + 1);
+		for (size_t k = 0; k <= half; k++)
+			a_twiddles[k] = std::polar(1.0f, static_cast<float>(-2.0 * std::numbers::pi * k / a_size));
+
+		int bits = 0;
+		while ((size_t(1) << bits) < half)
+			bits++;
+		a_reversed.resize(half);
+		for (size_t i = 0; i < half; i++)
+		{
+			uint32_t reversed = 0;
+			for (int b = 0; b < bits; b++)
+				reversed |= ((i >> b) & 1u) << (bits - 1 - b);
+			a_reversed[i] = reversed;
+		}
+	}
+
+	size_t getSize() const
+	{
+		return a_size;
+	}
+
+	// Spectrum of getSize() real samples into getSize() / 2 + 1 bins, DC to Nyquist
+	void forward(const float* in, std::complex<float>* out)
+	{
+		size_t half = a_size / 2;
+		for (size_t i = 0; i < half; i++)
+			a_work[a_reversed[i]] = { in[2 * i], in[2 * i + 1] };
+
+		// Butterflies over spans doubling up to half. A span's twiddles e^(-2 pi i k / (2 span))
+		// are every size / (2 span)-th entry of the table.
+		for (size_t span = 1; span < half; span <<= 1)
+		{
+			size_t stride = a_size / (2 * span);
+			for (size_t start = 0; start < half; start += 2 * span)
+			{
+				for (size_t k = 0; k < span; k++)
+				{
+					std::complex<float> odd = a_twiddles[k * stride] * a_work[start + k + span];
+					a_work[start + k + span] = a_work[start + k] - odd;
+					a_work[start + k] += odd;
+				}
+			}
+		}
+
+		// The even samples are the real part and the odd ones the imaginary part, take them apart
+		for (size_t k = 0; k <= half; k++)
+		{
+			std::complex<float> z = a_work[k % half];
+			std::complex<float> mirrored = std::conj(a_work[(half - k) % half]);
+			std::complex<float> even = 0.5f * (z + mirrored);
+			std::complex<float> odd = std::complex<float>(0.0f, -0.5f) * (z - mirrored);
+			out[k] = even + a_twiddles[k] * odd;
+		}
+	}
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+#include "Instrument.hpp"
+#include "VoicePool.hpp"
+#include "Wavetable.hpp"
+
+#define FM_OPERATORS 4
+#define FM_ALGORITHMS 8
+#define FM_VOICES 64
+
+// Which operators modulate which, in the classic four-operator layouts. Operator 4 is the
+// top of every stack and the one with feedback. An arrow reads "modulates".
+struct FMAlgorithm
+{
+	std::array<uint8_t, FM_OPERATORS> a_modulators;	// Bit j set when operator j modulates operator i
+	uint8_t a_carriers;								// Bit i set when operator i is heard
+};
+
+inline const std::array<FMAlgorithm, FM_ALGORITHMS> fm_algorithms = { {
+	{ { 0b0010, 0b0100, 0b1000, 0b0000 }, 0b0001 },	// 4 > 3 > 2 > 1
+	{ { 0b0010, 0b1100, 0b0000, 0b0000 }, 0b0001 },	// (3 + 4) > 2 > 1
+	{ { 0b1010, 0b0100, 0b0000, 0b0000 }, 0b0001 },	// (4 + (3 > 2)) > 1
+	{ { 0b0110, 0b0000, 0b1000, 0b0000 }, 0b0001 },	// (2 + (4 > 3)) > 1
+	{ { 0b0010, 0b0000, 0b1000, 0b0000 }, 0b0101 },	// 2 > 1, 4 > 3
+	{ { 0b1000, 0b1000, 0b1000, 0b0000 }, 0b0111 },	// 4 > 1, 4 > 2, 4 > 3
+	{ { 0b0000, 0b0000, 0b1000, 0b0000 }, 0b0111 },	// 1, 2, 4 > 3
+	{ { 0b0000, 0b0000, 0b0000, 0b0000 }, 0b1111 },	// 1, 2, 3, 4
+} };
+
+struct FMOperator
+{
+	double a_ratio = 1.0;		// Frequency as a multiple of the note
+	double a_detune = 0.0;		// Fixed offset in Hz
+	double a_level = 1.0;		// Output level, for a modulator its depth in cycles
+	ADSREnvelope<double> a_envelope;
+};
+
+// Phase accumulators and last outputs of one voice, one lane per operator
+struct FMVoice
+{
+	std::array<uint32_t, FM_OPERATORS> a_phase{};
+	std::array<float, FM_OPERATORS> a_output{};
+};
+
+// Phase-modulation synthesizer. Every operator reads the shared sine table from its own
+// phase accumulator, offset by the outputs of its modulators. Modulators act through their
+// output from the previous sample, so the operators of a sample don't depend on each other
+// and the inner loop runs them side by side as lanes. Envelopes are evaluated at block
+// boundaries and ramped in between.
+class FMSynth : public BaseInstrument<Sample>
+{
+private:
+	std::array<FMOperator, FM_OPERATORS> a_operators;
+	VoicePool<FMVoice, FM_VOICES> a_voices;
+	std::atomic<int> a_algorithm;	// Changed on the audio thread, read for display
+	double a_feedback;		// Operator 4 self-modulation depth in cycles
+
+	// Routing flattened for the render loop, rebuilt when the algorithm or feedback changes
+	std::array<std::array<float, FM_OPERATORS>, FM_OPERATORS> a_matrix;
+	std::array<float, FM_OPERATORS> a_carrier_gain;
+
+public:
+	// Defaults to an electric piano: a bright tine stack over a mellow body stack
+	FMSynth()
+		: a_algorithm(4), a_feedback(0.08)
+	{
+		setOperator(0, 1.0, 0.0, 1.0, 0.002, 1.8, 0.0, 0.4);
+		setOperator(1, 14.0, 0.0, 0.12, 0.0, 0.3, 0.0, 0.1);
+		setOperator(2, 1.0, 0.5, 0.8, 0.002, 2.5, 0.2, 0.4);
+		setOperator(3, 1.0, -0.5, 0.18, 0.002, 1.5, 0.3, 0.4);
+		a_volume = 0.8;
+		updateRouting();
+
+		// Suitcase-style auto-pan
+		a_modulation.getLFO(0).setRate(4.0);
+		a_modulation.getLFO(0).setShape(LFO_SHAPE::TRIANGLE);
+		a_modulation.addRoute(MOD_SOURCE::LFO_1, MOD_DESTINATION::PAN, 0.4);
+	}
+
+	void setOperator(int index, double ratio, double detune, double level, double attack, double decay, double sustain, double release)
+	{
+		FMOperator& op = a_operators[index];
+		op.a_ratio = ratio;
+		op.a_detune = detune;
+		op.a_level = level;
+		op.a_envelope.a_attack_time = attack;
+		op.a_envelope.a_decay_time = decay;
+		op.a_envelope.a_sustain_amplitude = sustain;
+		op.a_envelope.a_release_time = release;
+	}
+
+	FMOperator& getOperator(int index)
+	{
+		return a_operators[index];
+	}
+
+	void setAlgorithm(int algorithm)
+	{
+		a_algorithm = std::clamp(algorithm, 0, FM_ALGORITHMS - 1);
+		updateRouting();
+	}
+
+	int getAlgorithm() const
+	{
+		return a_algorithm;
+	}
+
+	void setFeedback(double feedback)
+	{
+		a_feedback = std::clamp(feedback, 0.0, 0.5);
+		updateRouting();
+	}
+
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished) override
+	{
+		float sample = 0.0f;
+		render(time, getTimeStep(), n, &sample, 1, is_note_finished);
+		return sample;
+	}
+
+	virtual void render(const double time, const double time_step, Note& n, float* out, uint32_t frames, bool& is_note_finished) override
+	{
+		bool is_new = false;
+		FMVoice* voice = a_voices.acquire(n, is_new);
+		if (voice == nullptr)
+		{
+			std::fill_n(out, frames, 0.0f);
+			is_note_finished = true;
+			return;
+		}
+		if (is_new)
+			*voice = FMVoice();
+
+		const FMAlgorithm& algorithm = fm_algorithms[a_algorithm];
+		double end_time = time + frames * time_step;
+		bool carriers_done = true;
+		double brightness = std::exp2(std::clamp(n.a_cutoff_shift, -8.0, 2.0));
+
+		std::array<uint32_t, FM_OPERATORS> increment;
+		std::array<float, FM_OPERATORS> level, level_step;
+		for (int k = 0; k < FM_OPERATORS; k++)
+		{
+			FMOperator& op = a_operators[k];
+			bool carrier = (algorithm.a_carriers >> k) & 1;
+
+			// Modulator depth plays the part of a filter cutoff: soft notes and a lowered
+			// cutoff drive the modulators less, which is what makes them darker
+			double depth = op.a_level * (carrier ? 1.0 : (0.5 + 0.5 * n.a_velocity) * brightness);
+			double start_level = depth * op.a_envelope.amplitude(time, n.a_on, n.a_off);
+			double end_level = depth * op.a_envelope.amplitude(end_time, n.a_on, n.a_off);
+			if (carrier && end_level > 0.0)
+				carriers_done = false;
+
+			increment[k] = phaseIncrement(n.a_freq * op.a_ratio + op.a_detune, time_step);
+			level[k] = static_cast<float>(start_level);
+			level_step[k] = static_cast<float>((end_level - start_level) / frames);
+		}
+
+		std::array<uint32_t, FM_OPERATORS> phase = voice->a_phase;
+		std::array<float, FM_OPERATORS> output = voice->a_output;
+		float gain = static_cast<float>(a_volume * n.a_velocity);
+
+		for (uint32_t i = 0; i < frames; i++)
+		{
+			std::array<float, FM_OPERATORS> next;
+			float sample = 0.0f;
+			for (int k = 0; k < FM_OPERATORS; k++)
+			{
+				float modulation = 0.0f;
+				for (int j = 0; j < FM_OPERATORS; j++)
+					modulation += a_matrix[k][j] * output[j];
+
+				uint32_t offset = static_cast<uint32_t>(static_cast<int64_t>(modulation * 4294967296.0f));
+				next[k] = sine_table.lookup(phase[k] + offset) * level[k];
+				sample += a_carrier_gain[k] * next[k];
+
+				phase[k] += increment[k];
+				level[k] += level_step[k];
+			}
+			output = next;
+			out[i] = gain * sample;
+		}
+
+		voice->a_phase = phase;
+		voice->a_output = output;
+
+		if (n.a_off > n.a_on && carriers_done)
+			is_note_finished = true;
+	}
+
+	virtual bool tracksPitchModulation() const override
+	{
+		return true;
+	}
+
+	virtual void releaseVoice(const Note& n) override
+	{
+		a_voices.release(n);
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"FM Piano (algorithm " + std::to_wstring(a_algorithm + 1) + L")";
+	}
+
+private:
+	void updateRouting()
+	{
+		const FMAlgorithm& algorithm = fm_algorithms[a_algorithm];
+		int carriers = 0;
+		for (int k = 0; k < FM_OPERATORS; k++)
+		{
+			for (int j = 0; j < FM_OPERATORS; j++)
+				a_matrix[k][j] = (algorithm.a_modulators[k] >> j) & 1 ? 1.0f : 0.0f;
+			carriers += (algorithm.a_carriers >> k) & 1;
+		}
+		a_matrix[FM_OPERATORS - 1][FM_OPERATORS - 1] = static_cast<float>(a_feedback);
+
+		// Keep the loudness similar whichever algorithm is picked
+		for (int k = 0; k < FM_OPERATORS; k++)
+			a_carrier_gain[k] = (algorithm.a_carriers >> k) & 1 ? 1.0f / carriers : 0.0f;
+	}
+};
@@ -1,12 +1,31 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
+#include <numbers>
+#include <algorithm>
+
+// RC of a one-pole filter with the given cutoff, the discrete coefficients follow from it
+// and the time step, so the cutoff stays put whatever the sample rate
+template <typename T>
+T timeConstant(T cutoff_freq)
+{
+	return static_cast<T>(1.0 / (2.0 * std::numbers::pi * cutoff_freq));
+}
 
 template <typename T>
 class BaseFilter
 {
 public:
+	virtual ~BaseFilter() = default;
 	virtual T filter(T x) = 0;
+
+	// Filter a block in place. Filters override this to run their loop without a virtual call per sample.
+	virtual void processBlock(T* samples, uint32_t frames)
+	{
+		for (uint32_t i = 0; i < frames; i++)
+			samples[i] = filter(samples[i]);
+	}
 };
 
 template <typename T>
@@ -19,7 +38,7 @@ private:
 
 public:
 	HighPassFilter(T cutoff_freq, T time_step)
-		: a_alpha(cutoff_freq / (cutoff_freq + time_step)),
+		: a_alpha(timeConstant(cutoff_freq) / (timeConstant(cutoff_freq) + time_step)),
 		a_prev_x(0.0), a_prev_y(0.0)
 	{
 	}
@@ -31,6 +50,12 @@ public:
 		a_prev_y = y;
 		return y;
 	}
+
+	void processBlock(T* samples, uint32_t frames) override
+	{
+		for (uint32_t i = 0; i < frames; i++)
+			samples[i] = HighPassFilter::filter(samples[i]);
+	}
 };
 
 template <typename T>
@@ -42,7 +67,7 @@ private:
 
 public:
 	LowPassFilter(T cutoff_freq, T time_step)
-		: a_alpha(time_step / (cutoff_freq + time_step)),
+		: a_alpha(time_step / (timeConstant(cutoff_freq) + time_step)),
 		a_prev_y(0.0)
 	{
 	}
@@ -52,6 +77,12 @@ public:
 		a_prev_y = a_alpha * x + (1 - a_alpha) * a_prev_y;
 		return a_prev_y;
 	}
+
+	void processBlock(T* samples, uint32_t frames) override
+	{
+		for (uint32_t i = 0; i < frames; i++)
+			samples[i] = LowPassFilter::filter(samples[i]);
+	}
 };
 
 template <typename T>
@@ -76,6 +107,12 @@ public:
 
 		return bandPassed;
 	}
+
+	void processBlock(T* samples, uint32_t frames) override
+	{
+		a_highpass_filter.processBlock(samples, frames);
+		a_lowpass_filter.processBlock(samples, frames);
+	}
 };
 
 template <typename T>
@@ -136,3 +173,67 @@ public:
 	}
 };
 
+// Delay line with a fractional length. The integer part is a circular buffer like
+// CombFilter's, the fraction is a first-order allpass so the tuning is exact without
+// the high-frequency loss of linear interpolation.
+template <typename T>
+class FractionalDelayLine
+{
+private:
+	std::vector<T> a_buffer;
+	size_t a_write_idx;
+	size_t a_delay;
+	T a_coefficient;
+	T a_prev_x, a_prev_y;
+
+public:
+	FractionalDelayLine(size_t max_delay)
+		: a_buffer(std::max<size_t>(max_delay, 2), 0.0), a_write_idx(0), a_delay(1), a_coefficient(0), a_prev_x(0), a_prev_y(0)
+	{
+	}
+
+	// The allpass handles a fraction between 0.5 and 1.5 samples, where its delay is flattest
+	void setDelay(double delay)
+	{
+		delay = std::clamp(delay, 1.5, static_cast<double>(a_buffer.size()) + 0.49);
+		a_delay = static_cast<size_t>(delay - 0.5);
+		double fraction = delay - static_cast<double>(a_delay);
+		a_coefficient = static_cast<T>((1.0 - fraction) / (1.0 + fraction));
+	}
+
+	// Not for the audio thread, it allocates and forgets what the line held
+	void resize(size_t max_delay)
+	{
+		a_buffer.assign(std::max<size_t>(max_delay, 2), static_cast<T>(0));
+		a_write_idx = 0;
+		a_delay = std::min(a_delay, a_buffer.size() - 1);
+		a_prev_x = 0;
+		a_prev_y = 0;
+	}
+
+	void clear()
+	{
+		std::fill(a_buffer.begin(), a_buffer.end(), static_cast<T>(0));
+		a_write_idx = 0;
+		a_prev_x = 0;
+		a_prev_y = 0;
+	}
+
+	// Output for this sample, call before write()
+	T read()
+	{
+		size_t read_idx = a_write_idx >= a_delay ? a_write_idx - a_delay : a_write_idx + a_buffer.size() - a_delay;
+		T x = a_buffer[read_idx];
+		T y = a_coefficient * (x - a_prev_y) + a_prev_x;
+		a_prev_x = x;
+		a_prev_y = y;
+		return y;
+	}
+
+	void write(T x)
+	{
+		a_buffer[a_write_idx] = x;
+		if (++a_write_idx == a_buffer.size())
+			a_write_idx = 0;
+	}
+};
@@ -0,0 +1,403 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <algorithm>
+
+#include "Instrument.hpp"
+#include "MappedFile.hpp"
+#include "WavFile.hpp"
+#include "VoicePool.hpp"
+
+#define GRANULAR_VOICES 32
+#define GRAIN_POOL_SIZE 4096			// Grains sounding at once across every voice
+#define GRAIN_WINDOW_BITS 10
+#define GRAIN_WINDOW_SIZE (1 << GRAIN_WINDOW_BITS)
+#define GRANULAR_CYCLE_BITS 11			// Single cycle the oscillator source plays, 2048 frames
+#define GRANULAR_CYCLE_SIZE (1 << GRANULAR_CYCLE_BITS)
+#define GRANULAR_ROOT_FREQUENCY 261.63	// Pitch a loaded source plays at unshifted, middle C
+#define GRANULAR_MAX_DENSITY 20000.0	// Grains per second per voice
+
+enum class GRAIN_WINDOW {
+	HANN,
+	TRIANGLE,
+	TUKEY,		// Flat top with cosine edges a quarter of the grain long, for denser textures
+	GAUSSIAN
+};
+
+#define NUM_GRAIN_WINDOWS 4
+
+// Grain envelopes tabulated once, read from a 32-bit phase that covers the grain exactly once
+class GrainWindows
+{
+private:
+	std::array<std::array<float, GRAIN_WINDOW_SIZE + 1>, NUM_GRAIN_WINDOWS> a_tables;	// Last entry closes the window
+
+public:
+	GrainWindows()
+	{
+		for (int i = 0; i <= GRAIN_WINDOW_SIZE; i++)
+		{
+			double x = static_cast<double>(i) / GRAIN_WINDOW_SIZE;
+			double edge = std::min(x, 1.0 - x) * 4.0;
+			a_tables[static_cast<int>(GRAIN_WINDOW::HANN)][i] = static_cast<float>(0.5 - 0.5 * std::cos(2.0 * std::numbers::pi * x));
+			a_tables[static_cast<int>(GRAIN_WINDOW::TRIANGLE)][i] = static_cast<float>(1.0 - std::abs(2.0 * x - 1.0));
+			a_tables[static_cast<int>(GRAIN_WINDOW::TUKEY)][i] = static_cast<float>(edge >= 1.0 ? 1.0 : 0.5 - 0.5 * std::cos(std::numbers::pi * edge));
+			a_tables[static_cast<int>(GRAIN_WINDOW::GAUSSIAN)][i] = static_cast<float>(std::exp(-0.5 * std::pow((x - 0.5) / 0.15, 2.0)));
+		}
+	}
+
+	const float* table(GRAIN_WINDOW window) const
+	{
+		return a_tables[static_cast<int>(window)].data();
+	}
+};
+
+inline const GrainWindows grain_windows;
+
+// One grain: a window's worth of the source read from a 32.32 fixed-point position
+struct Grain
+{
+	uint64_t a_position;		// Source frame, 32.32
+	uint64_t a_step;			// Source frames per output frame, 32.32
+	uint32_t a_window_phase;
+	uint32_t a_window_step;
+	uint32_t a_remaining;		// Frames left to play
+	uint32_t a_offset;			// Frames into the current block the grain starts, only in its first block
+	float a_gain;
+	int32_t a_next;				// Next grain of the same voice, or of the free list
+};
+
+struct GrainVoice
+{
+	int32_t a_grains = -1;		// First grain of the voice's list
+	double a_countdown = 0.0;	// Frames until the next grain starts
+	double a_scan = 0.0;		// Where in the source the grains are taken from, in source frames
+};
+
+// Granular synthesizer. Every voice starts short windowed grains of the source at a steady
+// density, each at a slightly scattered position and pitch, and sums them into its block
+// one grain at a time. The grains come from a fixed pool shared by all voices, so a dense
+// cloud of thousands of grains costs no allocation on the audio thread. The source is a
+// loaded WAV file scanned at its own speed, which stretches it in time independently of
+// pitch, or without one a single-cycle oscillator played at the note's pitch.
+class Granular : public BaseInstrument<Sample>
+{
+private:
+	std::array<Grain, GRAIN_POOL_SIZE> a_pool;
+	int32_t a_free;					// First grain of the free list
+	uint32_t a_active;				// Grains sounding
+	uint32_t a_dropped;				// Grains not started because the pool was empty
+	VoicePool<GrainVoice, GRANULAR_VOICES> a_voices;
+
+	std::vector<float> a_source;	// One guard frame past the end for interpolation
+	uint32_t a_source_mask;			// Wraps reads of the oscillator cycle, all ones for a buffer
+	double a_source_rate;
+	std::string a_source_name;
+
+	double a_grain_seconds;
+	double a_density;				// Grains per second per voice
+	double a_scatter;				// Spread of the start positions around the scan, in seconds
+	double a_pitch_jitter;			// Spread of the grain pitches, in semitones
+	double a_scan_speed;			// Source seconds scanned per second, 1 plays it at its own speed
+	GRAIN_WINDOW a_window;
+
+	std::vector<float> a_mix;
+
+public:
+	Granular()
+		: a_pool(), a_free(0), a_active(0), a_dropped(0), a_source_mask(0), a_source_rate(DEFAULT_SAMPLE_RATE),
+		a_grain_seconds(0.06), a_density(150.0), a_scatter(0.03), a_pitch_jitter(0.08), a_scan_speed(0.5), a_window(GRAIN_WINDOW::HANN)
+	{
+		for (int32_t i = 0; i < GRAIN_POOL_SIZE; i++)
+			a_pool[i].a_next = i + 1 < GRAIN_POOL_SIZE ? i + 1 : -1;
+
+		if (auto adsr_envelope = dynamic_cast<ADSREnvelope<Sample>*>(a_envelope.get()))
+		{
+			adsr_envelope->a_attack_time = 0.15;
+			adsr_envelope->a_decay_time = 0.3;
+			adsr_envelope->a_sustain_amplitude = 0.8;
+			adsr_envelope->a_release_time = 0.6;
+		}
+		a_volume = 0.7;
+		makeOscillatorSource();
+	}
+
+	// Not for the audio thread. Mixes the file down to mono; without a file, or if it can't
+	// be read, the oscillator source plays.
+	bool loadSource(const std::string& path)
+	{
+		MappedFile file;
+		WavFormat format;
+		if (!file.open(path) || !parseWavHeader(file.data(), file.size(), format) || format.a_frames < 2 || format.a_frames >= UINT32_MAX)
+		{
+			makeOscillatorSource();
+			return false;
+		}
+
+		a_source.assign(format.a_frames + 1, 0.0f);
+		readWavFrames(file.data(), format, 0, static_cast<uint32_t>(format.a_frames), a_source.data());
+		a_source_mask = UINT32_MAX;
+		a_source_rate = format.a_sample_rate;
+		a_source_name = path.substr(path.find_last_of("/\\") + 1);
+		return true;
+	}
+
+	void setGrainLength(double seconds)
+	{
+		a_grain_seconds = std::clamp(seconds, 0.002, 1.0);
+	}
+
+	void setDensity(double grains_per_second)
+	{
+		a_density = std::clamp(grains_per_second, 1.0, GRANULAR_MAX_DENSITY);
+	}
+
+	void setScatter(double seconds)
+	{
+		a_scatter = std::max(seconds, 0.0);
+	}
+
+	void setPitchJitter(double semitones)
+	{
+		a_pitch_jitter = std::max(semitones, 0.0);
+	}
+
+	void setScanSpeed(double speed)
+	{
+		a_scan_speed = speed;
+	}
+
+	void setWindow(GRAIN_WINDOW window)
+	{
+		a_window = window;
+	}
+
+	uint32_t getActiveGrains() const
+	{
+		return a_active;
+	}
+
+	uint32_t getDroppedGrains() const
+	{
+		return a_dropped;
+	}
+
+	virtual void prepare(uint32_t max_frames) override
+	{
+		BaseInstrument<Sample>::prepare(max_frames);
+		a_mix.resize(max_frames);
+	}
+
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished) override
+	{
+		float sample = 0.0f;
+		render(time, getTimeStep(), n, &sample, 1, is_note_finished);
+		return sample;
+	}
+
+	virtual void render(const double time, const double time_step, Note& n, float* out, uint32_t frames, bool& is_note_finished) override
+	{
+		bool is_new = false;
+		GrainVoice* voice = a_voices.acquire(n, is_new);
+		if (voice == nullptr)
+		{
+			std::fill_n(out, frames, 0.0f);
+			is_note_finished = true;
+			return;
+		}
+		if (is_new)
+		{
+			// The slot may have been stolen from a voice that still had grains sounding
+			freeGrains(*voice);
+			*voice = GrainVoice();
+		}
+
+		// The envelope is evaluated at the block's ends and ramped in between
+		double end_time = time + frames * time_step;
+		float level = static_cast<float>(a_envelope->amplitude(time, n.a_on, n.a_off));
+		float end_level = static_cast<float>(a_envelope->amplitude(end_time, n.a_on, n.a_off));
+		bool released = n.a_off > n.a_on;
+		if (!released || end_level > 0.0f)
+			startGrains(*voice, n, frames, time_step);
+
+		if (a_mix.size() < frames)
+			a_mix.resize(frames);
+		std::fill_n(a_mix.begin(), frames, 0.0f);
+		mixGrains(*voice, a_mix.data(), frames);
+
+		float gain = static_cast<float>(a_volume * n.a_velocity);
+		float level_step = (end_level - level) / frames;
+		for (uint32_t i = 0; i < frames; i++)
+		{
+			out[i] = gain * level * a_mix[i];
+			level += level_step;
+		}
+
+		// Scanning moves through the source at its own rate, whatever the pitch
+		if (a_source_mask == UINT32_MAX)
+		{
+			double length = static_cast<double>(a_source.size() - 1);
+			voice->a_scan = std::fmod(voice->a_scan + a_scan_speed * a_source_rate * frames * time_step, length);
+			if (voice->a_scan < 0.0)
+				voice->a_scan += length;
+		}
+
+		if (released && end_level <= 0.0f)
+			is_note_finished = true;
+	}
+
+	virtual bool tracksPitchModulation() const override
+	{
+		return true;
+	}
+
+	virtual void releaseVoice(const Note& n) override
+	{
+		if (GrainVoice* voice = a_voices.find(n))
+			freeGrains(*voice);
+		a_voices.release(n);
+	}
+
+	virtual std::wstring getName() const override
+	{
+		if (a_source_mask != UINT32_MAX)
+			return L"Granular";
+		return L"Granular: " + std::wstring(a_source_name.begin(), a_source_name.end());
+	}
+
+private:
+	// A cycle of a soft saw: eight harmonics falling off a little faster than a saw's
+	void makeOscillatorSource()
+	{
+		a_source.assign(GRANULAR_CYCLE_SIZE + 1, 0.0f);
+		for (int i = 0; i <= GRANULAR_CYCLE_SIZE; i++)
+		{
+			double phase = 2.0 * std::numbers::pi * i / GRANULAR_CYCLE_SIZE;
+			double value = 0.0;
+			for (int h = 1; h <= 8; h++)
+				value += std::sin(h * phase) / (h * std::sqrt(h));
+			a_source[i] = static_cast<float>(0.6 * value);
+		}
+		a_source_mask = GRANULAR_CYCLE_SIZE - 1;
+		a_source_rate = GRANULAR_CYCLE_SIZE * GRANULAR_ROOT_FREQUENCY;
+		a_source_name.clear();
+	}
+
+	// Start every grain due in this block, at the frame it is due
+	void startGrains(GrainVoice& voice, Note& n, uint32_t frames, double time_step)
+	{
+		double interval = 1.0 / (a_density * time_step);
+		uint32_t length = std::max(static_cast<uint32_t>(a_grain_seconds / time_step), 2u);
+
+		// Overlapping grains land at random phases, so their powers add
+		float grain_gain = static_cast<float>(1.0 / std::sqrt(std::max(a_density * a_grain_seconds, 1.0)));
+		bool is_buffer = a_source_mask == UINT32_MAX;
+		double source_frames = static_cast<double>(a_source.size() - 1);
+		double step = (n.a_freq / GRANULAR_ROOT_FREQUENCY) * a_source_rate * time_step;
+
+		while (voice.a_countdown < frames)
+		{
+			if (a_free < 0)
+			{
+				a_dropped++;
+				voice.a_countdown += interval;
+				continue;
+			}
+
+			double position = is_buffer ? voice.a_scan + a_scatter * a_source_rate * n.a_noise.white() : source_frames * (0.5 + 0.5 * n.a_noise.white());
+			double grain_step = step * std::exp2(a_pitch_jitter * n.a_noise.white() / 12.0);
+			uint32_t grain_length = length;
+			if (is_buffer)
+			{
+				// A grain running off the end of the buffer is shortened, keeping its whole window
+				position = std::clamp(position, 0.0, source_frames - 1.0);
+				grain_length = std::min<uint32_t>(grain_length, static_cast<uint32_t>((source_frames - 1.0 - position) / grain_step));
+				if (grain_length < 2)
+				{
+					voice.a_countdown += interval;
+					continue;
+				}
+			}
+
+			int32_t index = a_free;
+			Grain& grain = a_pool[index];
+			a_free = grain.a_next;
+			grain.a_position = static_cast<uint64_t>(position * 4294967296.0);
+			grain.a_step = static_cast<uint64_t>(grain_step * 4294967296.0);
+			grain.a_window_phase = 0;
+			grain.a_window_step = static_cast<uint32_t>(4294967296.0 / grain_length);
+			grain.a_remaining = grain_length;
+			grain.a_offset = static_cast<uint32_t>(voice.a_countdown);
+			grain.a_gain = grain_gain;
+			grain.a_next = voice.a_grains;
+			voice.a_grains = index;
+			a_active++;
+
+			// A little jitter on the spacing keeps dense clouds from buzzing at the grain rate
+			voice.a_countdown += interval * (1.0 + 0.25 * n.a_noise.white());
+		}
+		voice.a_countdown -= frames;
+	}
+
+	// Sum the voice's grains into mix, freeing the ones that finish
+	void mixGrains(GrainVoice& voice, float* mix, uint32_t frames)
+	{
+		const float* window = grain_windows.table(a_window);
+		const float* source = a_source.data();
+		uint32_t mask = a_source_mask;
+
+		int32_t* link = &voice.a_grains;
+		while (*link >= 0)
+		{
+			Grain& grain = a_pool[*link];
+			uint32_t count = std::min(grain.a_remaining, frames - grain.a_offset);
+			float* out = mix + grain.a_offset;
+
+			uint64_t position = grain.a_position;
+			uint32_t window_phase = grain.a_window_phase;
+			for (uint32_t i = 0; i < count; i++)
+			{
+				uint32_t index = static_cast<uint32_t>(position >> 32) & mask;
+				float fraction = static_cast<float>(static_cast<uint32_t>(position)) * (1.0f / 4294967296.0f);
+				uint32_t w = window_phase >> (32 - GRAIN_WINDOW_BITS);
+				float w_fraction = static_cast<float>(window_phase & ((1u << (32 - GRAIN_WINDOW_BITS)) - 1)) * (1.0f / (1u << (32 - GRAIN_WINDOW_BITS)));
+				float envelope = window[w] + w_fraction * (window[w + 1] - window[w]);
+				out[i] += grain.a_gain * envelope * (source[index] + fraction * (source[index + 1] - source[index]));
+				position += grain.a_step;
+				window_phase += grain.a_window_step;
+			}
+			grain.a_position = position;
+			grain.a_window_phase = window_phase;
+			grain.a_remaining -= count;
+			grain.a_offset = 0;
+
+			if (grain.a_remaining == 0)
+			{
+				int32_t finished = *link;
+				*link = grain.a_next;
+				grain.a_next = a_free;
+				a_free = finished;
+				a_active--;
+			}
+			else
+				link = &grain.a_next;
+		}
+	}
+
+	void freeGrains(GrainVoice& voice)
+	{
+		while (voice.a_grains >= 0)
+		{
+			int32_t index = voice.a_grains;
+			voice.a_grains = a_pool[index].a_next;
+			a_pool[index].a_next = a_free;
+			a_free = index;
+			a_active--;
+		}
+	}
+};
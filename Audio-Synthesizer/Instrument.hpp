@@ -4,35 +4,141 @@
 #include "Envelope.hpp"
 #include "Common.hpp"
 #include "Filter.hpp"
+#include "Oversampler.hpp"
+#include "Modulation.hpp"
+#include "VoicePool.hpp"
+#include "OneShotCache.hpp"
+
+// Voices compute in the sample type T and hand their blocks to the float mix bus. The
+// instruments below are written for the engine's Sample type.
+template<typename T>
+struct BaseInstrument
+{
+	T a_volume;
+	std::unique_ptr<BaseEnvelope<T>> a_envelope;
 
-int octave = 0;
+	// Voices of instruments with aliasing-heavy oscillators can be rendered at 2x or 4x
+	// the output rate and decimated back once for the whole instrument
+	uint32_t a_oversampling;
+	std::array<Decimator<float>, 2> a_decimators;	// Left and right
 
-double scale(int note_id)
-{
-	return 256 * std::pow(1.0594630943592952645618252949463, note_id + 12 * octave);
-}
+	double a_sample_rate;		// Output rate the instrument is set up for, before oversampling
 
+	// Fraction of the partials additive and band-limited oscillators compute, lowered by the
+	// quality governor when rendering falls behind
+	double a_detail;
 
-struct BaseInstrument
-{
-	double a_volume;
-	std::unique_ptr<BaseEnvelope> a_envelope;
-	virtual double sound(const double time, Note n, bool& is_note_finished) = 0;
+	// Shared LFOs and per-voice sources routed to pitch, cutoff, amplitude, pan and effect
+	ModMatrix a_modulation;
+
+	virtual ~BaseInstrument() = default;
+
+	virtual T sound(const double time, Note& n, bool& is_note_finished) = 0;
+
+	// Render a block of one voice into out. The default runs sound() per sample and scales
+	// it by the velocity, instruments with a cheaper block path can override it.
+	virtual void render(const double time, const double time_step, Note& n, float* out, uint32_t frames, bool& is_note_finished)
+	{
+		for (uint32_t i = 0; i < frames; i++)
+			out[i] = static_cast<float>(sound(time + i * time_step, n, is_note_finished) * static_cast<T>(n.a_velocity));
+	}
+
+	// Called once a voice is finished, for instruments that keep per-voice state
+	virtual void releaseVoice(const Note& n)
+	{
+	}
 
 	BaseInstrument()
 	{
-		a_volume = 1.0;
-		a_envelope = std::make_unique<ADSREnvelope>();
+		a_volume = 1;
+		a_envelope = std::make_unique<ADSREnvelope<T>>();
+		a_oversampling = 1;
+		a_sample_rate = DEFAULT_SAMPLE_RATE;
+		a_detail = 1.0;
+
+		// The mod wheel brings in vibrato, on instruments that can follow it, and a little tremolo
+		a_modulation.getLFO(1).setRate(5.5);
+		a_modulation.addRoute(MOD_SOURCE::WHEEL_LFO, MOD_DESTINATION::PITCH, 0.5);
+		a_modulation.addRoute(MOD_SOURCE::WHEEL_LFO, MOD_DESTINATION::AMPLITUDE, 0.15);
+	}
+
+	// Instruments holding filters override this to retune them for the oversampled rate
+	virtual void setOversampling(uint32_t factor)
+	{
+		for (Decimator<float>& decimator : a_decimators)
+			decimator.setFactor(factor);
+		a_oversampling = a_decimators[0].getFactor();
+	}
+
+	// Only call while the instrument is idle. Filters are retuned through setOversampling().
+	virtual void setSampleRate(double sample_rate)
+	{
+		a_sample_rate = sample_rate;
+		setOversampling(a_oversampling);
+	}
+
+	// Seconds per sample at the rate the voices render at
+	double getTimeStep() const
+	{
+		return 1.0 / (a_sample_rate * a_oversampling);
+	}
+
+	// Reserve everything a block of up to max_frames output frames needs, called before the
+	// audio thread starts. Instruments with their own block buffers extend this.
+	virtual void prepare(uint32_t max_frames)
+	{
+		for (Decimator<float>& decimator : a_decimators)
+			decimator.reserve(max_frames);
+		a_modulation.reserve(max_frames * 4);
+	}
+
+	// Instruments whose oscillators run on phase accumulators can follow a_freq changing
+	// from block to block. The others compute phase from time and would jump, so they
+	// keep the unmodulated pitch.
+	virtual bool tracksPitchModulation() const
+	{
+		return false;
+	}
+
+	uint32_t getOversampling() const
+	{
+		return a_oversampling;
+	}
+
+	// Partials to compute out of full at the current detail, at least one
+	int partialCount(int full) const
+	{
+		return std::max(1, static_cast<int>(std::lround(full * a_detail)));
 	}
 
 	virtual std::wstring getName() const = 0;
 };
 
-struct Drum : public BaseInstrument
+#define DRUM_VOICES 64
+
+struct DrumVoice
+{
+	int64_t a_frame = 0;		// Frames since the hit, negative until it starts
+	uint64_t a_key = 0;			// Noise seed of the hit
+	int a_slot = -1;			// Cache slot of the one-shot
+	bool a_live = false;		// Released before the one-shot ended, synthesized from then on
+	NoiseGenerator a_noise;		// Only advanced once live
+};
+
+struct Drum : public BaseInstrument<Sample>
 {
+	// Every hit of a key is the same noise through the same envelope, only the velocity
+	// scales it. So the first hit of a key is rendered once into a cache of one-shots and
+	// every later hit is a scaled copy. A hit released before its one-shot ends, which
+	// changes the envelope, carries on synthesized from where it was released.
+	OneShotCache a_cache;
+	VoicePool<DrumVoice, DRUM_VOICES> a_voices;
+	size_t a_cache_bytes;
+
 	Drum()
+		: a_cache_bytes(ONESHOT_CACHE_BYTES)
 	{
-		if (auto adsr_envelope = dynamic_cast<ADSREnvelope*>(a_envelope.get()))
+		if (auto adsr_envelope = dynamic_cast<ADSREnvelope<Sample>*>(a_envelope.get()))
 		{
 			adsr_envelope->a_attack_time = 0.01;
 			adsr_envelope->a_decay_time = 0.1;
@@ -41,29 +147,135 @@ struct Drum : public BaseInstrument
 		}
 
 		a_volume = 0.8;
+		Drum::setOversampling(a_oversampling);
+	}
+
+	// Not for the audio thread. 0 turns the cache off and synthesizes every hit.
+	void setCacheBudget(size_t bytes)
+	{
+		a_cache_bytes = bytes;
+		setOversampling(a_oversampling);
+	}
+
+	const OneShotCache& getCache() const
+	{
+		return a_cache;
+	}
+
+	virtual void setOversampling(uint32_t factor) override
+	{
+		BaseInstrument<Sample>::setOversampling(factor);
+		a_cache.configure(a_cache_bytes, oneShotFrames(getTimeStep()));
 	}
 
-	virtual double sound(const double time, Note n, bool& is_note_finished) override
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished) override
 	{
-		double amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
+		Sample amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
 		if (amplitude <= 0.0) is_note_finished = true;
 
-		double sound = generateWaveform(n.a_on - time, scale(n.a_id), OSCILLATOR_TYPE::NOISE);
+		Sample sound = static_cast<Sample>(n.a_noise.white());
 
 		return amplitude * sound * a_volume;
 	}
 
+	virtual void render(const double time, const double time_step, Note& n, float* out, uint32_t frames, bool& is_note_finished) override
+	{
+		bool is_new = false;
+		DrumVoice* voice = a_voices.acquire(n, is_new);
+		if (voice == nullptr || !a_cache.isEnabled() || oneShotFrames(time_step) > a_cache.getSlotFrames())
+		{
+			BaseInstrument<Sample>::render(time, time_step, n, out, frames, is_note_finished);
+			return;
+		}
+		if (is_new)
+		{
+			voice->a_frame = std::llround((time - n.a_on) / time_step);
+			voice->a_key = NoiseGenerator::voiceSeed(n.a_seed, n.a_id);
+			voice->a_slot = -1;
+			voice->a_live = false;
+		}
+
+		// Released early, the envelope leaves the one-shot: pick up its noise where it is
+		uint32_t length = oneShotFrames(time_step);
+		if (!voice->a_live && n.a_off >= n.a_on && voice->a_frame < length)
+		{
+			voice->a_noise.setSeed(voice->a_key);
+			for (int64_t k = 0; k < voice->a_frame; k++)
+				voice->a_noise.white();
+			voice->a_live = true;
+		}
+
+		float gain = static_cast<float>(n.a_velocity);
+		if (voice->a_live)
+		{
+			for (uint32_t i = 0; i < frames; i++)
+			{
+				Sample amplitude = a_envelope->amplitude(time + i * time_step, n.a_on, n.a_off);
+				if (amplitude <= 0.0) is_note_finished = true;
+				out[i] = static_cast<float>(amplitude * static_cast<Sample>(voice->a_noise.white()) * a_volume) * gain;
+			}
+			voice->a_frame += frames;
+			return;
+		}
+
+		if (!a_cache.holds(voice->a_slot, voice->a_key))
+		{
+			voice->a_slot = a_cache.find(voice->a_key);
+			if (voice->a_slot < 0)
+			{
+				voice->a_slot = a_cache.insert(voice->a_key, length);
+				renderOneShot(a_cache.data(voice->a_slot), length, voice->a_key, time_step);
+			}
+		}
+
+		const float* one_shot = a_cache.data(voice->a_slot);
+		for (uint32_t i = 0; i < frames; i++)
+		{
+			int64_t k = voice->a_frame + i;
+			out[i] = k >= 0 && k < length ? gain * one_shot[k] : 0.0f;
+		}
+		voice->a_frame += frames;
+		if (voice->a_frame >= length)
+			is_note_finished = true;
+	}
+
+	virtual void releaseVoice(const Note& n) override
+	{
+		a_voices.release(n);
+	}
+
 	virtual std::wstring getName() const override
 	{
 		return L"Drum";
 	}
+
+private:
+	// Frames until the envelope has decayed to silence with the key held
+	uint32_t oneShotFrames(double time_step) const
+	{
+		auto adsr_envelope = dynamic_cast<ADSREnvelope<Sample>*>(a_envelope.get());
+		if (adsr_envelope == nullptr || adsr_envelope->a_sustain_amplitude > 0.0)
+			return UINT32_MAX;
+		return static_cast<uint32_t>(std::ceil((adsr_envelope->a_attack_time + adsr_envelope->a_decay_time) / time_step)) + 1;
+	}
+
+	// The hit as sound() plays it with the key held
+	void renderOneShot(float* out, uint32_t frames, uint64_t key, double time_step)
+	{
+		NoiseGenerator noise(key);
+		for (uint32_t k = 0; k < frames; k++)
+		{
+			Sample amplitude = a_envelope->amplitude(1.0 + k * time_step, 1.0, 0.0);
+			out[k] = static_cast<float>(amplitude * static_cast<Sample>(noise.white()) * a_volume);
+		}
+	}
 };
 
-struct Piano : public BaseInstrument
+struct Piano : public BaseInstrument<Sample>
 {
 	Piano()
 	{
-		if (auto adsr_envelope = dynamic_cast<ADSREnvelope*>(a_envelope.get())) {
+		if (auto adsr_envelope = dynamic_cast<ADSREnvelope<Sample>*>(a_envelope.get())) {
 			adsr_envelope->a_attack_time = 0.01;
 			adsr_envelope->a_decay_time = 0.6;
 			adsr_envelope->a_sustain_amplitude = 0.8;
@@ -73,19 +285,20 @@ struct Piano : public BaseInstrument
 		a_volume = 1.0;
 	}
 
-	virtual double sound(const double time, Note n, bool& is_note_finished)
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished)
 	{
-		double amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
+		Sample amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
 		if (amplitude <= 0.0) is_note_finished = true;
 
-		double sound = 0.0;
+		Sample sound = 0;
 
-		for (int i = 1; i <= 6; ++i)
+		int partials = partialCount(6);
+		for (int i = 1; i <= partials; ++i)
 		{
-			sound += (1.0 / i) * generateWaveform(n.a_on - time, scale(n.a_id) * i, OSCILLATOR_TYPE::SINE);
+			sound += generateWaveform<Sample>(n.a_on - time, n.a_freq * i, OSCILLATOR_TYPE::SINE) / i;
 		}
 
-		sound += 0.01 * generateWaveform(n.a_on - time, scale(n.a_id), OSCILLATOR_TYPE::NOISE);
+		sound += static_cast<Sample>(0.01 * n.a_noise.white());
 
 		return amplitude * sound * a_volume;
 	}
@@ -96,16 +309,16 @@ struct Piano : public BaseInstrument
 	}
 };
 
-class Accordion : public BaseInstrument
+class Accordion : public BaseInstrument<Sample>
 {
 private:
-	LowPassFilter<double> a_bellowNoiseFilter;
+	LowPassFilter<Sample> a_bellowNoiseFilter;
 
 public:
 	Accordion()
-		: a_bellowNoiseFilter(LowPassFilter(1000.0, 1.0 / SAMPLE_RATE))
+		: a_bellowNoiseFilter(1000.0, 1.0 / DEFAULT_SAMPLE_RATE)
 	{
-		if (auto adsr_envelope = dynamic_cast<ADSREnvelope*>(a_envelope.get())) {
+		if (auto adsr_envelope = dynamic_cast<ADSREnvelope<Sample>*>(a_envelope.get())) {
 			adsr_envelope->a_attack_time = 0.1;
 			adsr_envelope->a_decay_time = 0.2;
 			adsr_envelope->a_sustain_amplitude = 0.9;
@@ -113,21 +326,35 @@ public:
 		}
 
 		a_volume = 1.0;
+
+		// Bellows tremolo
+		a_modulation.getLFO(0).setRate(5.5);
+		a_modulation.addRoute(MOD_SOURCE::LFO_1, MOD_DESTINATION::AMPLITUDE, 0.12);
+
+		// The square harmonics alias badly in the upper octaves
+		setOversampling(2);
+	}
+
+	virtual void setOversampling(uint32_t factor) override
+	{
+		BaseInstrument<Sample>::setOversampling(factor);
+		a_bellowNoiseFilter = LowPassFilter<Sample>(1000.0, getTimeStep());
 	}
 
-	virtual double sound(const double time, Note n, bool& is_note_finished)
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished)
 	{
-		double amp = a_envelope->amplitude(time, n.a_on, n.a_off);
+		Sample amp = a_envelope->amplitude(time, n.a_on, n.a_off);
 		if (amp <= 0.0) is_note_finished = true;
 
-		double sound = 0.0;
+		Sample sound = 0;
 
-		for (int i = 1; i <= 5; ++i)
+		int partials = partialCount(5);
+		for (int i = 1; i <= partials; ++i)
 		{
-		 sound += (1.0 / i) * generateWaveform(n.a_on - time, scale(n.a_id) * i, OSCILLATOR_TYPE::SQUARE);
+		 sound += generateWaveform<Sample>(n.a_on - time, n.a_freq * i, OSCILLATOR_TYPE::SQUARE) / i;
 		}
 
-		sound += 0.1 * a_bellowNoiseFilter.filter(generateWaveform(n.a_on - time, scale(n.a_id), OSCILLATOR_TYPE::NOISE));
+		sound += static_cast<Sample>(0.1) * a_bellowNoiseFilter.filter(static_cast<Sample>(n.a_noise.white()));
 
 		return amp * sound * a_volume;
 	}
@@ -138,16 +365,16 @@ public:
 	}
 };
 
-class AcousticGuitar : public BaseInstrument
+class AcousticGuitar : public BaseInstrument<Sample>
 {
 private:
-	HighPassFilter<double> a_stringNoiseFilter;
+	HighPassFilter<Sample> a_stringNoiseFilter;
 
 public:
 	AcousticGuitar()
-		: a_stringNoiseFilter(HighPassFilter(5000.0, 1.0 / SAMPLE_RATE))
+		: a_stringNoiseFilter(5000.0, 1.0 / DEFAULT_SAMPLE_RATE)
 	{
-		if (auto adsr_envelope = dynamic_cast<ADSREnvelope*>(a_envelope.get())) {
+		if (auto adsr_envelope = dynamic_cast<ADSREnvelope<Sample>*>(a_envelope.get())) {
 			adsr_envelope->a_attack_time = 0.05;
 			adsr_envelope->a_decay_time = 0.3;
 			adsr_envelope->a_sustain_amplitude = 0.7;
@@ -157,13 +384,19 @@ public:
 		a_volume = 0.8;
 	}
 
-	virtual double sound(const double time, Note n, bool& is_note_finished)
+	virtual void setOversampling(uint32_t factor) override
+	{
+		BaseInstrument<Sample>::setOversampling(factor);
+		a_stringNoiseFilter = HighPassFilter<Sample>(5000.0, getTimeStep());
+	}
+
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished)
 	{
-		double amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
+		Sample amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
 		if (amplitude <= 0.0) is_note_finished = true;
 
-		double sound = 0.5 * generateWaveform(n.a_on - time, scale(n.a_id), OSCILLATOR_TYPE::SINE) +
-			0.5 * generateWaveform(n.a_on - time, scale(n.a_id), OSCILLATOR_TYPE::TRIANGLE);
+		Sample sound = static_cast<Sample>(0.5) * (generateWaveform<Sample>(n.a_on - time, n.a_freq, OSCILLATOR_TYPE::SINE) +
+			generateWaveform<Sample>(n.a_on - time, n.a_freq, OSCILLATOR_TYPE::TRIANGLE));
 
 		sound = a_stringNoiseFilter.filter(sound);
 
@@ -176,16 +409,16 @@ public:
 	}
 };
 
-class Trumpet : public BaseInstrument
+class Trumpet : public BaseInstrument<Sample>
 {
 private:
-	LowPassFilter<double> a_buzzFilter;
+	LowPassFilter<Sample> a_buzzFilter;
 
 public:
 	Trumpet()
-		: a_buzzFilter(LowPassFilter(16000.0, 1.0 / SAMPLE_RATE))
+		: a_buzzFilter(16000.0, 1.0 / DEFAULT_SAMPLE_RATE)
 	{
-		if (auto adsr_envelope = dynamic_cast<ADSREnvelope*>(a_envelope.get())) {
+		if (auto adsr_envelope = dynamic_cast<ADSREnvelope<Sample>*>(a_envelope.get())) {
 			adsr_envelope->a_attack_time = 0.1;
 			adsr_envelope->a_decay_time = 0.2;
 			adsr_envelope->a_sustain_amplitude = 0.8;
@@ -193,14 +426,23 @@ public:
 		}
 
 		a_volume = 0.8;
+
+		// Naive square wave, oversample to keep the aliasing down
+		setOversampling(2);
+	}
+
+	virtual void setOversampling(uint32_t factor) override
+	{
+		BaseInstrument<Sample>::setOversampling(factor);
+		a_buzzFilter = LowPassFilter<Sample>(16000.0, getTimeStep());
 	}
 
-	virtual double sound(const double time, Note n, bool& is_note_finished)
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished)
 	{
-		double amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
+		Sample amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
 		if (amplitude <= 0.0) is_note_finished = true;
 
-		double sound = generateWaveform(n.a_on - time, scale(n.a_id), OSCILLATOR_TYPE::SQUARE);
+		Sample sound = generateWaveform<Sample>(n.a_on - time, n.a_freq, OSCILLATOR_TYPE::SQUARE);
 
 		sound = a_buzzFilter.filter(sound);
 
@@ -213,16 +455,16 @@ public:
 	}
 };
 
-class Saxophone : public BaseInstrument
+class Saxophone : public BaseInstrument<Sample>
 {
 private:
-	BandPassFilter<double> a_toneFilter;
+	BandPassFilter<Sample> a_toneFilter;
 
 public:
 	Saxophone()
-		: a_toneFilter(BandPassFilter(500.0, 2000.0, 1.0 / SAMPLE_RATE))
+		: a_toneFilter(500.0, 2000.0, 1.0 / DEFAULT_SAMPLE_RATE)
 	{
-		if (auto adsr_envelope = dynamic_cast<ADSREnvelope*>(a_envelope.get())) {
+		if (auto adsr_envelope = dynamic_cast<ADSREnvelope<Sample>*>(a_envelope.get())) {
 			adsr_envelope->a_attack_time = 0.1;
 			adsr_envelope->a_decay_time = 0.2;
 			adsr_envelope->a_sustain_amplitude = 0.8;
@@ -230,15 +472,25 @@ public:
 		}
 
 		a_volume = 0.8;
+
+		// Breath tremolo
+		a_modulation.getLFO(0).setRate(4.8);
+		a_modulation.addRoute(MOD_SOURCE::LFO_1, MOD_DESTINATION::AMPLITUDE, 0.06);
+	}
+
+	virtual void setOversampling(uint32_t factor) override
+	{
+		BaseInstrument<Sample>::setOversampling(factor);
+		a_toneFilter = BandPassFilter<Sample>(500.0, 2000.0, getTimeStep());
 	}
 
-	virtual double sound(const double time, Note n, bool& is_note_finished)
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished)
 	{
-		double amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
+		Sample amplitude = a_envelope->amplitude(time, n.a_on, n.a_off);
 		if (amplitude <= 0.0) is_note_finished = true;
 
-			double sound = 0.5 * generateWaveform(n.a_on - time, scale(n.a_id), OSCILLATOR_TYPE::SINE) +
-			0.5 * generateWaveform(n.a_on - time, scale(n.a_id), OSCILLATOR_TYPE::SAW_ANALOGUE);
+			Sample sound = static_cast<Sample>(0.5) * (generateWaveform<Sample>(n.a_on - time, n.a_freq, OSCILLATOR_TYPE::SINE) +
+			generateWaveform<Sample>(n.a_on - time, n.a_freq, OSCILLATOR_TYPE::SAW_ANALOGUE, 0.0, 0.0, partialCount(50)));
 
 			sound = a_toneFilter.filter(sound);
 
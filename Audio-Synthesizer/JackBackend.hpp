@@ -0,0 +1,163 @@
+#pragma once
+
+#ifdef SYNTH_HAVE_JACK
+
+#include <cstring>
+#include <jack/jack.h>
+
+#include "AudioBackend.hpp"
+
+// JACK client. JACK calls process() from its own real-time thread once per period and the
+// engine renders straight into the output ports there, so there is no render thread and no
+// queue: the latency is whatever the JACK server is configured for. Ports are float, so the
+// sample type of the generator is not used.
+template <typename T>
+class JackBackend : public AudioBackend<T>
+{
+private:
+	jack_client_t* a_client;
+	std::vector<jack_port_t*> a_ports;
+	std::vector<float*> a_port_buffers;
+	uint32_t a_block_frames;
+	std::atomic<BlockSource*> a_source;
+
+public:
+	JackBackend()
+		: a_client(nullptr), a_block_frames(0), a_source(nullptr)
+	{
+	}
+
+	~JackBackend()
+	{
+		close();
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"JACK";
+	}
+
+	// Outputs are connected to the physical playback ports, in order
+	virtual std::vector<std::wstring> enumerate() override
+	{
+		return { L"system" };
+	}
+
+	virtual bool open(const std::wstring& device, uint32_t sample_rate, uint32_t channels, uint32_t block_frames, uint32_t blocks, LATENCY_MODE latency_mode) override
+	{
+		a_block_frames = block_frames;
+
+		// Never start a server of our own, only join a running one
+		jack_status_t status;
+		a_client = jack_client_open("Audio-Synthesizer", JackNoStartServer, &status);
+		if (a_client == nullptr)
+			return false;
+
+		// The engine is set up for the rate it was asked for before the device opens, so the server has to match it
+		if (jack_get_sample_rate(a_client) != sample_rate)
+		{
+			close();
+			return false;
+		}
+
+		for (uint32_t c = 0; c < channels; c++)
+		{
+			std::string port_name = "out_" + std::to_string(c + 1);
+			jack_port_t* port = jack_port_register(a_client, port_name.c_str(), JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+			if (port == nullptr)
+			{
+				close();
+				return false;
+			}
+			a_ports.push_back(port);
+		}
+		a_port_buffers.resize(channels);
+
+		if (jack_set_process_callback(a_client, processWrap, this) != 0)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	virtual void close() override
+	{
+		if (a_client != nullptr)
+		{
+			jack_deactivate(a_client);
+			jack_client_close(a_client);
+			a_client = nullptr;
+		}
+		a_ports.clear();
+		a_source = nullptr;
+	}
+
+	virtual bool start(BlockSource& source) override
+	{
+		a_source = &source;
+		if (jack_activate(a_client) != 0)
+			return false;
+
+		// Ports can only be connected once the client is active
+		const char** playback_ports = jack_get_ports(a_client, nullptr, JACK_DEFAULT_AUDIO_TYPE, JackPortIsPhysical | JackPortIsInput);
+		if (playback_ports != nullptr)
+		{
+			for (size_t c = 0; c < a_ports.size() && playback_ports[c] != nullptr; c++)
+				jack_connect(a_client, jack_port_name(a_ports[c]), playback_ports[c]);
+			jack_free(playback_ports);
+		}
+		return true;
+	}
+
+	virtual double getLatency() const override
+	{
+		if (a_client == nullptr || a_ports.empty())
+			return 0.0;
+
+		jack_latency_range_t range;
+		jack_port_get_latency_range(a_ports[0], JackPlaybackLatency, &range);
+		return static_cast<double>(range.max + jack_get_buffer_size(a_client)) / static_cast<double>(jack_get_sample_rate(a_client));
+	}
+
+	// JACK runs process() on its own real-time thread
+	virtual bool isRealtime() const override
+	{
+		return a_client != nullptr && jack_is_realtime(a_client) != 0;
+	}
+
+private:
+	// Runs on the JACK thread. Periods longer than a block are rendered a block at a time.
+	int process(jack_nframes_t nframes)
+	{
+		for (size_t c = 0; c < a_ports.size(); c++)
+			a_port_buffers[c] = static_cast<float*>(jack_port_get_buffer(a_ports[c], nframes));
+
+		BlockSource* source = a_source;
+		jack_nframes_t done = 0;
+		while (done < nframes)
+		{
+			uint32_t frames = std::min<uint32_t>(nframes - done, a_block_frames);
+			if (source == nullptr)
+			{
+				for (float* out : a_port_buffers)
+					std::memset(out + done, 0, sizeof(float) * frames);
+			}
+			else
+			{
+				AudioBus& bus = source->renderBlock(frames);
+				for (size_t c = 0; c < a_port_buffers.size(); c++)
+					std::memcpy(a_port_buffers[c] + done, bus.channel(static_cast<uint32_t>(c)), sizeof(float) * frames);
+			}
+			done += frames;
+		}
+		return 0;
+	}
+
+	static int processWrap(jack_nframes_t nframes, void* instance)
+	{
+		return static_cast<JackBackend*>(instance)->process(nframes);
+	}
+};
+
+#endif
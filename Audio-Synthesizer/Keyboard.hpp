@@ -0,0 +1,147 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cctype>
+
+// Computer keyboard as a note and control surface. Windows reads the key state directly.
+// A POSIX terminal only delivers characters, so there a key counts as held while its
+// auto-repeat keeps arriving, and the first press is held long enough to bridge the
+// delay before repeating starts.
+
+#ifdef _WIN32
+
+#include <Windows.h>
+
+#define KEY_ESCAPE VK_ESCAPE
+#define KEY_TAB VK_TAB
+#define KEY_UP VK_UP
+#define KEY_DOWN VK_DOWN
+#define KEY_RIGHT VK_RIGHT
+#define KEY_ARPEGGIATOR VK_CONTROL
+#define KEY_ARPEGGIATOR_NAME "Ctrl"
+#define KEY_BACKTICK VK_OEM_3
+#define KEY_COMMA VK_OEM_COMMA
+#define KEY_PERIOD VK_OEM_PERIOD
+#define KEY_SLASH VK_OEM_2
+#define KEY_SEMICOLON VK_OEM_1
+#define KEY_QUOTE VK_OEM_7
+#define KEY_LEFT_BRACKET VK_OEM_4
+#define KEY_RIGHT_BRACKET VK_OEM_6
+
+class Keyboard
+{
+public:
+	void update()
+	{
+	}
+
+	bool isKeyDown(int key) const
+	{
+		return GetAsyncKeyState(key) & 0x8000;
+	}
+};
+
+#else
+
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+
+// Arrow keys arrive as escape sequences and get codes outside the character range.
+// A terminal can't report Ctrl on its own, so the arpeggiator is on the space bar.
+#define KEY_ESCAPE 27
+#define KEY_TAB '\t'
+#define KEY_UP 256
+#define KEY_DOWN 257
+#define KEY_RIGHT 258
+#define KEY_LEFT 259
+#define KEY_ARPEGGIATOR ' '
+#define KEY_ARPEGGIATOR_NAME "Space"
+#define KEY_BACKTICK '`'
+#define KEY_COMMA ','
+#define KEY_PERIOD '.'
+#define KEY_SLASH '/'
+#define KEY_SEMICOLON ';'
+#define KEY_QUOTE '\''
+#define KEY_LEFT_BRACKET '['
+#define KEY_RIGHT_BRACKET ']'
+
+#define KEY_CODES 260
+#define KEY_FIRST_HOLD_TIME 0.6		// Seconds, longer than the usual auto-repeat delay
+#define KEY_REPEAT_HOLD_TIME 0.1	// Seconds, a few auto-repeat intervals
+
+class Keyboard
+{
+private:
+	using Clock = std::chrono::steady_clock;
+
+	termios a_saved;
+	bool a_is_raw;
+	std::array<Clock::time_point, KEY_CODES> a_held_until;
+
+public:
+	Keyboard()
+		: a_is_raw(false)
+	{
+		a_held_until.fill(Clock::time_point());
+
+		// Unbuffered input without echo, restored on exit
+		if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &a_saved) == 0)
+		{
+			termios raw = a_saved;
+			raw.c_lflag &= ~(ICANON | ECHO);
+			raw.c_cc[VMIN] = 0;
+			raw.c_cc[VTIME] = 0;
+			a_is_raw = tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
+		}
+	}
+
+	~Keyboard()
+	{
+		if (a_is_raw)
+			tcsetattr(STDIN_FILENO, TCSANOW, &a_saved);
+	}
+
+	// Read everything typed since the last call
+	void update()
+	{
+		pollfd input = { STDIN_FILENO, POLLIN, 0 };
+		unsigned char buffer[64];
+		while (poll(&input, 1, 0) > 0)
+		{
+			ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+			if (count <= 0)
+				return;
+
+			for (ssize_t i = 0; i < count; i++)
+			{
+				// Escape followed by [ and a letter is an arrow key, on its own it is the escape key
+				if (buffer[i] == 27 && i + 2 < count && buffer[i + 1] == '[')
+				{
+					int arrow = buffer[i + 2] - 'A';
+					if (arrow >= 0 && arrow < 4)
+						press(KEY_UP + arrow);
+					i += 2;
+					continue;
+				}
+				press(std::toupper(buffer[i]));
+			}
+		}
+	}
+
+	bool isKeyDown(int key) const
+	{
+		return key >= 0 && key < KEY_CODES && Clock::now() < a_held_until[key];
+	}
+
+private:
+	void press(int key)
+	{
+		Clock::time_point now = Clock::now();
+		bool is_repeat = now < a_held_until[key];
+		a_held_until[key] = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(is_repeat ? KEY_REPEAT_HOLD_TIME : KEY_FIRST_HOLD_TIME));
+	}
+};
+
+#endif
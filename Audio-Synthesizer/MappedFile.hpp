@@ -0,0 +1,153 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Read-only memory mapping of a whole file. Pages are only read from disk when
+// touched, so mapping even a very large file is cheap, and release() gives back the
+// pages of ranges that have been read.
+class MappedFile
+{
+private:
+	const uint8_t* a_data;
+	size_t a_size;
+#ifdef _WIN32
+	HANDLE a_file;
+	HANDLE a_mapping;
+#else
+	int a_file;
+#endif
+
+public:
+	MappedFile()
+		: a_data(nullptr), a_size(0)
+#ifdef _WIN32
+		, a_file(INVALID_HANDLE_VALUE), a_mapping(NULL)
+#else
+		, a_file(-1)
+#endif
+	{
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	bool open(const std::string& path)
+	{
+		close();
+#ifdef _WIN32
+		a_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (a_file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(a_file, &size) || size.QuadPart == 0)
+			return close();
+
+		a_mapping = CreateFileMappingA(a_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (a_mapping == NULL)
+			return close();
+
+		a_data = static_cast<const uint8_t*>(MapViewOfFile(a_mapping, FILE_MAP_READ, 0, 0, 0));
+		if (a_data == nullptr)
+			return close();
+		a_size = static_cast<size_t>(size.QuadPart);
+#else
+		a_file = ::open(path.c_str(), O_RDONLY);
+		if (a_file < 0)
+			return false;
+
+		struct stat info;
+		if (fstat(a_file, &info) != 0 || info.st_size == 0)
+			return close();
+
+		void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, a_file, 0);
+		if (data == MAP_FAILED)
+			return close();
+		a_data = static_cast<const uint8_t*>(data);
+		a_size = static_cast<size_t>(info.st_size);
+#endif
+		return true;
+	}
+
+	bool close()
+	{
+#ifdef _WIN32
+		if (a_data != nullptr)
+			UnmapViewOfFile(a_data);
+		if (a_mapping != NULL)
+			CloseHandle(a_mapping);
+		if (a_file != INVALID_HANDLE_VALUE)
+			CloseHandle(a_file);
+		a_mapping = NULL;
+		a_file = INVALID_HANDLE_VALUE;
+#else
+		if (a_data != nullptr)
+			munmap(const_cast<uint8_t*>(a_data), a_size);
+		if (a_file >= 0)
+			::close(a_file);
+		a_file = -1;
+#endif
+		a_data = nullptr;
+		a_size = 0;
+		return false;
+	}
+
+	// Drop the resident pages of a range that was read and won't be needed soon. The data
+	// stays mapped, touching it again reads it back from the file. Only whole pages inside
+	// the range are dropped.
+	void release(size_t offset, size_t length) const
+	{
+		if (a_data == nullptr || offset >= a_size)
+			return;
+
+		size_t page = pageSize();
+		size_t first = (offset + page - 1) / page * page;
+		size_t last = std::min(offset + length, a_size) / page * page;
+		if (first >= last)
+			return;
+#ifdef _WIN32
+		// Unlocking pages that were never locked takes them out of the working set
+		VirtualUnlock(const_cast<uint8_t*>(a_data) + first, last - first);
+#else
+		madvise(const_cast<uint8_t*>(a_data) + first, last - first, MADV_DONTNEED);
+#endif
+	}
+
+	const uint8_t* data() const
+	{
+		return a_data;
+	}
+
+	size_t size() const
+	{
+		return a_size;
+	}
+
+private:
+	static size_t pageSize()
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwPageSize;
+#else
+		return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+	}
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "MappedFile.hpp"
+#include "MidiInput.hpp"
+
+#define MIDI_DEFAULT_TEMPO 500000	// Microseconds per quarter note until a tempo event says otherwise
+
+struct TimedMidiMessage
+{
+	double a_time;		// Seconds from the start of the file
+	MidiMessage a_message;
+};
+
+// Reads the channel messages of a Standard MIDI File, format 0 or 1, merged across tracks
+// and timed through the tempo map. SysEx and meta events other than tempo are skipped.
+class MidiFileReader
+{
+private:
+	struct TickedMessage
+	{
+		uint64_t a_tick;
+		MidiMessage a_message;
+	};
+
+	struct TempoChange
+	{
+		uint64_t a_tick;
+		uint32_t a_tempo;
+	};
+
+	const uint8_t* a_data;
+	size_t a_size;
+	size_t a_position;
+
+public:
+	MidiFileReader()
+		: a_data(nullptr), a_size(0), a_position(0)
+	{
+	}
+
+	bool read(const std::string& path, std::vector<TimedMidiMessage>& messages)
+	{
+		MappedFile file;
+		if (!file.open(path))
+			return false;
+
+		a_data = file.data();
+		a_size = file.size();
+		a_position = 0;
+		if (!expect("MThd") || readBig32() != 6)
+			return false;
+
+		uint16_t format = readBig16();
+		uint16_t tracks = readBig16();
+		uint16_t division = readBig16();
+		if (format > 1 || division == 0 || a_position > a_size)
+			return false;
+
+		std::vector<TickedMessage> ticked;
+		std::vector<TempoChange> tempos;
+		for (uint16_t t = 0; t < tracks; t++)
+		{
+			if (!expect("MTrk"))
+				return false;
+			uint32_t length = readBig32();
+			if (length > a_size - a_position)
+				return false;
+			if (!readTrack(a_position + length, ticked, tempos))
+				return false;
+		}
+
+		// Tracks are merged in time, messages on the same tick keep their file order
+		std::stable_sort(ticked.begin(), ticked.end(), [](const TickedMessage& a, const TickedMessage& b) { return a.a_tick < b.a_tick; });
+		std::stable_sort(tempos.begin(), tempos.end(), [](const TempoChange& a, const TempoChange& b) { return a.a_tick < b.a_tick; });
+
+		// SMPTE divisions count ticks per second, metrical ones ticks per quarter note
+		bool is_smpte = (division & 0x8000) != 0;
+		double ticks_per_second = is_smpte ? static_cast<double>(-static_cast<int8_t>(division >> 8)) * (division & 0xFF) : 0.0;
+		double ticks_per_quarter = division;
+
+		uint32_t tempo = MIDI_DEFAULT_TEMPO;
+		uint64_t tempo_tick = 0;
+		double tempo_time = 0.0;
+		size_t next_tempo = 0;
+		messages.clear();
+		messages.reserve(ticked.size());
+		for (const TickedMessage& m : ticked)
+		{
+			while (!is_smpte && next_tempo < tempos.size() && tempos[next_tempo].a_tick <= m.a_tick)
+			{
+				tempo_time += (tempos[next_tempo].a_tick - tempo_tick) * tempo * 1.0e-6 / ticks_per_quarter;
+				tempo_tick = tempos[next_tempo].a_tick;
+				tempo = tempos[next_tempo++].a_tempo;
+			}
+
+			double time = is_smpte ? m.a_tick / ticks_per_second : tempo_time + (m.a_tick - tempo_tick) * tempo * 1.0e-6 / ticks_per_quarter;
+			messages.push_back({ time, m.a_message });
+		}
+		return true;
+	}
+
+private:
+	bool readTrack(size_t end, std::vector<TickedMessage>& ticked, std::vector<TempoChange>& tempos)
+	{
+		uint64_t tick = 0;
+		uint8_t running_status = 0;
+		while (a_position < end)
+		{
+			tick += readVariable();
+			if (a_position >= end)
+				return false;
+
+			uint8_t status = a_data[a_position];
+			if (status < 0x80)
+			{
+				// Running status: the data byte belongs to the last channel message
+				if (running_status == 0)
+					return false;
+				status = running_status;
+			}
+			else
+				a_position++;
+
+			if (status == 0xFF)
+			{
+				if (a_position >= end)
+					return false;
+				uint8_t type = a_data[a_position++];
+				uint64_t length = readVariable();
+				if (length > end - std::min(a_position, end))
+					return false;
+				if (type == 0x51 && length == 3)
+					tempos.push_back({ tick, static_cast<uint32_t>((a_data[a_position] << 16) | (a_data[a_position + 1] << 8) | a_data[a_position + 2]) });
+				a_position += length;
+				if (type == 0x2F)
+					break;
+				continue;
+			}
+			if (status == 0xF0 || status == 0xF7)
+			{
+				uint64_t length = readVariable();
+				if (length > end - std::min(a_position, end))
+					return false;
+				a_position += length;
+				continue;
+			}
+
+			// Program change and channel pressure carry one data byte, every other channel message two
+			running_status = status;
+			int data_bytes = (status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0 ? 1 : 2;
+			if (end - a_position < static_cast<size_t>(data_bytes))
+				return false;
+			MidiMessage message = { status, static_cast<uint8_t>(a_data[a_position] & 0x7F), data_bytes == 2 ? static_cast<uint8_t>(a_data[a_position + 1] & 0x7F) : uint8_t(0) };
+			a_position += data_bytes;
+			ticked.push_back({ tick, message });
+		}
+		a_position = end;
+		return true;
+	}
+
+	bool expect(const char* tag)
+	{
+		if (a_size - std::min(a_position, a_size) < 4 || std::memcmp(a_data + a_position, tag, 4) != 0)
+			return false;
+		a_position += 4;
+		return true;
+	}
+
+	uint32_t readBig32()
+	{
+		uint32_t value = 0;
+		for (int i = 0; i < 4 && a_position < a_size; i++)
+			value = (value << 8) | a_data[a_position++];
+		return value;
+	}
+
+	uint16_t readBig16()
+	{
+		uint16_t value = 0;
+		for (int i = 0; i < 2 && a_position < a_size; i++)
+			value = static_cast<uint16_t>((value << 8) | a_data[a_position++]);
+		return value;
+	}
+
+	// Variable-length quantity, seven bits per byte with the top bit set on all but the last
+	uint64_t readVariable()
+	{
+		uint64_t value = 0;
+		for (int i = 0; i < 4 && a_position < a_size; i++)
+		{
+			uint8_t byte = a_data[a_position++];
+			value = (value << 7) | (byte & 0x7F);
+			if ((byte & 0x80) == 0)
+				break;
+		}
+		return value;
+	}
+};
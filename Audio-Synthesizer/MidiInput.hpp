@@ -0,0 +1,393 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cctype>
+#include <iterator>
+#include <algorithm>
+
+#include "AudioBackend.hpp"
+#include "Realtime.hpp"
+#include "Synth.hpp"
+
+// Live MIDI input. Each message is stamped with its arrival time, mapped onto the stream
+// clock and posted to the engine's MIDI event queue, where it lands on its own frame of
+// the next block. Windows reads a WinMM input device; Linux opens a virtual ALSA
+// sequencer port that controllers and other programs connect to.
+
+#define MIDI_MIDDLE_C 60			// MIDI note that plays note id 0
+#define MIDI_PITCH_BEND_RANGE 2.0	// Semitones at full bend
+#define MIDI_CC_MOD_WHEEL 1
+#define MIDI_CC_SUSTAIN 64
+
+// One channel voice message, data bytes without their top bit
+struct MidiMessage
+{
+	uint8_t a_status;
+	uint8_t a_data1;
+	uint8_t a_data2;
+};
+
+// Engine event for a message, false for messages the synthesizer has no use for. All
+// channels play the same instrument.
+inline bool midiToSynthEvent(const MidiMessage& message, double time, SynthEvent& event)
+{
+	int note_id = static_cast<int>(message.a_data1) - MIDI_MIDDLE_C;
+	switch (message.a_status & 0xF0)
+	{
+	case 0x90:
+		if (message.a_data2 > 0)
+		{
+			event = { SYNTH_EVENT::NOTE_ON, note_id, time, message.a_data2 / 127.0 };
+			return true;
+		}
+		[[fallthrough]];	// A note-on with no velocity is a note-off
+	case 0x80:
+		event = { SYNTH_EVENT::NOTE_OFF, note_id, time, 0.0 };
+		return true;
+	case 0xB0:
+		if (message.a_data1 == MIDI_CC_MOD_WHEEL)
+		{
+			event = { SYNTH_EVENT::MOD_WHEEL, 0, time, message.a_data2 / 127.0 };
+			return true;
+		}
+		if (message.a_data1 == MIDI_CC_SUSTAIN)
+		{
+			event = { SYNTH_EVENT::SUSTAIN, message.a_data2 >= 64 ? 1 : 0, time, 0.0 };
+			return true;
+		}
+		return false;
+	case 0xE0:
+	{
+		int bend = ((message.a_data2 << 7) | message.a_data1) - 8192;
+		event = { SYNTH_EVENT::PITCH_BEND, 0, time, bend / 8192.0 * MIDI_PITCH_BEND_RANGE };
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+// MIDI thread side, into an engine's MIDI queue. A full queue drops the message.
+inline bool postMidiMessage(EventQueue& queue, const MidiMessage& message, double time)
+{
+	SynthEvent event;
+	return midiToSynthEvent(message, time, event) && queue.post(event);
+}
+
+#if defined(_WIN32)
+
+#pragma comment(lib, "winmm.lib")
+
+#include <Windows.h>
+
+// WinMM input device. The driver stamps each message in milliseconds since midiInStart
+// and hands it to midiInProc on its own thread. Windows has no virtual ports of its own,
+// a loopback driver such as loopMIDI provides them.
+class MidiInput
+{
+private:
+	EventQueue& a_queue;
+	HMIDIIN a_handle;
+	std::wstring a_device_name;
+	const StreamClock* a_clock;
+	std::chrono::steady_clock::time_point a_start;
+
+public:
+	MidiInput(EventQueue& queue)
+		: a_queue(queue), a_handle(nullptr), a_clock(nullptr)
+	{
+	}
+
+	~MidiInput()
+	{
+		close();
+	}
+
+	std::wstring getName() const
+	{
+		return L"WinMM";
+	}
+
+	std::vector<std::wstring> enumerate()
+	{
+		std::vector<std::wstring> devices;
+		for (UINT id = 0; id < midiInGetNumDevs(); id++)
+		{
+			MIDIINCAPSW capabilities;
+			if (midiInGetDevCapsW(id, &capabilities, sizeof(capabilities)) == MMSYSERR_NOERROR)
+				devices.push_back(capabilities.szPname);
+		}
+		return devices;
+	}
+
+	// Opens the named device, or the first one without a name
+	bool open(const StreamClock& clock, const std::wstring& device)
+	{
+		std::vector<std::wstring> devices = enumerate();
+		auto found = device.empty() ? devices.begin() : std::find(devices.begin(), devices.end(), device);
+		if (found == devices.end())
+			return false;
+
+		a_clock = &clock;
+		UINT id = static_cast<UINT>(std::distance(devices.begin(), found));
+		if (midiInOpen(&a_handle, id, (DWORD_PTR)midiInProc, (DWORD_PTR)this, CALLBACK_FUNCTION) != MMSYSERR_NOERROR)
+		{
+			a_handle = nullptr;
+			return false;
+		}
+
+		a_device_name = *found;
+		a_start = std::chrono::steady_clock::now();
+		return midiInStart(a_handle) == MMSYSERR_NOERROR;
+	}
+
+	void close()
+	{
+		if (a_handle != nullptr)
+		{
+			midiInStop(a_handle);
+			midiInClose(a_handle);
+			a_handle = nullptr;
+		}
+	}
+
+	std::wstring getPortName() const
+	{
+		return a_handle != nullptr ? a_device_name : L"";
+	}
+
+private:
+	// Short messages only, SysEx is never asked for
+	static void CALLBACK midiInProc(HMIDIIN handle, UINT message, DWORD_PTR instance, DWORD_PTR param1, DWORD_PTR param2)
+	{
+		if (message != MIM_DATA)
+			return;
+
+		MidiInput* input = reinterpret_cast<MidiInput*>(instance);
+		MidiMessage midi = { static_cast<uint8_t>(param1 & 0xFF), static_cast<uint8_t>((param1 >> 8) & 0x7F), static_cast<uint8_t>((param1 >> 16) & 0x7F) };
+		auto arrival = input->a_start + std::chrono::milliseconds(param2);
+		postMidiMessage(input->a_queue, midi, input->a_clock->timeAt(arrival));
+	}
+};
+
+#elif defined(SYNTH_HAVE_ALSA)
+
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+// ALSA sequencer client with one virtual input port, so it can be played from a hardware
+// controller, a virtual keyboard or a sequencer without any hardware of its own. A thread
+// at real-time priority waits on the sequencer and stamps messages as they arrive.
+class MidiInput
+{
+private:
+	EventQueue& a_queue;
+	snd_seq_t* a_sequencer;
+	int a_port;
+	const StreamClock* a_clock;
+	std::thread a_input_thread;
+	std::atomic<bool> a_is_running;
+
+public:
+	MidiInput(EventQueue& queue)
+		: a_queue(queue), a_sequencer(nullptr), a_port(-1), a_clock(nullptr), a_is_running(false)
+	{
+	}
+
+	~MidiInput()
+	{
+		close();
+	}
+
+	std::wstring getName() const
+	{
+		return L"ALSA sequencer";
+	}
+
+	// Ports that can be connected to ours, as "client:port name"
+	std::vector<std::wstring> enumerate()
+	{
+		std::vector<std::wstring> ports;
+		snd_seq_t* sequencer = a_sequencer;
+		if (sequencer == nullptr && snd_seq_open(&sequencer, "default", SND_SEQ_OPEN_INPUT, 0) < 0)
+			return ports;
+
+		snd_seq_client_info_t* client_info = nullptr;
+		snd_seq_port_info_t* port_info = nullptr;
+		snd_seq_client_info_alloca(&client_info);
+		snd_seq_port_info_alloca(&port_info);
+
+		unsigned int readable = SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
+		snd_seq_client_info_set_client(client_info, -1);
+		while (snd_seq_query_next_client(sequencer, client_info) >= 0)
+		{
+			int client = snd_seq_client_info_get_client(client_info);
+			if (client == SND_SEQ_CLIENT_SYSTEM)
+				continue;
+
+			snd_seq_port_info_set_client(port_info, client);
+			snd_seq_port_info_set_port(port_info, -1);
+			while (snd_seq_query_next_port(sequencer, port_info) >= 0)
+			{
+				if ((snd_seq_port_info_get_capability(port_info) & readable) != readable)
+					continue;
+				std::string port = std::to_string(client) + ":" + std::to_string(snd_seq_port_info_get_port(port_info));
+				ports.push_back(widenDeviceName(port + " " + snd_seq_port_info_get_name(port_info)));
+			}
+		}
+
+		if (sequencer != a_sequencer)
+			snd_seq_close(sequencer);
+		return ports;
+	}
+
+	// Opens the virtual port and, given one, connects a source to it: "client:port" as
+	// enumerate() lists it, or a client name
+	bool open(const StreamClock& clock, const std::wstring& device)
+	{
+		a_clock = &clock;
+		if (snd_seq_open(&a_sequencer, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0)
+		{
+			a_sequencer = nullptr;
+			return false;
+		}
+
+		snd_seq_set_client_name(a_sequencer, "Audio-Synthesizer");
+		a_port = snd_seq_create_simple_port(a_sequencer, "MIDI In", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+		if (a_port < 0)
+		{
+			close();
+			return false;
+		}
+
+		std::string source = narrowDeviceName(device);
+		if (!source.empty() && std::isdigit(static_cast<unsigned char>(source[0])))
+			source = source.substr(0, source.find(' '));
+
+		snd_seq_addr_t address;
+		if (!source.empty() && (snd_seq_parse_address(a_sequencer, &address, source.c_str()) < 0 || snd_seq_connect_from(a_sequencer, a_port, address.client, address.port) < 0))
+		{
+			close();
+			return false;
+		}
+
+		a_is_running = true;
+		a_input_thread = std::thread(&MidiInput::inputThread, this);
+		return true;
+	}
+
+	void close()
+	{
+		a_is_running = false;
+		if (a_input_thread.joinable())
+			a_input_thread.join();
+
+		if (a_sequencer != nullptr)
+		{
+			snd_seq_close(a_sequencer);
+			a_sequencer = nullptr;
+		}
+		a_port = -1;
+	}
+
+	// Port other programs connect to, with its address such as "128:0"
+	std::wstring getPortName() const
+	{
+		if (a_sequencer == nullptr)
+			return L"";
+		return widenDeviceName("Audio-Synthesizer:MIDI In (" + std::to_string(snd_seq_client_id(a_sequencer)) + ":" + std::to_string(a_port) + ")");
+	}
+
+private:
+	void inputThread()
+	{
+		promoteToRealtimePriority();
+
+		std::vector<pollfd> descriptors(snd_seq_poll_descriptors_count(a_sequencer, POLLIN));
+		snd_seq_poll_descriptors(a_sequencer, descriptors.data(), static_cast<unsigned int>(descriptors.size()), POLLIN);
+
+		// Wake up now and then to notice close()
+		while (a_is_running)
+		{
+			if (poll(descriptors.data(), descriptors.size(), 100) <= 0)
+				continue;
+
+			auto arrival = std::chrono::steady_clock::now();
+			snd_seq_event_t* event = nullptr;
+			while (snd_seq_event_input(a_sequencer, &event) >= 0 && event != nullptr)
+			{
+				MidiMessage message;
+				if (decode(*event, message))
+					postMidiMessage(a_queue, message, a_clock->timeAt(arrival));
+			}
+		}
+	}
+
+	// The sequencer delivers decoded events, pack them back into channel messages
+	static bool decode(const snd_seq_event_t& event, MidiMessage& message)
+	{
+		switch (event.type)
+		{
+		case SND_SEQ_EVENT_NOTEON:
+		case SND_SEQ_EVENT_NOTEOFF:
+		{
+			uint8_t status = event.type == SND_SEQ_EVENT_NOTEON ? 0x90 : 0x80;
+			message = { static_cast<uint8_t>(status | (event.data.note.channel & 0x0F)), static_cast<uint8_t>(event.data.note.note & 0x7F), static_cast<uint8_t>(event.data.note.velocity & 0x7F) };
+			return true;
+		}
+		case SND_SEQ_EVENT_CONTROLLER:
+			message = { static_cast<uint8_t>(0xB0 | (event.data.control.channel & 0x0F)), static_cast<uint8_t>(event.data.control.param & 0x7F), static_cast<uint8_t>(event.data.control.value & 0x7F) };
+			return true;
+		case SND_SEQ_EVENT_PITCHBEND:
+		{
+			int value = event.data.control.value + 8192;
+			message = { static_cast<uint8_t>(0xE0 | (event.data.control.channel & 0x0F)), static_cast<uint8_t>(value & 0x7F), static_cast<uint8_t>((value >> 7) & 0x7F) };
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+};
+
+#else
+
+// Built without a MIDI API, only the computer keyboard plays
+class MidiInput
+{
+public:
+	MidiInput([[maybe_unused]] EventQueue& queue)
+	{
+	}
+
+	std::wstring getName() const
+	{
+		return L"None";
+	}
+
+	std::vector<std::wstring> enumerate()
+	{
+		return {};
+	}
+
+	bool open([[maybe_unused]] const StreamClock& clock, [[maybe_unused]] const std::wstring& device)
+	{
+		return false;
+	}
+
+	void close()
+	{
+	}
+
+	std::wstring getPortName() const
+	{
+		return L"";
+	}
+};
+
+#endif
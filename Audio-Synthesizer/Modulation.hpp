@@ -0,0 +1,322 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "Note.hpp"
+#include "Noise.hpp"
+#include "Envelope.hpp"
+#include "Wavetable.hpp"
+
+#define MOD_LFOS 2
+#define MOD_KEY_CENTRE 261.63	// Frequency where the key source is zero, middle C
+
+enum class MOD_SOURCE {
+	LFO_1,
+	LFO_2,
+	ENVELOPE,
+	VELOCITY,
+	KEY,
+	RANDOM,
+	MOD_WHEEL,		// 0 to 1, shared by every voice
+	WHEEL_LFO		// LFO 2 with its depth on the mod wheel, for vibrato and tremolo
+};
+
+// Pitch is in semitones, cutoff in octaves, amplitude a fraction of full gain,
+// pan -1 (left) to 1 (right) and effect a 0 to 1 offset on the effect's main parameter
+enum class MOD_DESTINATION {
+	PITCH,
+	CUTOFF,
+	AMPLITUDE,
+	PAN,
+	EFFECT
+};
+
+enum class LFO_SHAPE {
+	SINE,
+	TRIANGLE,
+	SQUARE,
+	SAW
+};
+
+// Free-running low frequency oscillator on a phase accumulator, shared by every voice
+class LFO
+{
+private:
+	uint32_t a_phase;
+	double a_rate;
+	LFO_SHAPE a_shape;
+
+public:
+	LFO(double rate = 5.0, LFO_SHAPE shape = LFO_SHAPE::SINE)
+		: a_phase(0), a_rate(rate), a_shape(shape)
+	{
+	}
+
+	void setRate(double rate)
+	{
+		a_rate = rate;
+	}
+
+	void setShape(LFO_SHAPE shape)
+	{
+		a_shape = shape;
+	}
+
+	// Value at the current phase, -1 to 1
+	float value() const
+	{
+		return valueAt(a_phase);
+	}
+
+	// Per-sample values for the next frames without moving the phase
+	void fill(float* out, uint32_t frames, double time_step) const
+	{
+		uint32_t phase = a_phase;
+		uint32_t increment = phaseIncrement(a_rate, time_step);
+		for (uint32_t i = 0; i < frames; i++, phase += increment)
+			out[i] = valueAt(phase);
+	}
+
+	void advance(uint32_t frames, double time_step)
+	{
+		a_phase += static_cast<uint32_t>(static_cast<uint64_t>(phaseIncrement(a_rate, time_step)) * frames);
+	}
+
+private:
+	float valueAt(uint32_t phase) const
+	{
+		float ramp = static_cast<float>(phase) * (1.0f / 4294967296.0f);
+		switch (a_shape)
+		{
+		case LFO_SHAPE::SINE:
+			return sine_table.lookup(phase);
+		case LFO_SHAPE::TRIANGLE:
+			return 1.0f - 4.0f * std::abs(ramp - 0.5f);
+		case LFO_SHAPE::SQUARE:
+			return ramp < 0.5f ? 1.0f : -1.0f;
+		case LFO_SHAPE::SAW:
+			return 2.0f * ramp - 1.0f;
+		default:
+			return 0.0f;
+		}
+	}
+};
+
+struct ModRoute
+{
+	MOD_SOURCE a_source;
+	MOD_DESTINATION a_destination;
+	double a_amount;
+	bool a_audio_rate;	// LFO to amplitude or pan only, every other route runs per block
+};
+
+// Block-rate modulation of one voice
+struct VoiceModulation
+{
+	double a_pitch = 0.0;
+	double a_cutoff = 0.0;
+	double a_amplitude = 1.0;
+	double a_pan = 0.0;
+};
+
+// Routes modulation sources to destinations for one instrument. Everything is evaluated
+// once per block: the LFOs and the modulation envelope are shared by all voices and the
+// per-voice sources are plain Note fields, so nothing here runs per sample unless a route
+// asks for audio rate. Those routes are summed once per block into shared signals that
+// the engine applies while mixing the voices.
+class ModMatrix
+{
+private:
+	std::vector<ModRoute> a_routes;
+	std::array<LFO, MOD_LFOS> a_lfos;
+	std::array<float, MOD_LFOS> a_lfo_values;
+	ADSREnvelope<double> a_envelope;
+	double a_mod_wheel;
+
+	std::vector<float> a_lfo_signal;
+	std::vector<float> a_audio_amplitude;
+	std::vector<float> a_audio_pan;
+	bool a_has_audio_amplitude;
+	bool a_has_audio_pan;
+
+public:
+	ModMatrix()
+		: a_mod_wheel(0.0), a_has_audio_amplitude(false), a_has_audio_pan(false)
+	{
+		a_lfo_values.fill(0.0f);
+	}
+
+	// Routes are set up from the control thread while the engine holds no voices of the instrument
+	void addRoute(MOD_SOURCE source, MOD_DESTINATION destination, double amount, bool audio_rate = false)
+	{
+		bool is_lfo = source == MOD_SOURCE::LFO_1 || source == MOD_SOURCE::LFO_2;
+		bool is_mixer = destination == MOD_DESTINATION::AMPLITUDE || destination == MOD_DESTINATION::PAN;
+		a_routes.push_back({ source, destination, amount, audio_rate && is_lfo && is_mixer });
+	}
+
+	void clearRoutes()
+	{
+		a_routes.clear();
+	}
+
+	const std::vector<ModRoute>& getRoutes() const
+	{
+		return a_routes;
+	}
+
+	LFO& getLFO(int index)
+	{
+		return a_lfos[index];
+	}
+
+	ADSREnvelope<double>& getEnvelope()
+	{
+		return a_envelope;
+	}
+
+	// Set by the engine from the MIDI mod wheel before each block
+	void setModWheel(double value)
+	{
+		a_mod_wheel = value;
+	}
+
+	// Size the audio-rate signals for blocks of up to frames, so beginBlock() doesn't allocate
+	void reserve(uint32_t frames)
+	{
+		if (a_lfo_signal.size() < frames)
+		{
+			a_lfo_signal.resize(frames);
+			a_audio_amplitude.resize(frames);
+			a_audio_pan.resize(frames);
+		}
+	}
+
+	// Advance the shared sources by one block and build the audio-rate signals
+	void beginBlock(uint32_t frames, double time_step)
+	{
+		for (int l = 0; l < MOD_LFOS; l++)
+			a_lfo_values[l] = a_lfos[l].value();
+
+		a_has_audio_amplitude = false;
+		a_has_audio_pan = false;
+		for (const ModRoute& route : a_routes)
+		{
+			if (!route.a_audio_rate)
+				continue;
+
+			reserve(frames);
+
+			bool is_amplitude = route.a_destination == MOD_DESTINATION::AMPLITUDE;
+			bool& has_signal = is_amplitude ? a_has_audio_amplitude : a_has_audio_pan;
+			float* signal = is_amplitude ? a_audio_amplitude.data() : a_audio_pan.data();
+			if (!has_signal)
+				std::fill_n(signal, frames, 0.0f);
+			has_signal = true;
+
+			a_lfos[static_cast<int>(route.a_source)].fill(a_lfo_signal.data(), frames, time_step);
+			float amount = static_cast<float>(route.a_amount);
+			for (uint32_t i = 0; i < frames; i++)
+				signal[i] += amount * a_lfo_signal[i];
+		}
+
+		for (LFO& lfo : a_lfos)
+			lfo.advance(frames, time_step);
+	}
+
+	// Per-sample amplitude offset of this block, nullptr when no route runs at audio rate
+	const float* audioAmplitude() const
+	{
+		return a_has_audio_amplitude ? a_audio_amplitude.data() : nullptr;
+	}
+
+	const float* audioPan() const
+	{
+		return a_has_audio_pan ? a_audio_pan.data() : nullptr;
+	}
+
+	VoiceModulation evaluate(Note& n, double time)
+	{
+		VoiceModulation modulation;
+		for (const ModRoute& route : a_routes)
+		{
+			if (route.a_audio_rate || route.a_destination == MOD_DESTINATION::EFFECT)
+				continue;
+
+			double value = route.a_amount * sourceValue(route.a_source, n, time);
+			switch (route.a_destination)
+			{
+			case MOD_DESTINATION::PITCH:
+				modulation.a_pitch += value;
+				break;
+			case MOD_DESTINATION::CUTOFF:
+				modulation.a_cutoff += value;
+				break;
+			case MOD_DESTINATION::AMPLITUDE:
+				modulation.a_amplitude += value;
+				break;
+			case MOD_DESTINATION::PAN:
+				modulation.a_pan += value;
+				break;
+			default:
+				break;
+			}
+		}
+
+		modulation.a_amplitude = std::max(modulation.a_amplitude, 0.0);
+		modulation.a_pan = std::clamp(modulation.a_pan, -1.0, 1.0);
+		return modulation;
+	}
+
+	// Effects are shared by all voices, so only the LFOs and the mod wheel can move them
+	double effectAmount() const
+	{
+		double amount = 0.0;
+		for (const ModRoute& route : a_routes)
+		{
+			if (route.a_destination != MOD_DESTINATION::EFFECT)
+				continue;
+			if (route.a_source == MOD_SOURCE::LFO_1 || route.a_source == MOD_SOURCE::LFO_2)
+				amount += route.a_amount * a_lfo_values[static_cast<int>(route.a_source)];
+			else if (route.a_source == MOD_SOURCE::MOD_WHEEL || route.a_source == MOD_SOURCE::WHEEL_LFO)
+				amount += route.a_amount * sharedValue(route.a_source);
+		}
+		return amount;
+	}
+
+private:
+	double sourceValue(MOD_SOURCE source, Note& n, double time)
+	{
+		switch (source)
+		{
+		case MOD_SOURCE::LFO_1:
+		case MOD_SOURCE::LFO_2:
+			return a_lfo_values[static_cast<int>(source)];
+		case MOD_SOURCE::ENVELOPE:
+			return a_envelope.amplitude(time, n.a_on, n.a_off);
+		case MOD_SOURCE::VELOCITY:
+			return n.a_velocity;
+		case MOD_SOURCE::KEY:
+			return n.a_base_freq > 0.0 ? std::log2(n.a_base_freq / MOD_KEY_CENTRE) : 0.0;
+		case MOD_SOURCE::RANDOM:
+		{
+			// Fixed for the life of the note, derived from its serial so nothing is stored
+			uint64_t hash = NoiseGenerator::voiceSeed(n.a_seed, static_cast<int>(n.a_serial));
+			return static_cast<double>(hash >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+		}
+		case MOD_SOURCE::MOD_WHEEL:
+		case MOD_SOURCE::WHEEL_LFO:
+			return sharedValue(source);
+		default:
+			return 0.0;
+		}
+	}
+
+	double sharedValue(MOD_SOURCE source) const
+	{
+		return source == MOD_SOURCE::WHEEL_LFO ? a_lfo_values[1] * a_mod_wheel : a_mod_wheel;
+	}
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Seed an engine's voices and a bus's dither start from unless given another. Rendering
+// the same notes with the same seed gives bit-identical output.
+#define DEFAULT_NOISE_SEED 0x5EED5EED5EED5EEDull
+
+enum class NOISE_TYPE {
+	WHITE,
+	PINK,
+	BROWN
+};
+
+// Seedable noise source made of four interleaved xorshift32 lanes. Scalar calls walk
+// the lanes round-robin and the block fills advance all four at once, so both paths
+// produce the same stream while the block loops vectorize.
+class NoiseGenerator
+{
+private:
+	std::array<uint32_t, 4> a_lanes;
+	uint32_t a_next_lane;
+
+	// Pink noise filter state (Paul Kellet's refined method) and brown noise integrator
+	std::array<double, 7> a_pink;
+	double a_brown;
+
+public:
+	NoiseGenerator(uint64_t seed = 1)
+	{
+		setSeed(seed);
+	}
+
+	void setSeed(uint64_t seed)
+	{
+		for (uint32_t& lane : a_lanes)
+		{
+			uint32_t value = static_cast<uint32_t>(splitMix(seed) >> 32);
+			lane = value != 0 ? value : 0x6D2B79F5u; // xorshift must never hold zero
+		}
+		a_next_lane = 0;
+		a_pink.fill(0.0);
+		a_brown = 0.0;
+	}
+
+	// Seed for one voice, so every note gets its own stream that does not depend on render order
+	static uint64_t voiceSeed(uint64_t seed, int note_id)
+	{
+		uint64_t state = seed ^ (static_cast<uint64_t>(static_cast<uint32_t>(note_id)) * 0xD1B54A32D192ED03ull);
+		return splitMix(state);
+	}
+
+	uint32_t nextUInt()
+	{
+		if (a_next_lane == 0)
+			stepLanes();
+
+		uint32_t value = a_lanes[a_next_lane];
+		a_next_lane = (a_next_lane + 1) & 3;
+		return value;
+	}
+
+	// Uniform in [-1, 1)
+	double white()
+	{
+		return static_cast<double>(static_cast<int32_t>(nextUInt())) * (1.0 / 2147483648.0);
+	}
+
+	double pink()
+	{
+		return pinkFilter(white());
+	}
+
+	double brown()
+	{
+		return brownFilter(white());
+	}
+
+	double next(NOISE_TYPE type)
+	{
+		switch (type)
+		{
+		case NOISE_TYPE::PINK:
+			return pink();
+		case NOISE_TYPE::BROWN:
+			return brown();
+		default:
+			return white();
+		}
+	}
+
+	void fillWhite(float* out, uint32_t frames)
+	{
+		uint32_t n = 0;
+
+		// Finish a partly used group of lanes so the stream lines up with the scalar path
+		for (; n < frames && a_next_lane != 0; n++)
+			out[n] = static_cast<float>(white());
+
+		const float to_unit = 1.0f / 2147483648.0f;
+		for (; n + 4 <= frames; n += 4)
+		{
+			stepLanes();
+			for (uint32_t l = 0; l < 4; l++)
+				out[n + l] = static_cast<float>(static_cast<int32_t>(a_lanes[l])) * to_unit;
+		}
+
+		for (; n < frames; n++)
+			out[n] = static_cast<float>(white());
+	}
+
+	void fill(NOISE_TYPE type, float* out, uint32_t frames)
+	{
+		fillWhite(out, frames);
+		if (type == NOISE_TYPE::PINK)
+		{
+			for (uint32_t n = 0; n < frames; n++)
+				out[n] = static_cast<float>(pinkFilter(out[n]));
+		}
+		else if (type == NOISE_TYPE::BROWN)
+		{
+			for (uint32_t n = 0; n < frames; n++)
+				out[n] = static_cast<float>(brownFilter(out[n]));
+		}
+	}
+
+private:
+	static uint64_t splitMix(uint64_t& state)
+	{
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	void stepLanes()
+	{
+		for (uint32_t& x : a_lanes)
+		{
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+		}
+	}
+
+	double pinkFilter(double white)
+	{
+		a_pink[0] = 0.99886 * a_pink[0] + white * 0.0555179;
+		a_pink[1] = 0.99332 * a_pink[1] + white * 0.0750759;
+		a_pink[2] = 0.96900 * a_pink[2] + white * 0.1538520;
+		a_pink[3] = 0.86650 * a_pink[3] + white * 0.3104856;
+		a_pink[4] = 0.55000 * a_pink[4] + white * 0.5329522;
+		a_pink[5] = -0.7616 * a_pink[5] - white * 0.0168980;
+		double pink = a_pink[0] + a_pink[1] + a_pink[2] + a_pink[3] + a_pink[4] + a_pink[5] + a_pink[6] + white * 0.5362;
+		a_pink[6] = white * 0.115926;
+		return pink * 0.11;
+	}
+
+	double brownFilter(double white)
+	{
+		a_brown = (a_brown + 0.02 * white) / 1.02;
+		return a_brown * 3.5;
+	}
+};
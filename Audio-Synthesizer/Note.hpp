@@ -1,15 +1,37 @@
 #pragma once
 
+#include <cstdint>
+#include "Noise.hpp"
 
 struct Note
 {
-	int a_id = 0;		// Position in scale
+	int a_id = 0;		// Position in scale, 0 is middle C
 	double a_on = 0.0;	// Time note was activated
 	double a_off = 0.0;	// Time note was deactivated
 	bool a_active = false;
 
-	Note(int id, double on, double off, bool active)
-		: a_id(id), a_on(on), a_off(off), a_active(active)
+	double a_level = 0.0;		// Peak output of the last rendered block
+	double a_silent_time = 0.0;	// How long the output has stayed below the silence threshold
+	bool a_sleeping = false;	// Held but silent, skipped by the render loop until retriggered
+	bool a_sustained = false;	// Key is up but the sustain pedal holds the note
+	bool a_stolen = false;		// Taken by the quality governor, fading out before it is dropped
+	float a_steal_gain = 1.0f;	// Gain of that fade, back to 1 if the note is retriggered
+
+	double a_base_freq = 0.0;	// Looked up from the tuning when the voice starts
+	double a_freq = 0.0;		// Base frequency with pitch modulation, updated every block
+	double a_cutoff_shift = 0.0;	// Filter cutoff modulation in octaves, updated every block
+	float a_mixed_amplitude = -1.0f;	// Amplitude and pan the last block was mixed with, negative before the first
+	float a_mixed_pan = 0.0f;
+	double a_velocity = 1.0;	// 0 to 1
+	uint64_t a_seed;			// The engine's noise seed, every random choice of the voice derives from it
+	NoiseGenerator a_noise;		// Per-voice noise source, seeded from a_seed and the note
+
+	uint64_t a_serial;			// Unique within the engine, so per-voice state can tell voices apart
+	int a_voice_slot = -1;		// Slot in the instrument's voice pool, if it uses one
+	double a_voice_on = 0.0;	// Start time the slot was claimed for
+
+	Note(int id, double on, double off, bool active, uint64_t serial, uint64_t seed = DEFAULT_NOISE_SEED)
+		: a_id(id), a_on(on), a_off(off), a_active(active), a_seed(seed), a_noise(NoiseGenerator::voiceSeed(seed, id)), a_serial(serial)
 	{
 	}
 };
\ No newline at end of file
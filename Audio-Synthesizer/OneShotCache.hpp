@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#define ONESHOT_CACHE_BYTES (4 * 1024 * 1024)	// Default budget, about 200 drum hits at 44.1 kHz
+
+// Pre-rendered one-shots of deterministic percussive voices, keyed by whatever decides the
+// sound (for noise drums, the voice's noise seed). The budget is carved into equal slots up
+// front, so a miss on the audio thread renders into the least recently used slot instead of
+// allocating. A slot is named by its index and the key it holds; a voice that keeps both can
+// check in constant time whether its one-shot is still there.
+class OneShotCache
+{
+private:
+	struct Slot
+	{
+		uint64_t a_key = 0;
+		uint64_t a_last_use = 0;	// 0 while the slot is empty
+		uint32_t a_frames = 0;
+	};
+
+	std::vector<float> a_samples;
+	std::vector<Slot> a_slots;
+	uint32_t a_slot_frames;
+	uint64_t a_clock;
+	uint64_t a_hits;
+	uint64_t a_misses;
+
+public:
+	OneShotCache()
+		: a_slot_frames(0), a_clock(0), a_hits(0), a_misses(0)
+	{
+	}
+
+	// Not for the audio thread. Forgets every one-shot. A budget too small for one slot
+	// turns the cache off.
+	void configure(size_t budget_bytes, uint32_t slot_frames)
+	{
+		a_slot_frames = std::max(slot_frames, 1u);
+		size_t slots = budget_bytes / (static_cast<size_t>(a_slot_frames) * sizeof(float));
+		a_slots.assign(slots, Slot());
+		a_samples.assign(slots * a_slot_frames, 0.0f);
+		a_clock = 0;
+	}
+
+	bool isEnabled() const
+	{
+		return !a_slots.empty();
+	}
+
+	uint32_t getSlotFrames() const
+	{
+		return a_slot_frames;
+	}
+
+	// Slot holding key, or -1. A hit makes the slot the most recently used.
+	int find(uint64_t key)
+	{
+		for (size_t s = 0; s < a_slots.size(); s++)
+		{
+			if (a_slots[s].a_last_use != 0 && a_slots[s].a_key == key)
+			{
+				a_slots[s].a_last_use = ++a_clock;
+				a_hits++;
+				return static_cast<int>(s);
+			}
+		}
+		return -1;
+	}
+
+	// Claim the least recently used slot for key, to be filled through data() with up to
+	// getSlotFrames() frames. Returns -1 when the cache is off.
+	int insert(uint64_t key, uint32_t frames)
+	{
+		if (a_slots.empty())
+			return -1;
+
+		size_t oldest = 0;
+		for (size_t s = 1; s < a_slots.size() && a_slots[oldest].a_last_use != 0; s++)
+		{
+			if (a_slots[s].a_last_use < a_slots[oldest].a_last_use)
+				oldest = s;
+		}
+
+		Slot& slot = a_slots[oldest];
+		slot.a_key = key;
+		slot.a_last_use = ++a_clock;
+		slot.a_frames = std::min(frames, a_slot_frames);
+		a_misses++;
+		return static_cast<int>(oldest);
+	}
+
+	// Whether slot still holds key, without touching the order
+	bool holds(int slot, uint64_t key) const
+	{
+		return slot >= 0 && static_cast<size_t>(slot) < a_slots.size() && a_slots[slot].a_last_use != 0 && a_slots[slot].a_key == key;
+	}
+
+	float* data(int slot)
+	{
+		return a_samples.data() + static_cast<size_t>(slot) * a_slot_frames;
+	}
+
+	uint32_t frames(int slot) const
+	{
+		return a_slots[slot].a_frames;
+	}
+
+	uint64_t getHits() const
+	{
+		return a_hits;
+	}
+
+	uint64_t getMisses() const
+	{
+		return a_misses;
+	}
+};
@@ -1,5 +1,7 @@
 #pragma once
+#include <cmath>
 #include <numbers>
+#include "Noise.hpp"
 
 enum class OSCILLATOR_TYPE {
 	SINE,
@@ -18,39 +20,44 @@ double convertHertzToAngularFrequency(double hertz)
 	return hertz * 2.0 * std::numbers::pi;
 }
 
-double generateWaveform(double time, double hertz, OSCILLATOR_TYPE osc_type,
-	double LFO_hertz = 0.0, double LFO_amp = 0.0, double custom = 50.0, double pulse_width = 0.5)
+// The phase grows with time, so it is built and wrapped to one turn in double and only the
+// waveform itself is evaluated in T. Noise is drawn from the caller's generator, a voice
+// passes its Note::a_noise; without one it is silent.
+template<typename T = double>
+T generateWaveform(double time, double hertz, OSCILLATOR_TYPE osc_type,
+	double LFO_hertz = 0.0, double LFO_amp = 0.0, double custom = 50.0, double pulse_width = 0.5, NoiseGenerator* noise = nullptr)
 {
 	double freq = convertHertzToAngularFrequency(hertz) * time + LFO_amp * hertz * (std::sin(convertHertzToAngularFrequency(LFO_hertz) * time));
+	T phase = static_cast<T>(std::remainder(freq, 2.0 * std::numbers::pi));
 
 	switch (osc_type)
 	{
 	case OSCILLATOR_TYPE::SINE: 
-		return std::sin(freq);
+		return std::sin(phase);
 	case OSCILLATOR_TYPE::SQUARE: 
-		return std::sin(freq) > 0 ? 1.0 : -1.0;
+		return phase > 0 ? T(1) : T(-1);
 	case OSCILLATOR_TYPE::TRIANGLE: 
-		return std::asin(std::sin(freq)) * (2.0 / std::numbers::pi);
+		return std::asin(std::sin(phase)) * std::numbers::inv_pi_v<T> * 2;
 	case OSCILLATOR_TYPE::SAW_ANALOGUE: 
 	{
-		double output = 0.0;
-		for (double n = 1.0; n < custom; n++)
-			output += (std::sin(n * freq)) / n;
-		return output * (2.0 / std::numbers::pi);
+		T output = 0;
+		for (int n = 1; n < custom; n++)
+			output += std::sin(n * phase) / n;
+		return output * std::numbers::inv_pi_v<T> * 2;
 	}
 	case OSCILLATOR_TYPE::SAW_DIGITAL:
-		return (2.0 / std::numbers::pi) * (hertz * std::numbers::pi * fmod(time, 1.0 / hertz) - (std::numbers::pi / 2.0));
+		return static_cast<T>((2.0 / std::numbers::pi) * (hertz * std::numbers::pi * fmod(time, 1.0 / hertz) - (std::numbers::pi / 2.0)));
 	case OSCILLATOR_TYPE::NOISE:
-		return 2.0 * (static_cast<double>(std::rand())) / static_cast<double>(RAND_MAX) - 1.0;
+		return noise != nullptr ? static_cast<T>(noise->white()) : T(0);
 	case OSCILLATOR_TYPE::PULSE: {
-		double phase = std::fmod(time * hertz, 1.0);
-		return (phase < pulse_width) ? 1.0 : -1.0;
+		double cycle = std::fmod(time * hertz, 1.0);
+		return (cycle < pulse_width) ? T(1) : T(-1);
 	}
 	case OSCILLATOR_TYPE::SAW_UP:
-		return 2.0 * (time * hertz - std::floor(0.5 + time * hertz));
+		return static_cast<T>(2.0 * (time * hertz - std::floor(0.5 + time * hertz)));
 	case OSCILLATOR_TYPE::SAW_DOWN:
-		return 2.0 * (std::floor(0.5 + time * hertz) - time * hertz);
+		return static_cast<T>(2.0 * (std::floor(0.5 + time * hertz) - time * hertz));
 	default:
-		return 0.0;
+		return 0;
 	}
 }
\ No newline at end of file
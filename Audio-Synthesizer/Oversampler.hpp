@@ -0,0 +1,161 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <algorithm>
+
+// Half-band FIR decimator by two. In a half-band filter every even offset from the
+// centre is zero and the centre tap is 0.5, so the polyphase form only evaluates
+// the odd-offset taps, once per output sample.
+template <typename T>
+class HalfBandDecimator
+{
+private:
+	std::vector<T> a_coefficients;	// Taps at offsets 1, 3, 5, ... from the centre
+	std::vector<T> a_history;		// Input history stored twice so a window never wraps
+	size_t a_length;
+	size_t a_centre;
+	size_t a_write_idx;
+
+public:
+	HalfBandDecimator(size_t side_taps = 8)
+	{
+		design(side_taps);
+	}
+
+	// Blackman-windowed half-band sinc with 4 * side_taps - 1 taps
+	void design(size_t side_taps)
+	{
+		side_taps = std::max<size_t>(side_taps, 1);
+		a_length = 4 * side_taps - 1;
+		a_centre = 2 * side_taps - 1;
+		a_coefficients.resize(side_taps);
+
+		double sum = 0.0;
+		for (size_t j = 0; j < side_taps; j++)
+		{
+			double offset = static_cast<double>(2 * j + 1);
+			double sinc = std::sin(std::numbers::pi * offset / 2.0) / (std::numbers::pi * offset);
+			double phase = std::numbers::pi * offset / static_cast<double>(a_centre + 1);
+			double window = 0.42 + 0.5 * std::cos(phase) + 0.08 * std::cos(2.0 * phase);
+			a_coefficients[j] = static_cast<T>(sinc * window);
+			sum += sinc * window;
+		}
+
+		// Normalise for unity gain at DC: the side taps on both sides have to add up to 0.5
+		for (T& c : a_coefficients)
+			c = static_cast<T>(c * (0.25 / sum));
+
+		a_history.assign(2 * a_length, 0);
+		a_write_idx = 0;
+	}
+
+	void reset()
+	{
+		std::fill(a_history.begin(), a_history.end(), static_cast<T>(0));
+		a_write_idx = 0;
+	}
+
+	// Delay in input samples
+	size_t getLatency() const
+	{
+		return a_centre;
+	}
+
+	// Reads 2 * frames samples from in and writes frames samples to out
+	void process(const T* in, T* out, uint32_t frames)
+	{
+		for (uint32_t n = 0; n < frames; n++)
+		{
+			push(in[2 * n]);
+			push(in[2 * n + 1]);
+
+			const T* window = a_history.data() + a_write_idx + 1;
+			T y = static_cast<T>(0.5) * window[a_centre];
+			for (size_t j = 0; j < a_coefficients.size(); j++)
+			{
+				size_t offset = 2 * j + 1;
+				y += a_coefficients[j] * (window[a_centre - offset] + window[a_centre + offset]);
+			}
+			out[n] = y;
+		}
+	}
+
+private:
+	void push(T x)
+	{
+		a_write_idx = (a_write_idx + 1) % a_length;
+		a_history[a_write_idx] = x;
+		a_history[a_write_idx + a_length] = x;
+	}
+};
+
+#define DECIMATOR_MIN_FRAMES 64		// Scratch a decimator starts with, before reserve()
+
+// Brings an oversampled signal back to the base rate with cascaded half-band stages.
+// The 4x path uses a short first stage because its transition band is wide.
+template <typename T>
+class Decimator
+{
+private:
+	uint32_t a_factor;
+	HalfBandDecimator<T> a_first_stage;
+	HalfBandDecimator<T> a_last_stage;
+	std::vector<T> a_scratch;
+
+public:
+	Decimator(uint32_t factor = 1)
+		: a_factor(1), a_first_stage(6), a_last_stage(8)
+	{
+		reserve(DECIMATOR_MIN_FRAMES);
+		setFactor(factor);
+	}
+
+	// Size the scratch for blocks of up to frames output frames, so process() doesn't allocate
+	void reserve(uint32_t frames)
+	{
+		if (a_scratch.size() < 2 * static_cast<size_t>(frames))
+			a_scratch.resize(2 * static_cast<size_t>(frames));
+	}
+
+	// Supported factors are 1, 2 and 4
+	void setFactor(uint32_t factor)
+	{
+		a_factor = factor >= 4 ? 4 : (factor >= 2 ? 2 : 1);
+		a_first_stage.reset();
+		a_last_stage.reset();
+	}
+
+	uint32_t getFactor() const
+	{
+		return a_factor;
+	}
+
+	// Reads frames * factor samples from in and writes frames samples to out
+	void process(const T* in, T* out, uint32_t frames)
+	{
+		switch (a_factor)
+		{
+		case 4:
+		{
+			// Blocks longer than reserve() allowed for go through the scratch in pieces
+			uint32_t piece = static_cast<uint32_t>(a_scratch.size() / 2);
+			for (uint32_t done = 0; done < frames; done += piece)
+			{
+				uint32_t count = std::min(piece, frames - done);
+				a_first_stage.process(in + 4 * static_cast<size_t>(done), a_scratch.data(), 2 * count);
+				a_last_stage.process(a_scratch.data(), out + done, count);
+			}
+			break;
+		}
+		case 2:
+			a_last_stage.process(in, out, frames);
+			break;
+		default:
+			std::copy_n(in, frames, out);
+			break;
+		}
+	}
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "Instrument.hpp"
+#include "VoicePool.hpp"
+
+#define PLUCKED_STRING_VOICES 64
+#define PLUCKED_STRING_MAX_DELAY 4096		// Longest string in samples at the default rate, about 11 Hz
+
+// One vibrating string: a delay line holding a period of the wave, closed by a loss filter
+struct StringVoice
+{
+	FractionalDelayLine<Sample> a_line{ PLUCKED_STRING_MAX_DELAY };
+	Sample a_prev_y = 0;			// Previous delay output for the two-point loss filter
+	double a_freq = 0.0;
+	double a_gain = 0.0;
+};
+
+// Karplus-Strong plucked string. A burst of filtered noise circulates through a delay line
+// tuned to the note's period and loses a little of its highs on every pass, which is all a
+// plucked string does. Each sample costs one allpass and one averaging filter.
+class PluckedString : public BaseInstrument<Sample>
+{
+private:
+	VoicePool<StringVoice, PLUCKED_STRING_VOICES> a_voices;
+	std::vector<Sample> a_excitation;
+
+	double a_sustain_time;		// Seconds for a held string to fall 60 dB
+	double a_release_time;		// Same once the key is let go and the string is damped
+	double a_brightness;		// 0..1, how much high end the pluck has
+	double a_pluck_position;	// Fraction of the string length where it is plucked
+
+public:
+	PluckedString()
+		: a_sustain_time(4.0), a_release_time(0.15), a_brightness(0.7), a_pluck_position(0.13)
+	{
+		a_volume = 0.8;
+		a_excitation.resize(PLUCKED_STRING_MAX_DELAY);
+
+		// Spread the strings across the stereo field, low ones to the left
+		a_modulation.addRoute(MOD_SOURCE::KEY, MOD_DESTINATION::PAN, 0.25);
+		a_modulation.addRoute(MOD_SOURCE::RANDOM, MOD_DESTINATION::PAN, 0.2);
+	}
+
+	// Lines are sized so the lowest string fits at any rate
+	virtual void setSampleRate(double sample_rate) override
+	{
+		BaseInstrument<Sample>::setSampleRate(sample_rate);
+		size_t max_delay = static_cast<size_t>(std::ceil(PLUCKED_STRING_MAX_DELAY * sample_rate / DEFAULT_SAMPLE_RATE));
+		for (size_t i = 0; i < a_voices.size(); i++)
+			a_voices[i].a_line.resize(max_delay);
+		a_excitation.resize(max_delay);
+	}
+
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished) override
+	{
+		float sample = 0.0f;
+		render(time, getTimeStep(), n, &sample, 1, is_note_finished);
+		return sample;
+	}
+
+	virtual void render(const double time, const double time_step, Note& n, float* out, uint32_t frames, bool& is_note_finished) override
+	{
+		bool is_new = false;
+		StringVoice* voice = a_voices.acquire(n, is_new);
+		if (voice == nullptr)
+		{
+			std::fill_n(out, frames, 0.0f);
+			is_note_finished = true;
+			return;
+		}
+		if (is_new)
+			pluck(*voice, n, time_step);
+
+		// Pitch changes retune the line without restarting the string
+		if (n.a_freq != voice->a_freq)
+			tune(*voice, n.a_freq, time_step);
+
+		bool released = n.a_off > n.a_on && time >= n.a_off;
+		Sample loss = static_cast<Sample>(0.5 * loopGain(n.a_freq, released ? a_release_time : a_sustain_time));
+		Sample gain = static_cast<Sample>(voice->a_gain);
+
+		FractionalDelayLine<Sample>& line = voice->a_line;
+		Sample prev_y = voice->a_prev_y;
+		Sample peak = 0;
+		for (uint32_t i = 0; i < frames; i++)
+		{
+			Sample y = line.read();
+			line.write(loss * (y + prev_y));
+			prev_y = y;
+			out[i] = static_cast<float>(gain * y);
+			peak = std::max(peak, std::abs(y));
+		}
+		voice->a_prev_y = prev_y;
+
+		if (released && peak * gain < static_cast<Sample>(1e-4))
+			is_note_finished = true;
+	}
+
+	virtual bool tracksPitchModulation() const override
+	{
+		return true;
+	}
+
+	virtual void releaseVoice(const Note& n) override
+	{
+		a_voices.release(n);
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"Plucked String";
+	}
+
+private:
+	// Amplitude kept per trip around the loop so the string rings for t60 seconds
+	static double loopGain(double freq, double t60)
+	{
+		return std::pow(10.0, -3.0 / (std::max(freq, 1.0) * t60));
+	}
+
+	void tune(StringVoice& voice, double freq, double time_step)
+	{
+		// The averaging filter adds half a sample to the loop, the line makes up the rest
+		double period = 1.0 / (std::max(freq, 1.0) * time_step);
+		voice.a_line.setDelay(period - 0.5);
+		voice.a_freq = freq;
+	}
+
+	void pluck(StringVoice& voice, Note& n, double time_step)
+	{
+		voice.a_line.clear();
+		voice.a_prev_y = 0;
+		voice.a_gain = a_volume * n.a_velocity;
+		tune(voice, n.a_freq, time_step);
+
+		size_t length = std::min<size_t>(static_cast<size_t>(1.0 / (std::max(n.a_freq, 1.0) * time_step)), a_excitation.size());
+		length = std::max<size_t>(length, 2);
+
+		// Softer notes are plucked with less high end, cutoff modulation scales the pluck's brightness
+		double brightness = a_brightness * std::exp2(std::clamp(n.a_cutoff_shift, -8.0, 2.0));
+		Sample smoothing = static_cast<Sample>(0.1 + 0.9 * std::min(brightness * n.a_velocity, 1.0));
+		Sample lowpassed = 0;
+		Sample mean = 0;
+		for (size_t i = 0; i < length; i++)
+		{
+			lowpassed += smoothing * (static_cast<Sample>(n.a_noise.white()) - lowpassed);
+			a_excitation[i] = lowpassed;
+			mean += lowpassed;
+		}
+		mean /= static_cast<Sample>(length);
+
+		// Plucking away from the bridge cancels the harmonics with a node at that point
+		size_t offset = std::max<size_t>(1, static_cast<size_t>(a_pluck_position * length));
+		for (size_t i = 0; i < length; i++)
+		{
+			Sample x = a_excitation[i] - mean;
+			Sample mirrored = i >= offset ? a_excitation[i - offset] - mean : 0;
+			voice.a_line.write(static_cast<Sample>(0.5) * (x - mirrored));
+		}
+	}
+};
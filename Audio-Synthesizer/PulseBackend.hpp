@@ -0,0 +1,109 @@
+#pragma once
+
+#ifdef SYNTH_HAVE_PULSE
+
+#include <type_traits>
+#include <pulse/simple.h>
+#include <pulse/error.h>
+
+#include "AudioBackend.hpp"
+
+// PulseAudio playback stream through the simple API. The server buffer is asked for the
+// full queue and the audio thread keeps only the target depth in it, measured from the
+// stream latency.
+template <typename T>
+class PulseBackend : public BlockingBackend<T>
+{
+private:
+	pa_simple* a_stream;
+	size_t a_block_bytes;
+
+public:
+	PulseBackend()
+		: a_stream(nullptr), a_block_bytes(0)
+	{
+	}
+
+	~PulseBackend()
+	{
+		this->close();
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"PulseAudio";
+	}
+
+	// The simple API has no device list, the server's default sink is used unless one is named
+	virtual std::vector<std::wstring> enumerate() override
+	{
+		return { L"default" };
+	}
+
+protected:
+	virtual bool openDevice(const std::wstring& device) override
+	{
+		a_block_bytes = static_cast<size_t>(this->a_block_frames) * this->a_channels * sizeof(T);
+
+		pa_sample_spec spec;
+		spec.format = sampleFormat();
+		spec.rate = this->a_sample_rate;
+		spec.channels = static_cast<uint8_t>(this->a_channels);
+
+		pa_buffer_attr attributes;
+		attributes.maxlength = static_cast<uint32_t>(a_block_bytes * this->a_block_count);
+		attributes.tlength = static_cast<uint32_t>(a_block_bytes * this->a_block_count);
+		attributes.prebuf = static_cast<uint32_t>(a_block_bytes);
+		attributes.minreq = static_cast<uint32_t>(a_block_bytes);
+		attributes.fragsize = static_cast<uint32_t>(-1);
+
+		std::string name = narrowDeviceName(device);
+		int error = 0;
+		a_stream = pa_simple_new(nullptr, "Audio-Synthesizer", PA_STREAM_PLAYBACK, name.empty() || name == "default" ? nullptr : name.c_str(), "Synthesizer", &spec, nullptr, &attributes, &error);
+		return a_stream != nullptr;
+	}
+
+	virtual void closeDevice() override
+	{
+		if (a_stream != nullptr)
+		{
+			pa_simple_free(a_stream);
+			a_stream = nullptr;
+		}
+	}
+
+	virtual uint32_t queuedBlocks() const override
+	{
+		int error = 0;
+		pa_usec_t latency = pa_simple_get_latency(a_stream, &error);
+		if (latency == static_cast<pa_usec_t>(-1))
+			return 0;
+		return static_cast<uint32_t>(latency * this->a_sample_rate / 1000000 / this->a_block_frames);
+	}
+
+	virtual bool waitForSpace(uint32_t target_blocks) override
+	{
+		while (this->isRunning() && queuedBlocks() >= target_blocks)
+			std::this_thread::sleep_for(std::chrono::microseconds(1000000 * this->a_block_frames / (2 * this->a_sample_rate)));
+		return this->isRunning();
+	}
+
+	virtual bool write(const T* samples) override
+	{
+		int error = 0;
+		return pa_simple_write(a_stream, samples, a_block_bytes, &error) >= 0;
+	}
+
+private:
+	static pa_sample_format_t sampleFormat()
+	{
+		if constexpr (std::is_same_v<T, float>)
+			return PA_SAMPLE_FLOAT32NE;
+		else if constexpr (std::is_same_v<T, int32_t>)
+			return PA_SAMPLE_S32NE;
+		else
+			return PA_SAMPLE_S16NE;
+	}
+};
+
+#endif
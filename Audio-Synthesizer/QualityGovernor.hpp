@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "RingBuffer.hpp"
+
+#define GOVERNOR_HIGH_LOAD 0.7			// Render time over block time that steps the quality down
+#define GOVERNOR_LOW_LOAD 0.35			// Load the render has to stay under before it steps back up
+#define GOVERNOR_LOAD_TIME 0.05			// Seconds the load is averaged over
+#define GOVERNOR_DOWN_HOLD 0.1			// Seconds after a change before the next step down, so its effect shows
+#define GOVERNOR_UP_HOLD 2.0			// Seconds of headroom before a step up
+#define GOVERNOR_MIN_VOICES 8			// Voices the governor never steals below
+#define GOVERNOR_LOG_SIZE 64			// Changes kept until the control thread reads them
+
+// Steps of the quality governor, from full quality down. Each one keeps the cuts of the
+// steps above it.
+enum class QUALITY_STAGE {
+	FULL,
+	FEWER_HARMONICS,	// Half the partials of additive and band-limited oscillators
+	FEWEST_HARMONICS,	// A quarter of them
+	NO_OVERSAMPLING,	// Oversampled instruments render at the output rate
+	VOICE_LIMIT,		// The quietest voices over a shrinking limit are stolen
+};
+
+inline const wchar_t* qualityStageName(QUALITY_STAGE stage)
+{
+	switch (stage) {
+	case QUALITY_STAGE::FULL: return L"full";
+	case QUALITY_STAGE::FEWER_HARMONICS: return L"fewer harmonics";
+	case QUALITY_STAGE::FEWEST_HARMONICS: return L"fewest harmonics";
+	case QUALITY_STAGE::NO_OVERSAMPLING: return L"no oversampling";
+	case QUALITY_STAGE::VOICE_LIMIT: return L"voice limit";
+	default: return L"";
+	}
+}
+
+// One step of the governor, as the control thread reads it back
+struct QualityChange
+{
+	double a_time = 0.0;		// Stream time of the block that caused it
+	QUALITY_STAGE a_stage = QUALITY_STAGE::FULL;
+	size_t a_voice_limit = 0;
+	size_t a_voices = 0;		// Voices playing when it was made
+	double a_load = 0.0;		// Averaged load that triggered it
+};
+
+// Trades sound quality for render time when the audio thread falls behind. The audio thread
+// reports how long each block took to render against how long it plays for; when the average
+// load gets close to the deadline the governor steps the quality down one stage at a time,
+// and steps it back up once the load has stayed low for a while. The thresholds and hold
+// times are far apart, so it doesn't flap between two stages. Every change is queued for
+// the control thread to log.
+class QualityGovernor
+{
+private:
+	bool a_is_enabled;
+	size_t a_max_voices;
+	QUALITY_STAGE a_stage;
+	size_t a_voice_limit;
+	double a_load;
+	double a_since_change;
+	double a_headroom_time;
+	double a_simulated_load;
+
+	std::atomic<double> a_shown_load;
+	SpscRingBuffer<QualityChange> a_log;
+	std::atomic<uint64_t> a_lost_changes;
+
+public:
+	QualityGovernor(size_t max_voices)
+		: a_is_enabled(false), a_max_voices(max_voices), a_stage(QUALITY_STAGE::FULL), a_voice_limit(max_voices), a_load(0.0),
+		a_since_change(0.0), a_headroom_time(0.0), a_simulated_load(0.0), a_shown_load(0.0), a_log(GOVERNOR_LOG_SIZE), a_lost_changes(0)
+	{
+	}
+
+	// Only while the engine is idle. Offline renders leave it off, they have no deadline.
+	void setEnabled(bool is_enabled)
+	{
+		a_is_enabled = is_enabled;
+		a_stage = QUALITY_STAGE::FULL;
+		a_voice_limit = a_max_voices;
+		a_load = 0.0;
+		a_since_change = 0.0;
+		a_headroom_time = 0.0;
+	}
+
+	bool isEnabled() const
+	{
+		return a_is_enabled;
+	}
+
+	// Added to every measured load, to try the stages out on a machine that keeps up easily
+	void setSimulatedLoad(double load)
+	{
+		a_simulated_load = load;
+	}
+
+	// Audio thread, once per block. Returns true when the stage or the voice limit changed.
+	bool update(double render_seconds, double block_seconds, double time, size_t voices)
+	{
+		if (!a_is_enabled || block_seconds <= 0.0)
+			return false;
+
+		double load = render_seconds / block_seconds + a_simulated_load;
+		a_load += (load - a_load) * (1.0 - std::exp(-block_seconds / GOVERNOR_LOAD_TIME));
+		a_shown_load.store(a_load, std::memory_order_relaxed);
+		a_since_change += block_seconds;
+		a_headroom_time = a_load < GOVERNOR_LOW_LOAD ? a_headroom_time + block_seconds : 0.0;
+
+		if (a_load > GOVERNOR_HIGH_LOAD && a_since_change >= GOVERNOR_DOWN_HOLD)
+			return stepDown(time, voices);
+		if (a_headroom_time >= GOVERNOR_UP_HOLD)
+			return stepUp(time, voices);
+		return false;
+	}
+
+	QUALITY_STAGE getStage() const
+	{
+		return a_stage;
+	}
+
+	// Voices allowed to play, the maximum until the last stage
+	size_t getVoiceLimit() const
+	{
+		return a_voice_limit;
+	}
+
+	// Fraction of their partials additive and band-limited oscillators compute
+	double getDetail() const
+	{
+		return a_stage >= QUALITY_STAGE::FEWEST_HARMONICS ? 0.25 : (a_stage >= QUALITY_STAGE::FEWER_HARMONICS ? 0.5 : 1.0);
+	}
+
+	bool allowsOversampling() const
+	{
+		return a_stage < QUALITY_STAGE::NO_OVERSAMPLING;
+	}
+
+	// Any thread. The averaged load of the last blocks, 1 is a render as long as the block.
+	double getLoad() const
+	{
+		return a_shown_load.load(std::memory_order_relaxed);
+	}
+
+	// Control thread. Takes up to count of the changes made since the last call, oldest first.
+	size_t readChanges(QualityChange* changes, size_t count)
+	{
+		return a_log.read(changes, count);
+	}
+
+	// Changes that didn't fit the log because the control thread fell behind
+	uint64_t getLostChanges() const
+	{
+		return a_lost_changes;
+	}
+
+private:
+	// Until the voice limit every step gives up one stage. After that each step steals a
+	// quarter of the voices still playing.
+	bool stepDown(double time, size_t voices)
+	{
+		if (a_stage < QUALITY_STAGE::VOICE_LIMIT) {
+			a_stage = static_cast<QUALITY_STAGE>(static_cast<int>(a_stage) + 1);
+			if (a_stage == QUALITY_STAGE::VOICE_LIMIT)
+				a_voice_limit = std::max<size_t>(voices * 3 / 4, GOVERNOR_MIN_VOICES);
+		}
+		else {
+			size_t limit = std::max<size_t>(std::min(a_voice_limit, voices) * 3 / 4, GOVERNOR_MIN_VOICES);
+			if (limit >= a_voice_limit)
+				return false;
+			a_voice_limit = limit;
+		}
+		return changed(time, voices);
+	}
+
+	// The voice limit is raised by half at a time before the stages come back
+	bool stepUp(double time, size_t voices)
+	{
+		if (a_stage == QUALITY_STAGE::FULL)
+			return false;
+
+		if (a_stage == QUALITY_STAGE::VOICE_LIMIT && a_voice_limit * 3 / 2 < a_max_voices)
+			a_voice_limit = a_voice_limit * 3 / 2;
+		else {
+			a_stage = static_cast<QUALITY_STAGE>(static_cast<int>(a_stage) - 1);
+			a_voice_limit = a_max_voices;
+		}
+		return changed(time, voices);
+	}
+
+	bool changed(double time, size_t voices)
+	{
+		a_since_change = 0.0;
+		a_headroom_time = 0.0;
+
+		QualityChange change;
+		change.a_time = time;
+		change.a_stage = a_stage;
+		change.a_voice_limit = a_voice_limit;
+		change.a_voices = voices;
+		change.a_load = a_load;
+		if (a_log.write(&change, 1) == 0)
+			a_lost_changes.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+};
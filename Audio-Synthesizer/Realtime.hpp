@@ -0,0 +1,108 @@
+#pragma once
+
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Real-time support for the audio thread: scheduling priority, and with
+// SYNTH_REALTIME_CHECKS defined a trap on every heap allocation made while the
+// thread is rendering. The engine must not allocate, lock or do I/O there.
+
+#define REALTIME_PRIORITY 70	// SCHED_FIFO priority, below JACK's default of 80 for its own threads
+
+// Give the calling thread real-time priority. Returns false when the system refused,
+// usually because the user may not use SCHED_FIFO (see /etc/security/limits.conf).
+inline bool promoteToRealtimePriority()
+{
+#ifdef _WIN32
+	return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#else
+	sched_param parameters = {};
+	parameters.sched_priority = std::min(REALTIME_PRIORITY, sched_get_priority_max(SCHED_FIFO));
+	return pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters) == 0;
+#endif
+}
+
+// Marks the calling thread as rendering for as long as it lives
+class RealtimeScope
+{
+private:
+	bool a_was_realtime;
+
+public:
+	RealtimeScope()
+		: a_was_realtime(isRealtime())
+	{
+		isRealtime() = true;
+	}
+
+	~RealtimeScope()
+	{
+		isRealtime() = a_was_realtime;
+	}
+
+	static bool& isRealtime()
+	{
+		static thread_local bool is_realtime = false;
+		return is_realtime;
+	}
+};
+
+#ifdef SYNTH_REALTIME_CHECKS
+
+// Replaces the global allocation functions of the program, so only include this with
+// the checks on from one translation unit
+inline void trapRealtimeAllocation()
+{
+	if (!RealtimeScope::isRealtime())
+		return;
+
+	RealtimeScope::isRealtime() = false;
+	std::fputs("Heap allocation on the audio thread\n", stderr);
+	std::abort();
+}
+
+void* operator new(std::size_t size)
+{
+	trapRealtimeAllocation();
+	if (void* memory = std::malloc(size == 0 ? 1 : size))
+		return memory;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+	if (memory != nullptr)
+		trapRealtimeAllocation();
+	std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	operator delete(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+	operator delete(memory);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept
+{
+	operator delete(memory);
+}
+
+#endif
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "AudioBus.hpp"
+#include "RingBuffer.hpp"
+#include "WavFile.hpp"
+
+#define RECORDER_BUFFER_SECONDS 4.0		// Audio the ring holds while the disk catches up
+#define RECORDER_WRITE_FRAMES 32768		// Frames the writer moves to disk at once
+#define RECORDER_MAX_FILE_BYTES (0xFFFFFFFFull - 36)	// Largest data chunk a RIFF header can describe
+
+// Records the master output to 32-bit float WAV files. The audio thread only copies each
+// finished block into a preallocated ring; a writer thread drains it to disk in large writes
+// and fixes the header up when the recording stops. A take longer than one WAV file can hold,
+// about three hours of 44.1 kHz stereo, carries on in numbered files next to the first.
+// When the disk falls so far behind that a block doesn't fit in the ring, the whole block is
+// dropped and counted, the audio thread never waits. Frames past the block size given to
+// start(), and everything after a failed disk write, are counted as dropped too.
+class Recorder
+{
+private:
+	SpscRingBuffer<float> a_ring;
+	std::vector<float> a_interleaved;	// One block, interleaved on the audio thread
+	std::vector<float> a_chunk;			// One write, on the writer thread
+	uint32_t a_channels;
+
+	std::atomic<bool> a_is_recording;
+	std::atomic<bool> a_in_record;		// The audio thread is between its check and its write
+	std::atomic<bool> a_writer_running;
+	std::thread a_writer;
+
+	WavWriter a_file;
+	std::string a_path;
+	uint32_t a_sample_rate;
+	uint32_t a_file_count;
+	std::atomic<uint64_t> a_recorded_frames;
+	std::atomic<uint64_t> a_dropped_frames;
+	std::atomic<bool> a_write_failed;
+
+public:
+	Recorder()
+		: a_channels(0), a_is_recording(false), a_in_record(false), a_writer_running(false), a_sample_rate(0), a_file_count(0),
+		a_recorded_frames(0), a_dropped_frames(0), a_write_failed(false)
+	{
+	}
+
+	~Recorder()
+	{
+		stop();
+	}
+
+	// Not for the audio thread. Blocks of up to max_frames are recorded without allocating.
+	bool start(const std::string& path, uint32_t channels, uint32_t sample_rate, uint32_t max_frames)
+	{
+		stop();
+		a_channels = std::max(channels, 1u);
+		a_sample_rate = sample_rate;
+		a_path = path;
+		a_file_count = 1;
+		if (!a_file.open(path, static_cast<uint16_t>(a_channels), sample_rate, 0))
+			return false;
+
+		a_ring.resize(static_cast<size_t>(RECORDER_BUFFER_SECONDS * sample_rate) * a_channels);
+		a_interleaved.assign(static_cast<size_t>(max_frames) * a_channels, 0.0f);
+		a_chunk.assign(static_cast<size_t>(RECORDER_WRITE_FRAMES) * a_channels, 0.0f);
+		a_recorded_frames = 0;
+		a_dropped_frames = 0;
+		a_write_failed = false;
+
+		a_writer_running = true;
+		a_writer = std::thread(&Recorder::writerThread, this);
+		a_is_recording = true;
+		return true;
+	}
+
+	// Not for the audio thread. Everything recorded so far reaches the disk before it returns.
+	void stop()
+	{
+		if (!a_writer_running)
+			return;
+
+		// Once the audio thread is seen outside record() it has seen the flag down as well
+		a_is_recording = false;
+		while (a_in_record)
+			std::this_thread::yield();
+
+		a_writer_running = false;
+		a_writer.join();
+		a_file.finish();
+	}
+
+	// Audio thread. Copies the bus as it will be heard, or drops it whole if it doesn't fit.
+	void record(const AudioBus& bus)
+	{
+		a_in_record = true;
+		if (!a_is_recording)
+		{
+			a_in_record = false;
+			return;
+		}
+
+		uint32_t frames = std::min<uint32_t>(bus.getFrames(), static_cast<uint32_t>(a_interleaved.size() / a_channels));
+		uint32_t channels = std::min(bus.getChannels(), a_channels);
+		if (a_ring.availableWrite() < static_cast<size_t>(frames) * a_channels)
+		{
+			a_dropped_frames.fetch_add(bus.getFrames(), std::memory_order_relaxed);
+			a_in_record = false;
+			return;
+		}
+		if (frames < bus.getFrames())
+			a_dropped_frames.fetch_add(bus.getFrames() - frames, std::memory_order_relaxed);
+
+		for (uint32_t c = 0; c < a_channels; c++)
+		{
+			const float* source = bus.channel(std::min(c, channels - 1));
+			for (uint32_t n = 0; n < frames; n++)
+				a_interleaved[static_cast<size_t>(n) * a_channels + c] = source[n];
+		}
+		a_ring.write(a_interleaved.data(), static_cast<size_t>(frames) * a_channels);
+		a_in_record = false;
+	}
+
+	bool isRecording() const
+	{
+		return a_is_recording;
+	}
+
+	// Frames written to the disk so far
+	uint64_t getRecordedFrames() const
+	{
+		return a_recorded_frames;
+	}
+
+	// Frames lost because the ring was full, the block was too long or a write failed, zero
+	// as long as the disk keeps up
+	uint64_t getDroppedFrames() const
+	{
+		return a_dropped_frames;
+	}
+
+	// A write to the disk failed; the rest of the take is drained and discarded
+	bool hasWriteFailed() const
+	{
+		return a_write_failed;
+	}
+
+	uint32_t getFileCount() const
+	{
+		return a_file_count;
+	}
+
+private:
+	// Drains the ring in large writes, and everything left once the recording stops
+	void writerThread()
+	{
+		uint64_t max_file_frames = RECORDER_MAX_FILE_BYTES / (static_cast<uint64_t>(a_channels) * sizeof(float));
+		while (true)
+		{
+			bool is_running = a_writer_running;
+			size_t available = a_ring.availableRead() / a_channels;
+			if (available < RECORDER_WRITE_FRAMES && is_running)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				continue;
+			}
+			if (available == 0)
+				break;
+
+			// A write never crosses into the next file
+			uint64_t frames = std::min<size_t>(available, RECORDER_WRITE_FRAMES);
+			if (!a_write_failed)
+				frames = std::min(frames, max_file_frames - a_file.getFramesWritten());
+			a_ring.read(a_chunk.data(), frames * a_channels);
+			if (!a_write_failed && a_file.write(a_chunk.data(), frames))
+				a_recorded_frames.fetch_add(frames, std::memory_order_relaxed);
+			else
+			{
+				a_write_failed = true;
+				a_dropped_frames.fetch_add(frames, std::memory_order_relaxed);
+			}
+
+			if (a_file.getFramesWritten() == max_file_frames && !a_write_failed)
+			{
+				a_file.finish();
+				if (!a_file.open(numberedPath(++a_file_count), static_cast<uint16_t>(a_channels), a_sample_rate, 0))
+					a_write_failed = true;
+			}
+		}
+	}
+
+	// take.wav, take-2.wav, take-3.wav...
+	std::string numberedPath(uint32_t number) const
+	{
+		size_t dot = a_path.find_last_of('.');
+		size_t slash = a_path.find_last_of("/\\");
+		if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+			dot = a_path.size();
+		return a_path.substr(0, dot) + "-" + std::to_string(number) + a_path.substr(dot);
+	}
+};
@@ -0,0 +1,520 @@
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+#include "Synth.hpp"
+#include "MidiFile.hpp"
+#include "WavFile.hpp"
+
+// Offline render jobs: a note script or MIDI file through an engine of its own into a
+// WAV file. Jobs share nothing, so any number of them render at once on their own threads.
+
+#define JOB_BLOCK_FRAMES 512
+#define JOB_CHANNELS 2
+#define JOB_DEFAULT_TAIL 2.0	// Seconds rendered after the last event, for releases and effect tails
+
+// One line of a job list:
+//
+//   <script.txt | song.mid> <output.wav> [instrument=<n>] [effect=<n>] [tail=<seconds>] [rate=<Hz>] [render-rate=<Hz>]
+//        [seed=<n>] [library.sfz] [scale.scl] [mapping.kbm]
+//
+// rate is the rate of the WAV file, render-rate a lower one to render at and resample from.
+// seed picks the noise, decimal or 0x hex; a job renders the same with the same seed
+// whatever else runs beside it.
+// A note script has an event per line, its time in seconds first:
+//
+//   0.0 on 0 0.8        note 0 (middle C) at velocity 0.8
+//   0.5 off 0
+//   1.0 instrument 6    also effect <n>, bend <semitones>, wheel <0 to 1>, sustain <0 or 1>
+//   1.0 midi 0x90 60 100
+struct RenderJob
+{
+	std::string a_input;
+	std::string a_output;
+	std::vector<std::string> a_resources;	// Sample libraries and tuning files for this job's engine
+	int a_instrument = 0;
+	int a_effect = 0;
+	double a_tail = JOB_DEFAULT_TAIL;
+	double a_sample_rate = DEFAULT_SAMPLE_RATE;
+	double a_render_rate = 0.0;				// 0 renders at a_sample_rate
+	uint64_t a_seed = DEFAULT_NOISE_SEED;
+	std::vector<SynthEvent> a_events;		// In time order
+	uint64_t a_frames = 0;
+};
+
+struct RenderResult
+{
+	bool a_is_ok = false;
+	std::string a_error;
+	double a_render_seconds = 0.0;
+	size_t a_peak_memory = 0;
+};
+
+// Heap use of the job running on a thread. Counted only when the program defines
+// SYNTH_JOB_MEMORY_LIMITS, see below.
+class JobMemory
+{
+private:
+	std::atomic<int64_t> a_in_use;
+	std::atomic<int64_t> a_peak;
+	int64_t a_base;
+	int64_t a_limit;
+
+public:
+	JobMemory()
+		: a_in_use(0), a_peak(0), a_base(0), a_limit(0)
+	{
+	}
+
+	// The job the calling thread's allocations are charged to, or nullptr
+	static JobMemory*& current()
+	{
+		static thread_local JobMemory* memory = nullptr;
+		return memory;
+	}
+
+	// Start a job allowed limit bytes on top of what is already in use, 0 for no limit
+	void begin(size_t limit)
+	{
+		a_base = a_in_use.load();
+		a_peak = a_base;
+		a_limit = static_cast<int64_t>(limit);
+	}
+
+	bool reserve(size_t size)
+	{
+		int64_t in_use = a_in_use.fetch_add(static_cast<int64_t>(size)) + static_cast<int64_t>(size);
+		if (a_limit > 0 && in_use - a_base > a_limit)
+		{
+			a_in_use.fetch_sub(static_cast<int64_t>(size));
+			return false;
+		}
+
+		int64_t peak = a_peak.load();
+		while (in_use > peak && !a_peak.compare_exchange_weak(peak, in_use))
+			;
+		return true;
+	}
+
+	void release(size_t size)
+	{
+		a_in_use.fetch_sub(static_cast<int64_t>(size));
+	}
+
+	size_t getPeak() const
+	{
+		return static_cast<size_t>(std::max<int64_t>(a_peak.load() - a_base, 0));
+	}
+};
+
+// Events of a note script. Returns false with the line in error when one can't be read.
+inline bool readNoteScript(const std::string& path, std::vector<SynthEvent>& events, std::string& error)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		error = "could not open " + path;
+		return false;
+	}
+
+	std::string line;
+	int line_number = 0;
+	while (std::getline(file, line))
+	{
+		line_number++;
+		line = line.substr(0, line.find('#'));
+		std::istringstream fields(line);
+		double time;
+		std::string command;
+		if (!(fields >> time))
+			continue;
+
+		bool is_read = false;
+		fields >> command;
+		if (command == "on" || command == "off")
+		{
+			int id;
+			double velocity = 1.0;
+			is_read = static_cast<bool>(fields >> id);
+			if (command == "on")
+				fields >> velocity;
+			if (is_read)
+				events.push_back({ command == "on" ? SYNTH_EVENT::NOTE_ON : SYNTH_EVENT::NOTE_OFF, id, time, std::clamp(velocity, 0.0, 1.0) });
+		}
+		else if (command == "instrument" || command == "effect" || command == "sustain")
+		{
+			int value;
+			is_read = static_cast<bool>(fields >> value);
+			SYNTH_EVENT type = command == "instrument" ? SYNTH_EVENT::INSTRUMENT : command == "effect" ? SYNTH_EVENT::SOUND_EFFECT : SYNTH_EVENT::SUSTAIN;
+			if (is_read)
+				events.push_back({ type, value, time, 0.0 });
+		}
+		else if (command == "bend" || command == "wheel")
+		{
+			double amount;
+			is_read = static_cast<bool>(fields >> amount);
+			if (is_read)
+				events.push_back({ command == "bend" ? SYNTH_EVENT::PITCH_BEND : SYNTH_EVENT::MOD_WHEEL, 0, time, amount });
+		}
+		else if (command == "midi")
+		{
+			std::string status, data1, data2 = "0";
+			is_read = static_cast<bool>(fields >> status >> data1);
+			fields >> data2;
+
+			SynthEvent event;
+			if (is_read)
+			{
+				MidiMessage message = { static_cast<uint8_t>(std::stoi(status, nullptr, 0)), static_cast<uint8_t>(std::stoi(data1, nullptr, 0) & 0x7F), static_cast<uint8_t>(std::stoi(data2, nullptr, 0) & 0x7F) };
+				if (midiToSynthEvent(message, time, event))
+					events.push_back(event);
+			}
+		}
+
+		if (!is_read)
+		{
+			error = path + ":" + std::to_string(line_number) + ": cannot read \"" + line + "\"";
+			return false;
+		}
+	}
+
+	std::stable_sort(events.begin(), events.end(), [](const SynthEvent& a, const SynthEvent& b) { return a.a_time < b.a_time; });
+	return true;
+}
+
+// Parse one line of a job list and read its script. Lines that are empty or comments
+// leave the job empty and return true.
+inline bool parseRenderJob(const std::string& line, RenderJob& job, std::string& error)
+{
+	std::istringstream fields(line.substr(0, line.find('#')));
+	if (!(fields >> job.a_input))
+		return true;
+	if (!(fields >> job.a_output))
+	{
+		error = job.a_input + ": no output file";
+		return false;
+	}
+
+	std::string option;
+	while (fields >> option)
+	{
+		try
+		{
+			if (option.starts_with("instrument="))
+				job.a_instrument = std::clamp(std::stoi(option.substr(11)), 0, NUM_INSTRUMENTS - 1);
+			else if (option.starts_with("effect="))
+				job.a_effect = std::clamp(std::stoi(option.substr(7)), 0, NUM_SOUND_EFFECTS - 1);
+			else if (option.starts_with("tail="))
+				job.a_tail = std::max(std::stod(option.substr(5)), 0.0);
+			else if (option.starts_with("rate="))
+				job.a_sample_rate = std::max(std::stod(option.substr(5)), 8000.0);
+			else if (option.starts_with("render-rate="))
+				job.a_render_rate = std::max(std::stod(option.substr(12)), 0.0);
+			else if (option.starts_with("seed="))
+				job.a_seed = std::stoull(option.substr(5), nullptr, 0);
+			else if (option.ends_with(".sfz") || option.ends_with(".scl") || option.ends_with(".kbm"))
+				job.a_resources.push_back(option);
+			else
+				throw std::invalid_argument(option);
+		}
+		catch (const std::exception&)
+		{
+			error = job.a_input + ": unknown option " + option;
+			return false;
+		}
+	}
+
+	if (job.a_input.ends_with(".mid") || job.a_input.ends_with(".midi"))
+	{
+		std::vector<TimedMidiMessage> messages;
+		if (!MidiFileReader().read(job.a_input, messages))
+		{
+			error = job.a_input + ": not a readable MIDI file";
+			return false;
+		}
+
+		SynthEvent event;
+		for (const TimedMidiMessage& m : messages)
+		{
+			if (midiToSynthEvent(m.a_message, m.a_time, event))
+				job.a_events.push_back(event);
+		}
+	}
+	else
+	{
+		try
+		{
+			if (!readNoteScript(job.a_input, job.a_events, error))
+				return false;
+		}
+		catch (const std::exception&)
+		{
+			error = job.a_input + ": bad MIDI bytes in the script";
+			return false;
+		}
+	}
+
+	if (job.a_render_rate > job.a_sample_rate)
+	{
+		error = job.a_input + ": render-rate is above rate";
+		return false;
+	}
+
+	double end = job.a_events.empty() ? 0.0 : std::max(job.a_events.back().a_time, 0.0);
+	job.a_frames = static_cast<uint64_t>(std::ceil((end + job.a_tail) * job.a_sample_rate));
+	return true;
+}
+
+// Render a job on the calling thread, streaming blocks to its output file
+inline RenderResult renderJob(const RenderJob& job)
+{
+	RenderResult result;
+	auto start = std::chrono::steady_clock::now();
+	try
+	{
+		Engine engine(job.a_sample_rate, job.a_render_rate);
+		for (const std::string& resource : job.a_resources)
+		{
+			bool is_loaded = false;
+			if (resource.ends_with(".sfz"))
+			{
+				for (auto& instrument : engine.a_instruments)
+				{
+					if (auto sampler = dynamic_cast<Sampler*>(instrument.get()))
+						is_loaded = sampler->load(resource);
+				}
+			}
+			else
+				is_loaded = resource.ends_with(".scl") ? engine.a_tuning.loadScala(resource) : engine.a_tuning.loadKeyboardMapping(resource);
+
+			if (!is_loaded)
+			{
+				result.a_error = "could not load " + resource;
+				return result;
+			}
+		}
+		engine.a_instrument_index = job.a_instrument;
+		engine.a_sound_effect_index = job.a_effect;
+		engine.setNoiseSeed(job.a_seed);
+
+		WavWriter writer;
+		if (!writer.open(job.a_output, JOB_CHANNELS, static_cast<uint32_t>(std::lround(job.a_sample_rate)), job.a_frames))
+		{
+			result.a_error = "could not write " + job.a_output;
+			return result;
+		}
+
+		AudioBus bus(JOB_CHANNELS, JOB_BLOCK_FRAMES);
+		bus.setDitherSeed(job.a_seed);
+		std::vector<float> block(JOB_BLOCK_FRAMES * JOB_CHANNELS);
+		double time_step = 1.0 / job.a_sample_rate;
+		uint64_t sample_clock = 0;
+		size_t next_event = 0;
+		while (sample_clock < job.a_frames)
+		{
+			uint32_t frames = static_cast<uint32_t>(std::min<uint64_t>(JOB_BLOCK_FRAMES, job.a_frames - sample_clock));
+
+			// Events land on their own frame. A block with more than the queue holds leaves the rest for the next one.
+			while (next_event < job.a_events.size() && std::llround(job.a_events[next_event].a_time * job.a_sample_rate) < static_cast<long long>(sample_clock + frames))
+			{
+				if (!engine.postEvent(job.a_events[next_event]))
+					break;
+				next_event++;
+			}
+
+			bus.setFrames(frames);
+			bus.clear();
+			engine.generateSound(bus, static_cast<double>(sample_clock) * time_step, time_step);
+			bus.convertToPCM<float>(block.data());
+			if (!writer.write(block.data(), frames))
+			{
+				result.a_error = "could not write " + job.a_output;
+				return result;
+			}
+			sample_clock += frames;
+		}
+
+		result.a_is_ok = writer.close();
+		if (!result.a_is_ok)
+			result.a_error = "could not write " + job.a_output;
+	}
+	catch (const std::bad_alloc&)
+	{
+		result.a_error = "over its memory limit";
+	}
+
+	result.a_render_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (JobMemory* memory = JobMemory::current())
+		result.a_peak_memory = memory->getPeak();
+	return result;
+}
+
+#ifdef SYNTH_JOB_MEMORY_LIMITS
+
+#ifdef SYNTH_REALTIME_CHECKS
+#error SYNTH_JOB_MEMORY_LIMITS and SYNTH_REALTIME_CHECKS both replace the allocation functions
+#endif
+
+// Replaces the global allocation functions of the program, so only include this with
+// the limits on from one translation unit. Every block carries the job it was charged
+// to, so it is given back to that job whichever thread frees it. The header sits right
+// before the block, which over-aligned blocks are shifted up to, and remembers where
+// the allocation really starts.
+struct alignas(std::max_align_t) JobBlockHeader
+{
+	JobMemory* a_memory;
+	std::size_t a_size;
+	void* a_allocation;
+};
+
+// nullptr when the job is over its limit or the heap is out of memory
+inline void* allocateJobBlock(std::size_t size, std::size_t alignment)
+{
+	JobMemory* memory = JobMemory::current();
+	if (memory != nullptr && !memory->reserve(size))
+		return nullptr;
+
+	std::size_t padding = alignment > alignof(JobBlockHeader) ? alignment : 0;
+	void* allocation = std::malloc(sizeof(JobBlockHeader) + padding + size);
+	if (allocation == nullptr)
+	{
+		if (memory != nullptr)
+			memory->release(size);
+		return nullptr;
+	}
+
+	std::uintptr_t first = reinterpret_cast<std::uintptr_t>(allocation) + sizeof(JobBlockHeader);
+	std::uintptr_t block = padding > 0 ? (first + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1) : first;
+	JobBlockHeader* header = reinterpret_cast<JobBlockHeader*>(block) - 1;
+	*header = { memory, size, allocation };
+	return reinterpret_cast<void*>(block);
+}
+
+inline void freeJobBlock(void* block) noexcept
+{
+	if (block == nullptr)
+		return;
+
+	JobBlockHeader* header = static_cast<JobBlockHeader*>(block) - 1;
+	if (header->a_memory != nullptr)
+		header->a_memory->release(header->a_size);
+	std::free(header->a_allocation);
+}
+
+void* operator new(std::size_t size)
+{
+	if (void* block = allocateJobBlock(size, 0))
+		return block;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	if (void* block = allocateJobBlock(size, static_cast<std::size_t>(alignment)))
+		return block;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	return allocateJobBlock(size, 0);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return allocateJobBlock(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return allocateJobBlock(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return allocateJobBlock(size, static_cast<std::size_t>(alignment));
+}
+
+// Every form frees the same way, the header knows the rest
+void operator delete(void* block) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete[](void* block) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete(void* block, std::size_t) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete[](void* block, std::size_t) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete(void* block, std::align_val_t) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete[](void* block, std::align_val_t) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete(void* block, std::size_t, std::align_val_t) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete[](void* block, std::size_t, std::align_val_t) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete(void* block, const std::nothrow_t&) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete[](void* block, const std::nothrow_t&) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete(void* block, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	freeJobBlock(block);
+}
+
+void operator delete[](void* block, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	freeJobBlock(block);
+}
+
+#endif
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <algorithm>
+
+#define RESAMPLER_TAPS 32			// Input frames under the kernel, half on either side of the output point
+#define RESAMPLER_PHASE_BITS 8		// 256 kernel positions tabulated per input frame
+#define RESAMPLER_PHASES (1 << RESAMPLER_PHASE_BITS)
+#define RESAMPLER_KAISER_BETA 8.6	// About 85 dB of stopband rejection
+#define RESAMPLER_PASSBAND 0.9		// Cutoff as a fraction of the lower of the two Nyquist frequencies
+
+// Stereo polyphase windowed-sinc sample rate converter, for rendering at a lower rate than
+// the device runs at. The Kaiser-windowed kernel is tabulated at RESAMPLER_PHASES fractional
+// positions and interpolated linearly in between, and the read position is 32.32 fixed point,
+// so any ratio works and the position never drifts. Each call produces exactly the output
+// frames asked for; inputFramesFor() says how many input frames that takes.
+class Resampler
+{
+private:
+	std::vector<float> a_kernel;		// RESAMPLER_PHASES + 1 rows of RESAMPLER_TAPS
+	std::vector<float> a_history_left;
+	std::vector<float> a_history_right;
+	std::array<float, RESAMPLER_TAPS> a_coefficients;
+	size_t a_buffered;					// Input frames held in the history
+	uint64_t a_position;				// Start of the next output's kernel in the history, 32.32
+	uint64_t a_step;					// Input frames per output frame, 32.32
+	double a_ratio;
+
+public:
+	Resampler()
+		: a_coefficients(), a_buffered(0), a_position(0), a_step(uint64_t(1) << 32), a_ratio(1.0)
+	{
+	}
+
+	// Not for the audio thread. The history is sized so blocks of up to max_output_frames
+	// don't allocate.
+	void setRates(double input_rate, double output_rate, uint32_t max_output_frames)
+	{
+		a_ratio = input_rate / output_rate;
+		a_step = static_cast<uint64_t>(std::llround(a_ratio * 4294967296.0));
+
+		// Going down in rate, the cutoff follows the output's Nyquist frequency
+		double cutoff = RESAMPLER_PASSBAND * std::min(1.0, 1.0 / a_ratio);
+		double half_width = RESAMPLER_TAPS / 2;
+		a_kernel.resize((RESAMPLER_PHASES + 1) * RESAMPLER_TAPS);
+		for (int p = 0; p <= RESAMPLER_PHASES; p++)
+		{
+			float* row = a_kernel.data() + p * RESAMPLER_TAPS;
+			double sum = 0.0;
+			for (int k = 0; k < RESAMPLER_TAPS; k++)
+			{
+				// Distance from the output point in input frames, it sits just after tap RESAMPLER_TAPS / 2 - 1
+				double x = k - (half_width - 1.0) - static_cast<double>(p) / RESAMPLER_PHASES;
+				double window = kaiser(x / half_width);
+				double sinc = x == 0.0 ? 1.0 : std::sin(std::numbers::pi * cutoff * x) / (std::numbers::pi * cutoff * x);
+				row[k] = static_cast<float>(cutoff * sinc * window);
+				sum += row[k];
+			}
+
+			// Unity gain at DC for every phase, or the fraction would show up as ripple
+			for (int k = 0; k < RESAMPLER_TAPS; k++)
+				row[k] = static_cast<float>(row[k] / sum);
+		}
+
+		a_history_left.assign(getMaxInputFrames(max_output_frames) + RESAMPLER_TAPS, 0.0f);
+		a_history_right.assign(a_history_left.size(), 0.0f);
+		reset();
+	}
+
+	// Not for the audio thread. Drops the history, the next input starts on the next output.
+	void reset()
+	{
+		// Half a kernel of silence ahead of the first input puts it right on the first output point
+		std::fill(a_history_left.begin(), a_history_left.end(), 0.0f);
+		std::fill(a_history_right.begin(), a_history_right.end(), 0.0f);
+		a_buffered = RESAMPLER_TAPS / 2 - 1;
+		a_position = 0;
+	}
+
+	// Input frames the next process() call needs to produce output_frames
+	uint32_t inputFramesFor(uint32_t output_frames) const
+	{
+		if (output_frames == 0)
+			return 0;
+		size_t needed = static_cast<size_t>((a_position + (output_frames - 1) * a_step) >> 32) + RESAMPLER_TAPS;
+		return needed > a_buffered ? static_cast<uint32_t>(needed - a_buffered) : 0;
+	}
+
+	// Most input frames any call for output_frames can ask for
+	uint32_t getMaxInputFrames(uint32_t output_frames) const
+	{
+		return static_cast<uint32_t>(std::ceil(output_frames * a_ratio)) + RESAMPLER_TAPS;
+	}
+
+	// input_frames has to be what inputFramesFor(output_frames) returned
+	void process(const float* in_left, const float* in_right, uint32_t input_frames, float* out_left, float* out_right, uint32_t output_frames)
+	{
+		// Only blocks beyond what setRates() was told about allocate here
+		if (a_buffered + input_frames > a_history_left.size())
+		{
+			a_history_left.resize(a_buffered + input_frames);
+			a_history_right.resize(a_buffered + input_frames);
+		}
+		std::copy_n(in_left, input_frames, a_history_left.begin() + a_buffered);
+		std::copy_n(in_right, input_frames, a_history_right.begin() + a_buffered);
+		a_buffered += input_frames;
+
+		for (uint32_t i = 0; i < output_frames; i++)
+		{
+			// The top bits of the fraction pick the tabulated phases, the rest blends them
+			uint32_t fraction = static_cast<uint32_t>(a_position);
+			uint32_t phase = fraction >> (32 - RESAMPLER_PHASE_BITS);
+			float blend = static_cast<float>(fraction & ((1u << (32 - RESAMPLER_PHASE_BITS)) - 1)) * (1.0f / (1u << (32 - RESAMPLER_PHASE_BITS)));
+			const float* row = a_kernel.data() + phase * RESAMPLER_TAPS;
+			for (int k = 0; k < RESAMPLER_TAPS; k++)
+				a_coefficients[k] = row[k] + blend * (row[k + RESAMPLER_TAPS] - row[k]);
+
+			size_t start = static_cast<size_t>(a_position >> 32);
+			const float* left = a_history_left.data() + start;
+			const float* right = a_history_right.data() + start;
+			float sum_left = 0.0f;
+			float sum_right = 0.0f;
+			for (int k = 0; k < RESAMPLER_TAPS; k++)
+			{
+				sum_left += a_coefficients[k] * left[k];
+				sum_right += a_coefficients[k] * right[k];
+			}
+			out_left[i] = sum_left;
+			out_right[i] = sum_right;
+			a_position += a_step;
+		}
+
+		// Move what later outputs still reach to the front
+		size_t consumed = std::min(static_cast<size_t>(a_position >> 32), a_buffered);
+		std::copy(a_history_left.begin() + consumed, a_history_left.begin() + a_buffered, a_history_left.begin());
+		std::copy(a_history_right.begin() + consumed, a_history_right.begin() + a_buffered, a_history_right.begin());
+		a_buffered -= consumed;
+		a_position -= static_cast<uint64_t>(consumed) << 32;
+	}
+
+private:
+	// Kaiser window at t in -1..1
+	static double kaiser(double t)
+	{
+		double x = 1.0 - t * t;
+		return x <= 0.0 ? 0.0 : besselI0(RESAMPLER_KAISER_BETA * std::sqrt(x)) / besselI0(RESAMPLER_KAISER_BETA);
+	}
+
+	// Zeroth order modified Bessel function of the first kind, by its power series
+	static double besselI0(double x)
+	{
+		double sum = 1.0;
+		double term = 1.0;
+		for (int k = 1; k < 32; k++)
+		{
+			term *= (x / (2.0 * k)) * (x / (2.0 * k));
+			sum += term;
+			if (term < sum * 1e-12)
+				break;
+		}
+		return sum;
+	}
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+// Lock-free single-producer single-consumer ring buffer. One thread writes, one
+// thread reads, neither ever blocks or allocates after construction.
+template <typename T>
+class SpscRingBuffer
+{
+private:
+	std::vector<T> a_buffer;
+	size_t a_mask;
+	alignas(64) std::atomic<size_t> a_write_idx;
+	alignas(64) std::atomic<size_t> a_read_idx;
+
+public:
+	// Capacity is rounded up to a power of two
+	SpscRingBuffer(size_t capacity = 0)
+		: a_mask(0), a_write_idx(0), a_read_idx(0)
+	{
+		resize(capacity);
+	}
+
+	// Not thread safe, only call while neither side is running
+	void resize(size_t capacity)
+	{
+		size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		a_buffer.assign(capacity == 0 ? 0 : size, T());
+		a_mask = capacity == 0 ? 0 : size - 1;
+		reset();
+	}
+
+	// Not thread safe, only call while the other side is known to be idle
+	void reset()
+	{
+		a_write_idx.store(0, std::memory_order_relaxed);
+		a_read_idx.store(0, std::memory_order_release);
+	}
+
+	size_t capacity() const
+	{
+		return a_buffer.size();
+	}
+
+	size_t availableRead() const
+	{
+		return a_write_idx.load(std::memory_order_acquire) - a_read_idx.load(std::memory_order_relaxed);
+	}
+
+	size_t availableWrite() const
+	{
+		return a_buffer.size() - (a_write_idx.load(std::memory_order_relaxed) - a_read_idx.load(std::memory_order_acquire));
+	}
+
+	// Writes as many items as fit, returns how many were written
+	size_t write(const T* items, size_t count)
+	{
+		size_t write_idx = a_write_idx.load(std::memory_order_relaxed);
+		size_t free = a_buffer.size() - (write_idx - a_read_idx.load(std::memory_order_acquire));
+		count = std::min(count, free);
+
+		for (size_t i = 0; i < count; i++)
+			a_buffer[(write_idx + i) & a_mask] = items[i];
+
+		a_write_idx.store(write_idx + count, std::memory_order_release);
+		return count;
+	}
+
+	// Reads up to count items, returns how many were read
+	size_t read(T* items, size_t count)
+	{
+		size_t read_idx = a_read_idx.load(std::memory_order_relaxed);
+		size_t used = a_write_idx.load(std::memory_order_acquire) - read_idx;
+		count = std::min(count, used);
+
+		for (size_t i = 0; i < count; i++)
+			items[i] = a_buffer[(read_idx + i) & a_mask];
+
+		a_read_idx.store(read_idx + count, std::memory_order_release);
+		return count;
+	}
+};
@@ -0,0 +1,534 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <chrono>
+#include <cctype>
+#include <algorithm>
+
+#include "Instrument.hpp"
+#include "MappedFile.hpp"
+#include "WavFile.hpp"
+#include "RingBuffer.hpp"
+#include "VoicePool.hpp"
+
+#define SAMPLER_VOICES 64
+#define SAMPLER_PRELOAD_FRAMES 8192		// Attack of every zone that stays resident
+#define SAMPLER_RING_FRAMES 32768		// Per-voice stream buffer
+#define SAMPLER_STREAM_CHUNK 4096		// Frames the reader moves per visit to a voice
+#define SAMPLER_STAGE_FRAMES 256		// Frames the render thread takes from the ring at once
+
+// One WAV file mapped onto a key and velocity range
+struct SampleZone
+{
+	std::string a_path;
+	int a_low_key = 0;
+	int a_high_key = 127;
+	int a_root_key = 60;
+	int a_low_velocity = 0;
+	int a_high_velocity = 127;
+	double a_root_frequency = 261.63;
+
+	MappedFile a_file;
+	WavFormat a_format;
+
+	// Filled in the background by the reader thread, so loading a library stays fast
+	std::vector<float> a_preload;
+	std::atomic<bool> a_preload_ready = false;
+};
+
+// Key and velocity mapped set of samples, loaded from a small subset of SFZ:
+// <control> default_path, and sample, key, lokey, hikey, pitch_keycenter, lovel
+// and hivel in <global>, <group> and <region>. Paths must not contain spaces.
+class SampleLibrary
+{
+private:
+	std::vector<std::unique_ptr<SampleZone>> a_zones;
+	std::string a_name;
+
+public:
+	bool addZone(const std::string& path, int low_key, int high_key, int root_key, int low_velocity = 0, int high_velocity = 127)
+	{
+		auto zone = std::make_unique<SampleZone>();
+		if (!zone->a_file.open(path) || !parseWavHeader(zone->a_file.data(), zone->a_file.size(), zone->a_format))
+			return false;
+
+		zone->a_path = path;
+		zone->a_low_key = low_key;
+		zone->a_high_key = high_key;
+		zone->a_root_key = root_key;
+		zone->a_low_velocity = low_velocity;
+		zone->a_high_velocity = high_velocity;
+		zone->a_root_frequency = 440.0 * std::pow(2.0, (root_key - 69) / 12.0);
+		zone->a_preload.resize(static_cast<size_t>(std::min<uint64_t>(SAMPLER_PRELOAD_FRAMES, zone->a_format.a_frames)));
+		a_zones.push_back(std::move(zone));
+		return true;
+	}
+
+	bool loadSfz(const std::string& path)
+	{
+		std::ifstream file(path);
+		if (!file)
+			return false;
+
+		a_name = path.substr(path.find_last_of("/\\") + 1);
+		std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+
+		// Strip comments and split into headers and opcodes
+		std::vector<std::string> tokens;
+		std::string line;
+		while (std::getline(file, line))
+		{
+			std::istringstream words(line.substr(0, line.find("//")));
+			std::string token;
+			while (words >> token)
+				tokens.push_back(token);
+		}
+		tokens.push_back("<end>");
+
+		std::string default_path;
+		std::vector<std::pair<std::string, std::string>> global, group, region;
+		std::string header;
+		size_t loaded = 0;
+
+		for (const std::string& token : tokens)
+		{
+			if (token.front() == '<')
+			{
+				if (header == "region" && addRegion(directory + default_path, global, group, region))
+					loaded++;
+
+				header = token.substr(1, token.size() - 2);
+				if (header == "global")
+					global.clear();
+				if (header == "group" || header == "global")
+					group.clear();
+				region.clear();
+				continue;
+			}
+
+			size_t equals = token.find('=');
+			if (equals == std::string::npos)
+				continue;
+
+			std::string opcode = token.substr(0, equals);
+			std::string value = token.substr(equals + 1);
+			if (header == "control" && opcode == "default_path")
+				default_path = value;
+			else if (header == "global")
+				global.emplace_back(opcode, value);
+			else if (header == "group")
+				group.emplace_back(opcode, value);
+			else if (header == "region")
+				region.emplace_back(opcode, value);
+		}
+
+		return loaded > 0;
+	}
+
+	const SampleZone* find(int key, int velocity) const
+	{
+		for (const auto& zone : a_zones)
+		{
+			if (key >= zone->a_low_key && key <= zone->a_high_key && velocity >= zone->a_low_velocity && velocity <= zone->a_high_velocity)
+				return zone.get();
+		}
+		return nullptr;
+	}
+
+	size_t getZoneCount() const
+	{
+		return a_zones.size();
+	}
+
+	SampleZone& zone(size_t i)
+	{
+		return *a_zones[i];
+	}
+
+	const SampleZone& zone(size_t i) const
+	{
+		return *a_zones[i];
+	}
+
+	const std::string& getName() const
+	{
+		return a_name;
+	}
+
+private:
+	// Key numbers or note names, with C4 = 60
+	static int parseKey(const std::string& value)
+	{
+		if (value.empty())
+			return 0;
+		if (std::isdigit(static_cast<unsigned char>(value[0])) || value[0] == '-')
+			return std::atoi(value.c_str());
+
+		static const int semitones[] = { 9, 11, 0, 2, 4, 5, 7 }; // a b c d e f g
+		int letter = std::tolower(static_cast<unsigned char>(value[0])) - 'a';
+		if (letter < 0 || letter > 6)
+			return 0;
+
+		size_t idx = 1;
+		int key = semitones[letter];
+		if (idx < value.size() && value[idx] == '#') { key++; idx++; }
+		else if (idx < value.size() && value[idx] == 'b') { key--; idx++; }
+		return key + 12 * (std::atoi(value.c_str() + idx) + 1);
+	}
+
+	bool addRegion(const std::string& directory, const std::vector<std::pair<std::string, std::string>>& global,
+		const std::vector<std::pair<std::string, std::string>>& group, const std::vector<std::pair<std::string, std::string>>& region)
+	{
+		std::string sample;
+		int low_key = 0, high_key = 127, root_key = -1, low_velocity = 0, high_velocity = 127;
+
+		// Later levels override earlier ones
+		for (const auto* level : { &global, &group, &region })
+		{
+			for (const auto& [opcode, value] : *level)
+			{
+				if (opcode == "sample") sample = value;
+				else if (opcode == "lokey") low_key = parseKey(value);
+				else if (opcode == "hikey") high_key = parseKey(value);
+				else if (opcode == "pitch_keycenter") root_key = parseKey(value);
+				else if (opcode == "lovel") low_velocity = std::atoi(value.c_str());
+				else if (opcode == "hivel") high_velocity = std::atoi(value.c_str());
+				else if (opcode == "key") low_key = high_key = root_key = parseKey(value);
+			}
+		}
+
+		if (sample.empty())
+			return false;
+		std::replace(sample.begin(), sample.end(), '\\', '/');
+		return addZone(directory + sample, low_key, high_key, root_key >= 0 ? root_key : low_key, low_velocity, high_velocity);
+	}
+};
+
+// Playback state of one voice. The render thread plays the resident preload first and
+// then continues from a ring that the reader thread keeps filled from the mapped file.
+struct StreamVoice
+{
+	const SampleZone* a_zone = nullptr;
+	double a_position = 0.0;			// Fraction between a_history[1] and a_history[2]
+	double a_increment = 1.0;
+	uint64_t a_next_frame = 0;			// Next source frame the render thread consumes
+	uint64_t a_preload_frames = 0;
+	bool a_ended = false;
+	std::array<float, 4> a_history = {};
+	std::array<float, SAMPLER_STAGE_FRAMES> a_staged = {};
+	uint32_t a_staged_count = 0;
+	uint32_t a_staged_idx = 0;
+	bool a_has_streamed = false;		// The ring delivered since the voice started
+	bool a_is_stalled = false;			// The ring ran dry after that, counted as one underrun
+
+	// Handshake with the reader: starting a voice bumps the request, the reader resets
+	// the ring and acknowledges it. The render thread only reads the ring while they match.
+	SpscRingBuffer<float> a_ring{ SAMPLER_RING_FRAMES };
+	std::atomic<const SampleZone*> a_stream_zone = nullptr;
+	std::atomic<uint64_t> a_stream_start = 0;
+	std::atomic<uint32_t> a_request = 0;
+	std::atomic<uint32_t> a_acknowledged = 0;
+	uint64_t a_stream_position = 0;		// Only touched by the reader
+};
+
+// Plays a SampleLibrary. Zones are picked by key and velocity when a note starts and
+// played back at the note's pitch through a 4-point Hermite interpolator, from the resident
+// preload first and then from a ring the reader thread streams into.
+//
+// Samples play in mono: every channel of a stereo or multichannel file is mixed down to one
+// at equal gain, and the voice is panned like any other. load() replaces the zones the
+// voices read from, so it must only run while no note of the sampler is sounding.
+class Sampler : public BaseInstrument<Sample>
+{
+private:
+	SampleLibrary a_library;
+	VoicePool<StreamVoice, SAMPLER_VOICES> a_voices;
+
+	std::thread a_reader;
+	std::atomic<bool> a_reader_running;
+	std::vector<float> a_chunk;
+	std::atomic<uint32_t> a_underruns;
+
+public:
+	Sampler()
+		: a_reader_running(false), a_underruns(0)
+	{
+		if (auto adsr_envelope = dynamic_cast<ADSREnvelope<Sample>*>(a_envelope.get())) {
+			adsr_envelope->a_attack_time = 0.002;
+			adsr_envelope->a_decay_time = 0.0;
+			adsr_envelope->a_sustain_amplitude = 1.0;
+			adsr_envelope->a_release_time = 0.3;
+		}
+
+		a_volume = 1.0;
+		a_chunk.resize(SAMPLER_STREAM_CHUNK);
+	}
+
+	~Sampler()
+	{
+		stopReader();
+	}
+
+	// Map a library. Only the headers are read here; preloads fill in the background.
+	// Not for the audio thread, and only while none of the sampler's notes sound.
+	bool load(const std::string& sfz_path)
+	{
+		stopReader();
+		a_library = SampleLibrary();
+		bool loaded = a_library.loadSfz(sfz_path);
+		startReader();
+		return loaded;
+	}
+
+	// Every zone's preload is resident, notes start without waiting on the disk
+	bool isPreloaded() const
+	{
+		for (size_t i = 0; i < a_library.getZoneCount(); i++)
+		{
+			if (!a_library.zone(i).a_preload_ready.load(std::memory_order_acquire))
+				return false;
+		}
+		return true;
+	}
+
+	// Not for the audio thread. Stops the reader, for instance while the drive the library
+	// lives on is busy; voices play on from what is buffered and then stall until it resumes.
+	void suspendStreaming()
+	{
+		stopReader();
+	}
+
+	void resumeStreaming()
+	{
+		if (!a_reader.joinable())
+			startReader();
+	}
+
+	// Number of times a playing voice ran out of streamed audio and had to output silence
+	uint32_t getStreamUnderruns() const
+	{
+		return a_underruns;
+	}
+
+	virtual Sample sound(const double time, Note& n, bool& is_note_finished) override
+	{
+		float sample = 0.0f;
+		render(time, 0.0, n, &sample, 1, is_note_finished);
+		return sample;
+	}
+
+	virtual void render(const double time, const double time_step, Note& n, float* out, uint32_t frames, bool& is_note_finished) override
+	{
+		bool is_new = false;
+		StreamVoice* voice = a_voices.acquire(n, is_new);
+		if (voice != nullptr && is_new)
+			startVoice(*voice, n, time_step);
+
+		if (voice == nullptr || voice->a_zone == nullptr)
+		{
+			std::fill_n(out, frames, 0.0f);
+			is_note_finished = true;
+			return;
+		}
+
+		// Follow pitch modulation, the zone stays the one picked at note on
+		voice->a_increment = (n.a_freq / voice->a_zone->a_root_frequency) * voice->a_zone->a_format.a_sample_rate * time_step;
+
+		Sample gain = a_volume * static_cast<Sample>(n.a_velocity);
+		for (uint32_t i = 0; i < frames; i++)
+		{
+			Sample amplitude = a_envelope->amplitude(time + i * time_step, n.a_on, n.a_off);
+			if (amplitude <= 0) is_note_finished = true;
+
+			while (voice->a_position >= 1.0)
+			{
+				advance(*voice);
+				voice->a_position -= 1.0;
+			}
+
+			out[i] = static_cast<float>(amplitude * gain * static_cast<Sample>(interpolate(voice->a_history, static_cast<float>(voice->a_position))));
+			voice->a_position += voice->a_increment;
+		}
+
+		if (voice->a_ended)
+			is_note_finished = true;
+	}
+
+	virtual bool tracksPitchModulation() const override
+	{
+		return true;
+	}
+
+	virtual void releaseVoice(const Note& n) override
+	{
+		if (StreamVoice* voice = a_voices.find(n))
+			voice->a_stream_zone.store(nullptr, std::memory_order_release);
+		a_voices.release(n);
+	}
+
+	virtual std::wstring getName() const override
+	{
+		if (a_library.getZoneCount() == 0)
+			return L"Sampler (no library)";
+		return L"Sampler: " + std::wstring(a_library.getName().begin(), a_library.getName().end());
+	}
+
+private:
+	void startVoice(StreamVoice& voice, const Note& n, double time_step)
+	{
+		int key = static_cast<int>(std::lround(69.0 + 12.0 * std::log2(n.a_freq / 440.0)));
+		int velocity = static_cast<int>(std::lround(n.a_velocity * 127.0));
+		voice.a_zone = a_library.find(key, velocity);
+		if (voice.a_zone == nullptr)
+			return;
+
+		voice.a_increment = (n.a_freq / voice.a_zone->a_root_frequency) * voice.a_zone->a_format.a_sample_rate * time_step;
+		voice.a_preload_frames = voice.a_zone->a_preload_ready.load(std::memory_order_acquire) ? voice.a_zone->a_preload.size() : 0;
+		voice.a_next_frame = 0;
+		voice.a_ended = false;
+		voice.a_position = 0.0;
+		voice.a_history.fill(0.0f);
+		voice.a_staged_count = 0;
+		voice.a_staged_idx = 0;
+		voice.a_has_streamed = false;
+		voice.a_is_stalled = false;
+
+		// Ask the reader to stream everything past the preload
+		voice.a_stream_zone.store(voice.a_zone, std::memory_order_relaxed);
+		voice.a_stream_start.store(voice.a_preload_frames, std::memory_order_relaxed);
+		voice.a_request.fetch_add(1, std::memory_order_release);
+
+		// Prime the interpolator so the first output is the first frame
+		for (int i = 0; i < 3; i++)
+			advance(voice);
+	}
+
+	void advance(StreamVoice& voice)
+	{
+		voice.a_history[0] = voice.a_history[1];
+		voice.a_history[1] = voice.a_history[2];
+		voice.a_history[2] = voice.a_history[3];
+		voice.a_history[3] = nextFrame(voice);
+	}
+
+	float nextFrame(StreamVoice& voice)
+	{
+		if (voice.a_next_frame >= voice.a_zone->a_format.a_frames)
+		{
+			voice.a_ended = true;
+			return 0.0f;
+		}
+
+		if (voice.a_next_frame < voice.a_preload_frames)
+			return voice.a_zone->a_preload[voice.a_next_frame++];
+
+		if (voice.a_staged_idx == voice.a_staged_count)
+		{
+			voice.a_staged_idx = 0;
+			voice.a_staged_count = 0;
+			if (voice.a_acknowledged.load(std::memory_order_acquire) == voice.a_request.load(std::memory_order_relaxed))
+				voice.a_staged_count = static_cast<uint32_t>(voice.a_ring.read(voice.a_staged.data(), SAMPLER_STAGE_FRAMES));
+
+			// The stream isn't there yet or fell behind, hold position and output silence.
+			// Waiting for the first fill is not an underrun, a stall counts once however long.
+			if (voice.a_staged_count == 0)
+			{
+				if (voice.a_has_streamed && !voice.a_is_stalled)
+					a_underruns++;
+				voice.a_is_stalled = voice.a_has_streamed;
+				return 0.0f;
+			}
+			voice.a_has_streamed = true;
+			voice.a_is_stalled = false;
+		}
+
+		voice.a_next_frame++;
+		return voice.a_staged[voice.a_staged_idx++];
+	}
+
+	// 4-point, 3rd-order Hermite between history[1] and history[2]
+	static float interpolate(const std::array<float, 4>& h, float x)
+	{
+		float c1 = 0.5f * (h[2] - h[0]);
+		float c2 = h[0] - 2.5f * h[1] + 2.0f * h[2] - 0.5f * h[3];
+		float c3 = 0.5f * (h[3] - h[0]) + 1.5f * (h[1] - h[2]);
+		return ((c3 * x + c2) * x + c1) * x + h[1];
+	}
+
+	static void releaseFrames(const SampleZone& zone, uint64_t start, uint64_t count)
+	{
+		zone.a_file.release(static_cast<size_t>(zone.a_format.a_data_offset + start * zone.a_format.frameSize()),
+			static_cast<size_t>(count * zone.a_format.frameSize()));
+	}
+
+	void startReader()
+	{
+		a_reader_running = true;
+		a_reader = std::thread(&Sampler::readerThread, this);
+	}
+
+	void stopReader()
+	{
+		a_reader_running = false;
+		if (a_reader.joinable())
+			a_reader.join();
+	}
+
+	// Keeps every streaming voice's ring topped up and fills zone preloads when idle.
+	// All page faults on the mapped files happen here, never on the render thread. Pages
+	// are released once copied, so resident memory follows the voices playing rather than
+	// the size of the library.
+	void readerThread()
+	{
+		size_t next_preload = 0;
+		while (a_reader_running)
+		{
+			bool busy = false;
+			for (size_t slot = 0; slot < a_voices.size(); slot++)
+			{
+				StreamVoice& voice = a_voices[slot];
+
+				uint32_t request = voice.a_request.load(std::memory_order_acquire);
+				if (request != voice.a_acknowledged.load(std::memory_order_relaxed))
+				{
+					voice.a_ring.reset();
+					voice.a_stream_position = voice.a_stream_start.load(std::memory_order_relaxed);
+					voice.a_acknowledged.store(request, std::memory_order_release);
+				}
+
+				const SampleZone* zone = voice.a_stream_zone.load(std::memory_order_acquire);
+				if (zone == nullptr || voice.a_stream_position >= zone->a_format.a_frames || voice.a_ring.availableWrite() < SAMPLER_STREAM_CHUNK)
+					continue;
+
+				uint32_t count = static_cast<uint32_t>(std::min<uint64_t>(SAMPLER_STREAM_CHUNK, zone->a_format.a_frames - voice.a_stream_position));
+				readWavFrames(zone->a_file.data(), zone->a_format, voice.a_stream_position, count, a_chunk.data());
+				voice.a_ring.write(a_chunk.data(), count);
+				releaseFrames(*zone, voice.a_stream_position, count);
+				voice.a_stream_position += count;
+				busy = true;
+			}
+
+			if (!busy && next_preload < a_library.getZoneCount())
+			{
+				SampleZone& zone = a_library.zone(next_preload++);
+				if (zone.a_preload_ready.load(std::memory_order_relaxed))
+					continue;
+				readWavFrames(zone.a_file.data(), zone.a_format, 0, static_cast<uint32_t>(zone.a_preload.size()), zone.a_preload.data());
+				releaseFrames(zone, 0, zone.a_preload.size());
+				zone.a_preload_ready.store(true, std::memory_order_release);
+				busy = true;
+			}
+
+			if (!busy)
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		}
+	}
+};
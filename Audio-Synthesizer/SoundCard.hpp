@@ -1,49 +1,120 @@
 #pragma once
 
-#pragma comment(lib, "winmm.lib")
-
-#include <iostream>
-#include <cmath>
-#include <fstream>
+#include <algorithm>
 #include <vector>
 #include <string>
-#include <thread>
 #include <atomic>
+#include <chrono>
 #include <memory>
-#include <condition_variable>
-#include <Windows.h>
 
 #include "Common.hpp"
+#include "AudioBus.hpp"
 #include "SoundEffect.hpp"
+#include "AudioBackend.hpp"
+#include "WinMMBackend.hpp"
+#include "AlsaBackend.hpp"
+#include "PulseBackend.hpp"
+#include "JackBackend.hpp"
+
+enum class AUDIO_BACKEND {
+	DEFAULT,	// The first one of these built in, in this order
+	WINMM,
+	JACK,
+	ALSA,
+	PULSE,
+	NULL_OUTPUT
+};
+
+// Backend from its name on the command line, DEFAULT for anything unknown
+inline AUDIO_BACKEND parseAudioBackend(const std::string& name)
+{
+	if (name == "winmm") return AUDIO_BACKEND::WINMM;
+	if (name == "jack") return AUDIO_BACKEND::JACK;
+	if (name == "alsa") return AUDIO_BACKEND::ALSA;
+	if (name == "pulse") return AUDIO_BACKEND::PULSE;
+	if (name == "null") return AUDIO_BACKEND::NULL_OUTPUT;
+	return AUDIO_BACKEND::DEFAULT;
+}
+
+// Backends that were not built in give nullptr. JACK is only the default while a server is running.
+template<typename T>
+std::unique_ptr<AudioBackend<T>> createAudioBackend(AUDIO_BACKEND type)
+{
+	switch (type)
+	{
+#ifdef _WIN32
+	case AUDIO_BACKEND::WINMM:
+		return std::make_unique<WinMMBackend<T>>();
+#endif
+#ifdef SYNTH_HAVE_JACK
+	case AUDIO_BACKEND::JACK:
+		return std::make_unique<JackBackend<T>>();
+#endif
+#ifdef SYNTH_HAVE_ALSA
+	case AUDIO_BACKEND::ALSA:
+		return std::make_unique<AlsaBackend<T>>();
+#endif
+#ifdef SYNTH_HAVE_PULSE
+	case AUDIO_BACKEND::PULSE:
+		return std::make_unique<PulseBackend<T>>();
+#endif
+	case AUDIO_BACKEND::NULL_OUTPUT:
+		return std::make_unique<NullBackend<T>>();
+	case AUDIO_BACKEND::DEFAULT:
+		break;
+	default:
+		return nullptr;
+	}
 
+#ifdef _WIN32
+	return std::make_unique<WinMMBackend<T>>();
+#else
+#ifdef SYNTH_HAVE_JACK
+	jack_status_t status;
+	if (jack_client_t* probe = jack_client_open("Audio-Synthesizer-probe", JackNoStartServer, &status))
+	{
+		jack_client_close(probe);
+		return std::make_unique<JackBackend<T>>();
+	}
+#endif
+#if defined(SYNTH_HAVE_ALSA)
+	return std::make_unique<AlsaBackend<T>>();
+#elif defined(SYNTH_HAVE_PULSE)
+	return std::make_unique<PulseBackend<T>>();
+#else
+	return std::make_unique<NullBackend<T>>();
+#endif
+#endif
+}
+
+// Drives an audio backend with the user function. The backend pulls blocks from its
+// audio thread through renderBlock(), which keeps the sample clock and runs the user
+// function inside a RealtimeScope so the allocation checks can see it.
 template<typename T>
-class SoundGenerator
+class SoundGenerator : public BlockSource
 {
 private:
-	double(*a_user_function)(int, double);
+	std::atomic<void(*)(AudioBus&, double, double)> a_user_function;
 
 	uint32_t a_sample_rate;
 	uint32_t a_channels;
-	uint32_t a_block_count;
-	uint32_t a_block_samples;
-	uint32_t a_block_current;
-
-	std::unique_ptr<T[]> a_block_memory_ptr;
-	std::unique_ptr<WAVEHDR[]> a_wave_headers;
-	HWAVEOUT a_device;
+	uint32_t a_block_frames;
 
-	std::thread a_sound_thread;
+	std::unique_ptr<AudioBackend<T>> a_backend;
 	std::atomic<bool> a_ready;
-	std::atomic<uint32_t> a_block_free;
-	std::condition_variable a_condition_not_zero;
-	std::mutex a_mutex_not_zero;
 
 	std::atomic<double> a_global_time;
+	uint64_t a_sample_clock;
+	StreamClock a_clock;
+
+	// Internal planar mix bus, converted to the device format by the backend
+	AudioBus a_bus;
+	std::atomic<double> a_render_load;		// Render time of the last block relative to its duration
 
 public:
-	SoundGenerator(std::wstring&& output_device, uint32_t channels = 1, uint32_t blocks = 8, uint32_t block_samples = 512)
+	SoundGenerator(std::unique_ptr<AudioBackend<T>> backend, std::wstring&& output_device, uint32_t channels = 1, uint32_t blocks = 8, uint32_t block_samples = 512, LATENCY_MODE latency_mode = LATENCY_MODE::FIXED, uint32_t sample_rate = DEFAULT_SAMPLE_RATE)
 	{
-		create(std::move(output_device), channels, blocks, block_samples);
+		create(std::move(backend), std::move(output_device), channels, blocks, block_samples, latency_mode, sample_rate);
 	}
 
 	~SoundGenerator()
@@ -51,79 +122,42 @@ public:
 		destroy();
 	}
 
-	bool create(std::wstring&& output_device, uint32_t channels = 1, uint32_t blocks = 8, uint32_t block_samples = 512)
+	bool create(std::unique_ptr<AudioBackend<T>> backend, std::wstring&& output_device, uint32_t channels = 1, uint32_t blocks = 8, uint32_t block_samples = 512, LATENCY_MODE latency_mode = LATENCY_MODE::FIXED, uint32_t sample_rate = DEFAULT_SAMPLE_RATE)
 	{
 		a_ready = false;
-		a_sample_rate = SAMPLE_RATE;
+		a_sample_rate = sample_rate;
 		a_channels = channels;
-		a_block_count = blocks;
-		a_block_samples = block_samples;
-		a_block_free = a_block_count;
-		a_block_current = 0;
-		a_block_memory_ptr.reset();
-		a_wave_headers.release();
-
+		a_block_frames = block_samples / channels;
+		a_global_time = 0.0;
+		a_sample_clock = 0;
+		a_render_load = 0.0;
 		a_user_function = nullptr;
+		a_bus.resize(a_channels, a_block_frames);
+
+		a_backend = std::move(backend);
+		if (a_backend == nullptr || !a_backend->open(output_device, a_sample_rate, a_channels, a_block_frames, blocks, latency_mode))
+			return destroy();
 
-		// Validate device
-		std::vector<std::wstring> devices = enumerate();
-		auto d = std::find(devices.begin(), devices.end(), output_device);
-		if (d != devices.end())
-		{
-			// Device is available
-			auto device_id = distance(devices.begin(), d);
-			WAVEFORMATEX waveFormat;
-			waveFormat.wFormatTag = WAVE_FORMAT_PCM;
-			waveFormat.nSamplesPerSec = a_sample_rate;
-			waveFormat.wBitsPerSample = sizeof(T) * 8;
-			waveFormat.nChannels = a_channels;
-			waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
-			waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
-			waveFormat.cbSize = 0;
-
-			// Open Device if valid
-			if (waveOutOpen(&a_device, static_cast<UINT>(device_id), &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
-				return destroy();
-		}
-
-		// Allocate Wave|Block Memory
-		a_block_memory_ptr = std::make_unique<T[]>(a_block_count * a_block_samples);
-		ZeroMemory(a_block_memory_ptr.get(), sizeof(T) * a_block_count * a_block_samples);
-		a_wave_headers = std::make_unique<WAVEHDR[]>(a_block_count);
-		ZeroMemory(a_wave_headers.get(), sizeof(WAVEHDR) * a_block_count);
-
-		// Link headers to block memory
-		for (uint32_t n = 0; n < a_block_count; n++)
-		{
-			a_wave_headers[n].dwBufferLength = a_block_samples * sizeof(T);
-			a_wave_headers[n].lpData = reinterpret_cast<LPSTR>(a_block_memory_ptr.get() + (n * a_block_samples));
-		}
-
-		a_ready = true;
-		a_sound_thread = std::thread(&SoundGenerator::soundThread, this);
-
-		// Start the ball rolling
-		std::unique_lock<std::mutex> lock(a_mutex_not_zero);
-		a_condition_not_zero.notify_one();
-
-		return true;
+		a_ready = a_backend->start(*this);
+		return a_ready || destroy();
 	}
 
 	bool destroy()
 	{
 		a_ready = false;
+		if (a_backend != nullptr)
+			a_backend->close();
+		return false;
+	}
 
-		if (a_sound_thread.joinable())
-			a_sound_thread.join();
-
-		if (a_device != NULL)
-		{
-			waveOutReset(a_device);
-			waveOutClose(a_device);
-			a_device = NULL;
-		}
+	bool isRunning() const
+	{
+		return a_ready;
+	}
 
-		return false;
+	std::wstring getBackendName() const
+	{
+		return a_backend != nullptr ? a_backend->getName() : L"None";
 	}
 
 	double getTime() const
@@ -131,107 +165,71 @@ public:
 		return a_global_time;
 	}
 
+	uint32_t getSampleRate() const
+	{
+		return a_sample_rate;
+	}
 
-
-public:
-	static std::vector<std::wstring> enumerate()
+	// For stamping events from other threads, such as MIDI input, with their stream time
+	const StreamClock& getClock() const
 	{
-		int device_count = waveOutGetNumDevs();
-		std::vector<std::wstring> devices;
-		WAVEOUTCAPS woc;
-		for (int n = 0; n < device_count; n++)
-			if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK) {
-				devices.emplace_back(woc.szPname);
-			}
-		return devices;
+		return a_clock;
 	}
 
-	void setUserFunction(double(*func)(int, double))
+	// Time between a sample being rendered and it reaching the device, in seconds.
+	// Add this to a render timestamp to get the time the sample is actually heard.
+	double getLatency() const
 	{
-		a_user_function = func;
+		return a_backend != nullptr ? a_backend->getLatency() : 0.0;
 	}
 
-	double clip(double sample, double max)
+	uint32_t getQueuedBlockTarget() const
 	{
-		return sample >= 0.0 ? std::fmin(sample, max) : std::fmax(sample, -max);
+		return a_backend != nullptr ? a_backend->getQueuedBlockTarget() : 0;
 	}
 
+	uint32_t getUnderrunCount() const
+	{
+		return a_backend != nullptr ? a_backend->getUnderrunCount() : 0;
+	}
 
-private:
-	// Handler for soundcard request for more data
-	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
+	double getRenderLoad() const
 	{
-		if (uMsg != WOM_DONE) return;
+		return a_render_load;
+	}
 
-		a_block_free++;
-		std::unique_lock<std::mutex> lock(a_mutex_not_zero);
-		a_condition_not_zero.notify_one();
+	bool isRealtime() const
+	{
+		return a_backend != nullptr && a_backend->isRealtime();
 	}
 
-	// Static wrapper for sound card handler
-	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+	// The user function renders one block into the bus, given the time of its first frame and the time step
+	void setUserFunction(void(*func)(AudioBus&, double, double))
 	{
-		reinterpret_cast<SoundGenerator*>(dwInstance)->waveOutProc(hWaveOut, uMsg, static_cast<DWORD>(dwParam1), static_cast<DWORD>(dwParam2));
+		a_user_function = func;
 	}
 
-	void soundThread()
+	// Render the next frames, at most one block, on the integer sample clock
+	virtual AudioBus& renderBlock(uint32_t frames) override
 	{
-		a_global_time = 0.0;
+		RealtimeScope realtime;
 		double time_step = 1.0 / static_cast<double>(a_sample_rate);
-
-		// Goofy hack to get maximum integer for a type at run-time
-		double max_sample = static_cast<double>((static_cast<T>(pow(2, (sizeof(T) * 8) - 1) - 1)));
-
-		while (a_ready)
-		{
-			// Wait for block to become available
-			if (a_block_free == 0)
-			{
-				std::unique_lock<std::mutex> lock(a_mutex_not_zero);
-				while (a_block_free == 0) {
-					a_condition_not_zero.wait(lock);
-				}
-			}
-
-			// Block is here, so use it
-			a_block_free--;
-
-			// Prepare block for processing
-			if (a_wave_headers[a_block_current].dwFlags & WHDR_PREPARED)
-				waveOutUnprepareHeader(a_device, &a_wave_headers[a_block_current], sizeof(WAVEHDR));
-
-			T new_sample = 0;
-			int nCurrentBlock = a_block_current * a_block_samples;
-
-			auto place_holder = [](int i, double j) {return 0.0; }; // dummy function when there is no user function
-#pragma omp parallel for
-			for (uint32_t n = 0; n < a_block_samples; n += a_channels)
-			{
-				// User Process
-				for (uint32_t c = 0; c < a_channels; c++)
-				{
-					T new_sample;
-					if (a_user_function == nullptr) {
-						new_sample = static_cast<T>((clip(place_holder(c, a_global_time), 1.0) * max_sample));
-					}
-					else {
-						new_sample = static_cast<T>((clip(a_user_function(c, a_global_time), 1.0) * max_sample));
-					}
-
-					a_block_memory_ptr[nCurrentBlock + n + c] = new_sample;
-				}
-
-#pragma omp critical
-				{
-					a_global_time = a_global_time + time_step;
-				}
-			}
-
-			// Send block to sound device
-			waveOutPrepareHeader(a_device, &a_wave_headers[a_block_current], sizeof(WAVEHDR));
-			waveOutWrite(a_device, &a_wave_headers[a_block_current], sizeof(WAVEHDR));
-			a_block_current++;
-			a_block_current %= a_block_count;
-		}
-	}
-};
\ No newline at end of file
+		auto render_start = std::chrono::steady_clock::now();
+		a_clock.mark(static_cast<double>(a_sample_clock) * time_step, static_cast<double>(a_block_frames) * time_step, render_start);
+
+		// User Process, mixing in float on the planar bus
+		a_bus.setFrames(std::min(frames, a_block_frames));
+		a_bus.clear();
+		auto user_function = a_user_function.load();
+		if (user_function != nullptr)
+			user_function(a_bus, static_cast<double>(a_sample_clock) * time_step, time_step);
+
+		// Keep time on an integer sample clock so it never drifts
+		a_sample_clock += a_bus.getFrames();
+		a_global_time = static_cast<double>(a_sample_clock) * time_step;
+
+		std::chrono::duration<double> render_time = std::chrono::steady_clock::now() - render_start;
+		a_render_load = render_time.count() / (static_cast<double>(a_bus.getFrames()) * time_step);
+		return a_bus;
+	}
+};
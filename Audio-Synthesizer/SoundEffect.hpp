@@ -1,75 +1,313 @@
 #pragma once
 
 #include <cassert>
+#include <array>
+#include <cmath>
 #include <vector>
 #include <numbers>
+#include <algorithm>
 #include "Filter.hpp"
 #include "Common.hpp"
+#include "Wavetable.hpp"
 
+#define PHASER_MAX_STAGES 12
+#define PHASER_MIN_HZ 200.0
+#define PHASER_MAX_HZ 4000.0
+
+// Delay in seconds and feedback gain
 template <typename T>
-using ReverbTap = std::pair<size_t, T>;
+using ReverbTap = std::pair<double, T>;
 
 template <typename T>
 struct BaseSoundEffect {
+    virtual ~BaseSoundEffect() = default;
     virtual T process(T input) {
         return input;
     }
+    // Process a block in place, effects override it to keep the virtual call out of the loop
+    virtual void processBlock(T* samples, uint32_t frames) {
+        for (uint32_t i = 0; i < frames; i++)
+            samples[i] = process(samples[i]);
+    }
+    // Resize delay lines and recompute coefficients, only while the effect is idle
+    virtual void setSampleRate(double sample_rate) {
+    }
+    // Offset of the effect's main parameter from the modulation matrix, set once per block
+    virtual void modulate(double amount) {
+    }
     virtual std::wstring getName() const {
         return L"No effect";
     }
 };
 
+// Delay line read at a fractional, moving delay behind each frame of the block last
+// written, so a block goes in with one copy and every voice then reads it in a loop of its own
+template <typename T>
+class ModulatedDelayLine {
+private:
+    std::vector<T> a_buffer;
+    size_t a_mask;
+    size_t a_write_idx;
+    double a_max_delay;
+
+public:
+    ModulatedDelayLine() : a_mask(0), a_write_idx(0), a_max_delay(0) {
+        resize(1);
+    }
+
+    // Not for the audio thread. Rounded up to a power of two so wrapping is a mask
+    void resize(double max_delay) {
+        size_t size = 1;
+        while (size < static_cast<size_t>(max_delay) + LFO_BANK_FRAMES + 2)
+            size <<= 1;
+        a_buffer.assign(size, static_cast<T>(0));
+        a_mask = size - 1;
+        a_write_idx = 0;
+        a_max_delay = std::floor(max_delay);
+    }
+
+    void write(const T* samples, uint32_t frames) {
+        for (uint32_t i = 0; i < frames; i++)
+            a_buffer[(a_write_idx + i) & a_mask] = samples[i];
+        a_write_idx = (a_write_idx + frames) & a_mask;
+    }
+
+    // delay samples before frame of the frames last written, linearly interpolated
+    T read(uint32_t frame, uint32_t frames, T delay) const {
+        delay = std::clamp(delay, static_cast<T>(0), static_cast<T>(a_max_delay));
+        size_t whole = static_cast<size_t>(delay);
+        T fraction = delay - static_cast<T>(whole);
+        size_t index = (a_write_idx + a_buffer.size() - frames + frame - whole) & a_mask;
+        return a_buffer[index] + fraction * (a_buffer[(index - 1) & a_mask] - a_buffer[index]);
+    }
+};
+
 template <typename T>
 class Flanger : public BaseSoundEffect<T> {
 private:
     const double a_max_delay_ms;
-    std::vector<T> a_delay_buffer;
-    size_t a_curr_write_idx;
-    double a_curr_delay_ms;
+    double a_sample_rate;
+    ModulatedDelayLine<T> a_delay_line;
+    LFOBank a_lfo;
     double a_depth;
-    double a_rate;
-    double a_curr_time;
+    double a_modulation;
 
 public:
     Flanger(double max_delay_ms, double depth, double rate)
-        : a_max_delay_ms(max_delay_ms), a_depth(depth), a_rate(rate), a_curr_write_idx(0), a_curr_delay_ms(0), a_curr_time(0) {
-        a_delay_buffer.resize(static_cast<size_t>(max_delay_ms * SAMPLE_RATE / 1000.0), 0.0);
+        : a_max_delay_ms(max_delay_ms), a_sample_rate(DEFAULT_SAMPLE_RATE), a_lfo(1, rate), a_depth(depth), a_modulation(0) {
+        Flanger::setSampleRate(DEFAULT_SAMPLE_RATE);
+    }
+
+    virtual void setSampleRate(double sample_rate) override {
+        a_sample_rate = sample_rate;
+        a_delay_line.resize(a_max_delay_ms * sample_rate / 1000.0);
+        a_lfo.setSampleRate(sample_rate);
     }
 
     T process(T input) override {
-        // Calculate delay time in samples
-        a_curr_delay_ms = (a_max_delay_ms / 2) * (1 + std::sin(2 * std::numbers::pi * a_rate * a_curr_time)) * a_depth;
-        double delay_samples = a_curr_delay_ms * SAMPLE_RATE / 1000.0;
+        Flanger::processBlock(&input, 1);
+        return input;
+    }
+
+    virtual void processBlock(T* samples, uint32_t frames) override {
+        // The sweep runs from no delay up to the maximum, scaled by the depth
+        T half_sweep = static_cast<T>(a_max_delay_ms * a_sample_rate / 2000.0 * std::clamp(a_depth + a_modulation, 0.0, 1.0));
+        for (uint32_t start = 0; start < frames; start += LFO_BANK_FRAMES) {
+            uint32_t count = std::min<uint32_t>(frames - start, LFO_BANK_FRAMES);
+            T* block = samples + start;
+            a_lfo.fill(count);
+            a_delay_line.write(block, count);
+
+            // Mix dry and wet signals
+            const float* sweep = a_lfo.values(0);
+            for (uint32_t i = 0; i < count; i++)
+                block[i] = static_cast<T>(0.5) * (block[i] + a_delay_line.read(i, count, half_sweep * (1 + static_cast<T>(sweep[i]))));
+        }
+    }
 
-        // Read from delay buffer
-        double delay_read_index = a_curr_write_idx - delay_samples;
-        if (delay_read_index < 0)
-            delay_read_index += a_delay_buffer.size();
+    virtual void modulate(double amount) override {
+        a_modulation = amount;
+    }
 
-        size_t read_index1 = static_cast<size_t>(floor(delay_read_index));
-        size_t read_index2 = (read_index1 + 1) % a_delay_buffer.size();
-        double fraction = delay_read_index - read_index1;
+    virtual std::wstring getName() const override {
+		return L"Flanger";
+	}
+};
 
-        // Linear interpolation
-        T delayed_sample = (1 - fraction) * a_delay_buffer[read_index1] + fraction * a_delay_buffer[read_index2];
+// Several copies of the input, each delayed by a voice of its own that sweeps slowly around
+// the base delay, spread evenly over the LFO cycle so the copies never line up
+template <typename T>
+class Chorus : public BaseSoundEffect<T> {
+private:
+    double a_sample_rate;
+    ModulatedDelayLine<T> a_delay_line;
+    LFOBank a_lfo;
+    LFOBank a_vibrato;          // A faster wobble on top of the sweep, off unless a_vibrato_ms is set
+    double a_delay_ms;
+    double a_sweep_ms;          // Widest swing of the delay, at full depth
+    double a_vibrato_ms;
+    double a_depth;
+    double a_modulation;
+    std::array<T, LFO_BANK_FRAMES> a_wet;
 
-        // Write to delay buffer
-        a_delay_buffer[a_curr_write_idx] = input;
+public:
+    Chorus(int voices, double delay_ms, double sweep_ms, double depth, double rate, uint32_t phase_offset = 0)
+        : a_sample_rate(DEFAULT_SAMPLE_RATE), a_lfo(voices, rate, phase_offset), a_vibrato(voices, 0.0, phase_offset),
+          a_delay_ms(delay_ms), a_sweep_ms(sweep_ms), a_vibrato_ms(0.0), a_depth(depth), a_modulation(0), a_wet() {
+        Chorus::setSampleRate(DEFAULT_SAMPLE_RATE);
+    }
 
-        a_curr_write_idx = (a_curr_write_idx + 1) % a_delay_buffer.size();
+    virtual void setSampleRate(double sample_rate) override {
+        a_sample_rate = sample_rate;
+        a_delay_line.resize((a_delay_ms + a_sweep_ms / 2 + a_vibrato_ms) * sample_rate / 1000.0);
+        a_lfo.setSampleRate(sample_rate);
+        a_vibrato.setSampleRate(sample_rate);
+    }
 
-        // Mix dry and wet signals
-        T output = 0.5 * (input + delayed_sample);
+    T process(T input) override {
+        Chorus::processBlock(&input, 1);
+        return input;
+    }
 
-        // Increment time
-        a_curr_time += 1.0 / SAMPLE_RATE;
+    virtual void processBlock(T* samples, uint32_t frames) override {
+        T centre = static_cast<T>(a_delay_ms * a_sample_rate / 1000.0);
+        T half_sweep = static_cast<T>(a_sweep_ms * a_sample_rate / 2000.0 * std::clamp(a_depth + a_modulation, 0.0, 1.0));
+        T vibrato = static_cast<T>(a_vibrato_ms * a_sample_rate / 1000.0);
+        // The voices are uncorrelated, so their powers add
+        T voice_gain = static_cast<T>(1.0 / std::sqrt(a_lfo.getVoices()));
+
+        for (uint32_t start = 0; start < frames; start += LFO_BANK_FRAMES) {
+            uint32_t count = std::min<uint32_t>(frames - start, LFO_BANK_FRAMES);
+            T* block = samples + start;
+            a_lfo.fill(count);
+            if (vibrato > 0)
+                a_vibrato.fill(count);
+            a_delay_line.write(block, count);
+
+            std::fill_n(a_wet.begin(), count, static_cast<T>(0));
+            for (int v = 0; v < a_lfo.getVoices(); v++) {
+                const float* sweep = a_lfo.values(v);
+                if (vibrato > 0) {
+                    const float* wobble = a_vibrato.values(v);
+                    for (uint32_t i = 0; i < count; i++)
+                        a_wet[i] += a_delay_line.read(i, count, centre + half_sweep * static_cast<T>(sweep[i]) + vibrato * static_cast<T>(wobble[i]));
+                }
+                else {
+                    for (uint32_t i = 0; i < count; i++)
+                        a_wet[i] += a_delay_line.read(i, count, centre + half_sweep * static_cast<T>(sweep[i]));
+                }
+            }
+
+            for (uint32_t i = 0; i < count; i++)
+                block[i] = static_cast<T>(0.5) * (block[i] + voice_gain * a_wet[i]);
+        }
+    }
 
-        return output;
+    virtual void modulate(double amount) override {
+        a_modulation = amount;
     }
 
     virtual std::wstring getName() const override {
-		return L"Flanger";
-	}
+        return L"Chorus";
+    }
+
+protected:
+    // Not for the audio thread, the delay line grows to fit the extra swing
+    void setVibrato(double rate, double vibrato_ms) {
+        a_vibrato.setRate(rate);
+        a_vibrato_ms = vibrato_ms;
+        Chorus::setSampleRate(a_sample_rate);
+    }
+};
+
+// The string machine ensemble: three chorus voices, each swept slowly and wobbled quickly
+template <typename T>
+class Ensemble : public Chorus<T> {
+public:
+    Ensemble(double rate, double vibrato_rate, uint32_t phase_offset = 0)
+        : Chorus<T>(3, 10.0, 6.0, 0.6, rate, phase_offset) {
+        Chorus<T>::setVibrato(vibrato_rate, 0.4);
+    }
+
+    virtual std::wstring getName() const override {
+        return L"Ensemble";
+    }
+};
+
+// A cascade of first order allpass filters whose break frequency sweeps exponentially
+// between PHASER_MIN_HZ and PHASER_MAX_HZ. Mixed with the dry signal, each pair of stages
+// cuts a notch that moves with the sweep; feedback deepens the notches.
+template <typename T>
+class Phaser : public BaseSoundEffect<T> {
+private:
+    double a_sample_rate;
+    LFOBank a_lfo;
+    std::array<T, PHASER_MAX_STAGES> a_states;
+    std::array<T, LFO_BANK_FRAMES> a_coefficients;
+    int a_stages;
+    double a_depth;
+    double a_modulation;
+    T a_feedback;
+    T a_last;
+
+public:
+    Phaser(int stages, double depth, double rate, T feedback, uint32_t phase_offset = 0)
+        : a_sample_rate(DEFAULT_SAMPLE_RATE), a_lfo(1, rate, phase_offset), a_states(), a_coefficients(), a_stages(std::clamp(stages, 1, PHASER_MAX_STAGES)),
+          a_depth(depth), a_modulation(0), a_feedback(feedback), a_last(0) {
+        Phaser::setSampleRate(DEFAULT_SAMPLE_RATE);
+    }
+
+    virtual void setSampleRate(double sample_rate) override {
+        a_sample_rate = sample_rate;
+        a_lfo.setSampleRate(sample_rate);
+        a_states.fill(0);
+        a_last = 0;
+    }
+
+    T process(T input) override {
+        Phaser::processBlock(&input, 1);
+        return input;
+    }
+
+    virtual void processBlock(T* samples, uint32_t frames) override {
+        // Break frequency as a fraction of the sample rate, times pi, swept in octaves
+        double top_hz = std::min(PHASER_MAX_HZ, 0.45 * a_sample_rate);
+        T octaves = static_cast<T>(std::log2(top_hz / PHASER_MIN_HZ) * std::clamp(a_depth + a_modulation, 0.0, 1.0));
+        T bottom = static_cast<T>(std::numbers::pi * PHASER_MIN_HZ / a_sample_rate);
+
+        for (uint32_t start = 0; start < frames; start += LFO_BANK_FRAMES) {
+            uint32_t count = std::min<uint32_t>(frames - start, LFO_BANK_FRAMES);
+            T* block = samples + start;
+            a_lfo.fill(count);
+
+            // tan(w) ~ w is close enough below a quarter of the sample rate
+            const float* sweep = a_lfo.values(0);
+            for (uint32_t i = 0; i < count; i++) {
+                T w = bottom * std::exp2(octaves * static_cast<T>(0.5) * (1 + static_cast<T>(sweep[i])));
+                a_coefficients[i] = (w - 1) / (w + 1);
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                T a = a_coefficients[i];
+                T x = block[i] + a_feedback * a_last;
+                for (int s = 0; s < a_stages; s++) {
+                    T y = a * x + a_states[s];
+                    a_states[s] = x - a * y;
+                    x = y;
+                }
+                a_last = x;
+                block[i] = static_cast<T>(0.5) * (block[i] + x);
+            }
+        }
+    }
+
+    virtual void modulate(double amount) override {
+        a_modulation = amount;
+    }
+
+    virtual std::wstring getName() const override {
+        return L"Phaser";
+    }
 };
 
 template <typename T>
@@ -77,15 +315,24 @@ class Delay : public BaseSoundEffect<T>{
 private:
     std::vector<T> a_delay_line;
     size_t a_delay_idx;
+    double a_delay_time;
     T a_feedback;
+    T a_modulated_feedback;
 
 public:
-    Delay(int delay_samples, T feedback)
-        : a_delay_line(delay_samples, 0.0), a_delay_idx(0), a_feedback(feedback) {}
+    Delay(double delay_time, T feedback)
+        : a_delay_idx(0), a_delay_time(delay_time), a_feedback(feedback), a_modulated_feedback(feedback) {
+        Delay::setSampleRate(DEFAULT_SAMPLE_RATE);
+    }
+
+    virtual void setSampleRate(double sample_rate) override {
+        a_delay_line.assign(std::max<size_t>(static_cast<size_t>(std::round(a_delay_time * sample_rate)), 1), 0.0);
+        a_delay_idx = 0;
+    }
 
     virtual T process(T input) override {
         T outputSample = input + a_delay_line[a_delay_idx];
-        a_delay_line[a_delay_idx] = outputSample * a_feedback;
+        a_delay_line[a_delay_idx] = outputSample * a_modulated_feedback;
 
         // Advance the delay line index
         a_delay_idx++;
@@ -96,6 +343,15 @@ public:
         return outputSample;
     }
 
+    virtual void processBlock(T* samples, uint32_t frames) override {
+        for (uint32_t i = 0; i < frames; i++)
+            samples[i] = Delay::process(samples[i]);
+    }
+
+    virtual void modulate(double amount) override {
+        a_modulated_feedback = std::clamp(a_feedback + static_cast<T>(amount), static_cast<T>(0), static_cast<T>(0.95));
+    }
+
     virtual std::wstring getName() const override {
         return L"Delay";
     }
@@ -105,19 +361,26 @@ template <typename T>
 class MultitapReverb : public BaseSoundEffect<T>{
 private:
     std::vector<ReverbTap<T>> a_taps;
+    std::vector<std::pair<size_t, T>> a_tap_samples;   // The taps in samples at the current rate
     std::vector<T> a_samples;
     size_t a_sample_idx;
 
 public:
     MultitapReverb(std::vector<ReverbTap<T>>&& taps) : a_sample_idx(0) {
         a_taps = taps;
+        MultitapReverb::setSampleRate(DEFAULT_SAMPLE_RATE);
+    }
 
+    virtual void setSampleRate(double sample_rate) override {
+        a_tap_samples.clear();
         size_t largestTimeOffset = 0;
         for (const auto& tap : a_taps) {
-            if (tap.first > largestTimeOffset)
-                largestTimeOffset = tap.first;
+            a_tap_samples.emplace_back(static_cast<size_t>(tap.first * sample_rate), tap.second);
+            largestTimeOffset = std::max(largestTimeOffset, a_tap_samples.back().first);
         }
 
+        a_samples.clear();
+        a_sample_idx = 0;
         if (largestTimeOffset == 0)
             return;
 
@@ -129,7 +392,7 @@ public:
             return input;
 
         T outSample = input;
-        for (const auto& tap : a_taps) {
+        for (const auto& tap : a_tap_samples) {
             size_t tapSampleIndex;
             if (tap.first > a_sample_idx)
                 tapSampleIndex = a_samples.size() - 1 - (tap.first - a_sample_idx);
@@ -150,6 +413,11 @@ public:
         return outSample;
     }
 
+    virtual void processBlock(T* samples, uint32_t frames) override {
+        for (uint32_t i = 0; i < frames; i++)
+            samples[i] = MultitapReverb::process(samples[i]);
+    }
+
     virtual std::wstring getName() const override {
 		return L"Multitap Reverb";
 	}
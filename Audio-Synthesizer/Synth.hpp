@@ -0,0 +1,736 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <cmath>
+#include <numbers>
+#include <algorithm>
+#include <chrono>
+
+#include "AudioBus.hpp"
+#include "Instrument.hpp"
+#include "SoundEffect.hpp"
+#include "Sampler.hpp"
+#include "Granular.hpp"
+#include "PluckedString.hpp"
+#include "FMSynth.hpp"
+#include "Dynamics.hpp"
+#include "Tuning.hpp"
+#include "RingBuffer.hpp"
+#include "AudioGraph.hpp"
+#include "Resampler.hpp"
+#include "QualityGovernor.hpp"
+
+// The engine: voices, instruments, effects, the graph they are wired up in and the block
+// renderer the sound card calls, all held by an Engine. Engines share no state, so an
+// offline renderer can run as many as it has cores.
+// Nothing here touches the platform, so tests and offline renders use it as it is.
+// generateSound() runs on the audio thread and never locks or allocates: the control
+// side talks to it through the event queue, and everything it needs is reserved up front.
+
+#define NUM_INSTRUMENTS 9
+#define NUM_SOUND_EFFECTS 7
+#define MAX_NOTES 128				// Notes held at once, further note-ons are dropped
+#define MAX_BLOCK_FRAMES 1024		// Largest block rendered without allocating
+#define SYNTH_EVENT_QUEUE_SIZE 1024
+
+// A voice whose block peak stays below the threshold for the hold time stops being rendered
+#define SILENCE_THRESHOLD 1.0e-5
+#define SILENCE_HOLD_TIME 0.05
+#define STEAL_FADE_TIME 0.005		// Stolen voices fade out over this long instead of stopping mid-waveform
+
+enum class SYNTH_EVENT {
+	NOTE_ON,
+	NOTE_OFF,
+	INSTRUMENT,			// Select the instrument in a_value
+	SOUND_EFFECT,		// Select the sound effect in a_value
+	NEXT_FM_ALGORITHM,	// Step the FM synthesizer to its next algorithm
+	PITCH_BEND,			// Bend every voice by a_amount semitones
+	MOD_WHEEL,			// Mod wheel position in a_amount, 0 to 1
+	SUSTAIN				// Sustain pedal down while a_value is 1
+};
+
+// Control change for the audio thread. It lands on the frame its time falls on, events
+// stamped before the block being rendered apply at its start.
+struct SynthEvent
+{
+	SYNTH_EVENT a_type;
+	int a_value;			// Note id for note events
+	double a_time;
+	double a_amount;		// Velocity for note-ons, semitones for pitch bend, 0 to 1 for the mod wheel
+};
+
+// Events from one control thread, in time order. The engine holds back the first event
+// that is not due yet, so the ones after it wait their turn without being reordered.
+class EventQueue
+{
+private:
+	SpscRingBuffer<SynthEvent> a_events;
+	SynthEvent a_pending;
+	bool a_has_pending;
+
+public:
+	EventQueue(size_t capacity)
+		: a_events(capacity), a_pending(), a_has_pending(false)
+	{
+	}
+
+	// Control thread side. Returns false when the queue is full and the event was dropped.
+	bool post(const SynthEvent& event)
+	{
+		return a_events.write(&event, 1) == 1;
+	}
+
+	// Not thread safe, only call while the engine is idle
+	void reset()
+	{
+		a_events.reset();
+		a_has_pending = false;
+	}
+
+	// Audio thread side. Applies every event due by time and returns the frames, up to
+	// frames, until the next one.
+	template<typename Apply>
+	uint32_t applyDue(double time, double time_step, uint32_t frames, Apply apply)
+	{
+		while (a_has_pending || a_events.read(&a_pending, 1) == 1) {
+			a_has_pending = true;
+			double offset = std::round((a_pending.a_time - time) / time_step);
+			if (offset >= 1.0)
+				return static_cast<uint32_t>(std::min(offset, static_cast<double>(frames)));
+
+			apply(a_pending);
+			a_has_pending = false;
+		}
+		return frames;
+	}
+};
+
+std::array<std::unique_ptr<BaseInstrument<Sample>>, NUM_INSTRUMENTS> makeInstruments()
+{
+	std::array<std::unique_ptr<BaseInstrument<Sample>>, NUM_INSTRUMENTS> made = { std::make_unique<Piano>(), std::make_unique<Accordion>(), std::make_unique<Trumpet>(), std::make_unique<Saxophone>(), std::make_unique<Drum>(), std::make_unique<PluckedString>(), std::make_unique<FMSynth>(), std::make_unique<Sampler>(), std::make_unique<Granular>() };
+	for (auto& instrument : made)
+		instrument->prepare(MAX_BLOCK_FRAMES);
+	return made;
+}
+
+// Effects keep state, so each side of the stereo mix gets its own set. They start out at
+// the default rate, setSampleRate() moves them. The right side's modulated effects sweep
+// a quarter of a cycle behind the left's, which spreads them across the stereo field.
+std::array<std::unique_ptr<BaseSoundEffect<Sample>>, NUM_SOUND_EFFECTS> makeSoundEffects(int channel = 0)
+{
+	uint32_t phase_offset = channel == 0 ? 0 : 0x40000000u;
+	return { std::make_unique<BaseSoundEffect<Sample>>(), std::make_unique<Flanger<Sample>>(5.0, 0.5, 0.25), std::make_unique<Delay<Sample>>(1.0, 0.7), std::make_unique<MultitapReverb<Sample>>(std::vector<ReverbTap<Sample>>{
+		{0.5, 0.5}, // 0.5 seconds delay and 0.5 feedback
+		{0.25, 0.3}, // 0.25 seconds delay and 0.3 feedback
+		{0.125, 0.2}, // 0.125 seconds delay and 0.2 feedback
+		{0.0625, 0.1}, // 0.0625 seconds delay and 0.1 feedback
+		{0.03125, 0.05}, // 0.03125 seconds delay and 0.05 feedback
+		{0.015625, 0.025}, // 0.015625 seconds delay and 0.025 feedback
+		{0.0078125, 0.01}, // 0.0078125 seconds delay and 0.01 feedback
+	}), std::make_unique<Chorus<Sample>>(6, 15.0, 8.0, 0.5, 0.8, phase_offset), std::make_unique<Ensemble<Sample>>(0.6, 6.0, phase_offset),
+		std::make_unique<Phaser<Sample>>(6, 0.8, 0.4, static_cast<Sample>(0.5), phase_offset) };
+}
+
+
+template<typename T>
+void safeRemove(T& v, bool(*func)(Note const& item))
+{
+	auto n = v.begin();
+	while (n != v.end()) {
+		if (!func(*n)) {
+			n = v.erase(n);
+		}
+		else {
+			++n;
+		}
+	}
+}
+
+// Silent release tails are dropped, held voices that went silent are put to sleep
+void trackVoiceLevel(Note& n, double peak, double block_duration)
+{
+	n.a_level = peak;
+	if (peak >= SILENCE_THRESHOLD) {
+		n.a_silent_time = 0.0;
+		return;
+	}
+
+	n.a_silent_time += block_duration;
+	if (n.a_silent_time < SILENCE_HOLD_TIME)
+		return;
+
+	if (n.a_off > n.a_on)
+		n.a_active = false;
+	else
+		n.a_sleeping = true;
+}
+
+// A stolen voice ramps down to silence, a retriggered one back up to full
+void fadeStolenVoice(Note& n, float* voice, uint32_t frames, double time_step)
+{
+	float step = static_cast<float>(time_step / STEAL_FADE_TIME);
+	for (uint32_t i = 0; i < frames; i++) {
+		n.a_steal_gain = n.a_stolen ? std::max(n.a_steal_gain - step, 0.0f) : std::min(n.a_steal_gain + step, 1.0f);
+		voice[i] *= n.a_steal_gain;
+	}
+}
+
+// Pan law on the shared sine table for pans that change every sample
+inline void fastPanGains(float pan, float& gain_left, float& gain_right)
+{
+	uint32_t phase = static_cast<uint32_t>((std::clamp(pan, -1.0f, 1.0f) + 1.0f) * 0.125f * 4294967296.0f);
+	gain_left = std::numbers::sqrt2_v<float> * sine_table.lookup(phase + 0x40000000u);
+	gain_right = std::numbers::sqrt2_v<float> * sine_table.lookup(phase);
+}
+
+// Add a voice to the stereo mix with its modulated amplitude and pan. Both are ramped from
+// the values of the last block so block-rate modulation doesn't step audibly.
+void mixVoice(Note& n, const VoiceModulation& modulation, const float* voice, float* left, float* right, uint32_t frames, const float* audio_amplitude, const float* audio_pan)
+{
+	float amplitude = static_cast<float>(modulation.a_amplitude);
+	float pan = static_cast<float>(modulation.a_pan);
+	if (n.a_mixed_amplitude < 0.0f) {
+		n.a_mixed_amplitude = amplitude;
+		n.a_mixed_pan = pan;
+	}
+
+	if (audio_amplitude == nullptr && audio_pan == nullptr) {
+		float start_left, start_right, end_left, end_right;
+		panGains(n.a_mixed_pan, start_left, start_right);
+		panGains(pan, end_left, end_right);
+
+		float gain_left = start_left * n.a_mixed_amplitude;
+		float gain_right = start_right * n.a_mixed_amplitude;
+		float step_left = (end_left * amplitude - gain_left) / frames;
+		float step_right = (end_right * amplitude - gain_right) / frames;
+		for (uint32_t i = 0; i < frames; i++) {
+			left[i] += voice[i] * gain_left;
+			right[i] += voice[i] * gain_right;
+			gain_left += step_left;
+			gain_right += step_right;
+		}
+	}
+	else {
+		float block_amplitude = n.a_mixed_amplitude;
+		float block_pan = n.a_mixed_pan;
+		float step_amplitude = (amplitude - block_amplitude) / frames;
+		float step_pan = (pan - block_pan) / frames;
+		for (uint32_t i = 0; i < frames; i++) {
+			float sample_amplitude = std::max(block_amplitude + (audio_amplitude != nullptr ? audio_amplitude[i] : 0.0f), 0.0f);
+			float gain_left, gain_right;
+			fastPanGains(block_pan + (audio_pan != nullptr ? audio_pan[i] : 0.0f), gain_left, gain_right);
+			left[i] += voice[i] * sample_amplitude * gain_left;
+			right[i] += voice[i] * sample_amplitude * gain_right;
+			block_amplitude += step_amplitude;
+			block_pan += step_pan;
+		}
+	}
+
+	n.a_mixed_amplitude = amplitude;
+	n.a_mixed_pan = pan;
+}
+
+class Engine;
+std::unique_ptr<AudioGraph> makeDefaultGraph(Engine& engine);
+
+// One synthesizer. The control thread posts events and reads the public state, the
+// audio thread calls generateSound(); nothing is shared with any other engine.
+class Engine
+{
+public:
+	// Only the audio thread touches the notes; the control thread posts events and reads a_note_count
+	std::vector<Note> a_notes;
+	std::atomic<size_t> a_note_count;
+	EventQueue a_synth_events;	// From the main thread: keys, arpeggiator, instrument changes
+	EventQueue a_midi_events;	// From the MIDI input thread
+
+	std::atomic<int> a_instrument_index;
+	std::atomic<int> a_sound_effect_index;
+	std::array<std::unique_ptr<BaseInstrument<Sample>>, NUM_INSTRUMENTS> a_instruments;
+	std::array<std::array<std::unique_ptr<BaseSoundEffect<Sample>>, NUM_SOUND_EFFECTS>, 2> a_sound_effects;
+	MasterDynamics a_master_dynamics;
+	Tuning a_tuning;
+
+	// Off unless the audio thread has a deadline to keep, see QualityGovernor
+	QualityGovernor a_governor;
+
+	// Swap the graph only while the engine is idle, edits to it go through commit()
+	std::unique_ptr<AudioGraph> a_graph;
+
+private:
+	int a_octave;
+
+	// Performance controls, changed through events on the audio thread only
+	double a_pitch_bend;
+	double a_mod_wheel;
+	bool a_sustain_pedal;
+	uint64_t a_note_serial;
+	uint64_t a_noise_seed;
+
+	std::vector<float> a_mix_left;
+	std::vector<float> a_mix_right;
+
+	// Oversampling each instrument was built with, given back when the governor allows it again
+	std::array<uint32_t, NUM_INSTRUMENTS> a_full_oversampling;
+
+	// The graph can render at a lower rate than the output and be resampled up to it. It
+	// then runs on a clock of its own, counted in frames at the render rate.
+	double a_sample_rate;
+	double a_render_rate;
+	Resampler a_resampler;
+	std::vector<float> a_render_left;
+	std::vector<float> a_render_right;
+	uint64_t a_render_clock;
+	double a_render_start;
+
+public:
+	// A render rate of 0 renders at the output rate
+	Engine(double sample_rate = DEFAULT_SAMPLE_RATE, double render_rate = 0.0)
+		: a_note_count(0), a_synth_events(SYNTH_EVENT_QUEUE_SIZE), a_midi_events(SYNTH_EVENT_QUEUE_SIZE), a_instrument_index(0), a_sound_effect_index(0),
+		a_instruments(makeInstruments()), a_sound_effects{ makeSoundEffects(0), makeSoundEffects(1) }, a_governor(MAX_NOTES), a_octave(0),
+		a_pitch_bend(0.0), a_mod_wheel(0.0), a_sustain_pedal(false), a_note_serial(0), a_noise_seed(DEFAULT_NOISE_SEED), a_mix_left(MAX_BLOCK_FRAMES), a_mix_right(MAX_BLOCK_FRAMES),
+		a_sample_rate(0.0), a_render_rate(0.0), a_render_clock(0), a_render_start(0.0)
+	{
+		a_notes.reserve(MAX_NOTES);
+		for (int i = 0; i < NUM_INSTRUMENTS; i++)
+			a_full_oversampling[i] = a_instruments[i]->getOversampling();
+		a_graph = makeDefaultGraph(*this);
+		setSampleRate(sample_rate, render_rate);
+	}
+
+	Engine(const Engine&) = delete;
+	Engine& operator=(const Engine&) = delete;
+
+	BaseInstrument<Sample>& getInstrument()
+	{
+		return *a_instruments[a_instrument_index];
+	}
+
+	BaseSoundEffect<Sample>& getSoundEffect(int channel)
+	{
+		return *a_sound_effects[channel][a_sound_effect_index];
+	}
+
+	int getOctave() const
+	{
+		return a_octave;
+	}
+
+	// Control thread
+	void setOctave(int octave)
+	{
+		a_octave = octave;
+		a_tuning.setOctave(octave);
+	}
+
+	double getPitchBend() const
+	{
+		return a_pitch_bend;
+	}
+
+	double getModWheel() const
+	{
+		return a_mod_wheel;
+	}
+
+	// Only while the engine is idle. Instruments and effects recompute their coefficients and
+	// resize their buffers for the render rate, the master dynamics for the output rate.
+	// A render rate of 0 renders at the output rate.
+	void setSampleRate(double sample_rate, double render_rate = 0.0)
+	{
+		a_sample_rate = sample_rate;
+		a_render_rate = render_rate > 0.0 ? render_rate : sample_rate;
+
+		for (auto& instrument : a_instruments)
+			instrument->setSampleRate(a_render_rate);
+		for (auto& effects : a_sound_effects) {
+			for (auto& effect : effects)
+				effect->setSampleRate(a_render_rate);
+		}
+		a_master_dynamics.setSampleRate(a_sample_rate);
+
+		a_resampler.setRates(a_render_rate, a_sample_rate, MAX_BLOCK_FRAMES);
+		a_render_left.resize(isResampling() ? a_resampler.getMaxInputFrames(MAX_BLOCK_FRAMES) : 0);
+		a_render_right.resize(a_render_left.size());
+		a_render_clock = 0;
+	}
+
+	double getSampleRate() const
+	{
+		return a_sample_rate;
+	}
+
+	// Seed the noise, random modulation and drum hits of notes started from now on derive
+	// from. Set it before rendering, the same seed renders the same notes bit for bit.
+	void setNoiseSeed(uint64_t seed)
+	{
+		a_noise_seed = seed;
+	}
+
+	uint64_t getNoiseSeed() const
+	{
+		return a_noise_seed;
+	}
+
+	double getRenderRate() const
+	{
+		return a_render_rate;
+	}
+
+	bool isResampling() const
+	{
+		return a_render_rate != a_sample_rate;
+	}
+
+	void generateSound(AudioBus& bus, double time, double time_step)
+	{
+		auto render_start = std::chrono::steady_clock::now();
+		if (a_notes.size() > a_governor.getVoiceLimit())
+			stealVoices(a_governor.getVoiceLimit());
+
+		// Only blocks beyond MAX_BLOCK_FRAMES allocate here, the graph renders them in pieces
+		uint32_t frames = bus.getFrames();
+		if (a_mix_left.size() < frames) {
+			a_mix_left.resize(frames);
+			a_mix_right.resize(frames);
+		}
+
+		if (isResampling()) {
+			// The render clock starts on the first block and then counts the frames the resampler took
+			uint32_t render_frames = a_resampler.inputFramesFor(frames);
+			if (a_render_left.size() < render_frames) {
+				a_render_left.resize(render_frames);
+				a_render_right.resize(render_frames);
+			}
+			if (a_render_clock == 0)
+				a_render_start = time;
+
+			double render_step = 1.0 / a_render_rate;
+			renderGraph(a_render_left.data(), a_render_right.data(), render_frames, a_render_start + a_render_clock * render_step, render_step);
+			a_resampler.process(a_render_left.data(), a_render_right.data(), render_frames, a_mix_left.data(), a_mix_right.data(), frames);
+			a_render_clock += render_frames;
+		}
+		else
+			renderGraph(a_mix_left.data(), a_mix_right.data(), frames, time, time_step);
+
+		// Level the mix and keep it out of the clipper however many voices play
+		a_master_dynamics.process(a_mix_left.data(), a_mix_right.data(), frames);
+
+		bus.addStereo(a_mix_left.data(), a_mix_right.data());
+
+		// The governor judges the whole block, resampling and dynamics included
+		std::chrono::duration<double> render_time = std::chrono::steady_clock::now() - render_start;
+		if (a_governor.update(render_time.count(), frames / a_sample_rate, time, playingVoices()))
+			applyQuality();
+	}
+
+	// Control thread side. Returns false when the queue is full and the event was dropped.
+	bool postEvent(const SynthEvent& event)
+	{
+		return a_synth_events.post(event);
+	}
+
+	bool postNoteOn(int id, double time, double velocity = 1.0)
+	{
+		return postEvent({ SYNTH_EVENT::NOTE_ON, id, time, velocity });
+	}
+
+	bool postNoteOff(int id, double time)
+	{
+		return postEvent({ SYNTH_EVENT::NOTE_OFF, id, time, 0.0 });
+	}
+
+private:
+	// Events land on their own frame: the block is rendered in segments that end where the next event is due
+	void renderGraph(float* left, float* right, uint32_t frames, double time, double time_step)
+	{
+		auto apply = [this](const SynthEvent& event) { applyEvent(event); };
+		uint32_t done = 0;
+		while (done < frames) {
+			double segment_time = time + done * time_step;
+			uint32_t limit = std::min<uint32_t>(frames - done, MAX_BLOCK_FRAMES);
+			uint32_t segment = std::min(a_synth_events.applyDue(segment_time, time_step, limit, apply),
+				a_midi_events.applyDue(segment_time, time_step, limit, apply));
+
+			a_graph->process(left + done, right + done, segment, segment_time, time_step);
+			done += segment;
+		}
+	}
+
+	// Bring every instrument to the governor's stage. Only oversampled instruments are retuned,
+	// the others would have nothing to change and may reset state on the way.
+	void applyQuality()
+	{
+		for (int i = 0; i < NUM_INSTRUMENTS; i++) {
+			a_instruments[i]->a_detail = a_governor.getDetail();
+			uint32_t factor = a_governor.allowsOversampling() ? a_full_oversampling[i] : 1;
+			if (a_instruments[i]->getOversampling() != factor)
+				a_instruments[i]->setOversampling(factor);
+		}
+	}
+
+	// Voices still sounding. Finished notes wait in a_notes until they are dropped, stolen ones
+	// until they have faded out.
+	size_t playingVoices() const
+	{
+		return std::count_if(a_notes.begin(), a_notes.end(), [](Note const& item) { return item.a_active && !item.a_sleeping && !item.a_stolen; });
+	}
+
+	// Steal the quietest voices over limit, released ones before held ones. They fade out over
+	// STEAL_FADE_TIME, so the cut doesn't click, and are dropped with their per-voice state.
+	void stealVoices(size_t limit)
+	{
+		size_t playing = playingVoices();
+		for (; playing > limit; playing--) {
+			Note* quietest = nullptr;
+			for (Note& n : a_notes) {
+				if (!n.a_active || n.a_sleeping || n.a_stolen)
+					continue;
+				bool is_released = n.a_off > n.a_on;
+				bool was_released = quietest != nullptr && quietest->a_off > quietest->a_on;
+				if (quietest == nullptr || (is_released && !was_released) || (is_released == was_released && n.a_level < quietest->a_level))
+					quietest = &n;
+			}
+			quietest->a_stolen = true;
+		}
+	}
+
+	// Apply one event the control side posted. Audio thread only.
+	void applyEvent(const SynthEvent& event)
+	{
+		switch (event.a_type) {
+		case SYNTH_EVENT::NOTE_ON:
+			noteOn(event.a_value, event.a_time, event.a_amount);
+			break;
+		case SYNTH_EVENT::NOTE_OFF:
+			noteOff(event.a_value, event.a_time);
+			break;
+		case SYNTH_EVENT::INSTRUMENT:
+			a_instrument_index = std::clamp(event.a_value, 0, NUM_INSTRUMENTS - 1);
+			break;
+		case SYNTH_EVENT::SOUND_EFFECT:
+			a_sound_effect_index = std::clamp(event.a_value, 0, NUM_SOUND_EFFECTS - 1);
+			break;
+		case SYNTH_EVENT::NEXT_FM_ALGORITHM:
+			if (auto fm = dynamic_cast<FMSynth*>(&getInstrument()))
+				fm->setAlgorithm((fm->getAlgorithm() + 1) % FM_ALGORITHMS);
+			break;
+		case SYNTH_EVENT::PITCH_BEND:
+			a_pitch_bend = event.a_amount;
+			break;
+		case SYNTH_EVENT::MOD_WHEEL:
+			a_mod_wheel = std::clamp(event.a_amount, 0.0, 1.0);
+			break;
+		case SYNTH_EVENT::SUSTAIN:
+			setSustain(event.a_value != 0, event.a_time);
+			break;
+		}
+	}
+
+	// Start a note, or retrigger it if it is still sounding its release or only held by the
+	// sustain pedal
+	void noteOn(int id, double time, double velocity)
+	{
+		auto note_found = std::find_if(a_notes.begin(), a_notes.end(), [id](Note const& item) { return item.a_id == id; });
+		if (note_found == a_notes.end()) {
+			if (a_notes.size() == MAX_NOTES)
+				return;
+			a_notes.emplace_back(id, time, 0.0, true, ++a_note_serial, a_noise_seed);
+			a_notes.back().a_velocity = velocity;
+			return;
+		}
+
+		// Key has been pressed again during release phase
+		if (note_found->a_off > note_found->a_on || note_found->a_sustained) {
+			note_found->a_on = time;
+			note_found->a_active = true;
+			note_found->a_sleeping = false;
+			note_found->a_sustained = false;
+			note_found->a_stolen = false;
+			note_found->a_silent_time = 0.0;
+			note_found->a_base_freq = 0.0;
+			note_found->a_velocity = velocity;
+		}
+	}
+
+	// Release a held note, or leave it to the sustain pedal while that is down
+	void noteOff(int id, double time)
+	{
+		auto note_found = std::find_if(a_notes.begin(), a_notes.end(), [id](Note const& item) { return item.a_id == id; });
+		if (note_found == a_notes.end() || !(note_found->a_off < note_found->a_on))
+			return;
+
+		if (a_sustain_pedal)
+			note_found->a_sustained = true;
+		else
+			note_found->a_off = time;
+	}
+
+	// Lifting the pedal releases every note whose key is already up
+	void setSustain(bool is_down, double time)
+	{
+		a_sustain_pedal = is_down;
+		if (is_down)
+			return;
+
+		for (Note& n : a_notes) {
+			if (n.a_sustained) {
+				n.a_off = time;
+				n.a_sustained = false;
+			}
+		}
+	}
+};
+
+// The engine's selected instrument playing its voices. There is one voice list per
+// engine, so a graph holds one of these.
+class InstrumentNode : public AudioNode
+{
+private:
+	Engine& a_engine;
+	std::vector<float> a_voice_buffer;
+	std::vector<float> a_oversampled_left;
+	std::vector<float> a_oversampled_right;
+
+public:
+	InstrumentNode(Engine& engine)
+		: a_engine(engine)
+	{
+	}
+
+	virtual NODE_TYPE getType() const override
+	{
+		return NODE_TYPE::SOURCE;
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"Instrument";
+	}
+
+	// Room for voices rendered at up to 4x oversampling
+	virtual void prepare(uint32_t max_frames) override
+	{
+		a_voice_buffer.resize(max_frames * 4);
+		a_oversampled_left.resize(max_frames * 4);
+		a_oversampled_right.resize(max_frames * 4);
+	}
+
+	virtual void process(NodeBuffer buffer, uint32_t frames, double time, double time_step) override
+	{
+		// Oversampled instruments render their voices at a multiple of the output rate and are decimated once
+		BaseInstrument<Sample>& instrument = a_engine.getInstrument();
+		uint32_t render_frames = frames * instrument.getOversampling();
+		double render_step = time_step / instrument.getOversampling();
+		bool is_oversampled = instrument.getOversampling() > 1;
+		float* render_left = is_oversampled ? a_oversampled_left.data() : buffer.a_left;
+		float* render_right = is_oversampled ? a_oversampled_right.data() : buffer.a_right;
+
+		std::fill_n(render_left, render_frames, 0.0f);
+		std::fill_n(render_right, render_frames, 0.0f);
+
+		// Shared modulation sources advance once per block, at the rate the voices render at
+		ModMatrix& modulation = instrument.a_modulation;
+		modulation.setModWheel(a_engine.getModWheel());
+		modulation.beginBlock(render_frames, render_step);
+
+		double pitch_bend = a_engine.getPitchBend();
+		std::vector<Note>& notes = a_engine.a_notes;
+		std::for_each(notes.begin(), notes.end(), [&](Note& n) {
+			// A sleeping voice stays silent through its release, so it can go as soon as the key is up
+			if (n.a_sleeping) {
+				if (n.a_off > n.a_on || n.a_stolen)
+					n.a_active = false;
+				return;
+			}
+
+			// The tuned pitch is fixed for the life of the voice, modulation and the pitch bend move around it
+			if (n.a_base_freq <= 0.0)
+				n.a_base_freq = a_engine.a_tuning.frequency(n.a_id);
+
+			VoiceModulation voice_modulation = modulation.evaluate(n, time);
+			n.a_freq = instrument.tracksPitchModulation() ? n.a_base_freq * std::exp2((voice_modulation.a_pitch + pitch_bend) / 12.0) : n.a_base_freq;
+			n.a_cutoff_shift = voice_modulation.a_cutoff;
+
+			bool is_note_finished = false;
+			instrument.render(time, render_step, n, a_voice_buffer.data(), render_frames, is_note_finished);
+			if (n.a_stolen || n.a_steal_gain < 1.0f)
+				fadeStolenVoice(n, a_voice_buffer.data(), render_frames, render_step);
+
+			float peak = 0.0f;
+			for (uint32_t i = 0; i < render_frames; i++)
+				peak = std::max(peak, std::fabs(a_voice_buffer[i]));
+			mixVoice(n, voice_modulation, a_voice_buffer.data(), render_left, render_right, render_frames, modulation.audioAmplitude(), modulation.audioPan());
+			trackVoiceLevel(n, peak, frames * time_step);
+
+			if ((is_note_finished && n.a_off > n.a_on) || (n.a_stolen && n.a_steal_gain <= 0.0f)) {
+				n.a_active = false;
+			}
+			});
+
+		// Let the instrument free per-voice state, then compact the voice list once per block
+		for (const Note& n : notes) {
+			if (!n.a_active)
+				instrument.releaseVoice(n);
+		}
+		safeRemove<std::vector<Note>>(notes, [](Note const& item) { return item.a_active; });
+		a_engine.a_note_count = notes.size();
+
+		if (is_oversampled) {
+			instrument.a_decimators[0].process(render_left, buffer.a_left, frames);
+			instrument.a_decimators[1].process(render_right, buffer.a_right, frames);
+		}
+	}
+};
+
+// The engine's selected sound effect, moved by the selected instrument's effect modulation
+class SelectedEffectNode : public AudioNode
+{
+private:
+	Engine& a_engine;
+
+public:
+	SelectedEffectNode(Engine& engine)
+		: a_engine(engine)
+	{
+	}
+
+	virtual NODE_TYPE getType() const override
+	{
+		return NODE_TYPE::EFFECT;
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return a_engine.getSoundEffect(0).getName();
+	}
+
+	virtual void process(NodeBuffer buffer, uint32_t frames, double, double) override
+	{
+		double effect_amount = a_engine.getInstrument().a_modulation.effectAmount();
+		for (int c = 0; c < 2; c++) {
+			BaseSoundEffect<Sample>& effect = a_engine.getSoundEffect(c);
+			effect.modulate(effect_amount);
+
+			processBuffer(effect, c == 0 ? buffer.a_left : buffer.a_right, frames);
+		}
+	}
+};
+
+// The instrument into the selected effect into the bus, the layout the keyboard plays.
+// Other layouts, such as send effects next to it, are built on the same graph.
+std::unique_ptr<AudioGraph> makeDefaultGraph(Engine& engine)
+{
+	auto graph = std::make_unique<AudioGraph>(MAX_BLOCK_FRAMES);
+	int instrument = graph->addNode(std::make_shared<InstrumentNode>(engine));
+	int effect = graph->addNode(std::make_shared<SelectedEffectNode>(engine));
+	int bus = graph->addNode(std::make_shared<BusNode>());
+	graph->connect(instrument, effect);
+	graph->connect(effect, bus);
+	graph->setOutput(bus);
+	graph->commit();
+	return graph;
+}
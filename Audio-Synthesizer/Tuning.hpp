@@ -0,0 +1,209 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+
+#define TUNING_TABLE_SIZE 192
+#define TUNING_LOWEST_NOTE -64		// Note ids below middle C are negative, so the table starts here
+#define TUNING_KBM_MIDDLE_C 60		// MIDI note number a .kbm file gives middle C, note id 0
+
+// Maps note ids to frequencies. The scale comes from a Scala .scl file (12-TET by
+// default) and the key layout from a Scala .kbm file. The whole table is rebuilt
+// when the tuning or the octave changes, so the render path only does a lookup.
+class Tuning
+{
+private:
+	// Ratio of every scale degree above the root, the last entry is the period (usually 2/1)
+	std::vector<double> a_scale;
+
+	// Keyboard mapping, as in a .kbm file. An empty mapping maps keys linearly onto degrees.
+	std::vector<int> a_mapping;		// Scale degree per key in the pattern, -1 for unmapped keys
+	int a_middle_note;				// Key that plays the first entry of the mapping
+	int a_reference_note;
+	double a_reference_frequency;
+	int a_octave_degree;			// Degree the mapping pattern repeats at
+
+	int a_octave;
+
+	// Double buffered so the render thread never sees a half built table
+	std::array<std::array<double, TUNING_TABLE_SIZE>, 2> a_tables;
+	std::atomic<int> a_active_table;
+
+public:
+	Tuning()
+		: a_middle_note(0), a_reference_note(0), a_reference_frequency(256.0), a_octave_degree(0), a_octave(0), a_active_table(0)
+	{
+		setEqualTemperament(12);
+	}
+
+	double frequency(int note_id) const
+	{
+		int index = std::clamp(note_id - TUNING_LOWEST_NOTE, 0, TUNING_TABLE_SIZE - 1);
+		return a_tables[a_active_table.load(std::memory_order_acquire)][index];
+	}
+
+	void setEqualTemperament(int divisions)
+	{
+		a_scale.clear();
+		for (int i = 1; i <= divisions; i++)
+			a_scale.push_back(std::pow(2.0, static_cast<double>(i) / divisions));
+		rebuild();
+	}
+
+	// Shift the keyboard by whole periods of the scale
+	void setOctave(int octave)
+	{
+		a_octave = octave;
+		rebuild();
+	}
+
+	void setReferencePitch(int note_id, double frequency)
+	{
+		a_reference_note = note_id;
+		a_reference_frequency = frequency;
+		rebuild();
+	}
+
+	// Load a Scala scale. Pitches with a '.' are cents, everything else is a ratio.
+	bool loadScala(const std::string& path)
+	{
+		std::ifstream file(path);
+		if (!file)
+			return false;
+
+		std::vector<std::string> lines = readLines(file);
+		if (lines.size() < 2)
+			return false;
+
+		// First line is the description, second the number of pitches
+		int count = std::atoi(lines[1].c_str());
+		if (count <= 0 || lines.size() < static_cast<size_t>(count) + 2)
+			return false;
+
+		std::vector<double> scale;
+		for (int i = 0; i < count; i++)
+		{
+			std::istringstream line(lines[i + 2]);
+			std::string pitch;
+			line >> pitch;
+
+			double ratio = 0.0;
+			if (pitch.find('.') != std::string::npos)
+			{
+				ratio = std::pow(2.0, std::atof(pitch.c_str()) / 1200.0);
+			}
+			else
+			{
+				size_t slash = pitch.find('/');
+				double numerator = std::atof(pitch.substr(0, slash).c_str());
+				double denominator = slash == std::string::npos ? 1.0 : std::atof(pitch.substr(slash + 1).c_str());
+				ratio = denominator != 0.0 ? numerator / denominator : 0.0;
+			}
+
+			if (ratio <= 0.0)
+				return false;
+			scale.push_back(ratio);
+		}
+
+		a_scale = std::move(scale);
+		rebuild();
+		return true;
+	}
+
+	// Load a Scala keyboard mapping. The first/last note range is ignored, every key is mapped.
+	// The file numbers keys as MIDI notes, they are moved to note ids on the way in.
+	bool loadKeyboardMapping(const std::string& path)
+	{
+		std::ifstream file(path);
+		if (!file)
+			return false;
+
+		std::vector<std::string> lines = readLines(file);
+		if (lines.size() < 7)
+			return false;
+
+		int map_size = std::atoi(lines[0].c_str());
+		if (map_size < 0 || lines.size() < static_cast<size_t>(map_size) + 7)
+			return false;
+
+		std::vector<int> mapping;
+		for (int i = 0; i < map_size; i++)
+		{
+			std::istringstream line(lines[i + 7]);
+			std::string degree;
+			line >> degree;
+			mapping.push_back(degree == "x" ? -1 : std::atoi(degree.c_str()));
+		}
+
+		a_mapping = std::move(mapping);
+		a_middle_note = std::atoi(lines[3].c_str()) - TUNING_KBM_MIDDLE_C;
+		a_reference_note = std::atoi(lines[4].c_str()) - TUNING_KBM_MIDDLE_C;
+		a_reference_frequency = std::atof(lines[5].c_str());
+		a_octave_degree = std::atoi(lines[6].c_str());
+		rebuild();
+		return true;
+	}
+
+private:
+	static std::vector<std::string> readLines(std::ifstream& file)
+	{
+		std::vector<std::string> lines;
+		std::string line;
+		while (std::getline(file, line))
+		{
+			if (!line.empty() && line[0] == '!')
+				continue;
+			lines.push_back(line);
+		}
+		return lines;
+	}
+
+	// Keys in one repetition of the layout, which is what an octave shift moves by
+	int keysPerPeriod() const
+	{
+		return a_mapping.empty() ? static_cast<int>(a_scale.size()) : static_cast<int>(a_mapping.size());
+	}
+
+	// Ratio of a key to the root of the scale, or 0 for unmapped keys
+	double ratio(int key) const
+	{
+		int degree = key - a_middle_note;
+		if (!a_mapping.empty())
+		{
+			int size = static_cast<int>(a_mapping.size());
+			int repeats = static_cast<int>(std::floor(static_cast<double>(degree) / size));
+			int mapped = a_mapping[degree - repeats * size];
+			if (mapped < 0)
+				return 0.0;
+
+			int octave_degree = a_octave_degree > 0 ? a_octave_degree : static_cast<int>(a_scale.size());
+			degree = repeats * octave_degree + mapped;
+		}
+
+		int size = static_cast<int>(a_scale.size());
+		int periods = static_cast<int>(std::floor(static_cast<double>(degree) / size));
+		int step = degree - periods * size;
+		return std::pow(a_scale.back(), periods) * (step == 0 ? 1.0 : a_scale[step - 1]);
+	}
+
+	void rebuild()
+	{
+		int next = 1 - a_active_table.load(std::memory_order_relaxed);
+		std::array<double, TUNING_TABLE_SIZE>& table = a_tables[next];
+
+		double reference_ratio = ratio(a_reference_note);
+		double root = reference_ratio > 0.0 ? a_reference_frequency / reference_ratio : a_reference_frequency;
+		int shift = a_octave * keysPerPeriod();
+
+		for (int index = 0; index < TUNING_TABLE_SIZE; index++)
+			table[index] = root * ratio(index + TUNING_LOWEST_NOTE + shift);
+
+		a_active_table.store(next, std::memory_order_release);
+	}
+};
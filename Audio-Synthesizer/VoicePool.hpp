@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include "Note.hpp"
+
+// Fixed pool of per-voice state for instruments that need more than a Note carries.
+// A note claims a slot on its first render and a fresh one when it is retriggered.
+// When the pool is full the slot claimed longest ago is stolen. Nothing is allocated
+// after construction.
+template <typename State, size_t N>
+class VoicePool
+{
+private:
+	std::array<State, N> a_states;
+	std::array<uint64_t, N> a_owners;		// Serial of the note holding each slot, 0 when free
+	std::array<uint64_t, N> a_claim_order;
+	uint64_t a_claims;
+
+public:
+	VoicePool()
+		: a_claims(0)
+	{
+		a_owners.fill(0);
+		a_claim_order.fill(0);
+	}
+
+	static constexpr size_t size()
+	{
+		return N;
+	}
+
+	// State of n's voice. is_new is set when the slot was just claimed and needs starting.
+	// Returns nullptr when the voice lost its slot to a newer one.
+	State* acquire(Note& n, bool& is_new)
+	{
+		is_new = false;
+		if (n.a_voice_slot >= 0 && n.a_voice_on == n.a_on)
+			return a_owners[n.a_voice_slot] == n.a_serial ? &a_states[n.a_voice_slot] : nullptr;
+
+		// First render, or the note was retriggered: give up the old slot and take a new one
+		release(n);
+
+		size_t chosen = 0;
+		for (size_t i = 0; i < N; i++)
+		{
+			if (a_owners[i] == 0)
+			{
+				chosen = i;
+				break;
+			}
+			if (a_claim_order[i] < a_claim_order[chosen])
+				chosen = i;
+		}
+
+		a_owners[chosen] = n.a_serial;
+		a_claim_order[chosen] = ++a_claims;
+		n.a_voice_slot = static_cast<int>(chosen);
+		n.a_voice_on = n.a_on;
+		is_new = true;
+		return &a_states[chosen];
+	}
+
+	// State owned by n, or nullptr if it holds no slot
+	State* find(const Note& n)
+	{
+		if (n.a_voice_slot >= 0 && a_owners[n.a_voice_slot] == n.a_serial)
+			return &a_states[n.a_voice_slot];
+		return nullptr;
+	}
+
+	void release(const Note& n)
+	{
+		if (n.a_voice_slot >= 0 && a_owners[n.a_voice_slot] == n.a_serial)
+			a_owners[n.a_voice_slot] = 0;
+	}
+
+	bool isClaimed(size_t slot) const
+	{
+		return a_owners[slot] != 0;
+	}
+
+	State& operator[](size_t slot)
+	{
+		return a_states[slot];
+	}
+};
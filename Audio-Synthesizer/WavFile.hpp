@@ -0,0 +1,255 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+struct WavFormat
+{
+	uint16_t a_format_tag = 0;
+	uint16_t a_channels = 0;
+	uint32_t a_sample_rate = 0;
+	uint16_t a_bits_per_sample = 0;
+	uint64_t a_data_offset = 0;	// Byte offset of the first frame in the file
+	uint64_t a_frames = 0;
+
+	uint32_t frameSize() const
+	{
+		return static_cast<uint32_t>(a_channels) * (a_bits_per_sample / 8);
+	}
+};
+
+inline uint16_t readLittleEndian16(const uint8_t* p)
+{
+	return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+inline uint32_t readLittleEndian32(const uint8_t* p)
+{
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+inline void writeLittleEndian16(uint8_t* p, uint16_t value)
+{
+	p[0] = static_cast<uint8_t>(value);
+	p[1] = static_cast<uint8_t>(value >> 8);
+}
+
+inline void writeLittleEndian32(uint8_t* p, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+// Canonical 44-byte header of a WAV file holding frames of 32-bit float samples
+inline void makeWavHeader(uint8_t* header, uint16_t channels, uint32_t sample_rate, uint64_t frames)
+{
+	uint32_t data_bytes = static_cast<uint32_t>(std::min<uint64_t>(frames * channels * sizeof(float), 0xFFFFFFFFull - 36));
+	std::memcpy(header, "RIFF", 4);
+	writeLittleEndian32(header + 4, 36 + data_bytes);
+	std::memcpy(header + 8, "WAVEfmt ", 8);
+	writeLittleEndian32(header + 16, 16);
+	writeLittleEndian16(header + 20, WAV_FORMAT_FLOAT);
+	writeLittleEndian16(header + 22, channels);
+	writeLittleEndian32(header + 24, sample_rate);
+	writeLittleEndian32(header + 28, sample_rate * channels * sizeof(float));
+	writeLittleEndian16(header + 32, static_cast<uint16_t>(channels * sizeof(float)));
+	writeLittleEndian16(header + 34, 32);
+	std::memcpy(header + 36, "data", 4);
+	writeLittleEndian32(header + 40, data_bytes);
+}
+
+// Writes a 32-bit float WAV file block by block, so long renders never have to be held
+// in memory. The length given to open() goes in the header; when it isn't known up front,
+// finish() rewrites the header for what was actually written.
+class WavWriter
+{
+private:
+	std::ofstream a_file;
+	uint16_t a_channels;
+	uint32_t a_sample_rate;
+	uint64_t a_frames_written;
+	std::vector<uint8_t> a_bytes;
+
+public:
+	WavWriter()
+		: a_channels(0), a_sample_rate(0), a_frames_written(0)
+	{
+	}
+
+	bool open(const std::string& path, uint16_t channels, uint32_t sample_rate, uint64_t frames)
+	{
+		a_file.open(path, std::ios::binary);
+		if (!a_file)
+			return false;
+
+		a_channels = channels;
+		a_sample_rate = sample_rate;
+		a_frames_written = 0;
+		uint8_t header[44];
+		makeWavHeader(header, channels, sample_rate, frames);
+		a_file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		return static_cast<bool>(a_file);
+	}
+
+	// Interleaved frames, appended to the data chunk
+	bool write(const float* samples, uint64_t frames)
+	{
+		// Samples go out byte by byte so the file is little-endian on any host
+		a_bytes.resize(frames * a_channels * sizeof(float));
+		for (uint64_t i = 0; i < frames * a_channels; i++)
+		{
+			uint32_t bits;
+			std::memcpy(&bits, &samples[i], sizeof(bits));
+			writeLittleEndian32(a_bytes.data() + i * sizeof(float), bits);
+		}
+		a_file.write(reinterpret_cast<const char*>(a_bytes.data()), static_cast<std::streamsize>(a_bytes.size()));
+		a_frames_written += frames;
+		return static_cast<bool>(a_file);
+	}
+
+	uint64_t getFramesWritten() const
+	{
+		return a_frames_written;
+	}
+
+	bool close()
+	{
+		a_file.close();
+		return static_cast<bool>(a_file);
+	}
+
+	// Fix the header up for the frames written so far and close the file
+	bool finish()
+	{
+		uint8_t header[44];
+		makeWavHeader(header, a_channels, a_sample_rate, a_frames_written);
+		a_file.seekp(0);
+		a_file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		return close();
+	}
+};
+
+// Write interleaved float frames to a 32-bit float WAV file
+inline bool writeWavFile(const std::string& path, const float* samples, uint64_t frames, uint16_t channels, uint32_t sample_rate)
+{
+	WavWriter writer;
+	return writer.open(path, channels, sample_rate, frames) && writer.write(samples, frames) && writer.close();
+}
+
+// Parse the RIFF header of an in-memory WAV file. Supports 16/24/32-bit integer
+// PCM and 32-bit float, plain or WAVE_FORMAT_EXTENSIBLE.
+inline bool parseWavHeader(const uint8_t* data, size_t size, WavFormat& format)
+{
+	if (size < 12 || std::memcmp(data, "RIFF", 4) != 0 || std::memcmp(data + 8, "WAVE", 4) != 0)
+		return false;
+
+	bool has_format = false;
+	size_t offset = 12;
+	while (offset + 8 <= size)
+	{
+		const uint8_t* chunk = data + offset;
+		uint32_t chunk_size = readLittleEndian32(chunk + 4);
+
+		if (std::memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16 && offset + 8 + chunk_size <= size)
+		{
+			format.a_format_tag = readLittleEndian16(chunk + 8);
+			format.a_channels = readLittleEndian16(chunk + 10);
+			format.a_sample_rate = readLittleEndian32(chunk + 12);
+			format.a_bits_per_sample = readLittleEndian16(chunk + 22);
+
+			// The real format tag of an extensible file is the first two bytes of the sub-format GUID
+			if (format.a_format_tag == WAV_FORMAT_EXTENSIBLE && chunk_size >= 40)
+				format.a_format_tag = readLittleEndian16(chunk + 32);
+			has_format = true;
+		}
+		else if (std::memcmp(chunk, "data", 4) == 0 && has_format)
+		{
+			format.a_data_offset = offset + 8;
+			uint64_t bytes = std::min<uint64_t>(chunk_size, size - format.a_data_offset);
+			if (format.frameSize() == 0)
+				return false;
+			format.a_frames = bytes / format.frameSize();
+
+			bool supported_pcm = format.a_format_tag == WAV_FORMAT_PCM && (format.a_bits_per_sample == 16 || format.a_bits_per_sample == 24 || format.a_bits_per_sample == 32);
+			bool supported_float = format.a_format_tag == WAV_FORMAT_FLOAT && format.a_bits_per_sample == 32;
+			return supported_pcm || supported_float;
+		}
+
+		// Chunks are padded to an even size
+		offset += 8 + chunk_size + (chunk_size & 1);
+	}
+	return false;
+}
+
+// Convert count frames starting at frame start to mono float
+inline void readWavFrames(const uint8_t* data, const WavFormat& format, uint64_t start, uint32_t count, float* out)
+{
+	const uint8_t* frame = data + format.a_data_offset + start * format.frameSize();
+	uint32_t bytes = format.a_bits_per_sample / 8;
+	float channel_gain = 1.0f / static_cast<float>(format.a_channels);
+
+	for (uint32_t n = 0; n < count; n++)
+	{
+		float sum = 0.0f;
+		for (uint16_t c = 0; c < format.a_channels; c++, frame += bytes)
+		{
+			if (format.a_format_tag == WAV_FORMAT_FLOAT)
+			{
+				float value;
+				std::memcpy(&value, frame, sizeof(float));
+				sum += value;
+			}
+			else if (bytes == 2)
+			{
+				sum += static_cast<float>(static_cast<int16_t>(readLittleEndian16(frame))) * (1.0f / 32768.0f);
+			}
+			else if (bytes == 3)
+			{
+				int32_t value = static_cast<int32_t>((frame[0] << 8) | (frame[1] << 16) | (static_cast<uint32_t>(frame[2]) << 24)) >> 8;
+				sum += static_cast<float>(value) * (1.0f / 8388608.0f);
+			}
+			else
+			{
+				sum += static_cast<float>(static_cast<int32_t>(readLittleEndian32(frame))) * (1.0f / 2147483648.0f);
+			}
+		}
+		out[n] = sum * channel_gain;
+	}
+}
+
+// Convert count frames starting at frame start to interleaved float, keeping every channel
+inline void readWavFramesInterleaved(const uint8_t* data, const WavFormat& format, uint64_t start, uint32_t count, float* out)
+{
+	const uint8_t* frame = data + format.a_data_offset + start * format.frameSize();
+	uint32_t bytes = format.a_bits_per_sample / 8;
+
+	for (uint64_t i = 0; i < static_cast<uint64_t>(count) * format.a_channels; i++, frame += bytes)
+	{
+		if (format.a_format_tag == WAV_FORMAT_FLOAT)
+		{
+			uint32_t bits = readLittleEndian32(frame);
+			std::memcpy(&out[i], &bits, sizeof(float));
+		}
+		else if (bytes == 2)
+		{
+			out[i] = static_cast<float>(static_cast<int16_t>(readLittleEndian16(frame))) * (1.0f / 32768.0f);
+		}
+		else if (bytes == 3)
+		{
+			int32_t value = static_cast<int32_t>((frame[0] << 8) | (frame[1] << 16) | (static_cast<uint32_t>(frame[2]) << 24)) >> 8;
+			out[i] = static_cast<float>(value) * (1.0f / 8388608.0f);
+		}
+		else
+		{
+			out[i] = static_cast<float>(static_cast<int32_t>(readLittleEndian32(frame))) * (1.0f / 2147483648.0f);
+		}
+	}
+}
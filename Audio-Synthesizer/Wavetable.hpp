@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <algorithm>
+
+#define SINE_TABLE_BITS 12
+#define SINE_TABLE_SIZE (1 << SINE_TABLE_BITS)
+
+// One cycle of a sine shared by every table-driven oscillator. Phases are 32-bit
+// accumulators where 2^32 is a full cycle, so they wrap for free.
+class SineTable
+{
+private:
+	std::array<float, SINE_TABLE_SIZE + 1> a_table;	// Last entry repeats the first for interpolation
+
+public:
+	SineTable()
+	{
+		for (int i = 0; i <= SINE_TABLE_SIZE; i++)
+			a_table[i] = static_cast<float>(std::sin(2.0 * std::numbers::pi * i / SINE_TABLE_SIZE));
+	}
+
+	// Linearly interpolated lookup, the top bits index the table and the rest are the fraction
+	float lookup(uint32_t phase) const
+	{
+		uint32_t index = phase >> (32 - SINE_TABLE_BITS);
+		float fraction = static_cast<float>(phase & ((1u << (32 - SINE_TABLE_BITS)) - 1)) * (1.0f / (1u << (32 - SINE_TABLE_BITS)));
+		return a_table[index] + fraction * (a_table[index + 1] - a_table[index]);
+	}
+};
+
+inline const SineTable sine_table;
+
+// Phase increment per sample for a frequency
+inline uint32_t phaseIncrement(double hertz, double time_step)
+{
+	double cycles = hertz * time_step;
+	return static_cast<uint32_t>(static_cast<int64_t>((cycles - std::floor(cycles)) * 4294967296.0));
+}
+
+#define LFO_BANK_VOICES 8		// Most LFOs one bank runs
+#define LFO_BANK_FRAMES 64		// Most frames of values one fill() computes
+
+// Sine LFOs sharing one rate with their phases spread evenly over the cycle, one per voice of
+// a modulated effect. fill() computes the next run of every voice's values from the sine
+// table in one pass, so the effect's per-sample loops only read arrays.
+class LFOBank
+{
+private:
+	std::array<uint32_t, LFO_BANK_VOICES> a_phases;
+	std::array<std::array<float, LFO_BANK_FRAMES>, LFO_BANK_VOICES> a_values;
+	int a_voices;
+	uint32_t a_increment;
+	double a_rate;
+	double a_time_step;
+
+public:
+	// phase_offset turns the whole bank, so the two sides of a stereo effect can sweep apart
+	LFOBank(int voices, double rate, uint32_t phase_offset = 0)
+		: a_phases(), a_values(), a_voices(std::clamp(voices, 1, LFO_BANK_VOICES)), a_increment(0), a_rate(rate), a_time_step(0.0)
+	{
+		for (int v = 0; v < a_voices; v++)
+			a_phases[v] = phase_offset + static_cast<uint32_t>(4294967296.0 * v / a_voices);
+	}
+
+	void setRate(double rate)
+	{
+		a_rate = rate;
+		a_increment = phaseIncrement(a_rate, a_time_step);
+	}
+
+	void setSampleRate(double sample_rate)
+	{
+		a_time_step = 1.0 / sample_rate;
+		a_increment = phaseIncrement(a_rate, a_time_step);
+	}
+
+	int getVoices() const
+	{
+		return a_voices;
+	}
+
+	// Values for the next frames, at most LFO_BANK_FRAMES, -1 to 1
+	void fill(uint32_t frames)
+	{
+		for (int v = 0; v < a_voices; v++)
+		{
+			uint32_t phase = a_phases[v];
+			float* out = a_values[v].data();
+			for (uint32_t i = 0; i < frames; i++, phase += a_increment)
+				out[i] = sine_table.lookup(phase);
+			a_phases[v] = phase;
+		}
+	}
+
+	// The voice's values from the last fill()
+	const float* values(int voice) const
+	{
+		return a_values[voice].data();
+	}
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#ifdef _WIN32
+
+#pragma comment(lib, "winmm.lib")
+
+#include <memory>
+#include <Windows.h>
+
+#include "AudioBackend.hpp"
+
+// waveOut device with a ring of blocks. Finished blocks come back through waveOutProc,
+// which wakes the audio thread with an event. SetEvent is one of the few calls the
+// driver allows from its callback, and nothing on either side takes a lock.
+template <typename T>
+class WinMMBackend : public BlockingBackend<T>
+{
+private:
+	uint32_t a_block_samples;
+	uint32_t a_block_current;
+
+	std::unique_ptr<T[]> a_block_memory_ptr;
+	std::unique_ptr<WAVEHDR[]> a_wave_headers;
+	HWAVEOUT a_device;
+
+	std::atomic<uint32_t> a_block_free;
+	HANDLE a_block_done;
+
+public:
+	WinMMBackend()
+		: a_block_samples(0), a_block_current(0), a_device(NULL), a_block_free(0)
+	{
+		a_block_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+
+	~WinMMBackend()
+	{
+		this->close();
+		CloseHandle(a_block_done);
+	}
+
+	virtual std::wstring getName() const override
+	{
+		return L"WinMM";
+	}
+
+	virtual std::vector<std::wstring> enumerate() override
+	{
+		int device_count = waveOutGetNumDevs();
+		std::vector<std::wstring> devices;
+		WAVEOUTCAPS woc;
+		for (int n = 0; n < device_count; n++)
+			if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK) {
+				devices.emplace_back(woc.szPname);
+			}
+		return devices;
+	}
+
+protected:
+	virtual bool openDevice(const std::wstring& device) override
+	{
+		a_block_samples = this->a_block_frames * this->a_channels;
+		a_block_free = this->a_block_count;
+		a_block_current = 0;
+
+		// Validate device
+		std::vector<std::wstring> devices = enumerate();
+		auto d = std::find(devices.begin(), devices.end(), device);
+		if (d == devices.end())
+			return false;
+
+		auto device_id = distance(devices.begin(), d);
+		WAVEFORMATEX waveFormat;
+		waveFormat.wFormatTag = WAVE_FORMAT_PCM;
+		waveFormat.nSamplesPerSec = this->a_sample_rate;
+		waveFormat.wBitsPerSample = sizeof(T) * 8;
+		waveFormat.nChannels = this->a_channels;
+		waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
+		waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
+		waveFormat.cbSize = 0;
+
+		if (waveOutOpen(&a_device, static_cast<UINT>(device_id), &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
+		{
+			a_device = NULL;
+			return false;
+		}
+
+		// Allocate Wave|Block Memory
+		a_block_memory_ptr = std::make_unique<T[]>(this->a_block_count * a_block_samples);
+		ZeroMemory(a_block_memory_ptr.get(), sizeof(T) * this->a_block_count * a_block_samples);
+		a_wave_headers = std::make_unique<WAVEHDR[]>(this->a_block_count);
+		ZeroMemory(a_wave_headers.get(), sizeof(WAVEHDR) * this->a_block_count);
+
+		// Link headers to block memory
+		for (uint32_t n = 0; n < this->a_block_count; n++)
+		{
+			a_wave_headers[n].dwBufferLength = a_block_samples * sizeof(T);
+			a_wave_headers[n].lpData = reinterpret_cast<LPSTR>(a_block_memory_ptr.get() + (n * a_block_samples));
+		}
+		return true;
+	}
+
+	virtual void closeDevice() override
+	{
+		if (a_device != NULL)
+		{
+			waveOutReset(a_device);
+			waveOutClose(a_device);
+			a_device = NULL;
+		}
+	}
+
+	// Number of blocks currently handed to the device and not yet returned
+	virtual uint32_t queuedBlocks() const override
+	{
+		return this->a_block_count - a_block_free;
+	}
+
+	virtual bool waitForSpace(uint32_t target_blocks) override
+	{
+		while (this->isRunning() && queuedBlocks() >= target_blocks) {
+			WaitForSingleObject(a_block_done, 100);
+		}
+		return this->isRunning();
+	}
+
+	virtual void wakeUp() override
+	{
+		SetEvent(a_block_done);
+	}
+
+	virtual bool write(const T* samples) override
+	{
+		// Block is here, so use it
+		a_block_free--;
+
+		// Prepare block for processing
+		if (a_wave_headers[a_block_current].dwFlags & WHDR_PREPARED)
+			waveOutUnprepareHeader(a_device, &a_wave_headers[a_block_current], sizeof(WAVEHDR));
+
+		std::copy_n(samples, a_block_samples, a_block_memory_ptr.get() + a_block_current * a_block_samples);
+
+		// Send block to sound device
+		waveOutPrepareHeader(a_device, &a_wave_headers[a_block_current], sizeof(WAVEHDR));
+		waveOutWrite(a_device, &a_wave_headers[a_block_current], sizeof(WAVEHDR));
+		a_block_current++;
+		a_block_current %= this->a_block_count;
+		return true;
+	}
+
+private:
+	// Handler for soundcard request for more data
+	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
+	{
+		if (uMsg != WOM_DONE) return;
+
+		a_block_free++;
+		SetEvent(a_block_done);
+	}
+
+	// Static wrapper for sound card handler
+	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+	{
+		reinterpret_cast<WinMMBackend*>(dwInstance)->waveOutProc(hWaveOut, uMsg, static_cast<DWORD>(dwParam1), static_cast<DWORD>(dwParam2));
+	}
+};
+
+#endif
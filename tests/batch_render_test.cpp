@@ -0,0 +1,294 @@
+// Tests of the batch renderer's parts: the job list parser, the Standard MIDI File reader,
+// the per-job memory limit and seeded renders. Writes its scripts, MIDI files and renders
+// into the working directory.
+//
+//   batch_render_test [case...]
+//
+// Built with SYNTH_JOB_MEMORY_LIMITS, so it replaces the allocation functions the way
+// Batch-Render does.
+
+#define SYNTH_JOB_MEMORY_LIMITS
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include "RenderJob.hpp"
+
+struct TestCase
+{
+	std::string a_name;
+	std::string(*a_run)();		// Empty string when it passes, otherwise what went wrong
+};
+
+void writeFile(const std::string& path, const std::string& text)
+{
+	std::ofstream(path, std::ios::binary) << text;
+}
+
+void writeFile(const std::string& path, const std::vector<uint8_t>& bytes)
+{
+	std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+// A Standard MIDI File of the given format, 480 ticks per quarter note, around raw track data
+std::vector<uint8_t> midiFile(uint16_t format, const std::vector<std::vector<uint8_t>>& tracks)
+{
+	std::vector<uint8_t> bytes = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, static_cast<uint8_t>(format), 0, static_cast<uint8_t>(tracks.size()), 0x01, 0xE0 };
+	for (const std::vector<uint8_t>& track : tracks)
+	{
+		uint32_t length = static_cast<uint32_t>(track.size());
+		bytes.insert(bytes.end(), { 'M', 'T', 'r', 'k', static_cast<uint8_t>(length >> 24), static_cast<uint8_t>(length >> 16), static_cast<uint8_t>(length >> 8), static_cast<uint8_t>(length) });
+		bytes.insert(bytes.end(), track.begin(), track.end());
+	}
+	return bytes;
+}
+
+std::string expectMessages(const std::string& path, const std::vector<TimedMidiMessage>& expected)
+{
+	std::vector<TimedMidiMessage> messages;
+	if (!MidiFileReader().read(path, messages))
+		return path + " was not read";
+	if (messages.size() != expected.size())
+		return std::to_string(messages.size()) + " messages, expected " + std::to_string(expected.size());
+
+	for (size_t i = 0; i < messages.size(); i++)
+	{
+		const MidiMessage& got = messages[i].a_message;
+		const MidiMessage& want = expected[i].a_message;
+		if (got.a_status != want.a_status || got.a_data1 != want.a_data1 || got.a_data2 != want.a_data2)
+			return "message " + std::to_string(i) + " has the wrong bytes";
+		if (std::fabs(messages[i].a_time - expected[i].a_time) > 1.0e-9)
+			return "message " + std::to_string(i) + " at " + std::to_string(messages[i].a_time) + " s, expected " + std::to_string(expected[i].a_time) + " s";
+	}
+	return "";
+}
+
+// Every line here has to be turned down with an error, none may leave a job behind
+std::string malformedJobLines()
+{
+	writeFile("bad_command.txt", "0.0 on 0 0.8\n0.5 strum 0\n");
+	writeFile("good.txt", "0.0 on 0 0.8\n0.5 off 0\n");
+	writeFile("bad_file.mid", "MThd");
+
+	const std::vector<std::string> lines = {
+		"good.txt",
+		"good.txt out.wav colour=blue",
+		"good.txt out.wav instrument=piano",
+		"good.txt out.wav rate=44100 render-rate=96000",
+		"missing.txt out.wav",
+		"bad_command.txt out.wav",
+		"bad_file.mid out.wav",
+	};
+	for (const std::string& line : lines)
+	{
+		RenderJob job;
+		std::string error;
+		if (parseRenderJob(line, job, error))
+			return "\"" + line + "\" was accepted";
+		if (error.empty())
+			return "\"" + line + "\" gave no error";
+	}
+
+	// Comments and blank lines are skipped, not errors
+	RenderJob job;
+	std::string error;
+	if (!parseRenderJob("   # good.txt out.wav", job, error) || !job.a_input.empty())
+		return "a comment line was not skipped";
+	if (!parseRenderJob("good.txt out.wav instrument=3 tail=0.5 # two notes", job, error) || job.a_instrument != 3 || job.a_events.size() != 2)
+		return "a good line was not read: " + error;
+	if (job.a_frames != static_cast<uint64_t>(std::ceil(1.0 * job.a_sample_rate)))
+		return "a good line has " + std::to_string(job.a_frames) + " frames";
+	return "";
+}
+
+// A single track with running status through note ons, a note on of velocity 0 and
+// one-byte program changes, and a tempo change halfway
+std::string midiFormat0RunningStatus()
+{
+	writeFile("format0.mid", midiFile(0, { {
+		0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20,	// 500000 us per quarter note
+		0x00, 0x90, 0x3C, 0x64,
+		0x83, 0x60, 0x40, 0x64,						// Running status, 480 ticks later
+		0x83, 0x60, 0x3C, 0x00,
+		0x00, 0xFF, 0x51, 0x03, 0x03, 0xD0, 0x90,	// 250000 us per quarter note from tick 960
+		0x83, 0x60, 0x40, 0x00,
+		0x00, 0xC0, 0x05,
+		0x00, 0x07,									// Running status on a one-byte message
+		0x00, 0xFF, 0x2F, 0x00,
+	} }));
+
+	return expectMessages("format0.mid", {
+		{ 0.0, { 0x90, 0x3C, 0x64 } },
+		{ 0.5, { 0x90, 0x40, 0x64 } },
+		{ 1.0, { 0x90, 0x3C, 0x00 } },
+		{ 1.25, { 0x90, 0x40, 0x00 } },
+		{ 1.25, { 0xC0, 0x05, 0x00 } },
+		{ 1.25, { 0xC0, 0x07, 0x00 } },
+	});
+}
+
+// A tempo track and two note tracks merged in time, and files the reader has to turn down
+std::string midiFormat1RunningStatus()
+{
+	writeFile("format1.mid", midiFile(1, {
+		{ 0x00, 0xFF, 0x51, 0x03, 0x03, 0xD0, 0x90, 0x83, 0x60, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20, 0x00, 0xFF, 0x2F, 0x00 },
+		{ 0x00, 0x90, 0x3C, 0x64, 0x87, 0x40, 0x3C, 0x00, 0x00, 0xFF, 0x2F, 0x00 },
+		{ 0x83, 0x60, 0x91, 0x43, 0x50, 0x83, 0x60, 0x43, 0x00, 0x00, 0xFF, 0x2F, 0x00 },
+	}));
+	std::string problem = expectMessages("format1.mid", {
+		{ 0.0, { 0x90, 0x3C, 0x64 } },
+		{ 0.25, { 0x91, 0x43, 0x50 } },
+		{ 0.75, { 0x90, 0x3C, 0x00 } },
+		{ 0.75, { 0x91, 0x43, 0x00 } },
+	});
+	if (!problem.empty())
+		return problem;
+
+	// A data byte before any status, a track running past the end of the file, format 2
+	std::vector<TimedMidiMessage> messages;
+	writeFile("no_status.mid", midiFile(1, { { 0x00, 0x3C, 0x64, 0x00, 0xFF, 0x2F, 0x00 } }));
+	if (MidiFileReader().read("no_status.mid", messages))
+		return "running status without a status byte was accepted";
+	std::vector<uint8_t> cut = midiFile(0, { { 0x00, 0x90, 0x3C, 0x64, 0x00, 0xFF, 0x2F, 0x00 } });
+	cut.resize(cut.size() - 3);
+	writeFile("cut.mid", cut);
+	if (MidiFileReader().read("cut.mid", messages))
+		return "a cut off track was accepted";
+	writeFile("format2.mid", midiFile(2, { { 0x00, 0xFF, 0x2F, 0x00 } }));
+	if (MidiFileReader().read("format2.mid", messages))
+		return "a format 2 file was accepted";
+	return "";
+}
+
+struct alignas(64) OverAligned
+{
+	char a_bytes[4096];
+};
+
+// A job over its budget fails on its own, and over-aligned allocations count against it
+std::string memoryLimit()
+{
+	writeFile("limit.txt", "0.0 on 0 0.8\n0.1 off 0\n");
+	RenderJob job;
+	std::string error;
+	if (!parseRenderJob("limit.txt limit.wav tail=0.1", job, error))
+		return error;
+
+	JobMemory memory;
+	memory.begin(64 * 1024);
+	JobMemory::current() = &memory;
+	RenderResult over = renderJob(job);
+	JobMemory::current() = nullptr;
+	if (over.a_is_ok || over.a_error != "over its memory limit")
+		return "a job over 64 kB rendered: " + (over.a_is_ok ? std::string("no error") : over.a_error);
+
+	memory.begin(0);
+	JobMemory::current() = &memory;
+	RenderResult unlimited = renderJob(job);
+	JobMemory::current() = nullptr;
+	if (!unlimited.a_is_ok)
+		return "the job failed without a limit: " + unlimited.a_error;
+	if (unlimited.a_peak_memory <= 64 * 1024)
+		return "the job peaked at only " + std::to_string(unlimited.a_peak_memory) + " bytes";
+
+	memory.begin(1024);
+	JobMemory::current() = &memory;
+	bool is_refused = false;
+	try
+	{
+		delete new OverAligned;
+	}
+	catch (const std::bad_alloc&)
+	{
+		is_refused = true;
+	}
+	OverAligned* nothrow_block = new (std::nothrow) OverAligned;
+	memory.begin(0);
+	OverAligned* block = new OverAligned;
+	size_t peak = memory.getPeak();
+	delete block;
+	JobMemory::current() = nullptr;
+
+	if (!is_refused || nothrow_block != nullptr)
+		return "an over-aligned allocation went over the limit";
+	if (reinterpret_cast<std::uintptr_t>(block) % alignof(OverAligned) != 0)
+		return "an over-aligned allocation is misaligned";
+	if (peak < sizeof(OverAligned))
+		return "an over-aligned allocation was not counted";
+	return "";
+}
+
+// Jobs with a seed of their own render the same file whichever jobs run beside them or
+// before them on the same thread, and another seed renders different noise
+std::string seededJobs()
+{
+	int drum = -1;
+	{
+		Engine engine;
+		for (int i = 0; i < NUM_INSTRUMENTS && drum < 0; i++)
+			drum = dynamic_cast<Drum*>(engine.a_instruments[i].get()) != nullptr ? i : -1;
+	}
+	writeFile("hits.txt", "0.0 on 0 1.0\n0.1 off 0\n0.2 on 7 0.7\n0.3 off 7\n");
+
+	auto render = [drum](const std::string& output, const std::string& seed) {
+		RenderJob job;
+		std::string error;
+		parseRenderJob("hits.txt " + output + " tail=0.3 instrument=" + std::to_string(drum) + " " + seed, job, error);
+		return renderJob(job).a_is_ok;
+	};
+	auto read = [](const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	};
+
+	bool is_ok[3] = {};
+	std::thread first([&]() { is_ok[0] = render("seed_a.wav", "seed=7") && render("seed_b.wav", "seed=0x2A"); });
+	std::thread second([&]() { is_ok[1] = render("seed_c.wav", "seed=0x2A"); });
+	first.join();
+	second.join();
+	is_ok[2] = render("seed_d.wav", "seed=7");
+	if (!is_ok[0] || !is_ok[1] || !is_ok[2])
+		return "a seeded job failed to render";
+
+	if (read("seed_b.wav").empty() || read("seed_b.wav") != read("seed_c.wav") || read("seed_a.wav") != read("seed_d.wav"))
+		return "jobs with the same seed rendered different files";
+	if (read("seed_a.wav") == read("seed_b.wav"))
+		return "jobs with different seeds rendered the same file";
+	return "";
+}
+
+int main(int argc, char* argv[])
+{
+	const std::vector<TestCase> cases = {
+		{ "malformed_job_lines", malformedJobLines },
+		{ "midi_format0_running_status", midiFormat0RunningStatus },
+		{ "midi_format1_running_status", midiFormat1RunningStatus },
+		{ "memory_limit", memoryLimit },
+		{ "seeded_jobs", seededJobs },
+	};
+	std::vector<std::string> selected(argv + 1, argv + argc);
+
+	int failures = 0;
+	for (const TestCase& test_case : cases)
+	{
+		if (!selected.empty() && std::find(selected.begin(), selected.end(), test_case.a_name) == selected.end())
+			continue;
+
+		std::string problem = test_case.a_run();
+		if (problem.empty())
+			std::cout << "passed   " << test_case.a_name << std::endl;
+		else
+			std::cout << "FAILED   " << test_case.a_name << ": " << problem << std::endl;
+		failures += problem.empty() ? 0 : 1;
+	}
+
+	if (failures > 0)
+		std::cout << failures << " case(s) failed" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
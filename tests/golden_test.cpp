@@ -0,0 +1,1021 @@
+// Golden-output regression test. Renders scripted note sequences through the engine
+// offline, with the fixed noise seed and the same integer sample clock the sound card
+// uses, and compares the result against reference renders stored in tests/golden.
+//
+//   golden_test [--golden-dir <dir>] [--update] [--snr <dB>] [case...]
+//
+// --update rewrites the references from the current build. Without --snr every sample
+// must match bit for bit; with it a case passes when the signal to error ratio against
+// the reference is at least the given number of dB.
+//
+// Note scripts take effect at block starts, MIDI scripts on the exact frame they are
+// stamped for, so those cases also check that the engine splits blocks at events.
+// A case can also wire the engine up in a graph of its own, or run it at another output
+// rate and render rate. Frames in the scripts and case lengths count at the default rate
+// and are scaled to the case's.
+//
+// Next to the renders it runs checks of parts whose output is not a render of its own,
+// such as the recorder, selected by name the same way and left out by --update.
+//
+// Built with SYNTH_REALTIME_CHECKS it also aborts on any heap allocation made while
+// the engine renders, the way the audio thread would.
+
+#include <array>
+#include <cmath>
+#include <cctype>
+#include <complex>
+#include <numbers>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "Realtime.hpp"
+#include "Synth.hpp"
+#include "MidiInput.hpp"
+#include "MappedFile.hpp"
+#include "WavFile.hpp"
+#include "Recorder.hpp"
+#include "Tuning.hpp"
+#include "QualityGovernor.hpp"
+#include "Analyzer.hpp"
+#include "FFT.hpp"
+
+#define GOLDEN_BLOCK_FRAMES 128
+#define GOLDEN_CHANNELS 2
+
+// A key going down or up. Events take effect at the start of the block containing their frame,
+// posted through the same queue key presses take to the live engine.
+struct NoteEvent
+{
+	uint64_t a_frame;
+	int a_id;
+	bool a_on;
+	double a_velocity;
+};
+
+// A raw MIDI message, posted through the MIDI queue with the time of its frame
+struct MidiScriptEvent
+{
+	uint64_t a_frame;
+	MidiMessage a_message;
+};
+
+struct GoldenCase
+{
+	std::string a_name;
+	int a_instrument;
+	int a_effect;
+	uint64_t a_frames;
+	std::vector<NoteEvent> a_script;
+	std::vector<MidiScriptEvent> a_midi;
+	std::unique_ptr<AudioGraph>(*a_graph)(Engine& engine) = makeDefaultGraph;
+	uint32_t a_sample_rate = DEFAULT_SAMPLE_RATE;
+	uint32_t a_render_rate = 0;		// 0 renders at a_sample_rate
+};
+
+struct Tolerance
+{
+	bool a_exact = true;
+	double a_min_snr_db = 0.0;
+};
+
+// A chord at three velocities, a melody note over its release and a retrigger of the
+// chord root while it is still fading
+std::vector<NoteEvent> chordScript()
+{
+	return {
+		{ 0, 0, true, 1.0 }, { 0, 4, true, 0.8 }, { 0, 7, true, 0.6 },
+		{ 11025, 0, false, 0.0 }, { 11025, 4, false, 0.0 }, { 11025, 7, false, 0.0 },
+		{ 13230, 12, true, 0.9 },
+		{ 15435, 0, true, 0.7 },
+		{ 19845, 12, false, 0.0 }, { 19845, 0, false, 0.0 },
+	};
+}
+
+// Short staccato notes, enough to hear the tail of an effect
+std::vector<NoteEvent> staccatoScript()
+{
+	return {
+		{ 0, 0, true, 1.0 }, { 2205, 0, false, 0.0 },
+		{ 4410, 7, true, 1.0 }, { 6615, 7, false, 0.0 },
+	};
+}
+
+// Repeated hits on two keys at changing velocities, the pattern a one-shot cache serves
+// from memory, with two hits cut short while their one-shot is still playing
+std::vector<NoteEvent> drumScript()
+{
+	std::vector<NoteEvent> script;
+	for (int hit = 0; hit < 8; hit++)
+	{
+		uint64_t frame = 300 + hit * 5000;
+		int id = hit % 2 == 0 ? 0 : 5;
+		script.push_back({ frame, id, true, 1.0 - 0.1 * hit });
+		script.push_back({ frame + (hit % 3 == 2 ? 1500 : 4900), id, false, 0.0 });
+	}
+	return script;
+}
+
+// Notes starting and stopping mid-block, held through the sustain pedal while the pitch
+// bends up and the mod wheel brings in vibrato
+std::vector<MidiScriptEvent> midiScript()
+{
+	return {
+		{ 300, { 0x90, 60, 100 } }, { 2000, { 0x90, 64, 60 } },
+		{ 4500, { 0xB0, MIDI_CC_SUSTAIN, 127 } },
+		{ 5000, { 0x80, 60, 0 } }, { 5001, { 0x90, 64, 0 } },
+		{ 7000, { 0xE0, 0x7F, 0x7F } },
+		{ 9000, { 0xB0, MIDI_CC_MOD_WHEEL, 127 } },
+		{ 12000, { 0xE0, 0x00, 0x40 } },
+		{ 14000, { 0xB0, MIDI_CC_SUSTAIN, 0 } },
+		{ 16000, { 0x91, 67, 90 } }, { 19000, { 0x81, 67, 0 } },
+	};
+}
+
+// The dry instrument with a delay and a reverb send beside it. The sends share a level,
+// so with workers running they render in parallel and must still match bit for bit.
+std::unique_ptr<AudioGraph> sendsGraph(Engine& engine)
+{
+	auto left = makeSoundEffects();
+	auto right = makeSoundEffects();
+	for (int e : { 2, 3 })
+	{
+		left[e]->setSampleRate(engine.getRenderRate());
+		right[e]->setSampleRate(engine.getRenderRate());
+	}
+
+	auto graph = std::make_unique<AudioGraph>(MAX_BLOCK_FRAMES);
+	int instrument = graph->addNode(std::make_shared<InstrumentNode>(engine));
+	int delay = graph->addNode(std::make_shared<EffectNode>(std::move(left[2]), std::move(right[2])));
+	int reverb = graph->addNode(std::make_shared<EffectNode>(std::move(left[3]), std::move(right[3])));
+	int bus = graph->addNode(std::make_shared<BusNode>());
+	graph->connect(instrument, bus, 0.6f);
+	graph->connect(instrument, delay, 0.3f);
+	graph->connect(instrument, reverb, 0.4f);
+	graph->connect(delay, bus);
+	graph->connect(reverb, bus);
+	graph->setOutput(bus);
+	graph->startWorkers(2);
+	graph->commit();
+	return graph;
+}
+
+// A delay send running in double precision whatever the engine's Sample type
+std::unique_ptr<AudioGraph> doubleDelayGraph(Engine& engine)
+{
+	auto left = std::make_unique<Delay<double>>(1.0, 0.7);
+	auto right = std::make_unique<Delay<double>>(1.0, 0.7);
+	left->setSampleRate(engine.getRenderRate());
+	right->setSampleRate(engine.getRenderRate());
+
+	auto graph = std::make_unique<AudioGraph>(MAX_BLOCK_FRAMES);
+	int instrument = graph->addNode(std::make_shared<InstrumentNode>(engine));
+	int delay = graph->addNode(std::make_shared<BasicEffectNode<double>>(std::move(left), std::move(right)));
+	int bus = graph->addNode(std::make_shared<BusNode>());
+	graph->connect(instrument, bus, 0.6f);
+	graph->connect(instrument, delay, 0.3f);
+	graph->connect(delay, bus);
+	graph->setOutput(bus);
+	graph->commit();
+	return graph;
+}
+
+// The granular instrument at a density where a three-note chord keeps over a thousand grains
+// sounding, every one of them taken from the pool
+std::unique_ptr<AudioGraph> denseGranularGraph(Engine& engine)
+{
+	for (auto& instrument : engine.a_instruments)
+	{
+		if (auto granular = dynamic_cast<Granular*>(instrument.get()))
+		{
+			granular->setDensity(5000.0);
+			granular->setGrainLength(0.15);
+		}
+	}
+	return makeDefaultGraph(engine);
+}
+
+std::vector<GoldenCase> goldenCases()
+{
+	std::vector<GoldenCase> cases;
+	Engine engine;
+	int effect_instrument = 0;
+	int fm_instrument = 0;
+	int trumpet_instrument = 0;
+	int granular_instrument = 0;
+	int drum_instrument = 0;
+
+	// The sampler has no library to play without one on the command line, so it is left out
+	for (int i = 0; i < NUM_INSTRUMENTS; i++)
+	{
+		if (dynamic_cast<Sampler*>(engine.a_instruments[i].get()))
+			continue;
+
+		// Effects are tested on the plucked string, its short clean notes show the tails best
+		if (dynamic_cast<PluckedString*>(engine.a_instruments[i].get()))
+			effect_instrument = i;
+
+		// MIDI is tested on the FM synthesizer, which follows the pitch bend and vibrato
+		if (dynamic_cast<FMSynth*>(engine.a_instruments[i].get()))
+			fm_instrument = i;
+
+		// Rates are tested on the trumpet, which is oversampled and filtered
+		if (dynamic_cast<Trumpet*>(engine.a_instruments[i].get()))
+			trumpet_instrument = i;
+
+		if (dynamic_cast<Granular*>(engine.a_instruments[i].get()))
+			granular_instrument = i;
+
+		if (dynamic_cast<Drum*>(engine.a_instruments[i].get()))
+			drum_instrument = i;
+
+		std::string name;
+		for (wchar_t c : engine.a_instruments[i]->getName())
+			name += std::isalnum(static_cast<int>(c)) ? static_cast<char>(std::tolower(static_cast<int>(c))) : '_';
+		cases.push_back({ "instrument_" + name.substr(0, name.find("__")), i, 0, 22050, chordScript() });
+	}
+
+	cases.push_back({ "effect_flanger", effect_instrument, 1, 22050, staccatoScript() });
+	cases.push_back({ "effect_delay", effect_instrument, 2, 48510, staccatoScript() });
+	cases.push_back({ "effect_reverb", effect_instrument, 3, 26460, staccatoScript() });
+	cases.push_back({ "effect_chorus", effect_instrument, 4, 22050, staccatoScript() });
+	cases.push_back({ "effect_ensemble", effect_instrument, 5, 22050, staccatoScript() });
+	cases.push_back({ "effect_phaser", effect_instrument, 6, 22050, staccatoScript() });
+	cases.push_back({ "midi_performance", fm_instrument, 0, 22050, {}, midiScript() });
+	cases.push_back({ "graph_sends", effect_instrument, 0, 48510, staccatoScript(), {}, sendsGraph });
+	cases.push_back({ "graph_double_delay", effect_instrument, 0, 48510, staccatoScript(), {}, doubleDelayGraph });
+	cases.push_back({ "rate_96000", trumpet_instrument, 0, 22050, chordScript(), {}, makeDefaultGraph, 96000 });
+	cases.push_back({ "rate_48000_from_32000", effect_instrument, 0, 26460, staccatoScript(), {}, sendsGraph, 48000, 32000 });
+	cases.push_back({ "granular_dense", granular_instrument, 0, 22050, chordScript(), {}, denseGranularGraph });
+	cases.push_back({ "drum_pattern", drum_instrument, 0, 44100, drumScript() });
+	return cases;
+}
+
+// A frame at the default rate moved to the case's rate
+uint64_t atCaseRate(const GoldenCase& golden_case, uint64_t frame)
+{
+	return frame * golden_case.a_sample_rate / DEFAULT_SAMPLE_RATE;
+}
+
+std::vector<float> render(const GoldenCase& golden_case)
+{
+	// A fresh engine for every case, so each renders the same whatever ran before it
+	Engine engine(golden_case.a_sample_rate, golden_case.a_render_rate);
+	engine.a_graph = golden_case.a_graph(engine);
+	engine.a_instrument_index = golden_case.a_instrument;
+	engine.a_sound_effect_index = golden_case.a_effect;
+
+	uint64_t total_frames = atCaseRate(golden_case, golden_case.a_frames);
+	std::vector<float> output(total_frames * GOLDEN_CHANNELS);
+	AudioBus bus(GOLDEN_CHANNELS, GOLDEN_BLOCK_FRAMES);
+	double time_step = 1.0 / golden_case.a_sample_rate;
+
+	uint64_t sample_clock = 0;
+	size_t next_event = 0;
+	size_t next_midi = 0;
+	while (sample_clock < total_frames)
+	{
+		uint32_t frames = static_cast<uint32_t>(std::min<uint64_t>(GOLDEN_BLOCK_FRAMES, total_frames - sample_clock));
+		double time = static_cast<double>(sample_clock) * time_step;
+
+		while (next_event < golden_case.a_script.size() && atCaseRate(golden_case, golden_case.a_script[next_event].a_frame) < sample_clock + frames)
+		{
+			const NoteEvent& event = golden_case.a_script[next_event++];
+			if (event.a_on)
+				engine.postNoteOn(event.a_id, time, event.a_velocity);
+			else
+				engine.postNoteOff(event.a_id, time);
+		}
+
+		while (next_midi < golden_case.a_midi.size() && atCaseRate(golden_case, golden_case.a_midi[next_midi].a_frame) < sample_clock + frames)
+		{
+			const MidiScriptEvent& event = golden_case.a_midi[next_midi++];
+			postMidiMessage(engine.a_midi_events, event.a_message, static_cast<double>(atCaseRate(golden_case, event.a_frame)) * time_step);
+		}
+
+		bus.setFrames(frames);
+		bus.clear();
+		{
+			RealtimeScope realtime;
+			engine.generateSound(bus, time, time_step);
+		}
+		bus.convertToPCM<float>(output.data() + sample_clock * GOLDEN_CHANNELS);
+		sample_clock += frames;
+	}
+	return output;
+}
+
+bool loadReference(const std::string& path, std::vector<float>& samples)
+{
+	MappedFile file;
+	WavFormat format;
+	if (!file.open(path) || !parseWavHeader(file.data(), file.size(), format) || format.a_channels != GOLDEN_CHANNELS)
+		return false;
+
+	samples.resize(format.a_frames * format.a_channels);
+	readWavFramesInterleaved(file.data(), format, 0, static_cast<uint32_t>(format.a_frames), samples.data());
+	return true;
+}
+
+// Returns an empty string when the render matches, otherwise what went wrong
+std::string compare(const std::vector<float>& rendered, const std::vector<float>& reference, const Tolerance& tolerance, double& snr_db)
+{
+	if (rendered.size() != reference.size())
+		return "length " + std::to_string(rendered.size() / GOLDEN_CHANNELS) + " frames, reference has " + std::to_string(reference.size() / GOLDEN_CHANNELS);
+
+	double signal = 0.0;
+	double error = 0.0;
+	size_t mismatches = 0;
+	size_t first_mismatch = 0;
+	for (size_t i = 0; i < rendered.size(); i++)
+	{
+		if (!std::isfinite(rendered[i]))
+			return "non-finite sample at frame " + std::to_string(i / GOLDEN_CHANNELS);
+
+		if (std::memcmp(&rendered[i], &reference[i], sizeof(float)) != 0 && mismatches++ == 0)
+			first_mismatch = i;
+
+		double difference = static_cast<double>(rendered[i]) - reference[i];
+		signal += static_cast<double>(reference[i]) * reference[i];
+		error += difference * difference;
+	}
+
+	snr_db = error > 0.0 ? 10.0 * std::log10(signal / error) : std::numeric_limits<double>::infinity();
+	if (tolerance.a_exact && mismatches > 0)
+		return std::to_string(mismatches) + " samples differ, first at frame " + std::to_string(first_mismatch / GOLDEN_CHANNELS) + ", SNR " + std::to_string(snr_db) + " dB";
+	if (!tolerance.a_exact && !(snr_db >= tolerance.a_min_snr_db))
+		return "SNR " + std::to_string(snr_db) + " dB is below " + std::to_string(tolerance.a_min_snr_db) + " dB";
+	return "";
+}
+
+// A check of a part of the engine, returns an empty string when it passes, otherwise what went wrong
+struct CheckCase
+{
+	std::string a_name;
+	std::string(*a_run)();
+};
+
+// Interleaves a bus the way the recorder writes it
+void appendInterleaved(const AudioBus& bus, uint32_t frames, std::vector<float>& samples)
+{
+	for (uint32_t n = 0; n < frames; n++)
+	{
+		for (uint32_t c = 0; c < bus.getChannels(); c++)
+			samples.push_back(bus.channel(c)[n]);
+	}
+}
+
+// The WAV a recording left behind, against the frames it should hold
+std::string checkRecording(const std::string& path, uint32_t sample_rate, const std::vector<float>& expected)
+{
+	MappedFile file;
+	WavFormat format;
+	if (!file.open(path) || !parseWavHeader(file.data(), file.size(), format))
+		return "no readable WAV at " + path;
+	if (format.a_format_tag != 3 || format.a_bits_per_sample != 32 || format.a_channels != GOLDEN_CHANNELS || format.a_sample_rate != sample_rate)
+		return "header says format " + std::to_string(format.a_format_tag) + ", " + std::to_string(format.a_bits_per_sample) + " bits, "
+			+ std::to_string(format.a_channels) + " channels at " + std::to_string(format.a_sample_rate) + " Hz";
+	if (format.a_frames * GOLDEN_CHANNELS != expected.size())
+		return "header says " + std::to_string(format.a_frames) + " frames, expected " + std::to_string(expected.size() / GOLDEN_CHANNELS);
+
+	std::vector<float> samples(expected.size());
+	readWavFramesInterleaved(file.data(), format, 0, static_cast<uint32_t>(format.a_frames), samples.data());
+	if (std::memcmp(samples.data(), expected.data(), samples.size() * sizeof(float)) != 0)
+		return "recorded samples differ from the rendered ones";
+	return "";
+}
+
+// Records the plucked string's chord block by block the way the audio thread does, and reads it back
+std::string recordRenderedBus()
+{
+	Engine engine;
+	for (int i = 0; i < NUM_INSTRUMENTS; i++)
+	{
+		if (dynamic_cast<PluckedString*>(engine.a_instruments[i].get()))
+			engine.a_instrument_index = i;
+	}
+
+	const std::string path = "golden_recorder_take.wav";
+	Recorder recorder;
+	if (!recorder.start(path, GOLDEN_CHANNELS, DEFAULT_SAMPLE_RATE, GOLDEN_BLOCK_FRAMES))
+		return "could not start recording to " + path;
+
+	std::vector<NoteEvent> script = chordScript();
+	const uint64_t total_frames = 22050;
+	std::vector<float> expected;
+	expected.reserve(total_frames * GOLDEN_CHANNELS);
+	AudioBus bus(GOLDEN_CHANNELS, GOLDEN_BLOCK_FRAMES);
+	double time_step = 1.0 / DEFAULT_SAMPLE_RATE;
+	size_t next_event = 0;
+	for (uint64_t sample_clock = 0; sample_clock < total_frames; sample_clock += GOLDEN_BLOCK_FRAMES)
+	{
+		uint32_t frames = static_cast<uint32_t>(std::min<uint64_t>(GOLDEN_BLOCK_FRAMES, total_frames - sample_clock));
+		double time = static_cast<double>(sample_clock) * time_step;
+		for (; next_event < script.size() && script[next_event].a_frame < sample_clock + frames; next_event++)
+		{
+			if (script[next_event].a_on)
+				engine.postNoteOn(script[next_event].a_id, time, script[next_event].a_velocity);
+			else
+				engine.postNoteOff(script[next_event].a_id, time);
+		}
+
+		bus.setFrames(frames);
+		bus.clear();
+		{
+			RealtimeScope realtime;
+			engine.generateSound(bus, time, time_step);
+			recorder.record(bus);
+		}
+		appendInterleaved(bus, frames, expected);
+	}
+	recorder.stop();
+
+	std::string problem = checkRecording(path, DEFAULT_SAMPLE_RATE, expected);
+	std::remove(path.c_str());
+	if (!problem.empty())
+		return problem;
+	if (recorder.getRecordedFrames() != total_frames || recorder.getDroppedFrames() != 0 || recorder.getFileCount() != 1 || recorder.hasWriteFailed())
+		return std::to_string(recorder.getRecordedFrames()) + " frames recorded and " + std::to_string(recorder.getDroppedFrames()) + " dropped, expected " + std::to_string(total_frames) + " and 0";
+	return "";
+}
+
+// At 4 kHz the ring holds 16384 stereo frames, fewer than one disk write, so the writer
+// leaves it alone until the recording stops and the blocks past that are dropped. A first
+// block twice the size the recorder was started with loses its second half.
+std::string recorderOverflow()
+{
+	const uint32_t sample_rate = 4000;
+	const uint32_t ring_frames = 16384;
+	const uint32_t blocks = 200;
+
+	const std::string path = "golden_recorder_overflow.wav";
+	Recorder recorder;
+	if (!recorder.start(path, GOLDEN_CHANNELS, sample_rate, GOLDEN_BLOCK_FRAMES))
+		return "could not start recording to " + path;
+
+	std::vector<float> expected;
+	AudioBus bus(GOLDEN_CHANNELS, GOLDEN_BLOCK_FRAMES * 2);
+	uint64_t fed_frames = 0;
+	for (uint32_t b = 0; b <= blocks; b++)
+	{
+		uint32_t frames = b == 0 ? GOLDEN_BLOCK_FRAMES * 2 : GOLDEN_BLOCK_FRAMES;
+		bus.setFrames(frames);
+		for (uint32_t c = 0; c < GOLDEN_CHANNELS; c++)
+		{
+			for (uint32_t n = 0; n < frames; n++)
+				bus.channel(c)[n] = static_cast<float>(fed_frames + n) / (ring_frames * 4) * (c == 0 ? 1.0f : -1.0f);
+		}
+		{
+			RealtimeScope realtime;
+			recorder.record(bus);
+		}
+		if (expected.size() < static_cast<size_t>(ring_frames) * GOLDEN_CHANNELS)
+			appendInterleaved(bus, GOLDEN_BLOCK_FRAMES, expected);
+		fed_frames += frames;
+	}
+	recorder.stop();
+
+	std::string problem = checkRecording(path, sample_rate, expected);
+	std::remove(path.c_str());
+	if (!problem.empty())
+		return problem;
+	if (recorder.getRecordedFrames() != ring_frames || recorder.getDroppedFrames() != fed_frames - ring_frames)
+		return std::to_string(recorder.getRecordedFrames()) + " frames recorded and " + std::to_string(recorder.getDroppedFrames()) + " dropped, expected "
+			+ std::to_string(ring_frames) + " and " + std::to_string(fed_frames - ring_frames);
+	return "";
+}
+
+// Feeds the governor a synthetic load: far over the deadline until it has stepped all the way
+// down to the voice floor, then far under it until it has climbed back to full quality. Blocks
+// of 1/64 s keep the clock exact, so every hold is checked to the block.
+std::string qualityGovernorSteps()
+{
+	const size_t max_voices = 64;
+	const size_t voices = 40;
+	const double block = 1.0 / 64.0;
+	struct Step
+	{
+		QUALITY_STAGE a_stage;
+		size_t a_voice_limit;
+	};
+	const std::vector<Step> expected = {
+		{ QUALITY_STAGE::FEWER_HARMONICS, 64 }, { QUALITY_STAGE::FEWEST_HARMONICS, 64 }, { QUALITY_STAGE::NO_OVERSAMPLING, 64 },
+		{ QUALITY_STAGE::VOICE_LIMIT, 30 }, { QUALITY_STAGE::VOICE_LIMIT, 22 }, { QUALITY_STAGE::VOICE_LIMIT, 16 },
+		{ QUALITY_STAGE::VOICE_LIMIT, 12 }, { QUALITY_STAGE::VOICE_LIMIT, 9 }, { QUALITY_STAGE::VOICE_LIMIT, GOVERNOR_MIN_VOICES },
+		{ QUALITY_STAGE::VOICE_LIMIT, 12 }, { QUALITY_STAGE::VOICE_LIMIT, 18 }, { QUALITY_STAGE::VOICE_LIMIT, 27 },
+		{ QUALITY_STAGE::VOICE_LIMIT, 40 }, { QUALITY_STAGE::VOICE_LIMIT, 60 }, { QUALITY_STAGE::NO_OVERSAMPLING, 64 },
+		{ QUALITY_STAGE::FEWEST_HARMONICS, 64 }, { QUALITY_STAGE::FEWER_HARMONICS, 64 }, { QUALITY_STAGE::FULL, 64 },
+	};
+	const size_t down_steps = 9;
+
+	QualityGovernor governor(max_voices);
+	governor.setEnabled(true);
+	const double high_until = 2.0;
+	const double low_until = 25.0;
+	size_t returned_changes = 0;
+	for (double time = 0.0; time < low_until; time += block)
+	{
+		double load = time < high_until ? 2.0 : 0.1;
+		returned_changes += governor.update(load * block, block, time, voices) ? 1 : 0;
+	}
+
+	std::vector<QualityChange> changes(GOVERNOR_LOG_SIZE);
+	changes.resize(governor.readChanges(changes.data(), changes.size()));
+	if (changes.size() != expected.size() || returned_changes != changes.size() || governor.getLostChanges() != 0)
+		return std::to_string(changes.size()) + " changes logged and " + std::to_string(returned_changes) + " reported, expected " + std::to_string(expected.size());
+
+	for (size_t i = 0; i < changes.size(); i++)
+	{
+		const QualityChange& change = changes[i];
+		std::string at = "change " + std::to_string(i) + " at " + std::to_string(change.a_time) + " s ";
+		if (change.a_stage != expected[i].a_stage || change.a_voice_limit != expected[i].a_voice_limit)
+			return at + "went to stage " + std::to_string(static_cast<int>(change.a_stage)) + " with " + std::to_string(change.a_voice_limit) + " voices, expected stage "
+				+ std::to_string(static_cast<int>(expected[i].a_stage)) + " with " + std::to_string(expected[i].a_voice_limit);
+		if (change.a_voices != voices)
+			return at + "logged " + std::to_string(change.a_voices) + " voices playing";
+
+		// Holds run from the end of the block that made the last change. Steps down come 0.1 s
+		// apart, the first counted from the start. Steps up need 2 s of headroom, the first
+		// counted from the start of the block that brought the load under the low mark.
+		bool is_down = i < down_steps;
+		double since = i == 0 ? 0.0 : changes[i - 1].a_time + block;
+		if (i == down_steps)
+		{
+			since = high_until;
+			double load = 2.0;
+			while ((load += (0.1 - load) * (1.0 - std::exp(-block / GOVERNOR_LOAD_TIME))) >= GOVERNOR_LOW_LOAD)
+				since += block;
+		}
+		double hold = is_down ? GOVERNOR_DOWN_HOLD : GOVERNOR_UP_HOLD;
+		double gap = change.a_time + block - since;
+		if (gap < hold || gap >= hold + block)
+			return at + "came " + std::to_string(gap) + " s after the last, the hold is " + std::to_string(hold) + " s";
+		if (is_down ? change.a_load <= GOVERNOR_HIGH_LOAD : change.a_load >= GOVERNOR_LOW_LOAD)
+			return at + "was made at a load of " + std::to_string(change.a_load);
+	}
+
+	if (governor.getStage() != QUALITY_STAGE::FULL || governor.getVoiceLimit() != max_voices || governor.getDetail() != 1.0 || !governor.allowsOversampling())
+		return "the governor did not end at full quality";
+	return "";
+}
+
+// Drives a whole engine through the governor with a simulated load on top of the real one:
+// every stage has to reach the instruments as soon as it is made, stolen voices have to fade
+// out rather than stop dead, and full quality has to come back once the load is gone.
+std::string governorInEngine()
+{
+	Engine engine;
+	for (int i = 0; i < NUM_INSTRUMENTS; i++)
+	{
+		if (dynamic_cast<Piano*>(engine.a_instruments[i].get()))
+			engine.a_instrument_index = i;
+	}
+	std::array<uint32_t, NUM_INSTRUMENTS> full_oversampling;
+	for (int i = 0; i < NUM_INSTRUMENTS; i++)
+		full_oversampling[i] = engine.a_instruments[i]->getOversampling();
+	if (*std::max_element(full_oversampling.begin(), full_oversampling.end()) < 2)
+		return "no instrument is oversampled";
+
+	// The piano's sines in a low cluster move slowly, so a voice cut mid-waveform would stand
+	// out as a jump. The clock starts at 1 s, a note on at 0 would read as released.
+	const int voices = 12;
+	const double start = 1.0;
+	for (int i = 0; i < voices; i++)
+		engine.postNoteOn(i - 36, start, 0.5);
+
+	QualityGovernor& governor = engine.a_governor;
+	governor.setEnabled(true);
+	governor.setSimulatedLoad(2.0);
+	const double high_until = start + 0.8;
+	const double low_until = start + 30.0;
+
+	AudioBus bus(GOLDEN_CHANNELS, GOLDEN_BLOCK_FRAMES);
+	double time_step = 1.0 / DEFAULT_SAMPLE_RATE;
+	float last = 0.0f;
+	float steady_jump = 0.0f;
+	float steal_jump = 0.0f;
+	bool was_fading = false;
+	for (uint64_t sample_clock = 0; start + sample_clock * time_step < low_until; sample_clock += GOLDEN_BLOCK_FRAMES)
+	{
+		double time = start + static_cast<double>(sample_clock) * time_step;
+		if (time >= high_until && governor.getStage() != QUALITY_STAGE::FULL && engine.a_notes.size() > 0)
+		{
+			// Without voices the blocks render in no time, so the climb back is quick
+			governor.setSimulatedLoad(0.0);
+			for (int i = 0; i < voices; i++)
+				engine.postNoteOff(i - 36, time);
+		}
+
+		size_t limit = governor.getVoiceLimit();
+		bool is_stealing = std::count_if(engine.a_notes.begin(), engine.a_notes.end(), [](const Note& n) { return n.a_active && !n.a_sleeping && !n.a_stolen; }) > static_cast<std::ptrdiff_t>(limit);
+		bus.setFrames(GOLDEN_BLOCK_FRAMES);
+		bus.clear();
+		engine.generateSound(bus, time, time_step);
+
+		std::string at = "at " + std::to_string(time) + " s ";
+		for (int i = 0; i < NUM_INSTRUMENTS; i++)
+		{
+			uint32_t expected = governor.allowsOversampling() ? full_oversampling[i] : 1;
+			if (engine.a_instruments[i]->a_detail != governor.getDetail() || engine.a_instruments[i]->getOversampling() != expected)
+				return at + "instrument " + std::to_string(i) + " renders at detail " + std::to_string(engine.a_instruments[i]->a_detail) + " and " + std::to_string(engine.a_instruments[i]->getOversampling())
+					+ "x oversampling, the governor's stage has " + std::to_string(governor.getDetail()) + " and " + std::to_string(expected) + "x";
+		}
+
+		size_t playing = 0;
+		for (const Note& n : engine.a_notes)
+		{
+			playing += n.a_active && !n.a_sleeping && !n.a_stolen ? 1 : 0;
+			was_fading = was_fading || (n.a_stolen && n.a_steal_gain > 0.0f);
+		}
+		if (time < high_until && playing > limit)
+			return at + std::to_string(playing) + " voices play over the limit of " + std::to_string(limit);
+
+		// The largest step between samples of the left channel in the blocks that steal, against
+		// the largest at the stage before, which plays the same partials without stealing
+		const float* left = bus.channel(0);
+		float jump = 0.0f;
+		for (uint32_t i = 0; i < GOLDEN_BLOCK_FRAMES; i++)
+		{
+			jump = std::max(jump, std::fabs(left[i] - last));
+			last = left[i];
+		}
+		if (is_stealing)
+			steal_jump = std::max(steal_jump, jump);
+		else if (governor.getStage() == QUALITY_STAGE::NO_OVERSAMPLING)
+			steady_jump = std::max(steady_jump, jump);
+	}
+
+	if (steal_jump == 0.0f || !was_fading)
+		return "no voice was stolen";
+	if (steal_jump > 1.5f * steady_jump)
+		return "stealing jumps " + std::to_string(steal_jump) + " between samples, playing steady only " + std::to_string(steady_jump);
+	if (governor.getStage() != QUALITY_STAGE::FULL || !engine.a_notes.empty())
+		return "the engine did not come back to full quality";
+	return "";
+}
+
+// The real FFT against a direct DFT in double, on noise from a fixed seed, at the smallest
+// size, a middle one and the analyzer's
+std::string fftAgainstDft()
+{
+	uint32_t seed = 12345;
+	for (size_t size : { size_t(4), size_t(64), size_t(ANALYZER_FFT_SIZE) })
+	{
+		std::vector<float> signal(size);
+		for (float& x : signal)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			x = static_cast<float>(seed) / 2147483648.0f - 1.0f;
+		}
+
+		RealFFT fft(size);
+		std::vector<std::complex<float>> bins(size / 2 + 1);
+		fft.forward(signal.data(), bins.data());
+
+		// Errors are measured against the energy of the whole signal, which every bin shares
+		double energy = 0.0;
+		for (float x : signal)
+			energy += static_cast<double>(x) * x;
+		double scale = std::sqrt(energy * size);
+		for (size_t k = 0; k < bins.size(); k++)
+		{
+			std::complex<double> sum = 0.0;
+			for (size_t n = 0; n < size; n++)
+				sum += static_cast<double>(signal[n]) * std::polar(1.0, -2.0 * std::numbers::pi * static_cast<double>(k * n % size) / size);
+
+			double error = std::abs(std::complex<double>(bins[k]) - sum) / scale;
+			if (error > 1.0e-5)
+				return "bin " + std::to_string(k) + " of " + std::to_string(size) + " is off by " + std::to_string(error) + " of the signal";
+		}
+	}
+	return "";
+}
+
+// A sine half of full scale, on a bin, on both sides. The right side also carries three
+// samples over full scale and one right on it, early enough to be out of the spectrum's window.
+std::string analyzerLevels()
+{
+	const double sample_rate = DEFAULT_SAMPLE_RATE;
+	const double hz = 93.0 * sample_rate / ANALYZER_FFT_SIZE;
+	const uint32_t blocks = 160;
+
+	Analyzer analyzer;
+	analyzer.prepare(sample_rate, GOLDEN_BLOCK_FRAMES);
+	AudioBus bus(GOLDEN_CHANNELS, GOLDEN_BLOCK_FRAMES);
+	bus.setFrames(GOLDEN_BLOCK_FRAMES);
+	std::array<float, 2> peak = {};
+	std::array<double, 2> energy = {};
+	for (uint32_t b = 0; b < blocks; b++)
+	{
+		for (uint32_t n = 0; n < GOLDEN_BLOCK_FRAMES; n++)
+		{
+			uint64_t frame = static_cast<uint64_t>(b) * GOLDEN_BLOCK_FRAMES + n;
+			float sine = static_cast<float>(0.5 * std::sin(2.0 * std::numbers::pi * hz * frame / sample_rate));
+			bus.channel(0)[n] = sine;
+			bus.channel(1)[n] = frame == 10 ? 1.5f : frame == 20 ? -1.25f : frame == 30 ? 1.0625f : frame == 40 ? 1.0f : sine;
+			for (int c = 0; c < 2; c++)
+			{
+				peak[c] = std::max(peak[c], std::fabs(bus.channel(c)[n]));
+				energy[c] += static_cast<double>(bus.channel(c)[n]) * bus.channel(c)[n];
+			}
+		}
+		RealtimeScope realtime;
+		analyzer.process(bus);
+	}
+
+	if (!analyzer.update())
+		return "the analyzer saw no audio";
+	if (analyzer.update())
+		return "a second update found audio that was already taken";
+	if (analyzer.getClippedSamples() != 3)
+		return std::to_string(analyzer.getClippedSamples()) + " samples counted as clipped, expected 3";
+
+	for (int c = 0; c < 2; c++)
+	{
+		double peak_db = 20.0 * std::log10(peak[c]);
+		double rms_db = 10.0 * std::log10(energy[c] / (static_cast<double>(blocks) * GOLDEN_BLOCK_FRAMES));
+		if (std::fabs(analyzer.getPeakDb(c) - peak_db) > 0.001 || std::fabs(analyzer.getRmsDb(c) - rms_db) > 0.001)
+			return "channel " + std::to_string(c) + " reads peak " + std::to_string(analyzer.getPeakDb(c)) + " dB and RMS " + std::to_string(analyzer.getRmsDb(c))
+				+ " dB, expected " + std::to_string(peak_db) + " and " + std::to_string(rms_db);
+	}
+	if (std::fabs(analyzer.getPeakDb(0) + 6.0206) > 0.01 || std::fabs(analyzer.getRmsDb(0) + 9.0309) > 0.01)
+		return "the clean sine reads peak " + std::to_string(analyzer.getPeakDb(0)) + " dB and RMS " + std::to_string(analyzer.getRmsDb(0)) + " dB";
+
+	// The window is scaled so a sine on a bin reads its amplitude
+	float tone = analyzer.getBandLevel(hz - 1.0, hz + 1.0);
+	float far = analyzer.getBandLevel(4.0 * hz, sample_rate / 2.0);
+	if (std::fabs(tone + 6.0206f) > 0.05f || far > -80.0f)
+		return "the spectrum reads " + std::to_string(tone) + " dB at the sine and " + std::to_string(far) + " dB far from it";
+	return "";
+}
+
+// Loads small Scala scale and keyboard mapping files and checks known pitches. A .kbm
+// numbers keys as MIDI notes, so its middle C is key 60 and note id 0.
+std::string scalaTuning()
+{
+	struct Pitch
+	{
+		int a_note_id;
+		double a_hz;
+	};
+	auto check = [](const Tuning& tuning, const std::vector<Pitch>& pitches) -> std::string {
+		for (const Pitch& pitch : pitches)
+		{
+			if (std::fabs(tuning.frequency(pitch.a_note_id) - pitch.a_hz) > 1.0e-6 * std::max(pitch.a_hz, 1.0))
+				return "note " + std::to_string(pitch.a_note_id) + " plays " + std::to_string(tuning.frequency(pitch.a_note_id)) + " Hz, expected " + std::to_string(pitch.a_hz);
+		}
+		return "";
+	};
+
+	// 12-TET in cents on the standard mapping, A above middle C at 440 Hz
+	std::ofstream("golden_12tet.scl") << "! golden_12tet.scl\n12-TET\n12\n!\n100.0\n200.0\n300.0\n400.0\n500.0\n600.0\n700.0\n800.0\n900.0\n1000.0\n1100.0\n2/1\n";
+	std::ofstream("golden_a440.kbm") << "! golden_a440.kbm\n12\n0\n127\n60\n69\n440.0\n12\n0\n1\n2\n3\n4\n5\n6\n7\n8\n9\n10\n11\n";
+	Tuning tuning;
+	if (!tuning.loadScala("golden_12tet.scl") || !tuning.loadKeyboardMapping("golden_a440.kbm"))
+		return "could not load the 12-TET files";
+	std::string problem = check(tuning, { { 9, 440.0 }, { 0, 440.0 * std::pow(2.0, -9.0 / 12.0) }, { 21, 880.0 }, { -3, 220.0 }, { -60, 440.0 * std::pow(2.0, -69.0 / 12.0) } });
+	if (!problem.empty())
+		return "12-TET: " + problem;
+
+	// Just intonation as ratios, rooted on D at 294 Hz, with C# left unmapped
+	std::ofstream("golden_just.scl") << "Five-limit just intonation\n 12\n16/15\n9/8\n6/5\n5/4\n4/3\n45/32\n3/2\n8/5\n5/3\n9/5\n15/8\n2\n";
+	std::ofstream("golden_d294.kbm") << "12\n0\n127\n62\n62\n294.0\n12\n0\n1\n2\n3\n4\n5\n6\n7\n8\n9\n10\nx\n";
+	if (!tuning.loadScala("golden_just.scl") || !tuning.loadKeyboardMapping("golden_d294.kbm"))
+		return "could not load the just intonation files";
+	problem = check(tuning, { { 2, 294.0 }, { 6, 294.0 * 5.0 / 4.0 }, { 9, 294.0 * 3.0 / 2.0 }, { 14, 588.0 }, { 0, 294.0 / 2.0 * 9.0 / 5.0 }, { 1, 0.0 }, { 13, 0.0 } });
+	if (!problem.empty())
+		return "just intonation: " + problem;
+
+	for (const char* path : { "golden_12tet.scl", "golden_a440.kbm", "golden_just.scl", "golden_d294.kbm" })
+		std::remove(path);
+	return "";
+}
+
+// Renders one note of the sampler on its own, time running on from where the last block ended
+struct SamplerPlayer
+{
+	Sampler& a_sampler;
+	Note a_note;
+	double a_time;
+
+	SamplerPlayer(Sampler& sampler, uint64_t serial, double hz, double velocity)
+		: a_sampler(sampler), a_note(0, 1.0, 0.0, true, serial), a_time(1.0)
+	{
+		a_note.a_freq = hz;
+		a_note.a_velocity = velocity;
+	}
+
+	~SamplerPlayer()
+	{
+		a_sampler.releaseVoice(a_note);
+	}
+
+	std::vector<float> play(uint32_t frames)
+	{
+		std::vector<float> out(frames);
+		double time_step = 1.0 / DEFAULT_SAMPLE_RATE;
+		for (uint32_t done = 0; done < frames; done += GOLDEN_BLOCK_FRAMES)
+		{
+			uint32_t count = std::min<uint32_t>(GOLDEN_BLOCK_FRAMES, frames - done);
+			bool is_finished = false;
+			{
+				RealtimeScope realtime;
+				a_sampler.render(a_time, time_step, a_note, out.data() + done, count, is_finished);
+			}
+			a_time += count * time_step;
+		}
+		return out;
+	}
+};
+
+// A small library written on the spot: below C5 a slow ramp for soft notes and a constant for
+// loud ones, above it a stereo constant that plays mixed down. Checks zone selection, pitch
+// interpolation across the hand-over from the preload to the stream, and that the underrun
+// counter counts each stall once and nothing before the stream first delivers.
+std::string samplerStreaming()
+{
+	const uint32_t ramp_frames = 5 * DEFAULT_SAMPLE_RATE;
+	const float ramp_top = 0.5f;
+	std::vector<float> ramp(ramp_frames), loud(2000, -0.5f), high(2 * 2000);
+	for (uint32_t k = 0; k < ramp_frames; k++)
+		ramp[k] = ramp_top * k / ramp_frames;
+	for (size_t k = 0; k < high.size(); k++)
+		high[k] = k % 2 == 0 ? 1.0f : 0.5f;
+	if (!writeWavFile("golden_ramp.wav", ramp.data(), ramp_frames, 1, DEFAULT_SAMPLE_RATE) || !writeWavFile("golden_loud.wav", loud.data(), loud.size(), 1, DEFAULT_SAMPLE_RATE)
+		|| !writeWavFile("golden_high.wav", high.data(), high.size() / 2, 2, DEFAULT_SAMPLE_RATE))
+		return "could not write the samples";
+	std::ofstream("golden_sampler.sfz") << "// golden_test library\n<group> lokey=0 hikey=71 pitch_keycenter=60\n<region> sample=golden_ramp.wav hivel=63\n"
+		"<region> sample=golden_loud.wav lovel=64\n<group> lokey=c5 hikey=127 pitch_keycenter=72\n<region> sample=golden_high.wav\n";
+
+	Sampler sampler;
+	bool is_loaded = sampler.load("golden_sampler.sfz");
+	for (int wait = 0; wait < 500 && !sampler.isPreloaded(); wait++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	if (!is_loaded || !sampler.isPreloaded())
+		return "the library did not load";
+
+	// Past the 2 ms attack the envelope holds at 1, so the output is the sample times the velocity
+	const uint32_t settled = 441;
+	const double middle_c = 440.0 * std::pow(2.0, -9.0 / 12.0);
+	struct Pick
+	{
+		double a_hz;
+		double a_velocity;
+		float a_expected;
+	};
+	uint64_t serial = 1;
+	for (const Pick& pick : { Pick{ middle_c, 0.9, -0.45f }, Pick{ middle_c * 2.0, 0.5, 0.375f }, Pick{ middle_c * 0.5, 0.8, -0.4f } })
+	{
+		SamplerPlayer player(sampler, serial++, pick.a_hz, pick.a_velocity);
+		float value = player.play(settled + 1)[settled];
+		if (std::fabs(value - pick.a_expected) > 1.0e-5f)
+			return "a note at " + std::to_string(pick.a_hz) + " Hz, velocity " + std::to_string(pick.a_velocity) + " plays " + std::to_string(value) + ", expected " + std::to_string(pick.a_expected);
+	}
+
+	// A fifth up reads the ramp 1.5 frames a step. Hermite interpolation is exact on a line, so
+	// every frame is known, across the end of the preload and through several refills. The
+	// pauses give the reader time to keep up whatever the machine's load.
+	const double velocity = 0.3;
+	const double step = 1.5;
+	SamplerPlayer fifth(sampler, serial++, middle_c * step, velocity);
+	std::vector<float> out = fifth.play(GOLDEN_BLOCK_FRAMES);
+	for (uint32_t played = GOLDEN_BLOCK_FRAMES; played < 60000; played += 4096)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		std::vector<float> block = fifth.play(4096);
+		out.insert(out.end(), block.begin(), block.end());
+	}
+	for (uint32_t i = settled; i < out.size(); i++)
+	{
+		float expected = static_cast<float>(velocity * ramp_top * (i * step) / ramp_frames);
+		if (std::fabs(out[i] - expected) > 1.0e-5f)
+			return "frame " + std::to_string(i) + " of the fifth plays " + std::to_string(out[i]) + ", expected " + std::to_string(expected);
+	}
+	if (sampler.getStreamUnderruns() != 0)
+		return std::to_string(sampler.getStreamUnderruns()) + " underruns while the reader kept up";
+
+	// With the reader stopped the voice plays what is buffered and then stalls, once
+	uint32_t stall_frames = static_cast<uint32_t>(SAMPLER_RING_FRAMES / step) + 4096;
+	sampler.suspendStreaming();
+	out = fifth.play(stall_frames);
+	if (sampler.getStreamUnderruns() != 1 || out.back() != 0.0f)
+		return std::to_string(sampler.getStreamUnderruns()) + " underruns after one stall, last frame " + std::to_string(out.back());
+
+	// It picks up where it stopped once the reader is back, and the next stall counts again
+	sampler.resumeStreaming();
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	out = fifth.play(4096);
+	float slope = out[4095] - out[4094];
+	float expected_slope = static_cast<float>(velocity * ramp_top * step / ramp_frames);
+	if (out[4095] <= 0.0f || std::fabs(slope - expected_slope) > 1.0e-6f)
+		return "the fifth did not resume after the stall";
+	sampler.suspendStreaming();
+	fifth.play(stall_frames);
+	sampler.resumeStreaming();
+	if (sampler.getStreamUnderruns() != 2)
+		return std::to_string(sampler.getStreamUnderruns()) + " underruns after two stalls";
+
+	for (const char* path : { "golden_ramp.wav", "golden_loud.wav", "golden_high.wav", "golden_sampler.sfz" })
+		std::remove(path);
+	return "";
+}
+
+std::vector<CheckCase> checkCases()
+{
+	return {
+		{ "recorder_take", recordRenderedBus },
+		{ "recorder_overflow", recorderOverflow },
+		{ "quality_governor", qualityGovernorSteps },
+		{ "governor_in_engine", governorInEngine },
+		{ "fft_against_dft", fftAgainstDft },
+		{ "analyzer_levels", analyzerLevels },
+		{ "scala_tuning", scalaTuning },
+		{ "sampler_streaming", samplerStreaming },
+	};
+}
+
+int main(int argc, char* argv[])
+{
+	std::string golden_dir = "tests/golden";
+	bool update = false;
+	Tolerance tolerance;
+	std::vector<std::string> selected;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		if (argument == "--golden-dir" && i + 1 < argc)
+			golden_dir = argv[++i];
+		else if (argument == "--update")
+			update = true;
+		else if (argument == "--snr" && i + 1 < argc)
+		{
+			tolerance.a_exact = false;
+			tolerance.a_min_snr_db = std::stod(argv[++i]);
+		}
+		else if (argument.starts_with("--"))
+		{
+			std::cerr << "Unknown option " << argument << std::endl;
+			return 2;
+		}
+		else
+			selected.push_back(argument);
+	}
+
+	int failures = 0;
+	for (const GoldenCase& golden_case : goldenCases())
+	{
+		if (!selected.empty() && std::find(selected.begin(), selected.end(), golden_case.a_name) == selected.end())
+			continue;
+
+		std::vector<float> rendered = render(golden_case);
+		std::string path = golden_dir + "/" + golden_case.a_name + ".wav";
+
+		if (update)
+		{
+			bool written = writeWavFile(path, rendered.data(), rendered.size() / GOLDEN_CHANNELS, GOLDEN_CHANNELS, golden_case.a_sample_rate);
+			std::cout << (written ? "updated  " : "FAILED   ") << golden_case.a_name << std::endl;
+			failures += written ? 0 : 1;
+			continue;
+		}
+
+		std::vector<float> reference;
+		if (!loadReference(path, reference))
+		{
+			std::cout << "FAILED   " << golden_case.a_name << ": no reference at " << path << ", run with --update to create it" << std::endl;
+			failures++;
+			continue;
+		}
+
+		double snr_db = 0.0;
+		std::string problem = compare(rendered, reference, tolerance, snr_db);
+		if (problem.empty())
+			std::cout << "passed   " << golden_case.a_name << std::endl;
+		else
+			std::cout << "FAILED   " << golden_case.a_name << ": " << problem << std::endl;
+		failures += problem.empty() ? 0 : 1;
+	}
+
+	for (const CheckCase& check_case : checkCases())
+	{
+		if (update || (!selected.empty() && std::find(selected.begin(), selected.end(), check_case.a_name) == selected.end()))
+			continue;
+
+		std::string problem = check_case.a_run();
+		if (problem.empty())
+			std::cout << "passed   " << check_case.a_name << std::endl;
+		else
+			std::cout << "FAILED   " << check_case.a_name << ": " << problem << std::endl;
+		failures += problem.empty() ? 0 : 1;
+	}
+
+	if (failures > 0)
+		std::cout << failures << " golden case(s) failed" << std::endl;
+	return failures == 0 ? 0 : 1;
+}